@@ -15,19 +15,97 @@
  * make
  *
  * Usage:
- * ./nortel-voiceware-decoder <rom_filepath> [-m <map_filepath>] [-i <message_index>] [-l|--list] [-q|--quiet] [-v|--verbose]
+ * ./nortel-voiceware-decoder <rom_filepath> [-m <map_filepath>] [-i <message_index>] [-o <output_dir>] [-j <threads>] [-l|--list] [--list-format=<format>] [--automap <reference_rom>] [--fp-query <index_filepath>] [--diff <known_rom>] [-s|--scan] [--stream] [--stats[=json]] [--trace <trace_filepath>] [--format=<format>] [--rate <hz>] [--raw-pcm] [--arena] [--writer=<backend>] [-q|--quiet] [-v|--verbose]
+ * ./nortel-voiceware-decoder -b <rom_or_dir>... [--manifest <manifest_filepath>] [options]
+ * ./nortel-voiceware-decoder -m <map_filepath> --compile-map <compiled_map_filepath>
+ * ./nortel-voiceware-decoder --fp-index <index_filepath> <rom_or_dir>... [--manifest <manifest_filepath>] [-m <map_filepath>] [-j <threads>]
+ * ./nortel-voiceware-decoder <rom_filepath> --diff <known_rom> [-m <map_filepath>] [-o <output_dir>]
+ * ./nortel-voiceware-decoder --encode <wav_filepath>... [-o <output_dir>] [--quality=<quality>] [-j <threads>]
+ * ./nortel-voiceware-decoder --bench-encode <json_filepath> <rom_or_dir>... [--manifest <manifest_filepath>] [-j <threads>]
+ * ./nortel-voiceware-decoder --build-rom <rom_filepath> -m <map_filepath> [<message_dir>]
+ * ./nortel-voiceware-decoder <rom_filepath> --patch <message_filepath> -i <message_index> [-s]
  *
  * Options:
- * <rom_filepath>      : Path to the input ROM file.
+ * <rom_filepath>      : Path to the input ROM file, or '-' to read from stdin (implies --stream).
  * -m <map_filepath>   : Path to the optional tab-delimited mapping file.
  *			 Format: SegIdx(0+)\tMsgIdxInSeg(0+)\tFilenameBase[\tComment]
  *			 Trailing whitespace is removed from FilenameBase during load.
+ *			 A compiled mapping file (see --compile-map) is detected by its magic and
+ *			 memory-mapped: lookups index it in place, with no parsing or allocation.
+ * --compile-map <file>: Compiles the -m text mapping file into <file> and exits. The
+ *			 compiled file holds a direct (segment, message) index and one string pool.
  * -i <message_index>  : Decode only the specified absolute message index (0-based). Ignored if -l is used.
+ * -o <output_dir>     : Write output files to this directory (created if needed).
+ *			 '-o -' streams the selected messages to stdout instead (--format=wav as one
+ *			 streaming WAV, s16le, ul or al), in ROM order on one thread.
+ * -j <threads>        : Number of decode worker threads (default: all CPUs in batch mode, 1 otherwise).
+ *			 A single ROM (file or --stream) is then decoded by a staged pipeline: reader,
+ *			 decoders, encoders and output writer joined by bounded lock-free queues.
+ * -b, --batch         : Batch mode. Accepts several ROM files and/or directories. Each ROM uses its own
+ *			 mapping ('<rom without extension>.map' if present, else -m) and output subdirectory.
+ *			 Decode jobs of all ROMs share one worker pool, longest messages first.
+ * --manifest <file>   : Adds the ROMs listed in a manifest (RomPath[\tMapPath[\tOutputSubdir]]). Implies -b.
  * -l, --list          : List messages in mapping file format (0-based SegIdx) to stdout instead of decoding.
  *			 Output includes a header comment '# ROM: <basename>\n\n'.
  *			 Uses tabs for padding to align comments (assuming 40 char filename width & 8-space tabs).
  *			 Comments are prefixed with '#'. PCM messages are indicated,
  *			 avoiding duplication if '(PCM)' is already in map comment.
+ * --list-format=<fmt> : Listing format (implies -l): map (default, as above), jsonl, csv or tsv.
+ *			 Records carry the ROM, indices, in-segment offset, byte length, mode, exact
+ *			 sample count, FNV-1a 64 hash of the message bytes, mapped name and comment.
+ *			 The listing is assembled in memory and written with one call per ROM.
+ * --automap <ref_rom> : Lists the ROM(s) (implies -l) with names carried over from the reference ROM
+ *			 and its -m mapping file: by identical payload hash, else by the most similar
+ *			 decoded loudness envelope among references of similar length. Produces a
+ *			 ready-made mapping file for a new ROM revision.
+ * --fp-index <file>   : Builds an acoustic fingerprint index of every message of the inputs (implies -b):
+ *			 32-bit band-energy sub-fingerprints every 8 ms of decoded audio, stored with
+ *			 an inverted index (sub-fingerprint -> frames). Built on the worker pool (-j).
+ * --fp-query <file>   : Lists the indexed prompts similar to message -i of the ROM (re-encoded or
+ *			 re-leveled copies included), using index lookups and SIMD Hamming distances.
+ * --diff <known_rom>  : Reports the messages of the ROM that were moved, changed, added or removed
+ *			 relative to <known_rom> (named by its -m map). Identical segments are skipped by
+ *			 hash; with -o only the changed and added messages are decoded.
+ * --encode            : Encodes the given WAV files (8/16-bit PCM, any rate and channel count) to
+ *			 uPD7759 ADPCM messages ('<name>.adpcm': mode byte, commands, end command),
+ *			 with silence commands for quiet gaps and repeat commands for repeated data.
+ * --quality=<quality> : Encoder search: greedy (best nibble per sample), lookahead (best nibble
+ *			 pair) or trellis (default; Viterbi search over the 16 step states, run
+ *			 on 4096-sample chunks in parallel with -j).
+ * --bench-encode <file>: Encoder benchmark (implies -b): decodes every message of the inputs, encodes
+ *			 them with each --quality at 1, 2, 4, ... up to -j threads, decodes them back and
+ *			 writes encode/decode time, bytes per second of audio, SNR and segmental SNR of
+ *			 each run as one JSON object ('-' for stdout). 'cmake --build . --target benchmark'.
+ * --build-rom <file>  : Builds a ROM image from the message files ('<name>.adpcm' or '<name>.pcm' in
+ *			 <message_dir>) named by the -m mapping file, in its (segment, message) order,
+ *			 packed into as few 128 KiB segments as possible. The mapping file of the new
+ *			 layout is written to '<rom without extension>.map'.
+ * --patch <file>      : Replaces message -i of the ROM file in place with a message file (.adpcm or
+ *			 .pcm). Only the following messages of the same segment move and only their
+ *			 offset table entries change; the free space left in the segment is reported.
+ * -s, --scan          : Recovery mode. Scans the whole file for segment headers ('xx 5A A5 69 55')
+ *			 instead of assuming one segment every 128 KiB. Handles leading garbage,
+ *			 missing segments and non-128 KiB chip sizes.
+ * --stream            : Read the ROM segment by segment through a fixed-size window instead
+ *			 of loading the whole file. Memory use is bounded regardless of input size.
+ * --stats[=json]      : Print per-phase timings (ROM load, map parse, segment parse, decode, write)
+ *			 and throughput/opcode counters to stderr at exit, as text or one JSON object.
+ * --trace <file>      : Record per-message decode/write spans (with thread, segment and message ids)
+ *			 and write them at exit in Chrome trace-event JSON format (chrome://tracing, Perfetto).
+ * --format=<format>   : Audio format of decoded messages: wav (default), flac (built-in lossless
+ *			 encoder using fixed/LPC prediction; the same tags as Vorbis comments),
+ *			 ulaw/alaw (G.711 WAV, format tags 7/6), ul/al (headerless G.711) or ima
+ *			 (IMA ADPCM WAV, format tag 0x11) or s16le (headerless 16-bit little-endian .raw).
+ * --rate <hz>         : Resample the decoded 8 kHz audio to this rate (polyphase windowed sinc) before
+ *			 encoding; the output headers carry the new rate.
+ * --raw-pcm           : Save PCM (mode 0x40) messages as raw '.pcm' files (mode byte and sample bytes)
+ *			 instead of decoding them like ADPCM messages.
+ * --arena             : Decode into a per-thread arena that is reset after every message: each message
+ *			 is measured first and its samples are allocated in one piece, so the decode
+ *			 path makes no heap calls once the arena has grown (--stats reports the blocks).
+ * --writer=<backend>  : How output files are written: sync (default, on the decode thread), thread
+ *			 (background writer threads), uring (batched openat/write/close through io_uring
+ *			 on Linux, else thread) or auto (uring if available, else thread).
  * -q, --quiet         : Quiet mode. Suppress all informational output (stdout & stderr). Only errors are printed to stderr. Overrides -v.
  * -v, --verbose       : Enable verbose debugging output to stderr. Ignored if -q is used.
  */
@@ -40,21 +118,65 @@
  #include <stdint.h>
  #include <string.h>
  #include <stdbool.h>
+ #include <stddef.h> /* For ptrdiff_t */
  #include <time.h>
  #include <ctype.h> /* For isspace */
- #include <limits.h> /* For UINT32_MAX */
+ #include <limits.h> /* For UINT32_MAX, INT_MIN */
+ #include <math.h> /* For cos, log, frexp (FLAC LPC analysis) */
  #include <stdarg.h> /* For va_list */
 
+ #ifdef _WIN32
+ #define WIN32_LEAN_AND_MEAN
+ #define NOMINMAX
+ #include <windows.h> /* Threads, directory listing */
+ #include <direct.h>  /* For _mkdir */
+ #else
+ #include <pthread.h>
+ #include <sched.h> /* For sched_yield */
+ #include <dirent.h>
+ #include <sys/stat.h>
+ #include <sys/mman.h> /* For mmap (compiled mapping files) */
+ #include <fcntl.h>
+ #include <errno.h>
+ #endif
+
  #ifdef _MSC_VER
  #pragma warning(disable : 4996) /* Disable deprecation warnings for fopen, etc. */
  #pragma warning(disable : 5045) /* Disable Spectre mitigation warning */
  #include <BaseTsd.h>
  typedef SSIZE_T ssize_t; /* Define ssize_t for MSVC */
  #define strdup _strdup     /* Use _strdup on MSVC */
+ #include <intrin.h> /* For _BitScanForward */
+ #include <io.h>     /* For _setmode */
+ #include <fcntl.h>  /* For _O_BINARY */
  #else
  #include <unistd.h> /* For getopt (if used) */
  #endif
 
+ /* io_uring output backend (Linux; detected by CMake, used through raw syscalls) */
+ #ifdef NVD_HAVE_IO_URING
+ #include <linux/io_uring.h>
+ #include <sys/syscall.h>
+ #include <sys/mman.h>
+ #include <fcntl.h>
+ #endif
+
+ /* Thread-local storage (used by the --trace rings) */
+ #ifdef _MSC_VER
+ #define THREAD_LOCAL __declspec(thread)
+ #else
+ #define THREAD_LOCAL __thread
+ #endif
+
+ /* SIMD support for the ROM magic scanner and the resampler (optional, scalar fallback always available) */
+ #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+ #include <emmintrin.h>
+ #define HAVE_SSE2 1
+ #elif defined(__ARM_NEON) && defined(__aarch64__)
+ #include <arm_neon.h>
+ #define HAVE_NEON 1
+ #endif
+
  /* --- Build Info Defines (Defaults for local builds) --- */
  #ifndef GIT_COMMIT_HASH
  #define GIT_COMMIT_HASH "local"
@@ -72,6 +194,68 @@
  #define ADPCM_CHANNELS 1 /* Mono */
  #define LIST_FILENAME_ALIGN_WIDTH 40 /* Width for filename alignment in list mode */
  #define TAB_WIDTH 8 /* Assumed tab width for alignment calculation */
+ #define STREAM_WINDOW_SIZE (2 * ROM_SEGMENT_SIZE) /* Input window for streaming mode */
+ #define STDOUT_BUFFER_SIZE (1 << 20) /* stdio buffer of the -o - audio stream */
+ #define MAX_WORKER_THREADS 256 /* Upper bound for -j */
+ #define TRACE_RING_CAPACITY 65536 /* Spans kept per thread for --trace */
+ #define OUTPUT_QUEUE_CAPACITY 128 /* Files pending in the asynchronous output writer */
+ #define OUTPUT_WRITER_THREADS 4 /* Writer threads of the thread output backend */
+ #define URING_QUEUE_DEPTH 64 /* io_uring submission queue entries */
+ #define URING_BATCH_SIZE 32 /* Files written per io_uring batch */
+ #define URING_DIR_CACHE_SIZE 8 /* Output directory descriptors kept open for openat() */
+ #define URING_PENDING INT_MIN /* io_uring result slot whose completion has not arrived */
+ #define URING_DRAIN_MS 1000 /* How long a failed ring is polled for owed completions */
+ #define PIPELINE_QUEUE_DEPTH 64 /* Messages buffered between pipeline stages (power of two) */
+ #define ARENA_BLOCK_SIZE (256 * 1024) /* Minimum heap block of an Arena */
+ #define ARENA_ALIGNMENT 16 /* Alignment of Arena allocations (and size of the block header) */
+ #define BINARY_MAP_MAGIC "NVDM" /* First bytes of a --compile-map file */
+ #define BINARY_MAP_VERSION 1
+ #define BINARY_MAP_HEADER_SIZE 32
+ #define BINARY_MAP_NO_STRING UINT32_MAX /* Comment offset of an entry without a comment */
+ #define AUTOMAP_FRAME_SIZE 400 /* Samples per loudness envelope frame of --automap (50 ms) */
+ #define AUTOMAP_MIN_FRAMES 4 /* Shorter messages are only matched exactly */
+ #define AUTOMAP_LENGTH_TOLERANCE 0.10 /* Fuzzy candidates differ in length by at most 10% */
+ #define AUTOMAP_FUZZY_THRESHOLD 0.90 /* Minimum envelope similarity of a fuzzy match */
+ #define AUTOMAP_TEXT_SIZE 1024 /* Buffer for a generated name or comment */
+ #define FP_INDEX_MAGIC "NVFP" /* First bytes of a --fp-index file */
+ #define FP_INDEX_VERSION 1
+ #define FP_INDEX_HEADER_SIZE 32
+ #define FP_PROMPT_RECORD_SIZE 32 /* Bytes per prompt record of a --fp-index file */
+ #define FP_FRAME_SIZE 256 /* Samples per fingerprint frame (32 ms; FFT size, power of two) */
+ #define FP_FRAME_HOP 64 /* Samples between fingerprint frames (8 ms) */
+ #define FP_BANDS 33 /* Spectral bands; adjacent pairs give the 32 bits of a sub-fingerprint */
+ #define FP_LOW_HZ 250.0 /* Lower edge of the lowest band */
+ #define FP_HIGH_HZ 3600.0 /* Upper edge of the highest band */
+ #define FP_MAX_POSTING_RUN 256 /* More common sub-fingerprints are not used to find candidates */
+ #define FP_MIN_OVERLAP 0.80 /* Aligned frames must cover 80% of the longer prompt */
+ #define FP_MAX_BIT_ERROR_RATE 0.35 /* Unrelated audio differs in about half of the bits */
+ #define FLAC_BLOCK_SIZE 4096 /* Samples per FLAC frame */
+ #define FLAC_BLOCK_SIZE_CODE 12 /* Frame header code for FLAC_BLOCK_SIZE (256 << (12 - 8)) */
+ #define FLAC_MAX_LPC_ORDER 12 /* Highest LPC predictor order tried */
+ #define FLAC_LPC_PRECISION 12 /* Bits per quantized LPC coefficient */
+ #define FLAC_MAX_PARTITION_ORDER 8 /* Highest Rice partition order tried */
+ #define FLAC_MAX_RICE_PARAMETER 14 /* 4-bit Rice parameters (15 is the escape code) */
+ #define MIN_OUTPUT_SAMPLE_RATE 1000 /* --rate limits */
+ #define MAX_OUTPUT_SAMPLE_RATE 192000
+ #define RESAMPLER_ZERO_CROSSINGS 16 /* Sinc zero crossings on each side of a --rate filter tap set */
+ #define RESAMPLER_CUTOFF 0.90 /* Resampler passband edge, as a fraction of the lower Nyquist rate */
+ #define RESAMPLER_KAISER_BETA 8.0 /* Kaiser window shape (about 80 dB stopband) */
+ #define RESAMPLER_MAX_PHASES 65536 /* Largest reduced output/input rate numerator */
+ #define IMA_BLOCK_ALIGN 256 /* Bytes per IMA ADPCM WAV block (mono, 8 kHz) */
+ #define IMA_SAMPLES_PER_BLOCK ((IMA_BLOCK_ALIGN - 4) * 2 + 1) /* Header sample + two codes per byte */
+ #define ENCODE_MIN_VALUE (-256) /* Decoder value range that maps to 16-bit output without clipping */
+ #define ENCODE_MAX_VALUE 255
+ #define ENCODE_SILENCE_LEVEL 128 /* Input samples below one decoder step count as silence */
+ #define ENCODE_MIN_SILENCE 64 /* Shortest zero region encoded as silence commands (8 ms) */
+ #define ENCODE_MAX_SILENCE_UNITS 0x3F /* Longest silence command (x 8 samples) */
+ #define ENCODE_MIN_REPEAT_SAVING 8 /* Nibbles a repeat block must save over literal blocks */
+ #define ENCODE_CHUNK_SIZE 4096 /* Samples per trellis chunk searched in parallel */
+ #define ENCODE_GROUP_SIZE 256 /* Files encoded per pass (bounds memory use) */
+ #define ENCODE_INFINITE_COST 1e30f /* Trellis cost of an unreachable state */
+ #define BENCH_FRAME_SAMPLES 160 /* Segmental SNR frame of the encoder benchmark (20 ms) */
+ #define BENCH_MIN_FRAME_SNR (-10.0) /* Clamp of each frame's SNR in dB, so silence and */
+ #define BENCH_MAX_FRAME_SNR 35.0    /* near-exact frames do not dominate the mean */
+ #define ROM_ERASED_BYTE 0xFF /* Unused ROM space, as left by an EPROM erase */
 
 
  /* ROM Header Magic Number */
@@ -79,7 +263,7 @@
 
  /* Message Modes */
  #define MODE_ADPCM 0x00
- #define MODE_PCM 0x40 /* Detected but not fully decoded */
+ #define MODE_PCM 0x40 /* 8-bit offset-binary samples up to the next message */
 
  /* ADPCM Decoding Tables (New) */
  /* Step size adjustment table (Delta values) - Now 2D */
@@ -97,62 +281,727 @@
  /* State Adjustment Table (New) */
  static const int state_table[16] = { -1, -1, 0, 0, 1, 2, 2, 3, -1, -1, 0, 0, 1, 2, 2, 3 };
 
+ /* IMA/DVI ADPCM step sizes and step index adjustments (--format=ima output) */
+ static const int ima_step_table[89] = {
+     7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+     50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+     337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+     2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+     15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+ };
+ static const int ima_index_table[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
 
  /* --- Global Variables --- */
  bool verbose_mode = false;
  bool list_mode = false; /* Flag for listing mode */
  bool quiet_mode = false; /* Flag for quiet mode */
+ bool scan_mode = false; /* Flag for signature-scanning recovery mode */
+ bool stream_mode = false; /* Flag for bounded-memory streaming input */
+ bool stats_enabled = false; /* Flag for --stats instrumentation */
+ bool stats_json = false; /* Report --stats as JSON */
+ bool trace_enabled = false; /* Flag for --trace span recording */
+ bool raw_pcm_mode = false; /* Save PCM messages as raw .pcm files (--raw-pcm) */
+ bool stdout_mode = false; /* Stream decoded audio to stdout instead of files (-o -) */
+ bool arena_mode = false; /* Decode into per-thread arenas instead of heap buffers (--arena) */
 
  /* --- Data Structures (Moved Before Forward Declarations) --- */
 
+ /**
+  * struct arena - Bump allocator for memory that is released all at once.
+  * @block:      Current block. Its first ARENA_ALIGNMENT bytes hold the
+  *              pointer to the previous block (NULL for the first).
+  * @block_size: Size of the current block in bytes.
+  * @used:       Bytes of the current block handed out (including the header).
+  * @reserved:   Bytes handed out since the last reset.
+  * @high_water: Largest @reserved seen; sizes the block after a reset.
+  * @heap_calls: Number of blocks malloc'd over the arena's lifetime.
+  * @external:   true if @block is a caller-supplied buffer (never grown or freed).
+  */
+ typedef struct {
+     uint8_t *block;
+     size_t block_size;
+     size_t used;
+     size_t reserved;
+     size_t high_water;
+     size_t heap_calls;
+     bool external;
+ } Arena;
+
+ /**
+  * struct arena_list - Dynamic array of the registered per-thread arenas.
+  * @arenas:   Pointer to array of arena pointers.
+  * @count:    Number of arenas currently stored.
+  * @capacity: Allocated capacity of the array.
+  */
+ typedef struct {
+     Arena **arenas;
+     size_t count;
+     size_t capacity;
+ } ArenaList;
+
  /**
   * struct message_mapping - Holds information parsed from the mapping file.
   * @segment_index:         0-based segment index from map file.
   * @message_index_in_seg:  0-based message index within segment from map file.
-  * @output_filename_base:  Malloc'd base filename (no extension).
-  * @comment:               Malloc'd comment string (cleaned).
+  * @output_filename_base:  Base filename (no extension), stored in the table's string arena
+  *                         (or the string pool of a compiled map).
+  * @comment:               Comment string (cleaned), stored like @output_filename_base.
   */
  typedef struct {
      int segment_index;
      int message_index_in_seg;
-     char *output_filename_base;
-     char *comment;
+     const char *output_filename_base;
+     const char *comment;
  } MessageMapping;
 
  /**
   * struct mapping_table - Dynamic array to store message mappings.
-  * @mappings: Pointer to array of MessageMapping structs.
-  * @count:    Number of mappings currently stored.
-  * @capacity: Allocated capacity of the mappings array.
+  * @mappings:    Pointer to array of MessageMapping structs.
+  * @count:       Number of mappings currently stored.
+  * @capacity:    Allocated capacity of the mappings array.
+  * @strings:     Arena holding the filename and comment strings of all entries.
+  * @binary:      Read-only view of a compiled (--compile-map) mapping file, or NULL
+  *               for a text mapping file. Lookups index it in place.
+  * @binary_size: Size of @binary in bytes.
+  *
+  * A compiled mapping file holds, in little-endian order:
+  *   header  "NVDM", version, segment count, entry count, then the file offsets
+  *           of the index, the entries and the string pool, and the pool size;
+  *   index   segment count * MAX_MESSAGES_PER_SEGMENT uint32 slots, 0 for an
+  *           unmapped message, else 1 + the entry number;
+  *   entries uint32 pool offsets of the filename and the comment
+  *           (BINARY_MAP_NO_STRING if none);
+  *   pool    NUL-terminated strings.
   */
  typedef struct {
      MessageMapping *mappings;
      size_t count;
      size_t capacity;
+     Arena strings;
+     const uint8_t *binary;
+     size_t binary_size;
  } MappingTable;
 
  /**
   * struct adpcm_state - Holds the state for the ADPCM decoder.
   * @current_sample: Current predicted sample.
   * @adpcm_state:    Current state index (0-15).
+  * @clamp_count:    Number of samples that had to be clamped.
   */
  typedef struct {
      int16_t current_sample;
      int8_t adpcm_state; /* State index remains 0-15 */
+     uint32_t clamp_count; /* For --stats */
  } AdpcmState;
 
+ /**
+  * struct resampler - Polyphase windowed-sinc filter bank for one rate ratio (--rate).
+  * @up:           Output rate / gcd (number of filter phases).
+  * @down:         Input rate / gcd.
+  * @half_taps:    Input samples used on each side of an output instant.
+  * @taps:         Taps per phase (2 * @half_taps rounded up to a multiple of 4).
+  * @coefficients: @up phases of @taps coefficients each.
+  */
+ typedef struct {
+     uint32_t up;
+     uint32_t down;
+     int half_taps;
+     int taps;
+     float *coefficients;
+ } Resampler;
+
+ /**
+  * struct ima_encoder_state - State of the IMA ADPCM encoder (--format=ima).
+  * @predictor:  Sample value the decoder will reconstruct.
+  * @step_index: Index into ima_step_table (0-88).
+  */
+ typedef struct {
+     int predictor;
+     int step_index;
+ } ImaEncoderState;
+
  /**
   * struct pcm_buffer - Dynamic buffer for storing decoded PCM samples.
   * @samples:  Pointer to array of 16-bit PCM samples.
   * @count:    Number of samples currently stored.
   * @capacity: Allocated capacity in samples.
+  * @reallocations: Number of times the sample array was (re)allocated.
+  * @fixed:    true if @samples is owned by an Arena or the caller; the buffer
+  *            then never grows and free_pcm_buffer() leaves it alone.
   */
  typedef struct {
      int16_t *samples;
      size_t count;
      size_t capacity;
+     size_t reallocations;
+     bool fixed;
  } PcmBuffer;
 
+ /**
+  * enum stats_phase - Phases timed by --stats.
+  */
+ typedef enum {
+     STATS_PHASE_ROM_LOAD,
+     STATS_PHASE_MAP_PARSE,
+     STATS_PHASE_SEGMENT_PARSE,
+     STATS_PHASE_DECODE,
+     STATS_PHASE_ENCODE,
+     STATS_PHASE_WRITE,
+     STATS_PHASE_COUNT
+ } StatsPhase;
+
+ /**
+  * enum opcode_type - ADPCM command classes counted by --stats.
+  */
+ typedef enum {
+     OPCODE_END,
+     OPCODE_SILENCE,
+     OPCODE_SHORT_BLOCK,
+     OPCODE_LONG_BLOCK,
+     OPCODE_REPEAT_BLOCK,
+     OPCODE_UNKNOWN,
+     OPCODE_TYPE_COUNT
+ } OpcodeType;
+
+ /**
+  * struct run_stats - Timers and counters collected by --stats.
+  * @start_ns:      Monotonic timestamp of the start of the run.
+  * @phase_ns:      Time spent per phase (summed over threads).
+  * @messages:      Messages decoded or saved.
+  * @samples:       PCM samples produced.
+  * @bytes_in:      ROM bytes read from the input.
+  * @bytes_out:     Bytes written to output files.
+  * @files_out:     Output files written.
+  * @opcodes:       ADPCM commands executed, by type.
+  * @clamps:        Samples clamped during decoding.
+  * @reallocations: PCM buffer (re)allocations.
+  * @arena_blocks:  Heap blocks allocated by the per-thread decode arenas (--arena).
+  *
+  * Hot paths count into a local RunStats and merge it once per message
+  * with stats_merge(), so disabled statistics cost no locking or clock reads.
+  */
+ typedef struct {
+     uint64_t start_ns;
+     uint64_t phase_ns[STATS_PHASE_COUNT];
+     uint64_t messages;
+     uint64_t samples;
+     uint64_t bytes_in;
+     uint64_t bytes_out;
+     uint64_t files_out;
+     uint64_t opcodes[OPCODE_TYPE_COUNT];
+     uint64_t clamps;
+     uint64_t reallocations;
+     uint64_t arena_blocks;
+ } RunStats;
+
+ /**
+  * struct adpcm_walk_hooks - Reporting done by walk_adpcm_stream() for decode_message().
+  * @stats:          Counts the commands executed and the samples clamped (may be NULL).
+  * @message_index:  Absolute message index named in warnings.
+  * @log_commands:   Logs every command and data byte with verbose_printf().
+  */
+ typedef struct {
+     RunStats *stats;
+     int message_index;
+     bool log_commands;
+ } AdpcmWalkHooks;
+
+ /**
+  * struct trace_event - One completed span recorded for --trace.
+  * @name:           Span name ("decode", "write", "rom_load", ...).
+  * @start_ns:       Monotonic start timestamp.
+  * @end_ns:         Monotonic end timestamp.
+  * @segment_index:  0-based segment index (-1 for spans not tied to a message).
+  * @message_index:  0-based message index within the segment.
+  * @absolute_index: 0-based absolute message index.
+  */
+ typedef struct {
+     const char *name;
+     uint64_t start_ns;
+     uint64_t end_ns;
+     int segment_index;
+     int message_index;
+     int absolute_index;
+ } TraceEvent;
+
+ /**
+  * struct trace_ring - Fixed-size ring of spans written by a single thread.
+  * @events:    Array of TRACE_RING_CAPACITY events.
+  * @recorded:  Total number of spans recorded (the ring keeps the newest).
+  * @thread_id: Small sequential id used as the trace "tid".
+  */
+ typedef struct {
+     TraceEvent *events;
+     uint64_t recorded;
+     int thread_id;
+ } TraceRing;
+
+ /**
+  * struct trace_ring_list - Dynamic array of all registered trace rings.
+  * @rings:    Pointer to array of ring pointers.
+  * @count:    Number of rings currently stored.
+  * @capacity: Allocated capacity of the array.
+  */
+ typedef struct {
+     TraceRing **rings;
+     size_t count;
+     size_t capacity;
+ } TraceRingList;
+
+ /* Portable thread primitives (see the Threading section) */
+ #ifdef _WIN32
+ typedef HANDLE ThreadHandle;
+ typedef CRITICAL_SECTION MutexLock;
+ typedef CONDITION_VARIABLE CondVar;
+ #else
+ typedef pthread_t ThreadHandle;
+ typedef pthread_mutex_t MutexLock;
+ typedef pthread_cond_t CondVar;
+ #endif
+
+ /**
+  * struct output_buffer - Growable byte buffer holding a serialized output file.
+  * @data:     Pointer to the bytes.
+  * @size:     Number of bytes used.
+  * @capacity: Allocated size in bytes.
+  */
+ typedef struct {
+     uint8_t *data;
+     size_t size;
+     size_t capacity;
+ } OutputBuffer;
+
+ /**
+  * enum output_file_kind - Kind of output file (selects the status message).
+  */
+ typedef enum {
+     OUTPUT_FILE_WAV,
+     OUTPUT_FILE_FLAC,
+     OUTPUT_FILE_G711,
+     OUTPUT_FILE_S16LE,
+     OUTPUT_FILE_RAW_PCM,
+     OUTPUT_FILE_ADPCM
+ } OutputFileKind;
+
+ /**
+  * enum output_format - Audio container written for decoded messages (--format).
+  */
+ typedef enum {
+     OUTPUT_FORMAT_WAV,       /* 16-bit PCM RIFF/WAVE with LIST/INFO tags */
+     OUTPUT_FORMAT_FLAC,      /* Lossless FLAC with Vorbis comments */
+     OUTPUT_FORMAT_ULAW_WAV,  /* G.711 mu-law WAV (format tag 7) */
+     OUTPUT_FORMAT_ALAW_WAV,  /* G.711 A-law WAV (format tag 6) */
+     OUTPUT_FORMAT_ULAW_RAW,  /* Headerless G.711 mu-law (.ul) */
+     OUTPUT_FORMAT_ALAW_RAW,  /* Headerless G.711 A-law (.al) */
+     OUTPUT_FORMAT_IMA_WAV,   /* 4-bit IMA ADPCM WAV (format tag 0x11) */
+     OUTPUT_FORMAT_S16LE      /* Headerless 16-bit little-endian PCM (.raw) */
+ } OutputFormat;
+
+ /**
+  * enum list_format - Record format of the message listing (--list-format).
+  */
+ typedef enum {
+     LIST_FORMAT_MAP,   /* Mapping file lines with aligned '#' comments (-l) */
+     LIST_FORMAT_JSONL, /* One JSON object per message */
+     LIST_FORMAT_CSV,   /* RFC 4180 CSV with a header row */
+     LIST_FORMAT_TSV    /* Tab-separated values with a header row */
+ } ListFormat;
+
+ /**
+  * enum encode_quality - Nibble search of the ADPCM encoder (--quality).
+  */
+ typedef enum {
+     ENCODE_QUALITY_GREEDY,    /* Closest sample, one nibble at a time */
+     ENCODE_QUALITY_LOOKAHEAD, /* Best pair of nibbles, keeping the first */
+     ENCODE_QUALITY_TRELLIS    /* Viterbi search over the 16 step states */
+ } EncodeQuality;
+
+ /**
+  * struct output_file - A serialized output file waiting to be written.
+  * @path:           Full output path.
+  * @directory:      Output directory (NULL for the current directory).
+  * @name_offset:    Offset of the filename within @path (relative to @directory).
+  * @kind:           Kind of file.
+  * @contents:       Complete file image.
+  * @sample_count:   Number of samples (for the status message).
+  * @segment_index:  0-based segment index (for --trace).
+  * @message_index:  0-based message index within the segment (for --trace).
+  * @absolute_index: 0-based absolute message index (for --trace).
+  */
+ typedef struct {
+     char *path;
+     char *directory;
+     size_t name_offset;
+     OutputFileKind kind;
+     OutputBuffer contents;
+     uint64_t sample_count;
+     int segment_index;
+     int message_index;
+     int absolute_index;
+ } OutputFile;
+
+ /**
+  * struct decoded_message - Result of the decode stage, input of the encode stage.
+  * @has_output:            true if there is a file to write.
+  * @kind:                  Kind of output file.
+  * @pcm:                   Decoded samples (any kind but OUTPUT_FILE_RAW_PCM).
+  * @raw:                   Copied message bytes (OUTPUT_FILE_RAW_PCM).
+  * @output_base:           Output filename base (mapping entry or @default_filename_base).
+  * @comment:               Comment from the mapping (or NULL).
+  * @default_filename_base: Storage for the default "message_S_XXX" name.
+  * @segment_index:         0-based segment index.
+  * @message_index:         0-based message index within the segment.
+  * @absolute_index:        0-based absolute message index.
+  */
+ typedef struct {
+     bool has_output;
+     OutputFileKind kind;
+     PcmBuffer pcm;
+     OutputBuffer raw;
+     const char *output_base;
+     const char *comment;
+     char default_filename_base[25]; /* "message_S_XXX" + buffer */
+     int segment_index;
+     int message_index;
+     int absolute_index;
+ } DecodedMessage;
+
+ /**
+  * struct queue_cell - One slot of a BoundedQueue.
+  * @sequence: Turn counter that orders producers and consumers of this slot.
+  * @item:     Stored item.
+  */
+ typedef struct {
+     volatile size_t sequence;
+     void *item;
+ } QueueCell;
+
+ /**
+  * struct bounded_queue - Bounded lock-free multi-producer/multi-consumer queue.
+  * @cells:       Ring of slots (power-of-two count).
+  * @mask:        Slot count minus one.
+  * @pad0:        Keeps the producer and consumer positions on separate cache lines.
+  * @enqueue_pos: Next position to write.
+  * @pad1:        See @pad0.
+  * @dequeue_pos: Next position to read.
+  * @closed:      Non-zero once the producers are done.
+  */
+ typedef struct {
+     QueueCell *cells;
+     size_t mask;
+     char pad0[64];
+     volatile size_t enqueue_pos;
+     char pad1[64];
+     volatile size_t dequeue_pos;
+     volatile size_t closed;
+ } BoundedQueue;
+
+ /**
+  * struct shared_segment - Reference-counted copy of a segment (streaming pipeline).
+  * @data:       Copied segment bytes.
+  * @size:       Number of bytes.
+  * @references: Reader reference plus one per pending MessageJob.
+  */
+ typedef struct {
+     uint8_t *data;
+     size_t size;
+     volatile size_t references;
+ } SharedSegment;
+
+ /**
+  * struct message_job - Message descriptor produced by the pipeline's reader stage.
+  * @segment:             Shared segment copy (NULL if @rom_data is the loaded ROM).
+  * @rom_data:            ROM (or segment copy) data.
+  * @rom_size:            Size of @rom_data.
+  * @segment_start:       Offset of the segment within @rom_data.
+  * @segment_index:       0-based segment index.
+  * @msg_idx_in_seg:      0-based message index within the segment.
+  * @absolute_msg_idx:    0-based absolute message index.
+  * @message_offset:      Offset of the message mode byte from the segment start.
+  * @next_message_offset: Offset of the next message (end of raw PCM data).
+  * @mapping:             Copy of the mapping entry (valid if @has_mapping).
+  * @has_mapping:         true if the message has a mapping entry.
+  */
+ typedef struct {
+     SharedSegment *segment;
+     const uint8_t *rom_data;
+     size_t rom_size;
+     size_t segment_start;
+     int segment_index;
+     int msg_idx_in_seg;
+     int absolute_msg_idx;
+     uint32_t message_offset;
+     uint32_t next_message_offset;
+     MessageMapping mapping;
+     bool has_mapping;
+ } MessageJob;
+
+ /**
+  * struct pipeline - Staged reader -> decoders -> encoders -> writer pipeline.
+  * @decode_queue:          MessageJobs from the reader to the decoders.
+  * @encode_queue:          DecodedMessages from the decoders to the encoders.
+  * @rom_basename:          Base filename of the input ROM file.
+  * @output_dir:            Directory for output files.
+  * @copy_input:            true if segments must be copied (streaming input).
+  * @current_segment:       Segment copy the reader is submitting from.
+  * @current_segment_index: Index of @current_segment.
+  * @active_decoders:       Decoders still running (the last one closes @encode_queue).
+  * @failed:                Non-zero after a fatal error in any stage.
+  * @threads:               Decoder threads followed by encoder threads.
+  * @thread_count:          Number of started threads.
+  * @encoder_count:         Number of encoder threads among @threads.
+  */
+ typedef struct {
+     BoundedQueue decode_queue;
+     BoundedQueue encode_queue;
+     const char *rom_basename;
+     const char *output_dir;
+     bool copy_input;
+     SharedSegment *current_segment;
+     int current_segment_index;
+     volatile size_t active_decoders;
+     volatile size_t failed;
+     ThreadHandle threads[MAX_WORKER_THREADS + MAX_WORKER_THREADS / 4 + 1];
+     int thread_count;
+     int encoder_count;
+ } Pipeline;
+
+ /**
+  * enum output_backend - How output files are written (--writer).
+  */
+ typedef enum {
+     OUTPUT_BACKEND_SYNC,   /* fopen/fwrite/fclose on the decode thread */
+     OUTPUT_BACKEND_THREAD, /* Queue drained by OUTPUT_WRITER_THREADS stdio threads */
+     OUTPUT_BACKEND_URING,  /* Queue drained in batches through io_uring (Linux) */
+     OUTPUT_BACKEND_AUTO    /* io_uring if available, else thread */
+ } OutputBackend;
+
+ /**
+  * struct output_writer - Bounded queue between decode threads and writer threads.
+  * @backend:      Active backend (never OUTPUT_BACKEND_AUTO once started).
+  * @queue:        Ring buffer of pending files.
+  * @head:         Index of the oldest pending file.
+  * @count:        Number of pending files.
+  * @closing:      Set when no more files will be submitted.
+  * @failed:       Number of files that could not be written.
+  * @lock:         Protects all fields above.
+  * @not_empty:    Signalled when a file is queued or the writer is closing.
+  * @not_full:     Signalled when queue slots become free.
+  * @threads:      Writer threads.
+  * @thread_count: Number of running writer threads.
+  */
+ typedef struct {
+     OutputBackend backend;
+     OutputFile *queue[OUTPUT_QUEUE_CAPACITY];
+     size_t head;
+     size_t count;
+     bool closing;
+     size_t failed;
+     MutexLock lock;
+     CondVar not_empty;
+     CondVar not_full;
+     ThreadHandle threads[OUTPUT_WRITER_THREADS];
+     int thread_count;
+ } OutputWriter;
+
+ /**
+  * struct program_options - Settings collected from the command line.
+  * @rom_filepaths:      Positional input paths (ROM files; also directories in batch mode).
+  * @rom_filepath_count: Number of entries in @rom_filepaths.
+  * @map_filepath:       Path to the mapping file (or NULL).
+  * @compile_map_filepath: Path of the compiled mapping file to write from @map_filepath (or NULL).
+  * @automap_filepath:   Reference ROM whose @map_filepath names are matched by content (or NULL).
+  * @fp_index_filepath:  Fingerprint index to build from the batch inputs (or NULL).
+  * @bench_encode_filepath: JSON file of the encoder benchmark over the batch inputs (or NULL; "-" for stdout).
+  * @fp_query_filepath:  Fingerprint index to search for the -i message (or NULL).
+  * @diff_filepath:      Known ROM to compare the ROM with (or NULL).
+  * @encode_mode:        True to encode the input WAV files to ADPCM messages.
+  * @encode_quality:     Nibble search of the encoder (--quality).
+  * @build_rom_filepath: ROM image to build from the message files listed in @map_filepath (or NULL).
+  * @patch_filepath:     Message file to replace message @target_message_idx of the ROM with (or NULL).
+  * @manifest_filepath:  Path to the batch manifest file (or NULL).
+  * @output_dir:         Output directory (or NULL for the current directory).
+  * @target_message_idx: Absolute message index to decode (-1 for all).
+  * @thread_count:       Number of decode worker threads.
+  * @batch_mode:         True if several ROMs are processed in one run.
+  * @list_mode:          True to list messages instead of decoding.
+  * @list_format:        Record format of the listing (--list-format).
+  * @scan_mode:          True to locate segments by scanning for headers.
+  * @stream_mode:        True to read the ROM through a bounded window.
+  * @stats_mode:         True to collect and report run statistics.
+  * @stats_json:         True to report the statistics as JSON.
+  * @trace_filepath:     Path of the Chrome trace-event file to write (or NULL).
+  * @output_backend:     How output files are written (--writer).
+  * @output_format:      Audio container for decoded messages (--format).
+  * @output_rate:        Sample rate of the encoded audio (--rate; 0 = DEFAULT_SAMPLE_RATE).
+  * @raw_pcm_mode:       True to save PCM messages as raw .pcm files instead of decoding them.
+  * @stdout_mode:        True to stream the decoded audio to stdout (-o -).
+  * @arena_mode:         True to decode into per-thread arenas (--arena).
+  * @quiet_mode:         True to suppress informational output.
+  * @verbose_mode:       True to enable verbose debugging output.
+  */
+ typedef struct {
+     const char **rom_filepaths;
+     int rom_filepath_count;
+     const char *map_filepath;
+     const char *compile_map_filepath;
+     const char *automap_filepath;
+     const char *fp_index_filepath;
+     const char *bench_encode_filepath;
+     const char *fp_query_filepath;
+     const char *diff_filepath;
+     bool encode_mode;
+     EncodeQuality encode_quality;
+     const char *build_rom_filepath;
+     const char *patch_filepath;
+     const char *manifest_filepath;
+     const char *output_dir;
+     long target_message_idx;
+     int thread_count;
+     bool batch_mode;
+     bool list_mode;
+     ListFormat list_format;
+     bool scan_mode;
+     bool stream_mode;
+     bool stats_mode;
+     bool stats_json;
+     const char *trace_filepath;
+     OutputBackend output_backend;
+     OutputFormat output_format;
+     uint32_t output_rate;
+     bool raw_pcm_mode;
+     bool stdout_mode;
+     bool arena_mode;
+     bool quiet_mode;
+     bool verbose_mode;
+ } ProgramOptions;
+
+ /**
+  * struct segment_entry - Location of one segment within the ROM data.
+  * @start:         Byte offset of the segment header (last_msg_idx byte).
+  * @size:          Number of bytes belonging to the segment (<= ROM_SEGMENT_SIZE).
+  * @message_count: Number of messages in the segment (last_msg_idx + 1).
+  */
+ typedef struct {
+     size_t start;
+     size_t size;
+     uint32_t message_count;
+ } SegmentEntry;
+
+ /**
+  * struct segment_directory - Dynamic array of segments found in the ROM.
+  * @segments: Pointer to array of SegmentEntry structs.
+  * @count:    Number of segments currently stored.
+  * @capacity: Allocated capacity of the segments array.
+  */
+ typedef struct {
+     SegmentEntry *segments;
+     size_t count;
+     size_t capacity;
+ } SegmentDirectory;
+
+ /**
+  * struct message_catalog - Metadata of the messages of a ROM, one array per field.
+  * @rom_data:      ROM data the offsets refer to.
+  * @rom_size:      Size of @rom_data.
+  * @count:         Number of messages, in ROM order.
+  * @capacity:      Number of entries allocated for each array.
+  * @block:         Single allocation holding all arrays.
+  * @hash:          64-bit FNV-1a hash of the bytes @start..@end.
+  * @segment_start: Offset of the message's segment header.
+  * @start:         Offset of the mode byte (at or past @rom_size if the offset table points outside the data).
+  * @limit:         Offset of the next message, or the end of the segment.
+  * @end:           Offset after the last byte of the message (measure_message(); @start if out of bounds).
+  * @samples:       Number of samples the message decodes to.
+  * @mapping:       Mapping entry of the message (or NULL).
+  * @compiled:      Entries read from a compiled mapping file; @mapping points here for those.
+  * @segment:       0-based segment index.
+  * @absolute:      0-based absolute message index.
+  * @index:         0-based message index within the segment.
+  * @mode:          Mode byte (ROM_ERASED_BYTE if out of bounds).
+  *
+  * Built in one pass by build_message_catalog(). Listing, decoding and the
+  * batch, fingerprint and benchmark modes read messages only from here.
+  */
+ typedef struct {
+     const uint8_t *rom_data;
+     size_t rom_size;
+     size_t count;
+     size_t capacity;
+     uint8_t *block;
+     uint64_t *hash;
+     size_t *segment_start;
+     size_t *start;
+     size_t *limit;
+     size_t *end;
+     size_t *samples;
+     const MessageMapping **mapping;
+     MessageMapping *compiled;
+     uint32_t *segment;
+     uint32_t *absolute;
+     uint16_t *index;
+     uint8_t *mode;
+ } MessageCatalog;
+
+ /**
+  * struct automap_entry - A mapped message of the --automap reference ROM.
+  * @hash:     64-bit FNV-1a hash of the message bytes (as in list_message()).
+  * @order:    Position in the reference ROM (breaks ties between equal hashes).
+  * @segment:  0-based segment index in the reference ROM.
+  * @index:    0-based message index within the segment.
+  * @envelope: Index of the first envelope frame in AutomapIndex.envelopes.
+  * @frames:   Number of envelope frames.
+  * @name:     Mapped output filename base (reference mapping table).
+  * @comment:  Mapped comment (or NULL).
+  */
+ typedef struct {
+     uint64_t hash;
+     size_t order;
+     uint32_t segment;
+     uint16_t index;
+     size_t envelope;
+     size_t frames;
+     const char *name;
+     const char *comment;
+ } AutomapEntry;
+
+ /**
+  * struct automap_index - Content index of a reference ROM for --automap.
+  * @entries:         Mapped reference messages, sorted by hash for exact lookups.
+  * @count:           Number of entries.
+  * @capacity:        Allocated capacity of @entries.
+  * @by_length:       Entries sorted by envelope length for fuzzy lookups.
+  * @names:           Names of all entries, sorted with strcmp() (see automap_name_exists()).
+  * @uses:            Times each entry has been assigned in the ROM being listed, or the
+  *                   last '_N' suffix given to its name if that is larger.
+  * @envelopes:       Loudness envelopes of all entries (log2 of the mean
+  *                   magnitude per AUTOMAP_FRAME_SIZE samples, 8.8 fixed point).
+  * @scratch:         Decoded samples of the message being indexed or matched.
+  * @query:           Envelope of the message being matched.
+  * @exact_matches:   Messages named by an identical payload.
+  * @fuzzy_matches:   Messages named by a similar envelope.
+  * @unmatched:       Messages left with default names.
+  * @name_buffer:     Name of the last match if it had to be made unique.
+  * @comment_buffer:  Comment of the last fuzzy match.
+  */
+ typedef struct {
+     AutomapEntry *entries;
+     size_t count;
+     size_t capacity;
+     const AutomapEntry **by_length;
+     const char **names;
+     unsigned *uses;
+     PcmBuffer envelopes;
+     PcmBuffer scratch;
+     PcmBuffer query;
+     size_t exact_matches;
+     size_t fuzzy_matches;
+     size_t unmatched;
+     char name_buffer[AUTOMAP_TEXT_SIZE];
+     char comment_buffer[AUTOMAP_TEXT_SIZE];
+ } AutomapIndex;
+
  /**
   * enum handle_message_result - Return codes for handle_message_iteration.
   * @MSG_HANDLED_CONTINUE:      Processing successful, continue loop.
@@ -165,6 +1014,65 @@
      MSG_HANDLED_ERROR
  } HandleMessageResult;
 
+ /**
+  * enum flac_subframe_type - FLAC subframe encodings used by the encoder.
+  */
+ typedef enum {
+     FLAC_SUBFRAME_CONSTANT,
+     FLAC_SUBFRAME_VERBATIM,
+     FLAC_SUBFRAME_FIXED,
+     FLAC_SUBFRAME_LPC
+ } FlacSubframeType;
+
+ /**
+  * struct bit_writer - MSB-first bit writer appending to an OutputBuffer.
+  * @output:      OutputBuffer receiving the bytes (space reserved by the caller).
+  * @accumulator: Bits not yet written.
+  * @bit_count:   Number of valid bits in @accumulator (< 8 between calls).
+  */
+ typedef struct {
+     OutputBuffer *output;
+     uint64_t accumulator;
+     unsigned bit_count;
+ } BitWriter;
+
+ /**
+  * struct flac_subframe_choice - Best encoding found for one subframe.
+  * @type:            Subframe encoding.
+  * @order:           Predictor order (FIXED/LPC).
+  * @precision:       Quantized LPC coefficient precision in bits.
+  * @shift:           Quantized LPC coefficient shift.
+  * @coefficients:    Quantized LPC coefficients.
+  * @partition_order: Rice partition order of the residual.
+  * @bits:            Size of the subframe in bits (estimate for FIXED/LPC).
+  */
+ typedef struct {
+     FlacSubframeType type;
+     int order;
+     int precision;
+     int shift;
+     int32_t coefficients[FLAC_MAX_LPC_ORDER];
+     int partition_order;
+     uint64_t bits;
+ } FlacSubframeChoice;
+
+
+ /**
+  * struct flac_scratch - Per-file FLAC encoder buffers, sized for one block.
+  * @samples:       Block samples with the wasted bits removed.
+  * @residual:      Residual of the predictor being evaluated.
+  * @best_residual: Residual of the best predictor so far.
+  * @window:        Windowed samples for the LPC analysis.
+  * @sums:          Rice partition sums.
+  */
+ typedef struct {
+     int32_t samples[FLAC_BLOCK_SIZE];
+     int32_t residual[FLAC_BLOCK_SIZE];
+     int32_t best_residual[FLAC_BLOCK_SIZE];
+     double window[FLAC_BLOCK_SIZE];
+     uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+ } FlacScratch;
+
 
  /* --- Forward Declarations --- */
  void print_usage(const char *prog_name);
@@ -172,23 +1080,49 @@
          size_t segment_start_offset, int segment_index_0_based,
          int msg_idx_in_segment, int absolute_msg_idx,
          uint32_t message_offset_in_segment, uint32_t next_message_offset_in_segment,
-         const MessageMapping *mapping, const char *rom_basename);
- HandleMessageResult handle_message_iteration(
-     const uint8_t *rom_data, size_t rom_size,
-     size_t segment_start_offset, int segment_index_0_based,
-     uint32_t msg_idx_in_seg, int absolute_msg_idx,
-     const uint16_t *offset_table, uint32_t message_count_in_segment,
-     const MappingTable *mapping_table, const char *rom_basename,
-     bool list_mode, bool quiet_mode, long target_message_idx);
+         const MessageMapping *mapping, const char *rom_basename, const char *output_dir);
+ HandleMessageResult handle_message_iteration(const MessageCatalog *catalog, size_t i, const char *rom_basename,
+     const char *output_dir, bool list_mode, bool quiet_mode, long target_message_idx);
  bool load_mappings(const char *filepath, MappingTable *table); /* Needed by load_mapping_data */
+ bool load_compiled_mappings(const char *filepath, MappingTable *table);
+ bool is_compiled_mapping_file(const char *filepath);
+ bool reserve_output_buffer(OutputBuffer *buffer, size_t extra);
+ bool pipeline_submit_message(Pipeline *pipeline, const uint8_t *rom_data, size_t rom_size,
+             size_t segment_start_offset, int segment_index_0_based,
+             int msg_idx_in_segment, int absolute_msg_idx,
+             uint32_t message_offset_in_segment, uint32_t next_message_offset_in_segment,
+             const MessageMapping *mapping);
+ extern Pipeline *active_pipeline; /* Defined in the Pipeline section */
+ extern ListFormat list_format; /* Defined in the List Output section */
+ extern AutomapIndex *active_automap; /* Defined in the Automap section */
+ bool automap_message(AutomapIndex *index, const MessageCatalog *catalog, size_t i, MessageMapping *mapping);
 
 
  /* --- Utility Functions --- */
 
+ static THREAD_LOCAL OutputBuffer *thread_status_capture; /* Holds the status lines of a pool job (WorkPool) */
+
+ /**
+  * get_status_stream() - Returns the stream status messages are printed to.
+  *
+  * While audio, a machine-readable listing or an automapped map is written
+  * to stdout (-o -, --list-format, --automap) the messages go to stderr.
+  *
+  * Return: stdout or stderr.
+  */
+ FILE *
+ get_status_stream(void)
+ {
+     return (stdout_mode || list_format != LIST_FORMAT_MAP || active_automap) ? stderr : stdout;
+ }
+
  /**
   * status_printf() - Prints status messages to stdout unless quiet_mode enabled.
   * @format: Printf-style format string.
   * @...:    Arguments for the format string.
+  *
+  * See get_status_stream() for the stream. While the calling thread runs a
+  * job of a WorkPool, the message is appended to the job's report instead.
   */
  void
  status_printf(const char *format, ...)
@@ -196,7 +1130,22 @@
      if (!quiet_mode) {
          va_list args;
          va_start(args, format);
-         vprintf(format, args);
+         if (thread_status_capture) {
+             OutputBuffer *report = thread_status_capture;
+             va_list copy;
+             int length;
+
+             va_copy(copy, args);
+             length = vsnprintf(NULL, 0, format, copy);
+             va_end(copy);
+             if (length >= 0 && reserve_output_buffer(report, (size_t)length + 1)) {
+                 vsnprintf((char *)report->data + report->size, (size_t)length + 1, format, args);
+                 report->size += (size_t)length;
+                 va_end(args);
+                 return;
+             }
+         }
+         vfprintf(get_status_stream(), format, args);
          va_end(args);
      }
  }
@@ -232,88 +1181,198 @@
  }
 
  /**
-  * write_u16le() - Writes a 16-bit unsigned integer in Little-Endian format.
-  * @value: The value to write.
-  * @fp:    File pointer.
+  * write_u16be() - Writes a 16-bit unsigned integer in Big-Endian format.
+  * @buffer: Pointer to the buffer.
+  * @value:  The value to write.
+  */
+ void
+ write_u16be(uint8_t *buffer, uint16_t value)
+ {
+     buffer[0] = (uint8_t)(value >> 8);
+     buffer[1] = (uint8_t)value;
+ }
+
+ /**
+  * read_u16le() - Reads a 16-bit unsigned integer in Little-Endian format.
+  * @buffer: Pointer to the buffer.
   *
-  * Return: true on success, false on failure.
+  * Return: The uint16_t value.
   */
- bool
- write_u16le(uint16_t value, FILE *fp)
+ uint16_t
+ read_u16le(const uint8_t *buffer)
+ {
+     return (uint16_t)(buffer[0] | (buffer[1] << 8));
+ }
+
+ /**
+  * read_u32le() - Reads a 32-bit unsigned integer in Little-Endian format.
+  * @buffer: Pointer to the buffer.
+  *
+  * Return: The uint32_t value.
+  */
+ uint32_t
+ read_u32le(const uint8_t *buffer)
  {
-     uint8_t buffer[2];
+     return (uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) |
+            ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+ }
 
-     buffer[0] = value & 0xFF;
-     buffer[1] = (value >> 8) & 0xFF;
-     return fwrite(buffer, 1, 2, fp) == 2;
+ /**
+  * init_output_buffer() - Initializes an empty OutputBuffer.
+  * @buffer: Pointer to the OutputBuffer.
+  */
+ void
+ init_output_buffer(OutputBuffer *buffer)
+ {
+     buffer->data = NULL;
+     buffer->size = 0;
+     buffer->capacity = 0;
  }
 
  /**
-  * write_u32le() - Writes a 32-bit unsigned integer in Little-Endian format.
-  * @value: The value to write.
-  * @fp:    File pointer.
+  * reserve_output_buffer() - Ensures room for at least @extra more bytes.
+  * @buffer: Pointer to the OutputBuffer.
+  * @extra:  Number of bytes about to be appended.
   *
-  * Return: true on success, false on failure.
+  * Return: true on success, false on memory allocation failure.
   */
  bool
- write_u32le(uint32_t value, FILE *fp)
+ reserve_output_buffer(OutputBuffer *buffer, size_t extra)
  {
-     uint8_t buffer[4];
+     size_t new_capacity;
+     uint8_t *new_data;
 
-     buffer[0] = value & 0xFF;
-     buffer[1] = (value >> 8) & 0xFF;
-     buffer[2] = (value >> 16) & 0xFF;
-     buffer[3] = (value >> 24) & 0xFF;
-     return fwrite(buffer, 1, 4, fp) == 4;
+     if (extra <= buffer->capacity - buffer->size)
+         return true;
+     if (extra > SIZE_MAX / 2 - buffer->size) {
+         fprintf(stderr, "ERROR: Output buffer size exceeds limit.\n");
+         return false;
+     }
+     new_capacity = (buffer->capacity == 0) ? 4096 : buffer->capacity;
+     while (new_capacity - buffer->size < extra)
+         new_capacity *= 2;
+     new_data = (uint8_t *)realloc(buffer->data, new_capacity);
+     if (!new_data) {
+         fprintf(stderr, "ERROR: Failed to allocate %zu bytes for output buffer.\n", new_capacity);
+         return false;
+     }
+     buffer->data = new_data;
+     buffer->capacity = new_capacity;
+     return true;
  }
 
  /**
-  * write_chunk_id() - Writes a 4-character chunk ID to a file.
-  * @id: The 4-character string ID.
-  * @fp: File pointer.
+  * append_bytes() - Appends raw bytes to an OutputBuffer.
+  * @buffer: Pointer to the OutputBuffer.
+  * @data:   Bytes to append.
+  * @length: Number of bytes.
   *
-  * Return: true on success, false on failure.
+  * Return: true on success, false on memory allocation failure.
   */
  bool
- write_chunk_id(const char *id, FILE *fp)
+ append_bytes(OutputBuffer *buffer, const void *data, size_t length)
  {
-     return fwrite(id, 1, 4, fp) == 4;
+     if (!reserve_output_buffer(buffer, length))
+         return false;
+     memcpy(buffer->data + buffer->size, data, length);
+     buffer->size += length;
+     return true;
  }
 
  /**
-  * get_base_filename() - Extracts the base filename from a full path.
-  * @filepath: The full path string.
+  * append_u16le() - Appends a 16-bit unsigned integer in Little-Endian format.
+  * @buffer: Pointer to the OutputBuffer.
+  * @value:  The value to append.
   *
-  * Return: A pointer to the start of the base filename within the input string.
+  * Return: true on success, false on memory allocation failure.
   */
- const char *
- get_base_filename(const char *filepath)
+ bool
+ append_u16le(OutputBuffer *buffer, uint16_t value)
  {
-     const char *last_slash = strrchr(filepath, '/');
-     const char *last_bslash = strrchr(filepath, '\\');
-     const char *base = filepath;
-
-     if (last_slash && last_slash >= base)
-         base = last_slash + 1;
-
-     if (last_bslash && last_bslash >= base)
-         base = last_bslash + 1;
+     uint8_t bytes[2];
 
-     return base;
+     bytes[0] = value & 0xFF;
+     bytes[1] = (value >> 8) & 0xFF;
+     return append_bytes(buffer, bytes, 2);
  }
 
  /**
-  * clean_comment() - Cleans comment string by removing leading whitespace,
-  * the first '#' encountered after that whitespace (if any),
-  * and any whitespace immediately following that '#'.
-  * @comment: The comment string to clean (modified in place).
+  * append_u32le() - Appends a 32-bit unsigned integer in Little-Endian format.
+  * @buffer: Pointer to the OutputBuffer.
+  * @value:  The value to append.
+  *
+  * Return: true on success, false on memory allocation failure.
   */
- void
- clean_comment(char *comment)
+ bool
+ append_u32le(OutputBuffer *buffer, uint32_t value)
  {
-     char *start_of_text = comment;
+     uint8_t bytes[4];
 
-     if (!comment || *comment == '\0')
+     bytes[0] = value & 0xFF;
+     bytes[1] = (value >> 8) & 0xFF;
+     bytes[2] = (value >> 16) & 0xFF;
+     bytes[3] = (value >> 24) & 0xFF;
+     return append_bytes(buffer, bytes, 4);
+ }
+
+ /**
+  * append_chunk_id() - Appends a 4-character chunk ID.
+  * @buffer: Pointer to the OutputBuffer.
+  * @id:     The 4-character string ID.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_chunk_id(OutputBuffer *buffer, const char *id)
+ {
+     return append_bytes(buffer, id, 4);
+ }
+
+ /**
+  * free_output_buffer() - Frees memory associated with an OutputBuffer.
+  * @buffer: Pointer to the OutputBuffer.
+  */
+ void
+ free_output_buffer(OutputBuffer *buffer)
+ {
+     free(buffer->data);
+     init_output_buffer(buffer);
+ }
+
+ /**
+  * get_base_filename() - Extracts the base filename from a full path.
+  * @filepath: The full path string.
+  *
+  * Return: A pointer to the start of the base filename within the input string.
+  */
+ const char *
+ get_base_filename(const char *filepath)
+ {
+     const char *last_slash = strrchr(filepath, '/');
+     const char *last_bslash = strrchr(filepath, '\\');
+     const char *base = filepath;
+
+     if (last_slash && last_slash >= base)
+         base = last_slash + 1;
+
+     if (last_bslash && last_bslash >= base)
+         base = last_bslash + 1;
+
+     return base;
+ }
+
+ /**
+  * clean_comment() - Cleans comment string by removing leading whitespace,
+  * the first '#' encountered after that whitespace (if any),
+  * and any whitespace immediately following that '#'.
+  * @comment: The comment string to clean (modified in place).
+  */
+ void
+ clean_comment(char *comment)
+ {
+     char *start_of_text = comment;
+
+     if (!comment || *comment == '\0')
          return;
 
      /* 1. Find the first non-whitespace character */
@@ -334,1119 +1393,11383 @@
          memmove(comment, start_of_text, strlen(start_of_text) + 1);
  }
 
+ /**
+  * build_output_path() - Builds an output file path from directory, base and extension.
+  * @buffer:    Destination buffer.
+  * @size:      Size of the destination buffer.
+  * @directory: Output directory (NULL or empty for the current directory).
+  * @base:      Base filename (no extension).
+  * @extension: Extension including the leading dot (e.g. ".wav").
+  *
+  * Return: true if the path fit into @buffer, false if it was truncated.
+  */
+ bool
+ build_output_path(char *buffer, size_t size, const char *directory,
+           const char *base, const char *extension)
+ {
+     int len;
 
- /* --- Mapping File Handling --- */
+     if (directory && directory[0] != '\0')
+         len = snprintf(buffer, size, "%s/%s%s", directory, base, extension);
+     else
+         len = snprintf(buffer, size, "%s%s", base, extension);
+     return len >= 0 && (size_t)len < size;
+ }
+
+
+ /* --- Threading --- */
 
  /**
-  * init_mapping_table() - Initializes a MappingTable.
-  * @table: Pointer to the MappingTable.
+  * struct thread_start - Trampoline data passed to a new native thread.
+  * @fn:  Worker function.
+  * @arg: Argument for the worker function.
   */
- void
- init_mapping_table(MappingTable *table)
+ typedef struct {
+     void (*fn)(void *arg);
+     void *arg;
+ } ThreadStart;
+
+ #ifdef _WIN32
+ static DWORD WINAPI
+ thread_trampoline(LPVOID param)
  {
-     table->mappings = NULL;
-     table->count = 0;
-     table->capacity = 0;
+     ThreadStart start = *(ThreadStart *)param;
+     free(param);
+     start.fn(start.arg);
+     return 0;
+ }
+ #else
+ static void *
+ thread_trampoline(void *param)
+ {
+     ThreadStart start = *(ThreadStart *)param;
+     free(param);
+     start.fn(start.arg);
+     return NULL;
  }
+ #endif
 
  /**
-  * add_mapping() - Adds a mapping entry to the table, handling duplicates.
-  * @table: Pointer to the MappingTable.
-  * @entry: The MessageMapping entry to add (ownership of strings transferred).
+  * thread_create() - Starts a new thread running fn(arg).
+  * @thread: Pointer to store the thread handle.
+  * @fn:     Worker function.
+  * @arg:    Argument for the worker function.
   *
-  * Return: true on success, false on memory allocation failure.
+  * Return: true on success, false on failure.
   */
  bool
- add_mapping(MappingTable *table, MessageMapping entry)
+ thread_create(ThreadHandle *thread, void (*fn)(void *arg), void *arg)
  {
-     size_t i;
+     ThreadStart *start = (ThreadStart *)malloc(sizeof(ThreadStart));
 
-     /* Check for duplicates and replace if found */
-     for (i = 0; i < table->count; ++i) {
-         /* Compare using 0-based indices */
-         if (table->mappings[i].segment_index == entry.segment_index &&
-             table->mappings[i].message_index_in_seg == entry.message_index_in_seg) {
-             verbose_printf("Replacing duplicate mapping for Segment %d, Message %d\n",
-                        entry.segment_index, entry.message_index_in_seg);
-             free(table->mappings[i].output_filename_base);
-             free(table->mappings[i].comment);
-             table->mappings[i] = entry; /* Replace existing entry */
-             return true;
-         }
+     if (!start)
+         return false;
+     start->fn = fn;
+     start->arg = arg;
+ #ifdef _WIN32
+     *thread = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+     if (*thread == NULL) {
+         free(start);
+         return false;
      }
-
-     /* Grow capacity if needed */
-     if (table->count >= table->capacity) {
-         size_t new_capacity = (table->capacity == 0) ? 16 : table->capacity * 2;
-         MessageMapping *new_mappings = (MessageMapping *)realloc(table->mappings, new_capacity * sizeof(MessageMapping));
-         if (!new_mappings) {
-             fprintf(stderr, "ERROR: Failed to allocate memory for mapping table.\n");
-             /* Free the passed-in entry's strings as it wasn't added */
-             free(entry.output_filename_base);
-             free(entry.comment);
-             return false;
-         }
-         table->mappings = new_mappings;
-         table->capacity = new_capacity;
+ #else
+     if (pthread_create(thread, NULL, thread_trampoline, start) != 0) {
+         free(start);
+         return false;
      }
-
-     /* Add the new entry */
-     table->mappings[table->count++] = entry;
+ #endif
      return true;
  }
 
  /**
-  * free_mapping_table() - Frees memory associated with a MappingTable.
-  * @table: Pointer to the MappingTable.
+  * thread_join() - Waits for a thread to finish and releases its handle.
+  * @thread: Thread handle from thread_create().
   */
  void
- free_mapping_table(MappingTable *table)
+ thread_join(ThreadHandle thread)
  {
-     size_t i;
-
-     if (table && table->mappings) {
-         for (i = 0; i < table->count; ++i) {
-             free(table->mappings[i].output_filename_base);
-             free(table->mappings[i].comment);
-         }
-         free(table->mappings);
-     }
-     table->mappings = NULL;
-     table->count = 0;
-     table->capacity = 0;
+ #ifdef _WIN32
+     WaitForSingleObject(thread, INFINITE);
+     CloseHandle(thread);
+ #else
+     pthread_join(thread, NULL);
+ #endif
  }
 
  /**
-  * load_mappings() - Loads and parses the mapping file (expects 0-based segment index).
-  * @filepath: Path to the mapping file.
-  * @table:    Pointer to the MappingTable to populate.
-  *
-  * Return: true on success, false on failure.
+  * mutex_init() - Initializes a mutex.
+  * @mutex: Pointer to the MutexLock.
   */
- bool
- load_mappings(const char *filepath, MappingTable *table)
+ void
+ mutex_init(MutexLock *mutex)
  {
-     FILE *fp;
-     char line[1024];
-     int line_num = 0;
-     bool success = true;
+ #ifdef _WIN32
+     InitializeCriticalSection(mutex);
+ #else
+     pthread_mutex_init(mutex, NULL);
+ #endif
+ }
 
-     fp = fopen(filepath, "r");
-     if (!fp) {
-         fprintf(stderr, "ERROR: Cannot open mapping file '%s'.\n", filepath);
-         return false;
-     }
+ /**
+  * mutex_destroy() - Releases a mutex initialized with mutex_init().
+  * @mutex: Pointer to the MutexLock.
+  */
+ void
+ mutex_destroy(MutexLock *mutex)
+ {
+ #ifdef _WIN32
+     DeleteCriticalSection(mutex);
+ #else
+     pthread_mutex_destroy(mutex);
+ #endif
+ }
 
-     while (fgets(line, sizeof(line), fp)) {
-         char *trimmed_line = line;
-         char *tab1, *tab2, *tab3;
-         char *endptr_seg, *endptr_msg;
-         long seg_idx_long, msg_idx_long;
-         MessageMapping entry;
-         char *filename_start, *comment_start, *end;
+ /**
+  * mutex_lock() - Acquires a mutex.
+  * @mutex: Pointer to the MutexLock.
+  */
+ void
+ mutex_lock(MutexLock *mutex)
+ {
+ #ifdef _WIN32
+     EnterCriticalSection(mutex);
+ #else
+     pthread_mutex_lock(mutex);
+ #endif
+ }
 
-         line_num++;
+ /**
+  * mutex_unlock() - Releases a mutex acquired with mutex_lock().
+  * @mutex: Pointer to the MutexLock.
+  */
+ void
+ mutex_unlock(MutexLock *mutex)
+ {
+ #ifdef _WIN32
+     LeaveCriticalSection(mutex);
+ #else
+     pthread_mutex_unlock(mutex);
+ #endif
+ }
 
-         /* Trim leading whitespace */
-         while (isspace((unsigned char)*trimmed_line))
-             trimmed_line++;
+ /**
+  * condvar_init() - Initializes a condition variable.
+  * @cond: Pointer to the CondVar.
+  */
+ void
+ condvar_init(CondVar *cond)
+ {
+ #ifdef _WIN32
+     InitializeConditionVariable(cond);
+ #else
+     pthread_cond_init(cond, NULL);
+ #endif
+ }
 
-         /* Skip empty lines and comments starting at beginning of line */
-         if (trimmed_line[0] == '\0' || trimmed_line[0] == '#')
-             continue;
+ /**
+  * condvar_destroy() - Releases a condition variable initialized with condvar_init().
+  * @cond: Pointer to the CondVar.
+  */
+ void
+ condvar_destroy(CondVar *cond)
+ {
+ #ifdef _WIN32
+     (void)cond; /* Win32 condition variables need no cleanup */
+ #else
+     pthread_cond_destroy(cond);
+ #endif
+ }
 
-         /* Find tabs */
-         tab1 = strchr(trimmed_line, '\t');
-         tab2 = tab1 ? strchr(tab1 + 1, '\t') : NULL;
-         tab3 = tab2 ? strchr(tab2 + 1, '\t') : NULL; /* Optional third tab */
+ /**
+  * condvar_wait() - Atomically releases @mutex and waits for a signal.
+  * @cond:  Pointer to the CondVar.
+  * @mutex: Pointer to the MutexLock held by the caller (held again on return).
+  */
+ void
+ condvar_wait(CondVar *cond, MutexLock *mutex)
+ {
+ #ifdef _WIN32
+     SleepConditionVariableCS(cond, mutex, INFINITE);
+ #else
+     pthread_cond_wait(cond, mutex);
+ #endif
+ }
 
-         if (!tab1 || !tab2) {
-             fprintf(stderr, "ERROR: Invalid format in mapping file '%s' at line %d: Missing tabs.\n", filepath, line_num);
-             success = false;
-             break;
-         }
+ /**
+  * condvar_signal() - Wakes one thread waiting on a condition variable.
+  * @cond: Pointer to the CondVar.
+  */
+ void
+ condvar_signal(CondVar *cond)
+ {
+ #ifdef _WIN32
+     WakeConditionVariable(cond);
+ #else
+     pthread_cond_signal(cond);
+ #endif
+ }
 
-         *tab1 = '\0'; /* Null-terminate segment index */
-         *tab2 = '\0'; /* Null-terminate message index */
+ /**
+  * condvar_broadcast() - Wakes all threads waiting on a condition variable.
+  * @cond: Pointer to the CondVar.
+  */
+ void
+ condvar_broadcast(CondVar *cond)
+ {
+ #ifdef _WIN32
+     WakeAllConditionVariable(cond);
+ #else
+     pthread_cond_broadcast(cond);
+ #endif
+ }
 
-         seg_idx_long = strtol(trimmed_line, &endptr_seg, 10);
-         msg_idx_long = strtol(tab1 + 1, &endptr_msg, 10);
+ /**
+  * atomic_load_size() - Reads a shared size_t with acquire semantics.
+  * @ptr: Pointer to the shared value.
+  *
+  * Return: The value.
+  */
+ size_t
+ atomic_load_size(volatile size_t *ptr)
+ {
+ #if defined(_MSC_VER) && defined(_WIN64)
+     return (size_t)InterlockedCompareExchange64((volatile LONG64 *)ptr, 0, 0);
+ #elif defined(_MSC_VER)
+     return (size_t)InterlockedCompareExchange((volatile LONG *)ptr, 0, 0);
+ #else
+     return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+ #endif
+ }
 
-         /* Validate indices (Segment index must be >= 0, Message index >= 0) */
-         if (*endptr_seg != '\0' || *endptr_msg != '\0' || seg_idx_long < 0 || msg_idx_long < 0) {
-             fprintf(stderr, "ERROR: Invalid index format in mapping file '%s' at line %d (ensure SegIdx >= 0, MsgIdxInSeg >= 0).\n", filepath, line_num);
-             success = false;
-             break;
-         }
+ /**
+  * atomic_store_size() - Writes a shared size_t with release semantics.
+  * @ptr:   Pointer to the shared value.
+  * @value: New value.
+  */
+ void
+ atomic_store_size(volatile size_t *ptr, size_t value)
+ {
+ #if defined(_MSC_VER) && defined(_WIN64)
+     InterlockedExchange64((volatile LONG64 *)ptr, (LONG64)value);
+ #elif defined(_MSC_VER)
+     InterlockedExchange((volatile LONG *)ptr, (LONG)value);
+ #else
+     __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+ #endif
+ }
 
-         entry.segment_index = (int)seg_idx_long; /* Store 0-based index */
-         entry.message_index_in_seg = (int)msg_idx_long;
+ /**
+  * atomic_cas_size() - Compare-and-swap on a shared size_t.
+  * @ptr:      Pointer to the shared value.
+  * @expected: Value the caller last saw.
+  * @desired:  Value to store if *@ptr still equals @expected.
+  *
+  * Return: true if the value was swapped.
+  */
+ bool
+ atomic_cas_size(volatile size_t *ptr, size_t expected, size_t desired)
+ {
+ #if defined(_MSC_VER) && defined(_WIN64)
+     return (size_t)InterlockedCompareExchange64((volatile LONG64 *)ptr, (LONG64)desired, (LONG64)expected) == expected;
+ #elif defined(_MSC_VER)
+     return (size_t)InterlockedCompareExchange((volatile LONG *)ptr, (LONG)desired, (LONG)expected) == expected;
+ #else
+     return __atomic_compare_exchange_n(ptr, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+ #endif
+ }
 
-         filename_start = tab2 + 1;
-         comment_start = NULL;
+ /**
+  * atomic_add_size() - Atomically adds to a shared size_t.
+  * @ptr:   Pointer to the shared value.
+  * @delta: Amount to add ((size_t)-1 decrements).
+  *
+  * Return: The new value.
+  */
+ size_t
+ atomic_add_size(volatile size_t *ptr, size_t delta)
+ {
+ #if defined(_MSC_VER) && defined(_WIN64)
+     return (size_t)InterlockedExchangeAdd64((volatile LONG64 *)ptr, (LONG64)delta) + delta;
+ #elif defined(_MSC_VER)
+     return (size_t)InterlockedExchangeAdd((volatile LONG *)ptr, (LONG)delta) + delta;
+ #else
+     return __atomic_add_fetch(ptr, delta, __ATOMIC_ACQ_REL);
+ #endif
+ }
 
-         /* Handle filename and potential comment */
-         if (tab3) {
-             /* Comment exists */
-             char *filename_end = tab3 - 1;
-             /* Trim trailing whitespace from filename */
-             while (filename_end >= filename_start && isspace((unsigned char)*filename_end)) {
-                 *filename_end-- = '\0';
-             }
-             *tab3 = '\0'; /* Null-terminate filename cleanly */
-             comment_start = tab3 + 1;
-         } else {
-             /* No comment field, trim trailing whitespace from filename */
-             end = filename_start + strlen(filename_start) - 1;
-             while (end >= filename_start && isspace((unsigned char)*end)) {
-                 *end-- = '\0';
-             }
-         }
+ /**
+  * backoff_wait() - Waits a little longer on each call while a lock-free
+  * operation cannot make progress.
+  * @round: Caller's retry counter (start at 0; incremented here).
+  *
+  * Spins briefly, then yields the processor, then sleeps so that a stage
+  * blocked on a slow neighbour (e.g. a writer on network storage) does not
+  * burn a CPU.
+  */
+ void
+ backoff_wait(unsigned *round)
+ {
+     if (*round < 16) {
+         /* Busy retry: the other side is usually mid-operation */
+     } else if (*round < 64) {
+ #ifdef _WIN32
+         SwitchToThread();
+ #else
+         sched_yield();
+ #endif
+     } else {
+ #ifdef _WIN32
+         Sleep(1);
+ #else
+         struct timespec delay = {0, 200000}; /* 200 us */
+         nanosleep(&delay, NULL);
+ #endif
+     }
+     if (*round < UINT_MAX)
+         (*round)++;
+ }
 
-         entry.output_filename_base = strdup(filename_start);
-         if (!entry.output_filename_base) {
-             fprintf(stderr, "ERROR: Memory allocation failed for filename (line %d).\n", line_num);
-             success = false;
-             break;
-         }
+ /**
+  * get_cpu_count() - Returns the number of online processors.
+  *
+  * Return: Processor count (at least 1).
+  */
+ int
+ get_cpu_count(void)
+ {
+ #ifdef _WIN32
+     SYSTEM_INFO info;
+     GetSystemInfo(&info);
+     return (info.dwNumberOfProcessors > 0) ? (int)info.dwNumberOfProcessors : 1;
+ #else
+     long count = sysconf(_SC_NPROCESSORS_ONLN);
+     return (count > 0) ? (int)count : 1;
+ #endif
+ }
 
-         if (comment_start && *comment_start != '\0') {
-             /* Trim trailing newline/whitespace from comment */
-             end = comment_start + strlen(comment_start) - 1;
-             while (end >= comment_start && isspace((unsigned char)*end))
-                 *end-- = '\0';
+ /**
+  * run_worker_threads() - Runs fn(arg) on thread_count threads and waits for all.
+  * @thread_count: Number of threads to use (the calling thread is one of them).
+  * @fn:           Worker function.
+  * @arg:          Argument shared by all workers.
+  *
+  * Falls back to fewer threads (down to just the caller) if threads cannot
+  * be created.
+  */
+ void
+ run_worker_threads(int thread_count, void (*fn)(void *arg), void *arg)
+ {
+     ThreadHandle *threads = NULL;
+     int started = 0;
+     int i;
 
-             entry.comment = strdup(comment_start);
-             if (!entry.comment) {
-                 fprintf(stderr, "ERROR: Memory allocation failed for comment (line %d).\n", line_num);
-                 free(entry.output_filename_base); /* Clean up */
-                 success = false;
+     if (thread_count > 1)
+         threads = (ThreadHandle *)malloc((size_t)(thread_count - 1) * sizeof(ThreadHandle));
+     if (threads) {
+         for (i = 0; i < thread_count - 1; ++i) {
+             if (!thread_create(&threads[started], fn, arg)) {
+                 fprintf(stderr, "WARN: Could not start worker thread %d; continuing with %d.\n", i + 1, started + 1);
                  break;
              }
-             /* Clean comment AFTER saving it, before adding to table */
-             clean_comment(entry.comment);
-         } else {
-             entry.comment = NULL; /* No comment provided */
-         }
-
-         if (!add_mapping(table, entry)) {
-             /* Error printed in add_mapping, entry strings already freed */
-             success = false;
-             break;
+             started++;
          }
      }
 
-     fclose(fp);
-     if (!success)
-         free_mapping_table(table); /* Clean up partially loaded table */
+     fn(arg); /* The calling thread works too */
 
-     return success;
+     for (i = 0; i < started; ++i)
+         thread_join(threads[i]);
+     free(threads);
  }
 
+
+ /* --- Tracing --- */
+
+ TraceRingList trace_rings;   /* Rings of all threads that recorded events (guarded by trace_lock) */
+ MutexLock trace_lock;
+ uint64_t trace_start_ns;     /* Timestamp 0 of the trace */
+ static THREAD_LOCAL TraceRing *thread_trace_ring; /* Ring of the calling thread */
+
  /**
-  * find_mapping() - Finds a mapping entry in the table using 0-based indices.
-  * @table:                 Pointer to the MappingTable.
-  * @segment_index_0_based: 0-based segment index.
-  * @message_index_in_seg:  0-based message index within the segment.
+  * get_monotonic_ns() - Reads a monotonic clock.
   *
-  * Return: Pointer to the found MessageMapping, or NULL if not found.
+  * Return: Current time in nanoseconds from an arbitrary starting point.
   */
- const MessageMapping *
- find_mapping(const MappingTable *table, int segment_index_0_based, int message_index_in_seg)
+ uint64_t
+ get_monotonic_ns(void)
  {
-     size_t i;
-
-     if (!table || !table->mappings)
-         return NULL;
+ #ifdef _WIN32
+     static LARGE_INTEGER frequency; /* Constant after boot; racing initializers store the same value */
+     LARGE_INTEGER counter;
+
+     if (frequency.QuadPart == 0)
+         QueryPerformanceFrequency(&frequency);
+     QueryPerformanceCounter(&counter);
+     return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+ #else
+     struct timespec ts;
 
-     for (i = 0; i < table->count; ++i) {
-         if (table->mappings[i].segment_index == segment_index_0_based &&
-             table->mappings[i].message_index_in_seg == message_index_in_seg)
-             return &table->mappings[i];
-     }
-     return NULL;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+ #endif
  }
 
-
- /* --- PCM Buffer Handling --- */
-
  /**
-  * init_pcm_buffer() - Initializes a PcmBuffer.
-  * @buffer: Pointer to the PcmBuffer.
+  * trace_init() - Enables trace recording for this run.
   */
  void
- init_pcm_buffer(PcmBuffer *buffer)
+ trace_init(void)
  {
-     buffer->samples = NULL;
-     buffer->count = 0;
-     buffer->capacity = 0;
+     trace_rings.rings = NULL;
+     trace_rings.count = 0;
+     trace_rings.capacity = 0;
+     mutex_init(&trace_lock);
+     trace_start_ns = get_monotonic_ns();
+     trace_enabled = true;
  }
 
  /**
-  * add_pcm_sample() - Adds a PCM sample to the buffer, resizing if necessary.
-  * @buffer: Pointer to the PcmBuffer.
-  * @sample: The 16-bit PCM sample to add.
+  * get_thread_trace_ring() - Returns the calling thread's trace ring, creating
+  * and registering it on first use.
   *
-  * Return: true on success, false on memory allocation failure.
+  * Only registration takes trace_lock; recording into the ring afterwards is
+  * lock-free because each ring has exactly one writer.
+  *
+  * Return: Pointer to the ring, or NULL on memory allocation failure.
   */
- bool
- add_pcm_sample(PcmBuffer *buffer, int16_t sample)
+ TraceRing *
+ get_thread_trace_ring(void)
  {
-     if (buffer->count >= buffer->capacity) {
-         size_t new_capacity = (buffer->capacity == 0) ? 2048 : buffer->capacity * 2;
-         int16_t *new_samples;
+     TraceRing *ring = thread_trace_ring;
 
-         /* Prevent excessively large allocations */
-         if (new_capacity > SIZE_MAX / sizeof(int16_t) / 2) {
-             fprintf(stderr, "ERROR: PCM buffer capacity exceeds limit.\n");
-             return false;
-         }
-         new_samples = (int16_t *)realloc(buffer->samples, new_capacity * sizeof(int16_t));
-         if (!new_samples) {
-             fprintf(stderr, "ERROR: Failed to reallocate memory for PCM buffer (capacity %zu).\n", new_capacity);
-             return false;
+     if (ring)
+         return ring;
+
+     ring = (TraceRing *)calloc(1, sizeof(TraceRing));
+     if (ring)
+         ring->events = (TraceEvent *)malloc(TRACE_RING_CAPACITY * sizeof(TraceEvent));
+     if (!ring || !ring->events) {
+         free(ring);
+         return NULL;
+     }
+
+     mutex_lock(&trace_lock);
+     if (trace_rings.count >= trace_rings.capacity) {
+         size_t new_capacity = (trace_rings.capacity == 0) ? 16 : trace_rings.capacity * 2;
+         TraceRing **new_rings = (TraceRing **)realloc(trace_rings.rings, new_capacity * sizeof(TraceRing *));
+         if (!new_rings) {
+             mutex_unlock(&trace_lock);
+             free(ring->events);
+             free(ring);
+             return NULL;
          }
-         buffer->samples = new_samples;
-         buffer->capacity = new_capacity;
+         trace_rings.rings = new_rings;
+         trace_rings.capacity = new_capacity;
      }
-     buffer->samples[buffer->count++] = sample;
-     return true;
+     ring->thread_id = (int)trace_rings.count;
+     trace_rings.rings[trace_rings.count++] = ring;
+     mutex_unlock(&trace_lock);
+
+     thread_trace_ring = ring;
+     return ring;
  }
 
  /**
-  * free_pcm_buffer() - Frees memory associated with a PcmBuffer.
-  * @buffer: Pointer to the PcmBuffer.
+  * trace_span() - Records a completed span ending now on the calling thread.
+  * @name:           Span name (must be a string literal or otherwise outlive the run).
+  * @start_ns:       Start timestamp from get_monotonic_ns().
+  * @segment_index:  0-based segment index, or -1 if not message related.
+  * @message_index:  0-based message index within the segment.
+  * @absolute_index: 0-based absolute message index.
+  *
+  * When a thread's ring is full the oldest events are overwritten.
   */
  void
- free_pcm_buffer(PcmBuffer *buffer)
+ trace_span(const char *name, uint64_t start_ns, int segment_index, int message_index, int absolute_index)
  {
-     free(buffer->samples);
-     buffer->samples = NULL;
-     buffer->count = 0;
-     buffer->capacity = 0;
- }
+     TraceRing *ring;
+     TraceEvent *event;
 
- /* --- ADPCM Decoding --- */
+     if (!trace_enabled || !(ring = get_thread_trace_ring()))
+         return;
+
+     event = &ring->events[ring->recorded % TRACE_RING_CAPACITY];
+     event->name = name;
+     event->start_ns = start_ns;
+     event->end_ns = get_monotonic_ns();
+     event->segment_index = segment_index;
+     event->message_index = message_index;
+     event->absolute_index = absolute_index;
+     ring->recorded++;
+ }
 
  /**
-  * decode_nibble() - Decodes a single 4-bit ADPCM nibble using updated tables.
-  * @nibble:     The 4-bit ADPCM nibble (0-15).
-  * @state:      Pointer to the current AdpcmState.
-  * @pcm_buffer: Pointer to the PcmBuffer to add the sample to.
+  * write_trace_file() - Writes all recorded spans in Chrome trace-event format
+  * and releases the trace rings.
+  * @trace_filepath: Path of the JSON file to create.
   *
-  * Return: true on success, false on failure (e.g., buffer allocation).
+  * Must be called after all worker threads have been joined. Spans become
+  * complete ("X") events with microsecond timestamps; every thread also gets
+  * a thread_name metadata event so viewers label its track.
+  *
+  * Return: true on success, false on failure.
   */
  bool
- decode_nibble(uint8_t nibble, AdpcmState *state, PcmBuffer *pcm_buffer)
+ write_trace_file(const char *trace_filepath)
  {
-     int diff; /* Signed difference from table */
-     int16_t pcm_sample;
-     int next_state;
+     FILE *fp;
+     bool success = false;
+     uint64_t dropped = 0;
+     size_t r;
 
-     /* Ensure state index is valid */
-     if (state->adpcm_state < 0 || state->adpcm_state > 15) {
-         fprintf(stderr, "ERROR: Invalid ADPCM state index %d\n", state->adpcm_state);
-         state->adpcm_state = 0; /* Reset state */
+     if (!trace_enabled)
+         return true;
+
+     fp = fopen(trace_filepath, "w");
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot open trace file '%s' for writing.\n", trace_filepath);
+         goto cleanup;
      }
 
-     /* Get difference from 2D step table */
-     diff = step_table[state->adpcm_state][nibble];
+     fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+     fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"nortel-voiceware-decoder\"}}");
+     for (r = 0; r < trace_rings.count; ++r) {
+         const TraceRing *ring = trace_rings.rings[r];
+         uint64_t first_event = (ring->recorded > TRACE_RING_CAPACITY) ? ring->recorded - TRACE_RING_CAPACITY : 0;
+         uint64_t e;
+
+         fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+             ring->thread_id, ring->thread_id);
+         dropped += first_event;
+         for (e = first_event; e < ring->recorded; ++e) {
+             const TraceEvent *event = &ring->events[e % TRACE_RING_CAPACITY];
+
+             fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                 event->name, ring->thread_id,
+                 (double)(event->start_ns - trace_start_ns) / 1000.0,
+                 (double)(event->end_ns - event->start_ns) / 1000.0);
+             if (event->segment_index >= 0)
+                 fprintf(fp, ",\"args\":{\"segment\":%d,\"message\":%d,\"index\":%d}",
+                     event->segment_index, event->message_index, event->absolute_index);
+             fputc('}', fp);
+         }
+     }
+     fprintf(fp, "\n]}\n");
 
-     /* Update sample value */
-     /* Note: Using int32_t for intermediate calculation to avoid overflow before clamping */
-     int32_t next_sample = (int32_t)state->current_sample + diff;
+     if (ferror(fp)) {
+         fprintf(stderr, "ERROR: Failed to write trace file '%s'.\n", trace_filepath);
+         fclose(fp);
+         goto cleanup;
+     }
+     fclose(fp);
+     if (dropped > 0)
+         fprintf(stderr, "WARN: Trace rings overflowed; the oldest %llu span(s) were dropped.\n", (unsigned long long)dropped);
+     status_printf("Wrote trace: %s\n", trace_filepath);
+     success = true;
 
-     /* Clamp sample (important for ADPCM) */
-     if (next_sample > 32767)
-         next_sample = 32767;
-     else if (next_sample < -32768)
-         next_sample = -32768;
-     state->current_sample = (int16_t)next_sample;
+ cleanup:
+     for (r = 0; r < trace_rings.count; ++r) {
+         free(trace_rings.rings[r]->events);
+         free(trace_rings.rings[r]);
+     }
+     free(trace_rings.rings);
+     trace_rings.rings = NULL;
+     trace_rings.count = 0;
+     trace_rings.capacity = 0;
+     mutex_destroy(&trace_lock);
+     trace_enabled = false;
+     return success;
+ }
 
-     /* Update state index using state table */
-     next_state = state->adpcm_state + state_table[nibble];
+ /* --- Run Statistics --- */
 
-     /* Clamp state index */
-     if (next_state < 0)
-         next_state = 0;
-     else if (next_state > 15)
-         next_state = 15;
-     state->adpcm_state = (int8_t)next_state;
+ /* Names used in the summary and JSON output; order matches StatsPhase / OpcodeType */
+ static const char *const stats_phase_names[STATS_PHASE_COUNT] = {
+     "rom_load", "map_parse", "segment_parse", "decode", "encode", "write"
+ };
+ static const char *const opcode_type_names[OPCODE_TYPE_COUNT] = {
+     "end", "silence", "short_block", "long_block", "repeat_block", "unknown"
+ };
 
-     /* Scale to 16-bit PCM (as per original specification's hint) and add to buffer */
-     /* Clamping might make this scaling less critical, but retain for consistency */
-     pcm_sample = (int16_t)(state->current_sample << 7);
-     /* Re-clamp after scaling, just in case << 7 causes overflow */
-     if ((state->current_sample > (32767 >> 7)) && (diff > 0)) pcm_sample = 32767;
-     if ((state->current_sample < (-32768 >> 7)) && (diff < 0)) pcm_sample = -32768;
+ RunStats run_stats;   /* Totals for the whole run (guarded by stats_lock) */
+ MutexLock stats_lock;
 
-     return add_pcm_sample(pcm_buffer, pcm_sample);
+ /**
+  * stats_init() - Enables statistics collection for this run.
+  * @json: true to report as JSON instead of a human-readable summary.
+  */
+ void
+ stats_init(bool json)
+ {
+     memset(&run_stats, 0, sizeof(run_stats));
+     mutex_init(&stats_lock);
+     stats_json = json;
+     stats_enabled = true;
+     run_stats.start_ns = get_monotonic_ns();
  }
 
+ /**
+  * stats_timer_start() - Starts timing a phase.
+  *
+  * Return: Start timestamp, or 0 if statistics and tracing are disabled (no clock read).
+  */
+ uint64_t
+ stats_timer_start(void)
+ {
+     return (stats_enabled || trace_enabled) ? get_monotonic_ns() : 0;
+ }
 
- /* --- WAV File Writing --- */
+ /**
+  * stats_timer_stop() - Adds the time since @start to a phase of a local delta.
+  * @stats: Per-message or per-thread statistics delta.
+  * @phase: Phase to charge.
+  * @start: Value returned by stats_timer_start().
+  */
+ void
+ stats_timer_stop(RunStats *stats, StatsPhase phase, uint64_t start)
+ {
+     if (stats_enabled)
+         stats->phase_ns[phase] += get_monotonic_ns() - start;
+ }
 
  /**
-  * write_info_sub_chunk() - Writes a metadata sub-chunk to the WAV file.
-  * @id:   The 4-character chunk ID.
-  * @text: The string data for the chunk.
-  * @fp:   File pointer.
-  *
-  * Return: The number of bytes written (including ID, size, data, padding),
-  * or 0 on error.
+  * stats_merge() - Adds a local statistics delta to the run totals.
+  * @delta: Counters collected by one message, segment or thread.
   */
- uint32_t
- write_info_sub_chunk(const char *id, const char *text, FILE *fp)
+ void
+ stats_merge(const RunStats *delta)
  {
-     size_t text_len;
-     uint32_t chunk_size;
-     bool needs_padding;
-     uint32_t total_size;
+     int i;
 
-     if (!text)
-         return 0; /* Skip if text is NULL */
+     if (!stats_enabled)
+         return;
 
-     text_len = strlen(text);
-     chunk_size = (uint32_t)text_len + 1; /* Include null terminator */
-     needs_padding = (chunk_size % 2 != 0);
-     total_size = 4 + 4 + chunk_size + (needs_padding ? 1 : 0);
+     mutex_lock(&stats_lock);
+     for (i = 0; i < STATS_PHASE_COUNT; ++i)
+         run_stats.phase_ns[i] += delta->phase_ns[i];
+     for (i = 0; i < OPCODE_TYPE_COUNT; ++i)
+         run_stats.opcodes[i] += delta->opcodes[i];
+     run_stats.messages += delta->messages;
+     run_stats.samples += delta->samples;
+     run_stats.bytes_in += delta->bytes_in;
+     run_stats.bytes_out += delta->bytes_out;
+     run_stats.files_out += delta->files_out;
+     run_stats.clamps += delta->clamps;
+     run_stats.reallocations += delta->reallocations;
+     run_stats.arena_blocks += delta->arena_blocks;
+     mutex_unlock(&stats_lock);
+ }
 
-     if (!write_chunk_id(id, fp)) return 0;
-     if (!write_u32le(chunk_size, fp)) return 0;
-     if (fwrite(text, 1, text_len + 1, fp) != text_len + 1) return 0; /* Write string + null */
-     if (needs_padding) {
-         uint8_t padding_byte = 0;
-         if (fwrite(&padding_byte, 1, 1, fp) != 1) return 0;
+ /**
+  * stats_record_phase() - Charges the time since @start to a phase of the run
+  * totals and records it as a span for --trace.
+  * @phase:    Phase to charge.
+  * @start:    Value returned by stats_timer_start().
+  * @bytes_in: ROM bytes read during the phase.
+  */
+ void
+ stats_record_phase(StatsPhase phase, uint64_t start, uint64_t bytes_in)
+ {
+     RunStats delta;
+
+     trace_span(stats_phase_names[phase], start, -1, 0, 0);
+     if (!stats_enabled)
+         return;
+     memset(&delta, 0, sizeof(delta));
+     stats_timer_stop(&delta, phase, start);
+     delta.bytes_in = bytes_in;
+     stats_merge(&delta);
+ }
+
+ /**
+  * print_stats() - Prints the run statistics to stderr.
+  *
+  * Phase times of decode and write are summed over all worker threads, so
+  * they can exceed the wall time in parallel runs.
+  */
+ void
+ print_stats(void)
+ {
+     uint64_t wall_ns;
+     double wall_s, audio_s;
+     int i;
+
+     if (!stats_enabled)
+         return;
+
+     wall_ns = get_monotonic_ns() - run_stats.start_ns;
+     wall_s = (double)wall_ns / 1e9;
+     audio_s = (double)run_stats.samples / DEFAULT_SAMPLE_RATE;
+
+     if (stats_json) {
+         fprintf(stderr, "{\"wall_ms\":%.3f,\"phases_ms\":{", (double)wall_ns / 1e6);
+         for (i = 0; i < STATS_PHASE_COUNT; ++i)
+             fprintf(stderr, "%s\"%s\":%.3f", i ? "," : "", stats_phase_names[i], (double)run_stats.phase_ns[i] / 1e6);
+         fprintf(stderr, "},\"messages\":%llu,\"samples\":%llu,\"audio_seconds\":%.3f,"
+             "\"bytes_in\":%llu,\"bytes_out\":%llu,\"files_out\":%llu,\"opcodes\":{",
+             (unsigned long long)run_stats.messages, (unsigned long long)run_stats.samples, audio_s,
+             (unsigned long long)run_stats.bytes_in, (unsigned long long)run_stats.bytes_out,
+             (unsigned long long)run_stats.files_out);
+         for (i = 0; i < OPCODE_TYPE_COUNT; ++i)
+             fprintf(stderr, "%s\"%s\":%llu", i ? "," : "", opcode_type_names[i], (unsigned long long)run_stats.opcodes[i]);
+         fprintf(stderr, "},\"clamps\":%llu,\"reallocations\":%llu,\"arena_blocks\":%llu,\"samples_per_second\":%.0f}\n",
+             (unsigned long long)run_stats.clamps, (unsigned long long)run_stats.reallocations,
+             (unsigned long long)run_stats.arena_blocks,
+             wall_s > 0 ? (double)run_stats.samples / wall_s : 0.0);
+         return;
      }
 
-     return total_size;
+     fprintf(stderr, "--- Statistics ---\n");
+     fprintf(stderr, "  Wall time:       %10.3f ms\n", (double)wall_ns / 1e6);
+     for (i = 0; i < STATS_PHASE_COUNT; ++i)
+         fprintf(stderr, "  %-16s %10.3f ms\n", stats_phase_names[i], (double)run_stats.phase_ns[i] / 1e6);
+     fprintf(stderr, "  Messages:        %10llu\n", (unsigned long long)run_stats.messages);
+     fprintf(stderr, "  Samples:         %10llu (%.2f s of audio, %.2f Msamples/s)\n",
+         (unsigned long long)run_stats.samples, audio_s,
+         wall_s > 0 ? (double)run_stats.samples / wall_s / 1e6 : 0.0);
+     fprintf(stderr, "  Bytes in:        %10llu\n", (unsigned long long)run_stats.bytes_in);
+     fprintf(stderr, "  Bytes out:       %10llu (%llu files)\n",
+         (unsigned long long)run_stats.bytes_out, (unsigned long long)run_stats.files_out);
+     fprintf(stderr, "  Opcodes:        ");
+     for (i = 0; i < OPCODE_TYPE_COUNT; ++i)
+         fprintf(stderr, " %s=%llu", opcode_type_names[i], (unsigned long long)run_stats.opcodes[i]);
+     fprintf(stderr, "\n");
+     fprintf(stderr, "  Clamps hit:      %10llu\n", (unsigned long long)run_stats.clamps);
+     fprintf(stderr, "  Reallocations:   %10llu\n", (unsigned long long)run_stats.reallocations);
+     if (arena_mode)
+         fprintf(stderr, "  Arena blocks:    %10llu\n", (unsigned long long)run_stats.arena_blocks);
  }
 
+ /* --- Arena Allocation --- */
+
+ ArenaList thread_arenas;     /* Arenas of all threads that decoded in arena mode (guarded by arena_lock) */
+ MutexLock arena_lock;
+ static THREAD_LOCAL Arena *thread_arena; /* Decode arena of the calling thread */
+
  /**
-  * write_wav_file() - Writes decoded PCM data to a WAV file with metadata.
-  * @output_filepath:    Full path for the output WAV file.
-  * @pcm_buffer:         Pointer to the PcmBuffer containing the samples.
-  * @sample_rate:        Sample rate (e.g., 8000).
-  * @rom_basename:       Base filename of the input ROM (for Artist tag).
-  * @track_title:        Title for the track (INAM tag).
-  * @track_number_str:   String representation of the absolute track number.
-  * @comment:            Comment string (ICMT tag, can be NULL).
+  * init_arena() - Initializes an Arena.
+  * @arena:  Pointer to the Arena.
+  * @buffer: Caller-supplied memory to allocate from, or NULL to use heap blocks.
+  * @size:   Size of @buffer in bytes (ignored if @buffer is NULL).
   *
-  * Return: true on success, false on failure.
+  * An arena over a caller buffer never touches the heap; allocations that do
+  * not fit fail instead.
   */
- bool
- write_wav_file(const char *output_filepath, const PcmBuffer *pcm_buffer,
-            uint32_t sample_rate, const char *rom_basename,
-            const char *track_title, const char *track_number_str,
-            const char *comment)
+ void
+ init_arena(Arena *arena, void *buffer, size_t size)
+ {
+     memset(arena, 0, sizeof(*arena));
+     if (buffer) {
+         size_t skip = (ARENA_ALIGNMENT - (uintptr_t)buffer % ARENA_ALIGNMENT) % ARENA_ALIGNMENT;
+
+         if (size >= skip + ARENA_ALIGNMENT) {
+             arena->block = (uint8_t *)buffer + skip;
+             arena->block_size = size - skip;
+             arena->used = ARENA_ALIGNMENT;
+             *(uint8_t **)arena->block = NULL;
+         }
+         arena->external = true;
+     }
+ }
+
+ /**
+  * arena_alloc() - Allocates memory from an Arena.
+  * @arena: Pointer to the Arena.
+  * @size:  Number of bytes.
+  *
+  * A request that does not fit starts a new block of at least
+  * ARENA_BLOCK_SIZE bytes. Earlier blocks stay valid until the next reset.
+  *
+  * Return: Pointer aligned to ARENA_ALIGNMENT, or NULL if out of memory.
+  */
+ void *
+ arena_alloc(Arena *arena, size_t size)
+ {
+     void *memory;
+
+     if (size > SIZE_MAX - 2 * ARENA_ALIGNMENT)
+         return NULL;
+     size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+     if (!arena->block || arena->block_size - arena->used < size) {
+         size_t block_size = ARENA_BLOCK_SIZE;
+         uint8_t *block;
+
+         if (arena->external)
+             return NULL;
+         if (block_size < arena->high_water + ARENA_ALIGNMENT)
+             block_size = arena->high_water + ARENA_ALIGNMENT;
+         if (block_size < size + ARENA_ALIGNMENT)
+             block_size = size + ARENA_ALIGNMENT;
+         block = (uint8_t *)malloc(block_size);
+         if (!block)
+             return NULL;
+         *(uint8_t **)block = arena->block;
+         arena->block = block;
+         arena->block_size = block_size;
+         arena->used = ARENA_ALIGNMENT;
+         arena->heap_calls++;
+     }
+     memory = arena->block + arena->used;
+     arena->used += size;
+     arena->reserved += size;
+     if (arena->reserved > arena->high_water)
+         arena->high_water = arena->reserved;
+     return memory;
+ }
+
+ /**
+  * arena_strdup() - Copies a string into an Arena.
+  * @arena: Pointer to the Arena.
+  * @text:  String to copy.
+  *
+  * Return: Pointer to the copy, or NULL if out of memory.
+  */
+ char *
+ arena_strdup(Arena *arena, const char *text)
+ {
+     size_t length = strlen(text) + 1;
+     char *copy = (char *)arena_alloc(arena, length);
+
+     if (copy)
+         memcpy(copy, text, length);
+     return copy;
+ }
+
+ /**
+  * arena_reset() - Releases everything allocated from an Arena.
+  * @arena: Pointer to the Arena.
+  *
+  * If the arena had to grow, its blocks are freed and the next allocation
+  * gets one block sized to the high-water mark, so a thread that decodes
+  * message after message reaches a steady state without heap calls.
+  */
+ void
+ arena_reset(Arena *arena)
+ {
+     if (arena->block && !arena->external && *(uint8_t **)arena->block) {
+         uint8_t *block = arena->block;
+
+         while (block) {
+             uint8_t *previous = *(uint8_t **)block;
+             free(block);
+             block = previous;
+         }
+         arena->block = NULL;
+         arena->block_size = 0;
+     }
+     arena->used = ARENA_ALIGNMENT;
+     arena->reserved = 0;
+ }
+
+ /**
+  * free_arena() - Frees the heap blocks of an Arena.
+  * @arena: Pointer to the Arena.
+  */
+ void
+ free_arena(Arena *arena)
+ {
+     uint8_t *block = arena->external ? NULL : arena->block;
+
+     while (block) {
+         uint8_t *previous = *(uint8_t **)block;
+         free(block);
+         block = previous;
+     }
+     arena->block = NULL;
+     arena->block_size = 0;
+     arena->used = 0;
+     arena->reserved = 0;
+ }
+
+ /**
+  * init_thread_arenas() - Enables per-thread decode arenas for this run (--arena).
+  */
+ void
+ init_thread_arenas(void)
+ {
+     thread_arenas.arenas = NULL;
+     thread_arenas.count = 0;
+     thread_arenas.capacity = 0;
+     mutex_init(&arena_lock);
+     arena_mode = true;
+ }
+
+ /**
+  * get_thread_arena() - Returns the calling thread's decode arena, creating
+  * and registering it on first use.
+  *
+  * Only registration takes arena_lock; the arena itself is used by its
+  * thread alone.
+  *
+  * Return: Pointer to the arena, or NULL on memory allocation failure.
+  */
+ Arena *
+ get_thread_arena(void)
+ {
+     Arena *arena = thread_arena;
+
+     if (arena)
+         return arena;
+
+     arena = (Arena *)malloc(sizeof(Arena));
+     if (!arena)
+         return NULL;
+     init_arena(arena, NULL, 0);
+
+     mutex_lock(&arena_lock);
+     if (thread_arenas.count >= thread_arenas.capacity) {
+         size_t new_capacity = (thread_arenas.capacity == 0) ? 16 : thread_arenas.capacity * 2;
+         Arena **new_arenas = (Arena **)realloc(thread_arenas.arenas, new_capacity * sizeof(Arena *));
+         if (!new_arenas) {
+             mutex_unlock(&arena_lock);
+             free(arena);
+             return NULL;
+         }
+         thread_arenas.arenas = new_arenas;
+         thread_arenas.capacity = new_capacity;
+     }
+     thread_arenas.arenas[thread_arenas.count++] = arena;
+     mutex_unlock(&arena_lock);
+
+     thread_arena = arena;
+     return arena;
+ }
+
+ /**
+  * free_thread_arenas() - Frees all per-thread arenas at the end of the run.
+  *
+  * All threads that used an arena must have finished. Call at most once.
+  */
+ void
+ free_thread_arenas(void)
+ {
+     size_t i;
+
+     if (!arena_mode)
+         return;
+     for (i = 0; i < thread_arenas.count; ++i) {
+         free_arena(thread_arenas.arenas[i]);
+         free(thread_arenas.arenas[i]);
+     }
+     free(thread_arenas.arenas);
+     thread_arenas.arenas = NULL;
+     thread_arenas.count = 0;
+     thread_arenas.capacity = 0;
+     mutex_destroy(&arena_lock);
+ }
+
+
+ /* --- Mapping File Handling --- */
+
+ /**
+  * init_mapping_table() - Initializes a MappingTable.
+  * @table: Pointer to the MappingTable.
+  */
+ void
+ init_mapping_table(MappingTable *table)
+ {
+     table->mappings = NULL;
+     table->count = 0;
+     table->capacity = 0;
+     init_arena(&table->strings, NULL, 0);
+     table->binary = NULL;
+     table->binary_size = 0;
+ }
+
+ /**
+  * add_mapping() - Adds a mapping entry to the table, handling duplicates.
+  * @table: Pointer to the MappingTable.
+  * @entry: The MessageMapping entry to add (strings allocated from @table->strings).
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ add_mapping(MappingTable *table, MessageMapping entry)
+ {
+     size_t i;
+
+     /* Check for duplicates and replace if found */
+     for (i = 0; i < table->count; ++i) {
+         /* Compare using 0-based indices */
+         if (table->mappings[i].segment_index == entry.segment_index &&
+             table->mappings[i].message_index_in_seg == entry.message_index_in_seg) {
+             verbose_printf("Replacing duplicate mapping for Segment %d, Message %d\n",
+                        entry.segment_index, entry.message_index_in_seg);
+             table->mappings[i] = entry; /* Replace existing entry */
+             return true;
+         }
+     }
+
+     /* Grow capacity if needed */
+     if (table->count >= table->capacity) {
+         size_t new_capacity = (table->capacity == 0) ? 16 : table->capacity * 2;
+         MessageMapping *new_mappings = (MessageMapping *)realloc(table->mappings, new_capacity * sizeof(MessageMapping));
+         if (!new_mappings) {
+             fprintf(stderr, "ERROR: Failed to allocate memory for mapping table.\n");
+             return false;
+         }
+         table->mappings = new_mappings;
+         table->capacity = new_capacity;
+     }
+
+     /* Add the new entry */
+     table->mappings[table->count++] = entry;
+     return true;
+ }
+
+ /**
+  * free_mapping_table() - Frees memory associated with a MappingTable.
+  * @table: Pointer to the MappingTable.
+  */
+ void
+ free_mapping_table(MappingTable *table)
+ {
+     free(table->mappings);
+     free_arena(&table->strings); /* All filename and comment strings */
+     if (table->binary) {
+ #ifdef _WIN32
+         UnmapViewOfFile(table->binary);
+ #else
+         munmap((void *)table->binary, table->binary_size);
+ #endif
+     }
+     table->mappings = NULL;
+     table->count = 0;
+     table->capacity = 0;
+     table->binary = NULL;
+     table->binary_size = 0;
+ }
+
+ /**
+  * load_mappings() - Loads and parses the mapping file (expects 0-based segment index).
+  * @filepath: Path to the mapping file.
+  * @table:    Pointer to the MappingTable to populate.
+  *
+  * A compiled mapping file (see --compile-map) is recognized by its magic and
+  * mapped instead of parsed.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ load_mappings(const char *filepath, MappingTable *table)
  {
      FILE *fp;
-     bool success = false; /* Assume failure */
-     char date_str[11]; /* YYYY-MM-DD */
-     time_t now;
-     struct tm *t;
-     const char *album = "Nortel Millennium VoiceWare";
-     const char *artist = rom_basename;
-     uint32_t num_samples, bytes_per_sample, data_chunk_size;
-     uint64_t data_chunk_size_64;
-     bool data_needs_padding;
-     uint32_t padded_data_chunk_size;
-     uint32_t info_chunk_total_size, info_chunk_data_size;
-     size_t temp_len;
-     bool temp_pad;
-     uint32_t fmt_chunk_size, riff_chunk_size, bytes_per_sec;
-     uint16_t block_align;
+     char line[1024];
+     int line_num = 0;
+     bool success = true;
+
+     if (is_compiled_mapping_file(filepath))
+         return load_compiled_mappings(filepath, table);
+
+     fp = fopen(filepath, "r");
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot open mapping file '%s'.\n", filepath);
+         return false;
+     }
+
+     while (fgets(line, sizeof(line), fp)) {
+         char *trimmed_line = line;
+         char *tab1, *tab2, *tab3;
+         char *endptr_seg, *endptr_msg;
+         long seg_idx_long, msg_idx_long;
+         MessageMapping entry;
+         char *filename_start, *comment_start, *end;
+
+         line_num++;
+
+         /* Trim leading whitespace */
+         while (isspace((unsigned char)*trimmed_line))
+             trimmed_line++;
+
+         /* Skip empty lines and comments starting at beginning of line */
+         if (trimmed_line[0] == '\0' || trimmed_line[0] == '#')
+             continue;
+
+         /* Find tabs */
+         tab1 = strchr(trimmed_line, '\t');
+         tab2 = tab1 ? strchr(tab1 + 1, '\t') : NULL;
+         tab3 = tab2 ? strchr(tab2 + 1, '\t') : NULL; /* Optional third tab */
+
+         if (!tab1 || !tab2) {
+             fprintf(stderr, "ERROR: Invalid format in mapping file '%s' at line %d: Missing tabs.\n", filepath, line_num);
+             success = false;
+             break;
+         }
+
+         *tab1 = '\0'; /* Null-terminate segment index */
+         *tab2 = '\0'; /* Null-terminate message index */
+
+         seg_idx_long = strtol(trimmed_line, &endptr_seg, 10);
+         msg_idx_long = strtol(tab1 + 1, &endptr_msg, 10);
+
+         /* Validate indices (Segment index must be >= 0, Message index >= 0) */
+         if (*endptr_seg != '\0' || *endptr_msg != '\0' || seg_idx_long < 0 || msg_idx_long < 0) {
+             fprintf(stderr, "ERROR: Invalid index format in mapping file '%s' at line %d (ensure SegIdx >= 0, MsgIdxInSeg >= 0).\n", filepath, line_num);
+             success = false;
+             break;
+         }
+
+         entry.segment_index = (int)seg_idx_long; /* Store 0-based index */
+         entry.message_index_in_seg = (int)msg_idx_long;
+
+         filename_start = tab2 + 1;
+         comment_start = NULL;
+
+         /* Handle filename and potential comment */
+         if (tab3) {
+             /* Comment exists */
+             char *filename_end = tab3 - 1;
+             /* Trim trailing whitespace from filename */
+             while (filename_end >= filename_start && isspace((unsigned char)*filename_end)) {
+                 *filename_end-- = '\0';
+             }
+             *tab3 = '\0'; /* Null-terminate filename cleanly */
+             comment_start = tab3 + 1;
+         } else {
+             /* No comment field, trim trailing whitespace from filename */
+             end = filename_start + strlen(filename_start) - 1;
+             while (end >= filename_start && isspace((unsigned char)*end)) {
+                 *end-- = '\0';
+             }
+         }
+
+         entry.output_filename_base = arena_strdup(&table->strings, filename_start);
+         if (!entry.output_filename_base) {
+             fprintf(stderr, "ERROR: Memory allocation failed for filename (line %d).\n", line_num);
+             success = false;
+             break;
+         }
+
+         if (comment_start && *comment_start != '\0') {
+             /* Trim trailing newline/whitespace from comment */
+             end = comment_start + strlen(comment_start) - 1;
+             while (end >= comment_start && isspace((unsigned char)*end))
+                 *end-- = '\0';
+
+             char *comment = arena_strdup(&table->strings, comment_start);
+             if (!comment) {
+                 fprintf(stderr, "ERROR: Memory allocation failed for comment (line %d).\n", line_num);
+                 success = false;
+                 break;
+             }
+             /* Clean comment AFTER saving it, before adding to table */
+             clean_comment(comment);
+             entry.comment = comment;
+         } else {
+             entry.comment = NULL; /* No comment provided */
+         }
+
+         if (!add_mapping(table, entry)) {
+             /* Error printed in add_mapping */
+             success = false;
+             break;
+         }
+     }
+
+     fclose(fp);
+     if (!success)
+         free_mapping_table(table); /* Clean up partially loaded table */
+
+     return success;
+ }
+
+ /**
+  * is_compiled_mapping_file() - Checks whether a mapping file is in compiled form.
+  * @filepath: Path to the mapping file.
+  *
+  * Return: true if the file starts with BINARY_MAP_MAGIC.
+  */
+ bool
+ is_compiled_mapping_file(const char *filepath)
+ {
+     char magic[4];
+     FILE *fp = fopen(filepath, "rb");
+     bool compiled;
+
+     if (!fp)
+         return false; /* load_mappings reports the error */
+     compiled = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+                memcmp(magic, BINARY_MAP_MAGIC, sizeof(magic)) == 0;
+     fclose(fp);
+     return compiled;
+ }
+
+ /**
+  * map_file_read_only() - Maps a whole file read-only into memory.
+  * @filepath: Path to the file.
+  * @size:     Receives the file size.
+  *
+  * Return: Pointer to the view (release with UnmapViewOfFile/munmap), or NULL.
+  */
+ const uint8_t *
+ map_file_read_only(const char *filepath, size_t *size)
+ {
+ #ifdef _WIN32
+     HANDLE file, mapping;
+     LARGE_INTEGER file_size;
+     const uint8_t *view = NULL;
+
+     file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+     if (file == INVALID_HANDLE_VALUE)
+         return NULL;
+     if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 &&
+         (unsigned long long)file_size.QuadPart <= SIZE_MAX) {
+         mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+         if (mapping) {
+             view = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+             CloseHandle(mapping); /* The view keeps the mapping alive */
+         }
+         *size = (size_t)file_size.QuadPart;
+     }
+     CloseHandle(file);
+     return view;
+ #else
+     struct stat st;
+     void *view;
+     int fd = open(filepath, O_RDONLY);
+
+     if (fd < 0)
+         return NULL;
+     if (fstat(fd, &st) != 0 || st.st_size <= 0 || (unsigned long long)st.st_size > SIZE_MAX) {
+         close(fd);
+         return NULL;
+     }
+     view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+     close(fd); /* The mapping keeps the file open */
+     if (view == MAP_FAILED)
+         return NULL;
+     *size = (size_t)st.st_size;
+     return (const uint8_t *)view;
+ #endif
+ }
+
+ /**
+  * map_file_read_write() - Maps a whole file into memory for in-place changes.
+  * @filepath: Path to the file.
+  * @size:     Receives the file size.
+  *
+  * Changes to the view are written back to the file (shared mapping).
+  *
+  * Return: Pointer to the view (release with UnmapViewOfFile/munmap), or NULL.
+  */
+ uint8_t *
+ map_file_read_write(const char *filepath, size_t *size)
+ {
+ #ifdef _WIN32
+     HANDLE file, mapping;
+     LARGE_INTEGER file_size;
+     uint8_t *view = NULL;
+
+     file = CreateFileA(filepath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+     if (file == INVALID_HANDLE_VALUE)
+         return NULL;
+     if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 &&
+         (unsigned long long)file_size.QuadPart <= SIZE_MAX) {
+         mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+         if (mapping) {
+             view = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+             CloseHandle(mapping); /* The view keeps the mapping alive */
+         }
+         *size = (size_t)file_size.QuadPart;
+     }
+     CloseHandle(file);
+     return view;
+ #else
+     struct stat st;
+     void *view;
+     int fd = open(filepath, O_RDWR);
+
+     if (fd < 0)
+         return NULL;
+     if (fstat(fd, &st) != 0 || st.st_size <= 0 || (unsigned long long)st.st_size > SIZE_MAX) {
+         close(fd);
+         return NULL;
+     }
+     view = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+     close(fd); /* The mapping keeps the file open */
+     if (view == MAP_FAILED)
+         return NULL;
+     *size = (size_t)st.st_size;
+     return (uint8_t *)view;
+ #endif
+ }
+
+ /**
+  * load_compiled_mappings() - Maps a compiled mapping file for in-place lookups.
+  * @filepath: Path to the compiled mapping file.
+  * @table:    Pointer to the (empty) MappingTable to populate.
+  *
+  * Only the header is validated here: the index and entries are bounds-checked
+  * by find_mapping() as they are used, so loading costs no parsing and no
+  * allocation regardless of the map size.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ load_compiled_mappings(const char *filepath, MappingTable *table)
+ {
+     size_t size = 0;
+     const uint8_t *map = map_file_read_only(filepath, &size);
+     uint64_t segment_count, entry_count, index_offset, entries_offset, strings_offset, strings_size;
+
+     if (!map) {
+         fprintf(stderr, "ERROR: Cannot map compiled mapping file '%s'.\n", filepath);
+         return false;
+     }
+     table->binary = map;
+     table->binary_size = size;
+
+     if (size < BINARY_MAP_HEADER_SIZE || read_u32le(map + 4) != BINARY_MAP_VERSION) {
+         fprintf(stderr, "ERROR: Unsupported compiled mapping file '%s'.\n", filepath);
+         free_mapping_table(table);
+         return false;
+     }
+     segment_count = read_u32le(map + 8);
+     entry_count = read_u32le(map + 12);
+     index_offset = read_u32le(map + 16);
+     entries_offset = read_u32le(map + 20);
+     strings_offset = read_u32le(map + 24);
+     strings_size = read_u32le(map + 28);
+
+     /* Every section must lie inside the file; the pool must end in a NUL so
+      * that any in-range string offset yields a terminated string. */
+     if (index_offset + segment_count * MAX_MESSAGES_PER_SEGMENT * 4 > size ||
+         entries_offset + entry_count * 8 > size || strings_offset + strings_size > size ||
+         (strings_size > 0 && map[strings_offset + strings_size - 1] != '\0') ||
+         (index_offset | entries_offset) % 4 != 0) {
+         fprintf(stderr, "ERROR: Compiled mapping file '%s' is truncated or corrupt.\n", filepath);
+         free_mapping_table(table);
+         return false;
+     }
+     table->count = (size_t)entry_count;
+     return true;
+ }
+
+ /**
+  * find_compiled_mapping() - Looks up a message in a compiled mapping file.
+  * @table:                 Pointer to a MappingTable loaded by load_compiled_mappings().
+  * @segment_index_0_based: 0-based segment index.
+  * @message_index_in_seg:  0-based message index within the segment.
+  * @mapping:               Receives the entry; its strings point into the mapped pool.
+  *
+  * Return: true if the message is mapped.
+  */
+ bool
+ find_compiled_mapping(const MappingTable *table, int segment_index_0_based,
+                       int message_index_in_seg, MessageMapping *mapping)
+ {
+     const uint8_t *map = table->binary;
+     uint32_t strings_size = read_u32le(map + 28);
+     const char *strings = (const char *)map + read_u32le(map + 24);
+     const uint8_t *entry;
+     uint32_t slot, name, comment;
+
+     if (segment_index_0_based < 0 || (uint32_t)segment_index_0_based >= read_u32le(map + 8) ||
+         message_index_in_seg < 0 || message_index_in_seg >= MAX_MESSAGES_PER_SEGMENT)
+         return false;
+
+     slot = read_u32le(map + read_u32le(map + 16) +
+                       ((size_t)segment_index_0_based * MAX_MESSAGES_PER_SEGMENT + (size_t)message_index_in_seg) * 4);
+     if (slot == 0 || slot > table->count)
+         return false;
+
+     entry = map + read_u32le(map + 20) + (size_t)(slot - 1) * 8;
+     name = read_u32le(entry);
+     comment = read_u32le(entry + 4);
+     if (name >= strings_size || (comment != BINARY_MAP_NO_STRING && comment >= strings_size))
+         return false;
+
+     mapping->segment_index = segment_index_0_based;
+     mapping->message_index_in_seg = message_index_in_seg;
+     mapping->output_filename_base = strings + name;
+     mapping->comment = (comment == BINARY_MAP_NO_STRING) ? NULL : strings + comment;
+     return true;
+ }
+
+ /**
+  * find_mapping() - Finds a mapping entry in the table using 0-based indices.
+  * @table:                 Pointer to the MappingTable.
+  * @segment_index_0_based: 0-based segment index.
+  * @message_index_in_seg:  0-based message index within the segment.
+  * @mapping:               Receives a copy of the entry. Its strings remain valid
+  *                         until the table is freed.
+  *
+  * Return: true if the message is mapped, false if not.
+  */
+ bool
+ find_mapping(const MappingTable *table, int segment_index_0_based, int message_index_in_seg,
+              MessageMapping *mapping)
+ {
+     size_t i;
+
+     if (!table)
+         return false;
+     if (table->binary)
+         return find_compiled_mapping(table, segment_index_0_based, message_index_in_seg, mapping);
+     if (!table->mappings)
+         return false;
+
+     for (i = 0; i < table->count; ++i) {
+         if (table->mappings[i].segment_index == segment_index_0_based &&
+             table->mappings[i].message_index_in_seg == message_index_in_seg) {
+             *mapping = table->mappings[i];
+             return true;
+         }
+     }
+     return false;
+ }
+
+ /**
+  * compile_mappings() - Writes a loaded text mapping table as a compiled mapping file.
+  * @table:    Pointer to the MappingTable (loaded from a text mapping file).
+  * @filepath: Path of the compiled mapping file to write.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ compile_mappings(const MappingTable *table, const char *filepath)
+ {
+     OutputBuffer header, index, entries, strings;
+     uint32_t *slots = NULL;
+     uint32_t segment_count = 0;
+     size_t i, slot_count;
+     FILE *fp;
+     bool written, success = false;
+
+     init_output_buffer(&header);
+     init_output_buffer(&index);
+     init_output_buffer(&entries);
+     init_output_buffer(&strings);
+
+     if (table->binary) {
+         fprintf(stderr, "ERROR: The mapping file is already compiled.\n");
+         return false;
+     }
+     for (i = 0; i < table->count; ++i) {
+         const MessageMapping *m = &table->mappings[i];
+
+         if (m->message_index_in_seg >= MAX_MESSAGES_PER_SEGMENT) {
+             fprintf(stderr, "ERROR: Message index %d of segment %d cannot be compiled (limit %d).\n",
+                     m->message_index_in_seg, m->segment_index, MAX_MESSAGES_PER_SEGMENT - 1);
+             return false;
+         }
+         if ((uint32_t)m->segment_index >= segment_count)
+             segment_count = (uint32_t)m->segment_index + 1;
+     }
+     if ((uint64_t)segment_count * MAX_MESSAGES_PER_SEGMENT * 4 > UINT32_MAX / 2) {
+         fprintf(stderr, "ERROR: Segment index %u is too large to compile.\n", segment_count - 1);
+         return false;
+     }
+
+     slot_count = (size_t)segment_count * MAX_MESSAGES_PER_SEGMENT;
+     slots = (uint32_t *)calloc(slot_count ? slot_count : 1, sizeof(uint32_t));
+     if (!slots) {
+         fprintf(stderr, "ERROR: Memory allocation failed for compiled mapping.\n");
+         goto cleanup;
+     }
+
+     for (i = 0; i < table->count; ++i) {
+         const MessageMapping *m = &table->mappings[i];
+         const char *texts[2];
+         uint32_t offsets[2];
+         int k;
+
+         texts[0] = m->output_filename_base;
+         texts[1] = m->comment;
+         for (k = 0; k < 2; ++k) {
+             size_t length;
+
+             offsets[k] = BINARY_MAP_NO_STRING;
+             if (!texts[k])
+                 continue;
+             length = strlen(texts[k]) + 1;
+             if (strings.size + length > UINT32_MAX / 2) {
+                 fprintf(stderr, "ERROR: Mapping strings are too large to compile.\n");
+                 goto cleanup;
+             }
+             offsets[k] = (uint32_t)strings.size;
+             if (!append_bytes(&strings, texts[k], length))
+                 goto cleanup;
+         }
+         if (!append_u32le(&entries, offsets[0]) || !append_u32le(&entries, offsets[1]))
+             goto cleanup;
+         slots[(size_t)m->segment_index * MAX_MESSAGES_PER_SEGMENT + (size_t)m->message_index_in_seg] = (uint32_t)i + 1;
+     }
+     for (i = 0; i < slot_count; ++i) {
+         if (!append_u32le(&index, slots[i]))
+             goto cleanup;
+     }
+
+     if (!append_bytes(&header, BINARY_MAP_MAGIC, 4) ||
+         !append_u32le(&header, BINARY_MAP_VERSION) ||
+         !append_u32le(&header, segment_count) ||
+         !append_u32le(&header, (uint32_t)table->count) ||
+         !append_u32le(&header, BINARY_MAP_HEADER_SIZE) ||
+         !append_u32le(&header, (uint32_t)(BINARY_MAP_HEADER_SIZE + index.size)) ||
+         !append_u32le(&header, (uint32_t)(BINARY_MAP_HEADER_SIZE + index.size + entries.size)) ||
+         !append_u32le(&header, (uint32_t)strings.size))
+         goto cleanup;
+
+     fp = fopen(filepath, "wb");
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot create compiled mapping file '%s'.\n", filepath);
+         goto cleanup;
+     }
+     written = fwrite(header.data, 1, header.size, fp) == header.size &&
+               fwrite(index.data, 1, index.size, fp) == index.size &&
+               fwrite(entries.data, 1, entries.size, fp) == entries.size &&
+               fwrite(strings.data, 1, strings.size, fp) == strings.size;
+     if (fclose(fp) != 0 || !written) {
+         fprintf(stderr, "ERROR: Failed to write compiled mapping file '%s'.\n", filepath);
+         goto cleanup;
+     }
+     status_printf("Compiled %zu mappings (%u segments, %zu string bytes) to '%s'.\n",
+                   table->count, segment_count, strings.size, filepath);
+     success = true;
+
+ cleanup:
+     free(slots);
+     free_output_buffer(&header);
+     free_output_buffer(&index);
+     free_output_buffer(&entries);
+     free_output_buffer(&strings);
+     return success;
+ }
+
+
+ /* --- PCM Buffer Handling --- */
+
+ /**
+  * init_pcm_buffer() - Initializes a PcmBuffer.
+  * @buffer: Pointer to the PcmBuffer.
+  */
+ void
+ init_pcm_buffer(PcmBuffer *buffer)
+ {
+     buffer->samples = NULL;
+     buffer->count = 0;
+     buffer->capacity = 0;
+     buffer->reallocations = 0;
+     buffer->fixed = false;
+ }
+
+ /**
+  * add_pcm_sample() - Adds a PCM sample to the buffer, resizing if necessary.
+  * @buffer: Pointer to the PcmBuffer.
+  * @sample: The 16-bit PCM sample to add.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ add_pcm_sample(PcmBuffer *buffer, int16_t sample)
+ {
+     if (buffer->count >= buffer->capacity) {
+         size_t new_capacity;
+         int16_t *new_samples;
+
+         if (buffer->fixed) {
+             fprintf(stderr, "ERROR: PCM buffer capacity (%zu samples) exceeded.\n", buffer->capacity);
+             return false;
+         }
+         new_capacity = (buffer->capacity == 0) ? 2048 : buffer->capacity * 2;
+
+         /* Prevent excessively large allocations */
+         if (new_capacity > SIZE_MAX / sizeof(int16_t) / 2) {
+             fprintf(stderr, "ERROR: PCM buffer capacity exceeds limit.\n");
+             return false;
+         }
+         new_samples = (int16_t *)realloc(buffer->samples, new_capacity * sizeof(int16_t));
+         if (!new_samples) {
+             fprintf(stderr, "ERROR: Failed to reallocate memory for PCM buffer (capacity %zu).\n", new_capacity);
+             return false;
+         }
+         buffer->samples = new_samples;
+         buffer->capacity = new_capacity;
+         buffer->reallocations++;
+     }
+     buffer->samples[buffer->count++] = sample;
+     return true;
+ }
+
+ /**
+  * reserve_pcm_buffer() - Makes room for a known number of samples in one allocation.
+  * @buffer: Pointer to the PcmBuffer.
+  * @count:  Total number of samples the buffer must hold.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ reserve_pcm_buffer(PcmBuffer *buffer, size_t count)
+ {
+     int16_t *new_samples;
+
+     if (count <= buffer->capacity)
+         return true;
+     if (buffer->fixed || count > SIZE_MAX / sizeof(int16_t) / 2) {
+         fprintf(stderr, "ERROR: PCM buffer capacity exceeds limit.\n");
+         return false;
+     }
+     new_samples = (int16_t *)realloc(buffer->samples, count * sizeof(int16_t));
+     if (!new_samples) {
+         fprintf(stderr, "ERROR: Failed to reallocate memory for PCM buffer (capacity %zu).\n", count);
+         return false;
+     }
+     buffer->samples = new_samples;
+     buffer->capacity = count;
+     buffer->reallocations++;
+     return true;
+ }
+
+ /**
+  * reserve_pcm_samples() - Sizes an empty PcmBuffer for an exact sample count.
+  * @buffer: Pointer to the PcmBuffer.
+  * @arena:  Arena to take the samples from, or NULL for the heap.
+  * @count:  Number of samples the message decodes to.
+  *
+  * Return: true on success, false if the memory is not available.
+  */
+ bool
+ reserve_pcm_samples(PcmBuffer *buffer, Arena *arena, size_t count)
+ {
+     int16_t *samples;
+
+     if (!arena)
+         return reserve_pcm_buffer(buffer, count);
+     samples = (count > SIZE_MAX / sizeof(int16_t)) ? NULL : (int16_t *)arena_alloc(arena, count * sizeof(int16_t));
+     if (!samples) {
+         fprintf(stderr, "ERROR: Decode arena cannot hold %zu samples.\n", count);
+         return false;
+     }
+     buffer->samples = samples;
+     buffer->count = 0;
+     buffer->capacity = count;
+     buffer->fixed = true;
+     return true;
+ }
+
+ /**
+  * free_pcm_buffer() - Frees memory associated with a PcmBuffer.
+  * @buffer: Pointer to the PcmBuffer.
+  */
+ void
+ free_pcm_buffer(PcmBuffer *buffer)
+ {
+     if (!buffer->fixed)
+         free(buffer->samples);
+     buffer->samples = NULL;
+     buffer->count = 0;
+     buffer->capacity = 0;
+     buffer->fixed = false;
+ }
+
+ /**
+  * copy_pcm_buffer() - Copies the samples of one PcmBuffer into another.
+  * @source: Samples to copy.
+  * @copy:   Destination buffer (its old samples are replaced).
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ copy_pcm_buffer(const PcmBuffer *source, PcmBuffer *copy)
+ {
+     copy->count = 0;
+     if (!reserve_pcm_buffer(copy, source->count))
+         return false;
+     if (source->count > 0)
+         memcpy(copy->samples, source->samples, source->count * sizeof(int16_t));
+     copy->count = source->count;
+     return true;
+ }
+
+ /* --- ADPCM Decoding --- */
+
+ /**
+  * decode_nibble() - Decodes a single 4-bit ADPCM nibble using updated tables.
+  * @nibble:     The 4-bit ADPCM nibble (0-15).
+  * @state:      Pointer to the current AdpcmState.
+  * @pcm_buffer: Pointer to the PcmBuffer to add the sample to.
+  *
+  * Return: true on success, false on failure (e.g., buffer allocation).
+  */
+ bool
+ decode_nibble(uint8_t nibble, AdpcmState *state, PcmBuffer *pcm_buffer)
+ {
+     int diff; /* Signed difference from table */
+     int16_t pcm_sample;
+     int next_state;
+
+     /* Ensure state index is valid */
+     if (state->adpcm_state < 0 || state->adpcm_state > 15) {
+         fprintf(stderr, "ERROR: Invalid ADPCM state index %d\n", state->adpcm_state);
+         state->adpcm_state = 0; /* Reset state */
+     }
+
+     /* Get difference from 2D step table */
+     diff = step_table[state->adpcm_state][nibble];
+
+     /* Update sample value */
+     /* Note: Using int32_t for intermediate calculation to avoid overflow before clamping */
+     int32_t next_sample = (int32_t)state->current_sample + diff;
+
+     /* Clamp sample (important for ADPCM) */
+     if (next_sample > 32767) {
+         next_sample = 32767;
+         state->clamp_count++;
+     } else if (next_sample < -32768) {
+         next_sample = -32768;
+         state->clamp_count++;
+     }
+     state->current_sample = (int16_t)next_sample;
+
+     /* Update state index using state table */
+     next_state = state->adpcm_state + state_table[nibble];
+
+     /* Clamp state index */
+     if (next_state < 0)
+         next_state = 0;
+     else if (next_state > 15)
+         next_state = 15;
+     state->adpcm_state = (int8_t)next_state;
+
+     /* Scale to 16-bit PCM (as per original specification's hint) and add to buffer */
+     /* Clamping might make this scaling less critical, but retain for consistency */
+     pcm_sample = (int16_t)(state->current_sample << 7);
+     /* Re-clamp after scaling, just in case << 7 causes overflow */
+     if ((state->current_sample > (32767 >> 7)) && (diff > 0)) { pcm_sample = 32767; state->clamp_count++; }
+     if ((state->current_sample < (-32768 >> 7)) && (diff < 0)) { pcm_sample = -32768; state->clamp_count++; }
+
+     return add_pcm_sample(pcm_buffer, pcm_sample);
+ }
+
+
+ /**
+  * walk_adpcm_stream() - Runs the commands of an ADPCM message.
+  * @rom_data: Pointer to the start of the ROM data buffer.
+  * @rom_size: Total size of the ROM data.
+  * @pos:      Offset of the first command (after the mode byte).
+  * @hooks:    Logging and statistics (NULL to walk silently).
+  * @pcm:      PcmBuffer the samples are appended to, or NULL to only count them.
+  * @samples:  Receives the number of samples produced (may be NULL).
+  * @end:      Receives the offset after the furthest byte read (may be NULL).
+  *
+  * This is the only uPD7759 command interpreter: decode_message(), the
+  * analysis decoders (--automap, --fp-index, --bench-encode) and the
+  * measurements for arenas and listings all walk streams through it, so
+  * they agree on every message. The stream ends at an end command or at the
+  * end of the data. A Long or Repeat Block command whose length byte lies
+  * past the data fails the message.
+  *
+  * Return: true on success, false if the stream is truncated or memory
+  * allocation fails (counting alone allocates nothing).
+  */
+ bool
+ walk_adpcm_stream(const uint8_t *rom_data, size_t rom_size, size_t pos, const AdpcmWalkHooks *hooks,
+                   PcmBuffer *pcm, size_t *samples, size_t *end)
+ {
+     AdpcmState state = {0, 0, 0};
+     RunStats *stats = hooks ? hooks->stats : NULL;
+     bool log = hooks && hooks->log_commands;
+     bool success = true;
+     size_t produced = 0;
+     size_t furthest = pos;
+     uint32_t nibble_count = 0;
+     uint8_t repeat_count = 0; /* Times to repeat *next* block (0=play once) */
+     size_t repeat_start = 0;
+     uint32_t repeat_nibble_count = 0;
+
+     while (pos < rom_size) {
+         uint8_t command;
+
+         /* --- Nibble Decoding Phase --- */
+         if (nibble_count > 0) {
+             uint8_t data_byte = rom_data[pos++];
+             uint32_t nibbles = (nibble_count > 1) ? 2 : 1; /* MSN first, then LSN */
+
+             if (log)
+                 verbose_printf("    Nibble Read: Byte 0x%02X -> N1=0x%X, N2=0x%X (Pos 0x%zX)\n",
+                                data_byte, (data_byte >> 4) & 0x0F, data_byte & 0x0F, pos - 1);
+             if (pcm && (!decode_nibble((data_byte >> 4) & 0x0F, &state, pcm) ||
+                         (nibbles == 2 && !decode_nibble(data_byte & 0x0F, &state, pcm)))) {
+                 success = false;
+                 break;
+             }
+             produced += nibbles;
+             nibble_count -= nibbles;
+
+             /* Handle repeat logic */
+             if (repeat_count > 0 && nibble_count == 0) {
+                 if (--repeat_count > 0) {
+                     if (log)
+                         verbose_printf("    Repeating block (%u nibbles left, %u repeats left)\n", repeat_nibble_count, repeat_count);
+                     if (pos > furthest)
+                         furthest = pos;
+                     pos = repeat_start;
+                     nibble_count = repeat_nibble_count;
+                 } else if (log) {
+                     verbose_printf("    Finished repeating block.\n");
+                 }
+             }
+             continue;
+         }
+
+         /* --- Command Reading Phase --- */
+         command = rom_data[pos++];
+         if (log)
+             verbose_printf("  Command Read: 0x%02X (Pos 0x%zX)\n", command, pos - 1);
+
+         if (command == 0x00) { /* End of Message */
+             if (stats)
+                 stats->opcodes[OPCODE_END]++;
+             if (log)
+                 verbose_printf("    Opcode: End of Message\n");
+             break;
+         } else if (command <= 0x3F) { /* Silence */
+             uint32_t silence_samples = (uint32_t)command * 8;
+             uint32_t i;
+
+             if (stats)
+                 stats->opcodes[OPCODE_SILENCE]++;
+             if (log)
+                 verbose_printf("    Opcode: Silence (%u samples)\n", silence_samples);
+             for (i = 0; pcm && i < silence_samples; ++i) {
+                 if (!add_pcm_sample(pcm, 0)) {
+                     success = false;
+                     break;
+                 }
+             }
+             if (!success)
+                 break;
+             produced += silence_samples;
+         } else if (command <= 0x7F) { /* Play Short Block */
+             nibble_count = 256; /* 128 bytes * 2 nibbles/byte */
+             repeat_count = 0;
+             if (stats)
+                 stats->opcodes[OPCODE_SHORT_BLOCK]++;
+             if (log)
+                 verbose_printf("    Opcode: Play Short Block (%u nibbles)\n", nibble_count);
+         } else { /* Play Long Block (0x80-0xBF) or Repeat Block (0xC0-0xFF) */
+             bool repeat = (command >= 0xC0);
+             uint8_t n;
+
+             if (pos >= rom_size) {
+                 if (hooks)
+                     fprintf(stderr, "WARN: Unexpected end of ROM reading N for %s Block (Cmd 0x%02X) in message %d.\n",
+                             repeat ? "Repeat" : "Long", command, hooks->message_index);
+                 success = false;
+                 break;
+             }
+             n = rom_data[pos++];
+             nibble_count = (uint32_t)n + 1;
+             repeat_count = repeat ? ((command >> 3) & 0x07) : 0; /* R bits (0-7) */
+             repeat_start = pos;
+             repeat_nibble_count = nibble_count;
+             if (stats)
+                 stats->opcodes[repeat ? OPCODE_REPEAT_BLOCK : OPCODE_LONG_BLOCK]++;
+             if (log && repeat)
+                 verbose_printf("    Opcode: Play Repeat Block (N=0x%02X -> %u nibbles, R=%u -> %u plays total) (Pos 0x%zX)\n",
+                                n, nibble_count, repeat_count, repeat_count + 1, pos - 1);
+             else if (log)
+                 verbose_printf("    Opcode: Play Long Block (N=0x%02X -> %u nibbles) (Pos 0x%zX)\n", n, nibble_count, pos - 1);
+         }
+     }
+     if (stats)
+         stats->clamps += state.clamp_count;
+     if (samples)
+         *samples = produced;
+     if (end)
+         *end = (pos > furthest) ? pos : furthest;
+     return success;
+ }
+
+ /**
+  * measure_adpcm_stream() - Counts the samples an ADPCM message decodes to.
+  * @rom_data: Pointer to the start of the ROM data buffer.
+  * @rom_size: Total size of the ROM data.
+  * @pos:      Offset of the first command (after the mode byte).
+  * @end:      Receives the offset after the last byte of the stream (may be NULL).
+  *
+  * Counts with walk_adpcm_stream() without decoding any nibbles, so the
+  * samples can be placed in a buffer of the right size before decoding
+  * starts. A truncated stream is counted up to the damage.
+  *
+  * Return: Number of samples walk_adpcm_stream() produces for the stream.
+  */
+ size_t
+ measure_adpcm_stream(const uint8_t *rom_data, size_t rom_size, size_t pos, size_t *end)
+ {
+     size_t samples;
+
+     walk_adpcm_stream(rom_data, rom_size, pos, NULL, NULL, &samples, end);
+     return samples;
+ }
+
+ /* --- PCM Decoding --- */
+
+ /**
+  * find_pcm_extent() - Finds the length of an 8-bit PCM message.
+  * @data:            Pointer to the first sample byte (after the mode byte).
+  * @limit:           Number of bytes up to the next message or the end of the segment.
+  * @last_in_segment: True if @limit is the end of the segment.
+  *
+  * Samples are offset binary, so 0x00 and 0xFF are full-scale audio; only
+  * bytes that cannot be samples are trimmed. The last message of a segment
+  * is followed by erased ROM (0xFF) up to the segment end, which can be most
+  * of 128 KiB and is skipped 16 bytes at a time. Messages start on a word
+  * boundary, so a message with an even number of samples is followed by one
+  * pad byte: a final 0x00 or 0xFF that leaves an odd extent is taken for it.
+  *
+  * Return: Number of sample bytes.
+  */
+ size_t
+ find_pcm_extent(const uint8_t *data, size_t limit, bool last_in_segment)
+ {
+     size_t end = limit;
+
+     if (last_in_segment) {
+ #if defined(HAVE_SSE2)
+         const __m128i erased = _mm_set1_epi8((char)ROM_ERASED_BYTE);
+         while (end >= 16) {
+             __m128i bytes = _mm_loadu_si128((const __m128i *)(data + end - 16));
+             if (_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, erased)) != 0xFFFF)
+                 break;
+             end -= 16;
+         }
+ #elif defined(HAVE_NEON)
+         while (end >= 16) {
+             if (vminvq_u8(vceqq_u8(vld1q_u8(data + end - 16), vdupq_n_u8(ROM_ERASED_BYTE))) != 0xFF)
+                 break;
+             end -= 16;
+         }
+ #endif
+         while (end > 0 && data[end - 1] == ROM_ERASED_BYTE)
+             end--;
+     }
+     if (end % 2 == 1 && (data[end - 1] == 0x00 || data[end - 1] == ROM_ERASED_BYTE))
+         end--; /* Word-alignment pad */
+     return end;
+ }
+
+ /**
+  * convert_pcm_samples() - Converts 8-bit offset-binary PCM to 16-bit samples.
+  * @output: Destination array of @count samples.
+  * @input:  Source bytes.
+  * @count:  Number of samples.
+  *
+  * Flipping the sign bit gives a two's complement byte, which becomes the
+  * high byte of the 16-bit sample (0x00 -> -32768, 0x80 -> 0, 0xFF -> 32512).
+  */
+ void
+ convert_pcm_samples(int16_t *output, const uint8_t *input, size_t count)
+ {
+     size_t i = 0;
+ #if defined(HAVE_SSE2)
+     const __m128i sign = _mm_set1_epi8((char)0x80);
+     const __m128i zero = _mm_setzero_si128();
+     for (; i + 16 <= count; i += 16) {
+         __m128i bytes = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(input + i)), sign);
+         _mm_storeu_si128((__m128i *)(output + i), _mm_unpacklo_epi8(zero, bytes));
+         _mm_storeu_si128((__m128i *)(output + i + 8), _mm_unpackhi_epi8(zero, bytes));
+     }
+ #elif defined(HAVE_NEON)
+     for (; i + 16 <= count; i += 16) {
+         int8x16_t bytes = vreinterpretq_s8_u8(veorq_u8(vld1q_u8(input + i), vdupq_n_u8(0x80)));
+         vst1q_s16(output + i, vshll_n_s8(vget_low_s8(bytes), 8));
+         vst1q_s16(output + i + 8, vshll_high_n_s8(bytes, 8));
+     }
+ #endif
+     for (; i < count; ++i)
+         output[i] = (int16_t)(((int)input[i] - 0x80) * 256);
+ }
+
+ /**
+  * decode_message_samples() - Decodes an ADPCM or PCM message for analysis.
+  * @rom_data: Pointer to the start of the ROM data buffer.
+  * @rom_size: Total size of the ROM data.
+  * @start:    Offset of the message mode byte.
+  * @end:      Offset after the last byte of the message (measure_message()).
+  * @pcm:      PcmBuffer that receives the samples (emptied first).
+  *
+  * Produces the same samples as decode_message(), but without logging,
+  * statistics or tracing, for code that compares audio. Messages of other
+  * modes, and ADPCM messages that decode_message() fails, give no samples.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ decode_message_samples(const uint8_t *rom_data, size_t rom_size, size_t start, size_t end, PcmBuffer *pcm)
+ {
+     pcm->count = 0;
+     if (rom_data[start] == MODE_ADPCM) {
+         size_t samples;
+
+         if (!walk_adpcm_stream(rom_data, rom_size, start + 1, NULL, NULL, &samples, NULL))
+             return true; /* Truncated: no audio, like decode_message() */
+         return reserve_pcm_buffer(pcm, samples) &&
+                walk_adpcm_stream(rom_data, rom_size, start + 1, NULL, pcm, NULL, NULL);
+     }
+     if (rom_data[start] == MODE_PCM && end > start + 1) {
+         if (!reserve_pcm_buffer(pcm, end - start - 1))
+             return false;
+         convert_pcm_samples(pcm->samples, rom_data + start + 1, end - start - 1);
+         pcm->count = end - start - 1;
+     }
+     return true;
+ }
+
+ /* --- Output Writer --- */
+
+ OutputWriter output_writer; /* Backend and queue shared by all decode threads */
+
+ /**
+  * get_output_backend_name() - Returns the --writer name of a backend.
+  * @backend: The OutputBackend.
+  *
+  * Return: Static string.
+  */
+ const char *
+ get_output_backend_name(OutputBackend backend)
+ {
+     switch (backend) {
+     case OUTPUT_BACKEND_THREAD: return "thread";
+     case OUTPUT_BACKEND_URING:  return "uring";
+     case OUTPUT_BACKEND_AUTO:   return "auto";
+     default:                    return "sync";
+     }
+ }
+
+ /**
+  * free_output_file() - Frees an OutputFile and its contents.
+  * @file: Pointer to the OutputFile (may be NULL).
+  */
+ void
+ free_output_file(OutputFile *file)
+ {
+     if (!file)
+         return;
+     free(file->path);
+     free(file->directory);
+     free_output_buffer(&file->contents);
+     free(file);
+ }
+
+ /**
+  * finish_output_file() - Reports a written file and records its statistics.
+  * @file:     The OutputFile that was written.
+  * @start_ns: Start of the write (from stats_timer_start()).
+  * @charge:   true to charge the elapsed time to the write phase; false if
+  *            the caller charges a shared batch of files itself.
+  */
+ void
+ finish_output_file(const OutputFile *file, uint64_t start_ns, bool charge)
+ {
+     RunStats stats;
+
+     if (file->kind == OUTPUT_FILE_WAV)
+         status_printf("Successfully wrote WAV: %s (%llu samples)\n", file->path, (unsigned long long)file->sample_count);
+     else if (file->kind == OUTPUT_FILE_FLAC)
+         status_printf("Successfully wrote FLAC: %s (%llu samples, %zu bytes)\n", file->path,
+                   (unsigned long long)file->sample_count, file->contents.size);
+     else if (file->kind == OUTPUT_FILE_G711)
+         status_printf("Successfully wrote G.711: %s (%llu samples)\n", file->path, (unsigned long long)file->sample_count);
+     else if (file->kind == OUTPUT_FILE_S16LE)
+         status_printf("Successfully wrote raw s16le: %s (%llu samples)\n", file->path, (unsigned long long)file->sample_count);
+     else if (file->kind == OUTPUT_FILE_ADPCM)
+         status_printf("Saved encoded ADPCM: %s (%llu samples, %zu bytes)\n", file->path,
+                   (unsigned long long)file->sample_count, file->contents.size);
+     else
+         status_printf("Saved raw PCM data: %s (%zu bytes)\n", file->path, file->contents.size);
+
+     trace_span("write", start_ns, file->segment_index, file->message_index, file->absolute_index);
+     if (!stats_enabled)
+         return;
+     memset(&stats, 0, sizeof(stats));
+     if (charge)
+         stats_timer_stop(&stats, STATS_PHASE_WRITE, start_ns);
+     stats.bytes_out = file->contents.size;
+     stats.files_out = 1;
+     stats_merge(&stats);
+ }
+
+ /**
+  * write_output_file_blocking() - Writes an OutputFile with stdio.
+  * @file: The OutputFile to write.
+  *
+  * Used by the sync and thread backends, and as the fallback of the
+  * io_uring backend.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ write_output_file_blocking(const OutputFile *file)
+ {
+     uint64_t start_ns = stats_timer_start();
+     FILE *fp;
+     size_t written;
+     bool closed;
+
+     fp = fopen(file->path, "wb");
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot open output file '%s' for writing.\n", file->path);
+         return false;
+     }
+     written = fwrite(file->contents.data, 1, file->contents.size, fp);
+     closed = (fclose(fp) == 0); /* Network filesystems may only report errors here */
+     if (written != file->contents.size || !closed) {
+         fprintf(stderr, "ERROR: Failed to write output file '%s'.\n", file->path);
+         return false;
+     }
+     finish_output_file(file, start_ns, true);
+     return true;
+ }
+
+ #ifdef NVD_HAVE_IO_URING
+ /**
+  * struct uring_context - A minimal io_uring instance driven by raw syscalls.
+  * @ring_fd:      File descriptor returned by io_uring_setup().
+  * @entries:      Number of submission queue entries.
+  * @sq_tail:      Local submission tail (published on submit).
+  * @sq_head_ptr:  Kernel-updated submission head.
+  * @sq_tail_ptr:  Shared submission tail.
+  * @sq_mask_ptr:  Submission ring mask.
+  * @sq_array:     Submission index array.
+  * @sqes:         Submission queue entries.
+  * @cq_head_ptr:  Shared completion head.
+  * @cq_tail_ptr:  Kernel-updated completion tail.
+  * @cq_mask_ptr:  Completion ring mask.
+  * @cqes:         Completion queue entries.
+  * @sq_ring:      Mapping of the submission ring.
+  * @sq_ring_size: Size of @sq_ring.
+  * @cq_ring:      Mapping of the completion ring (may equal @sq_ring).
+  * @cq_ring_size: Size of @cq_ring.
+  * @sqes_size:    Size of the @sqes mapping.
+  * @dir_names:    Output directories with an open descriptor.
+  * @dir_fds:      Directory descriptors for openat(), parallel to @dir_names.
+  * @dir_count:    Number of cached directories.
+  * @broken:       Set when io_uring_enter() fails; the ring is not used again.
+  * @in_flight:    Entries of a broken ring still unfinished after uring_drain().
+  */
+ typedef struct {
+     int ring_fd;
+     unsigned entries;
+     unsigned sq_tail;
+     unsigned *sq_head_ptr;
+     unsigned *sq_tail_ptr;
+     unsigned *sq_mask_ptr;
+     unsigned *sq_array;
+     struct io_uring_sqe *sqes;
+     unsigned *cq_head_ptr;
+     unsigned *cq_tail_ptr;
+     unsigned *cq_mask_ptr;
+     struct io_uring_cqe *cqes;
+     void *sq_ring;
+     size_t sq_ring_size;
+     void *cq_ring;
+     size_t cq_ring_size;
+     size_t sqes_size;
+     char *dir_names[URING_DIR_CACHE_SIZE];
+     int dir_fds[URING_DIR_CACHE_SIZE];
+     int dir_count;
+     bool broken;
+     unsigned in_flight;
+ } UringContext;
+
+ /**
+  * uring_close() - Tears down an io_uring instance and its directory cache.
+  * @ctx: Pointer to the UringContext.
+  */
+ void
+ uring_close(UringContext *ctx)
+ {
+     int i;
+
+     for (i = 0; i < ctx->dir_count; ++i) {
+         close(ctx->dir_fds[i]);
+         free(ctx->dir_names[i]);
+     }
+     ctx->dir_count = 0;
+     if (ctx->sqes)
+         munmap(ctx->sqes, ctx->sqes_size);
+     if (ctx->cq_ring && ctx->cq_ring != ctx->sq_ring)
+         munmap(ctx->cq_ring, ctx->cq_ring_size);
+     if (ctx->sq_ring)
+         munmap(ctx->sq_ring, ctx->sq_ring_size);
+     if (ctx->ring_fd >= 0)
+         close(ctx->ring_fd);
+     memset(ctx, 0, sizeof(*ctx));
+     ctx->ring_fd = -1;
+ }
+
+ /**
+  * uring_open() - Creates an io_uring instance and checks the needed opcodes.
+  * @ctx:     Pointer to the UringContext to initialize.
+  * @entries: Requested submission queue size.
+  *
+  * Return: true on success, false if io_uring is unavailable (old kernel,
+  * disabled by seccomp or sysctl) or lacks openat/write/close support.
+  */
+ bool
+ uring_open(UringContext *ctx, unsigned entries)
+ {
+     struct io_uring_params params;
+     struct io_uring_probe *probe;
+     size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+     uint8_t *sq_ring, *cq_ring;
+     bool supported = false;
+
+     memset(ctx, 0, sizeof(*ctx));
+     memset(&params, 0, sizeof(params));
+     ctx->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+     if (ctx->ring_fd < 0) {
+         verbose_printf("io_uring_setup failed (%s).\n", strerror(errno));
+         ctx->ring_fd = -1;
+         return false;
+     }
+     ctx->entries = params.sq_entries;
+
+     /* Map the rings (one mapping for both on kernels with IORING_FEAT_SINGLE_MMAP) */
+     ctx->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+     ctx->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         if (ctx->cq_ring_size > ctx->sq_ring_size)
+             ctx->sq_ring_size = ctx->cq_ring_size;
+         ctx->cq_ring_size = ctx->sq_ring_size;
+     }
+     ctx->sq_ring = mmap(NULL, ctx->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ctx->ring_fd, IORING_OFF_SQ_RING);
+     if (ctx->sq_ring == MAP_FAILED) {
+         ctx->sq_ring = NULL;
+         goto fail;
+     }
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         ctx->cq_ring = ctx->sq_ring;
+     } else {
+         ctx->cq_ring = mmap(NULL, ctx->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ctx->ring_fd, IORING_OFF_CQ_RING);
+         if (ctx->cq_ring == MAP_FAILED) {
+             ctx->cq_ring = NULL;
+             goto fail;
+         }
+     }
+     ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+     ctx->sqes = (struct io_uring_sqe *)mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQES);
+     if (ctx->sqes == MAP_FAILED) {
+         ctx->sqes = NULL;
+         goto fail;
+     }
+
+     sq_ring = (uint8_t *)ctx->sq_ring;
+     cq_ring = (uint8_t *)ctx->cq_ring;
+     ctx->sq_head_ptr = (unsigned *)(sq_ring + params.sq_off.head);
+     ctx->sq_tail_ptr = (unsigned *)(sq_ring + params.sq_off.tail);
+     ctx->sq_mask_ptr = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+     ctx->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+     ctx->cq_head_ptr = (unsigned *)(cq_ring + params.cq_off.head);
+     ctx->cq_tail_ptr = (unsigned *)(cq_ring + params.cq_off.tail);
+     ctx->cq_mask_ptr = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+     ctx->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+     ctx->sq_tail = *ctx->sq_tail_ptr;
+
+     /* openat/close need Linux 5.6; make sure this kernel has them */
+     probe = (struct io_uring_probe *)calloc(1, probe_size);
+     if (probe && syscall(__NR_io_uring_register, ctx->ring_fd, IORING_REGISTER_PROBE, probe, 256) >= 0) {
+         supported = probe->last_op >= IORING_OP_CLOSE &&
+                 (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+                 (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+                 (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED);
+     }
+     free(probe);
+     if (!supported) {
+         verbose_printf("io_uring lacks openat/write/close support on this kernel.\n");
+         goto fail;
+     }
+     return true;
+
+ fail:
+     uring_close(ctx);
+     return false;
+ }
+
+ /**
+  * uring_get_sqe() - Returns a cleared submission entry (published by uring_submit_and_wait()).
+  * @ctx: Pointer to the UringContext.
+  *
+  * Return: Pointer to the entry, or NULL if the submission queue is full.
+  */
+ struct io_uring_sqe *
+ uring_get_sqe(UringContext *ctx)
+ {
+     unsigned head = __atomic_load_n(ctx->sq_head_ptr, __ATOMIC_ACQUIRE);
+     unsigned index;
+     struct io_uring_sqe *sqe;
+
+     if (ctx->sq_tail - head >= ctx->entries)
+         return NULL;
+     index = ctx->sq_tail & *ctx->sq_mask_ptr;
+     sqe = &ctx->sqes[index];
+     memset(sqe, 0, sizeof(*sqe));
+     ctx->sq_array[index] = index;
+     ctx->sq_tail++;
+     return sqe;
+ }
+
+ /**
+  * uring_drain() - Collects the completions a failed ring still owes.
+  * @ctx:     Pointer to the broken UringContext.
+  * @pending: Entries the kernel took whose completion has not been collected.
+  * @results: Receives each completion's result, indexed by its user_data.
+  *
+  * The kernel finishes the entries it took even after io_uring_enter()
+  * fails, and reads their buffers meanwhile; the ones it never took will
+  * not run. The completion ring is polled for up to URING_DRAIN_MS
+  * milliseconds; entries still unfinished then are left in @ctx->in_flight.
+  */
+ void
+ uring_drain(UringContext *ctx, unsigned pending, int *results)
+ {
+     uint64_t deadline = get_monotonic_ns() + (uint64_t)URING_DRAIN_MS * 1000000u;
+     unsigned round = 0;
+
+     while (pending > 0 && get_monotonic_ns() < deadline) {
+         unsigned head = *ctx->cq_head_ptr;
+         unsigned tail = __atomic_load_n(ctx->cq_tail_ptr, __ATOMIC_ACQUIRE);
+
+         if (head == tail) {
+             backoff_wait(&round);
+             continue;
+         }
+         for (; head != tail && pending > 0; ++head, --pending) {
+             const struct io_uring_cqe *cqe = &ctx->cqes[head & *ctx->cq_mask_ptr];
+             results[cqe->user_data] = cqe->res;
+         }
+         __atomic_store_n(ctx->cq_head_ptr, head, __ATOMIC_RELEASE);
+     }
+     ctx->in_flight = pending;
+ }
+
+ /**
+  * uring_submit_and_wait() - Submits all prepared entries and collects their completions.
+  * @ctx:     Pointer to the UringContext.
+  * @count:   Number of entries prepared since the last call.
+  * @results: Receives each completion's result, indexed by its user_data.
+  *
+  * If the ring itself fails, @ctx is marked broken and the completions of
+  * the entries the kernel already took are collected by uring_drain().
+  *
+  * Return: true on success, false if the ring itself failed.
+  */
+ bool
+ uring_submit_and_wait(UringContext *ctx, unsigned count, int *results)
+ {
+     unsigned to_submit = count;
+     unsigned completed = 0;
+
+     __atomic_store_n(ctx->sq_tail_ptr, ctx->sq_tail, __ATOMIC_RELEASE);
+     while (completed < count) {
+         unsigned head = *ctx->cq_head_ptr;
+         unsigned tail = __atomic_load_n(ctx->cq_tail_ptr, __ATOMIC_ACQUIRE);
+
+         if (head == tail || to_submit > 0) {
+             long ret = syscall(__NR_io_uring_enter, ctx->ring_fd, to_submit, head == tail ? 1 : 0,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+             if (ret < 0) {
+                 if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                     continue;
+                 fprintf(stderr, "ERROR: io_uring_enter failed (%s); writing the remaining files synchronously.\n",
+                         strerror(errno));
+                 ctx->broken = true;
+                 uring_drain(ctx, __atomic_load_n(ctx->sq_head_ptr, __ATOMIC_ACQUIRE) -
+                                  (ctx->sq_tail - count) - completed, results);
+                 return false;
+             }
+             to_submit -= (unsigned)ret < to_submit ? (unsigned)ret : to_submit;
+             continue;
+         }
+         for (; head != tail; ++head) {
+             const struct io_uring_cqe *cqe = &ctx->cqes[head & *ctx->cq_mask_ptr];
+             results[cqe->user_data] = cqe->res;
+             completed++;
+         }
+         __atomic_store_n(ctx->cq_head_ptr, head, __ATOMIC_RELEASE);
+     }
+     return true;
+ }
+
+ /**
+  * uring_get_directory_fd() - Returns a cached descriptor for an output directory.
+  * @ctx:       Pointer to the UringContext.
+  * @directory: Output directory (NULL for the current directory).
+  *
+  * Return: Descriptor usable with openat(), AT_FDCWD for the current
+  * directory or when the directory cannot be opened (paths stay valid).
+  */
+ int
+ uring_get_directory_fd(UringContext *ctx, const char *directory)
+ {
+     int i, fd;
+
+     if (!directory)
+         return AT_FDCWD;
+     for (i = 0; i < ctx->dir_count; ++i) {
+         if (strcmp(ctx->dir_names[i], directory) == 0)
+             return ctx->dir_fds[i];
+     }
+     fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (fd < 0)
+         return AT_FDCWD;
+     if (ctx->dir_count == URING_DIR_CACHE_SIZE) { /* Evict the oldest entry */
+         close(ctx->dir_fds[0]);
+         free(ctx->dir_names[0]);
+         memmove(ctx->dir_names, ctx->dir_names + 1, (URING_DIR_CACHE_SIZE - 1) * sizeof(char *));
+         memmove(ctx->dir_fds, ctx->dir_fds + 1, (URING_DIR_CACHE_SIZE - 1) * sizeof(int));
+         ctx->dir_count--;
+     }
+     ctx->dir_names[ctx->dir_count] = strdup(directory);
+     if (!ctx->dir_names[ctx->dir_count]) {
+         close(fd);
+         return AT_FDCWD;
+     }
+     ctx->dir_fds[ctx->dir_count++] = fd;
+     return fd;
+ }
+
+ /**
+  * uring_recover_batch() - Finishes a batch whose open or write stage hit a failed ring.
+  * @ctx:     Pointer to the broken UringContext (descriptors already closed).
+  * @files:   Files of the batch.
+  * @count:   Number of files.
+  * @results: Result slots of the failed stage (URING_PENDING if no completion arrived).
+  * @retry:   Files to write again with write_output_file_blocking().
+  *
+  * While @ctx->in_flight is non-zero, any file without a completion may
+  * still be read by the kernel (its path, its contents) or be truncated by
+  * a late open. Such a file is reported as failed and removed from @files,
+  * so its memory is never freed.
+  *
+  * Return: Number of files that could not be written.
+  */
+ size_t
+ uring_recover_batch(UringContext *ctx, OutputFile **files, size_t count, const int *results, const bool *retry)
+ {
+     size_t failed = 0;
+     size_t i;
+
+     for (i = 0; i < count; ++i) {
+         if (results[i] == URING_PENDING && ctx->in_flight > 0) {
+             fprintf(stderr, "ERROR: Output file '%s' was left to an unfinished io_uring request.\n", files[i]->path);
+             files[i] = NULL;
+             failed++;
+         } else if (!retry[i] || !write_output_file_blocking(files[i])) {
+             failed++;
+         }
+     }
+     return failed;
+ }
+
+ /**
+  * uring_write_files() - Writes a batch of files through io_uring.
+  * @ctx:   Pointer to the UringContext.
+  * @files: Files to write (at most URING_BATCH_SIZE).
+  * @count: Number of files.
+  *
+  * Each stage (openat, write, close) is one io_uring_enter() for the whole
+  * batch. openat is relative to a cached output directory descriptor. Short
+  * writes are completed with pwrite().
+  *
+  * If the ring fails (@ctx is then broken), every descriptor opened so far
+  * is closed. After a failed open or write stage the batch is written again
+  * by uring_recover_batch(), which may set entries of @files to NULL. After
+  * a failed close stage the descriptors the kernel never took (SQ head) are
+  * closed with close(), and a file whose close the kernel took but did not
+  * finish is reported as failed, as its close error cannot be seen.
+  *
+  * Return: Number of files that could not be written.
+  */
+ size_t
+ uring_write_files(UringContext *ctx, OutputFile **files, size_t count)
+ {
+     int fds[URING_BATCH_SIZE];
+     int results[URING_BATCH_SIZE];
+     bool ok[URING_BATCH_SIZE];
+     uint64_t start_ns = stats_timer_start();
+     unsigned queued = 0;
+     unsigned first_close;
+     size_t failed = 0;
+     size_t i;
+
+     /* --- Stage 1: open all files --- */
+     for (i = 0; i < count; ++i) {
+         struct io_uring_sqe *sqe = uring_get_sqe(ctx);
+         const OutputFile *file = files[i];
+         int dir_fd = uring_get_directory_fd(ctx, file->directory);
+
+         sqe->opcode = IORING_OP_OPENAT;
+         sqe->fd = dir_fd;
+         sqe->addr = (uint64_t)(uintptr_t)(dir_fd == AT_FDCWD ? file->path : file->path + file->name_offset);
+         sqe->len = 0666;
+         sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+         sqe->user_data = i;
+         results[i] = URING_PENDING;
+         ok[i] = true;
+     }
+     if (!uring_submit_and_wait(ctx, (unsigned)count, results)) {
+         for (i = 0; i < count; ++i) {
+             if (results[i] >= 0)
+                 close(results[i]);
+         }
+         return uring_recover_batch(ctx, files, count, results, ok);
+     }
+     for (i = 0; i < count; ++i) {
+         fds[i] = results[i];
+         ok[i] = fds[i] >= 0;
+         if (!ok[i])
+             fprintf(stderr, "ERROR: Cannot open output file '%s' for writing (%s).\n", files[i]->path, strerror(-fds[i]));
+     }
+
+     /* --- Stage 2: write the contents --- */
+     for (i = 0; i < count; ++i) {
+         struct io_uring_sqe *sqe;
+
+         results[i] = 0;
+         if (!ok[i] || files[i]->contents.size == 0)
+             continue;
+         sqe = uring_get_sqe(ctx);
+         sqe->opcode = IORING_OP_WRITE;
+         sqe->fd = fds[i];
+         sqe->addr = (uint64_t)(uintptr_t)files[i]->contents.data;
+         sqe->len = (uint32_t)files[i]->contents.size;
+         sqe->off = 0;
+         sqe->user_data = i;
+         results[i] = URING_PENDING;
+         queued++;
+     }
+     if (queued > 0 && !uring_submit_and_wait(ctx, queued, results)) {
+         for (i = 0; i < count; ++i) {
+             if (fds[i] >= 0)
+                 close(fds[i]);
+         }
+         return uring_recover_batch(ctx, files, count, results, ok);
+     }
+     for (i = 0; i < count; ++i) {
+         size_t done;
+
+         if (!ok[i])
+             continue;
+         if (results[i] < 0) {
+             fprintf(stderr, "ERROR: Failed to write output file '%s' (%s).\n", files[i]->path, strerror(-results[i]));
+             ok[i] = false;
+             continue;
+         }
+         for (done = (size_t)results[i]; done < files[i]->contents.size; ) {
+             ssize_t n = pwrite(fds[i], files[i]->contents.data + done, files[i]->contents.size - done, (off_t)done);
+             if (n <= 0) {
+                 fprintf(stderr, "ERROR: Failed to write output file '%s'.\n", files[i]->path);
+                 ok[i] = false;
+                 break;
+             }
+             done += (size_t)n;
+         }
+     }
+
+     /* --- Stage 3: close (network filesystems may report write errors here) --- */
+     queued = 0;
+     first_close = ctx->sq_tail;
+     for (i = 0; i < count; ++i) {
+         struct io_uring_sqe *sqe;
+
+         results[i] = 0;
+         if (fds[i] < 0)
+             continue;
+         sqe = uring_get_sqe(ctx);
+         sqe->opcode = IORING_OP_CLOSE;
+         sqe->fd = fds[i];
+         sqe->user_data = i;
+         results[i] = URING_PENDING;
+         queued++;
+     }
+     if (queued > 0 && !uring_submit_and_wait(ctx, queued, results)) {
+         /* The kernel takes entries in order: it owns the first ones, the rest are closed here */
+         unsigned taken = __atomic_load_n(ctx->sq_head_ptr, __ATOMIC_ACQUIRE) - first_close;
+         unsigned position = 0;
+
+         for (i = 0; i < count; ++i) {
+             if (fds[i] < 0)
+                 continue;
+             if (position++ >= taken) {
+                 results[i] = (close(fds[i]) == 0) ? 0 : -errno;
+             } else if (results[i] == URING_PENDING && ok[i]) {
+                 fprintf(stderr, "ERROR: Output file '%s' was left to an unfinished io_uring close.\n", files[i]->path);
+                 ok[i] = false;
+             }
+         }
+     }
+
+     for (i = 0; i < count; ++i) {
+         if (ok[i] && results[i] < 0) {
+             fprintf(stderr, "ERROR: Failed to write output file '%s' (%s).\n", files[i]->path, strerror(-results[i]));
+             ok[i] = false;
+         }
+         if (ok[i])
+             finish_output_file(files[i], start_ns, false);
+         else
+             failed++;
+     }
+     if (stats_enabled) {
+         RunStats stats;
+
+         memset(&stats, 0, sizeof(stats));
+         stats_timer_stop(&stats, STATS_PHASE_WRITE, start_ns);
+         stats_merge(&stats);
+     }
+     return failed;
+ }
+
+ /**
+  * write_output_files_blocking() - Writes a batch of files with write_output_file_blocking().
+  * @files: Files to write.
+  * @count: Number of files.
+  *
+  * Used by the io_uring backend once its ring has failed.
+  *
+  * Return: Number of files that could not be written.
+  */
+ size_t
+ write_output_files_blocking(OutputFile **files, size_t count)
+ {
+     size_t failed = 0;
+     size_t i;
+
+     for (i = 0; i < count; ++i) {
+         if (!write_output_file_blocking(files[i]))
+             failed++;
+     }
+     return failed;
+ }
+ #endif /* NVD_HAVE_IO_URING */
+
+ /**
+  * output_queue_pop() - Takes up to @max files from the writer queue.
+  * @files: Receives the files.
+  * @max:   Maximum number of files to take.
+  *
+  * Blocks until at least one file is queued or the writer is shutting down.
+  *
+  * Return: Number of files taken; 0 once the queue is closed and empty.
+  */
+ size_t
+ output_queue_pop(OutputFile **files, size_t max)
+ {
+     OutputWriter *writer = &output_writer;
+     size_t taken = 0;
+
+     mutex_lock(&writer->lock);
+     while (writer->count == 0 && !writer->closing)
+         condvar_wait(&writer->not_empty, &writer->lock);
+     while (taken < max && writer->count > 0) {
+         files[taken++] = writer->queue[writer->head];
+         writer->head = (writer->head + 1) % OUTPUT_QUEUE_CAPACITY;
+         writer->count--;
+     }
+     if (taken > 0)
+         condvar_broadcast(&writer->not_full);
+     mutex_unlock(&writer->lock);
+     return taken;
+ }
+
+ /**
+  * output_thread_worker() - Writer thread of the thread backend.
+  * @arg: Unused.
+  */
+ void
+ output_thread_worker(void *arg)
+ {
+     OutputFile *file;
+
+     (void)arg;
+     while (output_queue_pop(&file, 1) == 1) {
+         if (!write_output_file_blocking(file)) {
+             mutex_lock(&output_writer.lock);
+             output_writer.failed++;
+             mutex_unlock(&output_writer.lock);
+         }
+         free_output_file(file);
+     }
+ }
+
+ #ifdef NVD_HAVE_IO_URING
+ /**
+  * output_uring_worker() - Writer thread of the io_uring backend.
+  * @arg: Pointer to the UringContext (owned by this thread).
+  *
+  * Takes whatever has queued up (at most URING_BATCH_SIZE files) and writes
+  * it as one io_uring batch. Once the ring has failed, the batches are
+  * written synchronously instead.
+  */
+ void
+ output_uring_worker(void *arg)
+ {
+     UringContext *ctx = (UringContext *)arg;
+     OutputFile *files[URING_BATCH_SIZE];
+     size_t count, failed, i;
+
+     while ((count = output_queue_pop(files, URING_BATCH_SIZE)) > 0) {
+         if (ctx->broken)
+             failed = write_output_files_blocking(files, count);
+         else
+             failed = uring_write_files(ctx, files, count);
+         if (failed > 0) {
+             mutex_lock(&output_writer.lock);
+             output_writer.failed += failed;
+             mutex_unlock(&output_writer.lock);
+         }
+         for (i = 0; i < count; ++i)
+             free_output_file(files[i]);
+     }
+     uring_close(ctx);
+     free(ctx);
+ }
+ #endif
+
+ /**
+  * output_writer_start() - Selects and starts the output backend.
+  * @backend: Requested backend (OUTPUT_BACKEND_AUTO picks io_uring where
+  *           available, else the thread backend).
+  *
+  * A requested io_uring backend that cannot be set up at runtime falls back
+  * to the thread backend.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ output_writer_start(OutputBackend backend)
+ {
+     OutputWriter *writer = &output_writer;
+     int i;
+
+     memset(writer, 0, sizeof(*writer));
+     writer->backend = OUTPUT_BACKEND_SYNC;
+     if (backend == OUTPUT_BACKEND_SYNC)
+         return true;
+
+     mutex_init(&writer->lock);
+     condvar_init(&writer->not_empty);
+     condvar_init(&writer->not_full);
+
+     if (backend == OUTPUT_BACKEND_URING || backend == OUTPUT_BACKEND_AUTO) {
+ #ifdef NVD_HAVE_IO_URING
+         UringContext *ctx = (UringContext *)malloc(sizeof(UringContext));
+
+         if (ctx && uring_open(ctx, URING_QUEUE_DEPTH)) {
+             if (thread_create(&writer->threads[0], output_uring_worker, ctx)) {
+                 writer->thread_count = 1;
+                 writer->backend = OUTPUT_BACKEND_URING;
+                 verbose_printf("Output writer: io_uring (batches of up to %d files).\n", URING_BATCH_SIZE);
+                 return true;
+             }
+             uring_close(ctx);
+         }
+         free(ctx);
+ #endif
+         if (backend == OUTPUT_BACKEND_URING)
+             status_printf("INFO: io_uring is not available; using the thread output writer.\n");
+     }
+
+     for (i = 0; i < OUTPUT_WRITER_THREADS; ++i) {
+         if (!thread_create(&writer->threads[i], output_thread_worker, NULL))
+             break;
+         writer->thread_count++;
+     }
+     if (writer->thread_count == 0) {
+         fprintf(stderr, "WARN: Could not start output writer threads; writing synchronously.\n");
+         condvar_destroy(&writer->not_full);
+         condvar_destroy(&writer->not_empty);
+         mutex_destroy(&writer->lock);
+         return true;
+     }
+     writer->backend = OUTPUT_BACKEND_THREAD;
+     verbose_printf("Output writer: %d thread(s).\n", writer->thread_count);
+     return true;
+ }
+
+ /**
+  * submit_output_file() - Hands a finished output file to the output writer.
+  * @output_dir:     Output directory (NULL for the current directory).
+  * @output_base:    Base filename (no extension).
+  * @extension:      Extension including the leading dot.
+  * @kind:           Kind of file (selects the status message).
+  * @contents:       Complete file image. Ownership moves to the writer and
+  *                  @contents is reset to empty, also on failure.
+  * @sample_count:   Number of samples (for the status message).
+  * @segment_index:  0-based segment index (for --trace).
+  * @message_index:  0-based message index within the segment (for --trace).
+  * @absolute_index: 0-based absolute message index (for --trace).
+  *
+  * With the sync backend the file is written before returning. Otherwise it
+  * is queued, blocking while OUTPUT_QUEUE_CAPACITY files are already pending.
+  *
+  * Return: true if the file was written or queued, false on failure.
+  */
+ bool
+ submit_output_file(const char *output_dir, const char *output_base, const char *extension,
+            OutputFileKind kind, OutputBuffer *contents, uint64_t sample_count,
+            int segment_index, int message_index, int absolute_index)
+ {
+     OutputWriter *writer = &output_writer;
+     char path[FILENAME_MAX];
+     OutputFile *file;
+     bool success;
+
+     if (!build_output_path(path, sizeof(path), output_dir, output_base, extension)) {
+         fprintf(stderr, "ERROR: Output path for '%s%s' is too long.\n", output_base, extension);
+         free_output_buffer(contents);
+         return false;
+     }
+     file = (OutputFile *)calloc(1, sizeof(OutputFile));
+     if (!file || !(file->path = strdup(path)) ||
+         (output_dir && output_dir[0] != '\0' && !(file->directory = strdup(output_dir)))) {
+         fprintf(stderr, "ERROR: Memory allocation failed for output file '%s'.\n", path);
+         free_output_file(file);
+         free_output_buffer(contents);
+         return false;
+     }
+     file->name_offset = file->directory ? strlen(file->directory) + 1 : 0;
+     file->kind = kind;
+     file->contents = *contents;
+     file->sample_count = sample_count;
+     file->segment_index = segment_index;
+     file->message_index = message_index;
+     file->absolute_index = absolute_index;
+     init_output_buffer(contents);
+
+     if (writer->backend == OUTPUT_BACKEND_SYNC) {
+         success = write_output_file_blocking(file);
+         free_output_file(file);
+         return success;
+     }
+
+     mutex_lock(&writer->lock);
+     while (writer->count == OUTPUT_QUEUE_CAPACITY)
+         condvar_wait(&writer->not_full, &writer->lock);
+     writer->queue[(writer->head + writer->count) % OUTPUT_QUEUE_CAPACITY] = file;
+     writer->count++;
+     condvar_signal(&writer->not_empty);
+     mutex_unlock(&writer->lock);
+     return true;
+ }
+
+ /**
+  * output_writer_finish() - Writes all pending files and stops the writer threads.
+  *
+  * As with synchronous writing, failed files are reported but do not change
+  * the exit code.
+  */
+ void
+ output_writer_finish(void)
+ {
+     OutputWriter *writer = &output_writer;
+     int i;
+
+     if (writer->backend == OUTPUT_BACKEND_SYNC)
+         return;
+
+     mutex_lock(&writer->lock);
+     writer->closing = true;
+     condvar_broadcast(&writer->not_empty);
+     mutex_unlock(&writer->lock);
+     for (i = 0; i < writer->thread_count; ++i)
+         thread_join(writer->threads[i]);
+
+     condvar_destroy(&writer->not_full);
+     condvar_destroy(&writer->not_empty);
+     mutex_destroy(&writer->lock);
+     writer->backend = OUTPUT_BACKEND_SYNC;
+     if (writer->failed > 0)
+         fprintf(stderr, "WARN: %zu output file(s) could not be written.\n", writer->failed);
+ }
+
+ /* --- Resampling --- */
+
+ Resampler resampler; /* Filter bank for --rate (coefficients NULL when not resampling) */
+ uint32_t output_sample_rate = DEFAULT_SAMPLE_RATE; /* Rate of the encoded audio (--rate) */
+
+ /**
+  * bessel_i0() - Modified Bessel function of the first kind, order 0.
+  * @x: Argument.
+  *
+  * Return: I0(x), by its power series (used for the Kaiser window).
+  */
+ double
+ bessel_i0(double x)
+ {
+     double sum = 1.0, term = 1.0;
+     int k;
+
+     for (k = 1; k < 50; ++k) {
+         term *= (x / (2.0 * k)) * (x / (2.0 * k));
+         sum += term;
+         if (term < sum * 1e-12)
+             break;
+     }
+     return sum;
+ }
+
+ /**
+  * init_resampler() - Precomputes the polyphase filter bank for one rate ratio.
+  * @bank:     Pointer to the Resampler to fill.
+  * @in_rate:  Input sample rate (Hz).
+  * @out_rate: Output sample rate (Hz).
+  *
+  * The ratio is reduced to up/down = out_rate/in_rate. Phase p of the bank
+  * holds the Kaiser-windowed sinc taps for an output sample that falls p/up
+  * of the way between two input samples. The cutoff sits at
+  * RESAMPLER_CUTOFF of the lower Nyquist frequency, and each phase is
+  * normalized to unity DC gain. Called once from main() before any worker
+  * thread starts.
+  *
+  * Return: true on success, false on invalid ratio or allocation failure.
+  */
+ bool
+ init_resampler(Resampler *bank, uint32_t in_rate, uint32_t out_rate)
+ {
+     uint32_t a = in_rate, b = out_rate;
+     double cutoff, half_width, beta = RESAMPLER_KAISER_BETA;
+     uint32_t p;
+     int i;
+
+     memset(bank, 0, sizeof(*bank));
+     while (b != 0) { /* gcd */
+         uint32_t t = a % b;
+         a = b;
+         b = t;
+     }
+     bank->up = out_rate / a;
+     bank->down = in_rate / a;
+     if (bank->up > RESAMPLER_MAX_PHASES) {
+         fprintf(stderr, "ERROR: Resampling ratio %u/%u needs too many filter phases (max %d).\n",
+             bank->up, bank->down, RESAMPLER_MAX_PHASES);
+         return false;
+     }
+
+     /* Cutoff relative to the input rate; widen the filter when downsampling */
+     cutoff = RESAMPLER_CUTOFF * ((out_rate < in_rate) ? (double)out_rate / in_rate : 1.0);
+     bank->half_taps = (int)ceil(RESAMPLER_ZERO_CROSSINGS / (cutoff / RESAMPLER_CUTOFF));
+     bank->taps = (2 * bank->half_taps + 3) & ~3; /* Multiple of 4 for the SIMD dot product */
+     half_width = bank->half_taps;
+
+     bank->coefficients = (float *)malloc((size_t)bank->up * bank->taps * sizeof(float));
+     if (!bank->coefficients) {
+         fprintf(stderr, "ERROR: Failed to allocate resampler filter bank.\n");
+         return false;
+     }
+     for (p = 0; p < bank->up; ++p) {
+         float *phase = bank->coefficients + (size_t)p * bank->taps;
+         double fraction = (double)p / bank->up;
+         double sum = 0.0;
+         for (i = 0; i < bank->taps; ++i) {
+             /* Distance (in input samples) from the output instant to tap i */
+             double t = fraction + bank->half_taps - 1 - i;
+             double x = t / half_width;
+             double value = 0.0;
+             if (i < 2 * bank->half_taps && fabs(x) < 1.0) {
+                 double arg = 3.14159265358979323846 * cutoff * t;
+                 double sinc = (fabs(arg) < 1e-9) ? 1.0 : sin(arg) / arg;
+                 value = cutoff * sinc * bessel_i0(beta * sqrt(1.0 - x * x)) / bessel_i0(beta);
+             }
+             phase[i] = (float)value;
+             sum += value;
+         }
+         for (i = 0; i < bank->taps; ++i)
+             phase[i] = (float)(phase[i] / sum);
+     }
+     return true;
+ }
+
+ /**
+  * free_resampler() - Releases a Resampler's filter bank.
+  * @bank: Pointer to the Resampler.
+  */
+ void
+ free_resampler(Resampler *bank)
+ {
+     free(bank->coefficients);
+     bank->coefficients = NULL;
+ }
+
+ /**
+  * dot_product() - Multiplies and sums two float vectors.
+  * @a:     First vector.
+  * @b:     Second vector.
+  * @count: Number of elements (multiple of 4).
+  *
+  * Return: The sum of a[i] * b[i].
+  */
+ float
+ dot_product(const float *a, const float *b, int count)
+ {
+     int i;
+ #if defined(HAVE_SSE2)
+     __m128 acc = _mm_setzero_ps();
+     for (i = 0; i < count; i += 4)
+         acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+     acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+     acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+     return _mm_cvtss_f32(acc);
+ #elif defined(HAVE_NEON)
+     float32x4_t acc = vdupq_n_f32(0.0f);
+     for (i = 0; i < count; i += 4)
+         acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+     return vaddvq_f32(acc);
+ #else
+     float sum = 0.0f;
+     for (i = 0; i < count; ++i)
+         sum += a[i] * b[i];
+     return sum;
+ #endif
+ }
+
+ /**
+  * resample_pcm() - Converts a decoded message to the output sample rate.
+  * @bank:   Filter bank from init_resampler().
+  * @input:  Samples at the decoder rate.
+  * @output: PcmBuffer to fill (initialized by the caller).
+  *
+  * Output sample k lies at input position k * down / up; its phase selects
+  * the taps and the input window around it is read from a zero-padded float
+  * copy, so the inner loop needs no bounds checks.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ resample_pcm(const Resampler *bank, const PcmBuffer *input, PcmBuffer *output)
+ {
+     size_t padding = (size_t)bank->taps;
+     size_t out_count = (size_t)(((uint64_t)input->count * bank->up + bank->down - 1) / bank->down);
+     float *padded;
+     size_t i, k;
+
+     padded = (float *)calloc(input->count + 2 * padding, sizeof(float));
+     output->samples = (int16_t *)malloc((out_count > 0 ? out_count : 1) * sizeof(int16_t));
+     if (!padded || !output->samples) {
+         fprintf(stderr, "ERROR: Failed to allocate resampling buffers.\n");
+         free(padded);
+         free(output->samples);
+         output->samples = NULL;
+         return false;
+     }
+     for (i = 0; i < input->count; ++i)
+         padded[padding + i] = input->samples[i];
+
+     for (k = 0; k < out_count; ++k) {
+         uint64_t position = (uint64_t)k * bank->down;
+         size_t base = (size_t)(position / bank->up);
+         uint32_t phase = (uint32_t)(position % bank->up);
+         /* First tap sits half_taps - 1 samples before the base sample */
+         const float *window = padded + padding + base - (size_t)(bank->half_taps - 1);
+         float value = dot_product(window, bank->coefficients + (size_t)phase * bank->taps, bank->taps);
+         long rounded = lrintf(value);
+         output->samples[k] = (int16_t)(rounded > 32767 ? 32767 : rounded < -32768 ? -32768 : rounded);
+     }
+     output->count = out_count;
+     output->capacity = out_count;
+     free(padded);
+     return true;
+ }
+
+ /* --- G.711 Companding --- */
+
+ uint8_t ulaw_table[1 << 14]; /* mu-law code by 14-bit sample (index: 16-bit sample >> 2) */
+ uint8_t alaw_table[1 << 13]; /* A-law code by 13-bit sample (index: 16-bit sample >> 3) */
+
+ /**
+  * linear_to_ulaw() - Compresses one 14-bit linear sample to G.711 mu-law.
+  * @value: Sample in the range -8192..8191.
+  *
+  * Return: The mu-law code (bit-inverted, as transmitted).
+  */
+ uint8_t
+ linear_to_ulaw(int value)
+ {
+     int mask = 0xFF;
+     int segment = 0;
+
+     if (value < 0) {
+         value = -value;
+         mask = 0x7F;
+     }
+     if (value > 8159)
+         value = 8159; /* Clip so that adding the bias stays in range */
+     value += 0x84 >> 2; /* Bias */
+     while (segment < 8 && value > (0x40 << segment) - 1)
+         segment++;
+     if (segment >= 8)
+         return (uint8_t)(0x7F ^ mask);
+     return (uint8_t)(((segment << 4) | ((value >> (segment + 1)) & 0x0F)) ^ mask);
+ }
+
+ /**
+  * linear_to_alaw() - Compresses one 13-bit linear sample to G.711 A-law.
+  * @value: Sample in the range -4096..4095.
+  *
+  * Return: The A-law code (even bits inverted, as transmitted).
+  */
+ uint8_t
+ linear_to_alaw(int value)
+ {
+     int mask = 0xD5;
+     int segment = 0;
+     int code;
+
+     if (value < 0) {
+         value = -value - 1;
+         mask = 0x55;
+     }
+     while (segment < 8 && value > (0x20 << segment) - 1)
+         segment++;
+     if (segment >= 8)
+         return (uint8_t)(0x7F ^ mask);
+     code = segment << 4;
+     code |= (segment < 2) ? ((value >> 1) & 0x0F) : ((value >> segment) & 0x0F);
+     return (uint8_t)(code ^ mask);
+ }
+
+ /**
+  * init_g711_tables() - Fills the mu-law and A-law lookup tables.
+  *
+  * Called once from main() before any worker thread starts, so encoding is a
+  * single table load per sample instead of a segment search.
+  */
+ void
+ init_g711_tables(void)
+ {
+     int i;
+
+     for (i = 0; i < (1 << 14); ++i)
+         ulaw_table[i] = linear_to_ulaw((i & 0x2000) ? i - (1 << 14) : i);
+     for (i = 0; i < (1 << 13); ++i)
+         alaw_table[i] = linear_to_alaw((i & 0x1000) ? i - (1 << 13) : i);
+ }
+
+ /**
+  * compand_g711() - Converts 16-bit PCM samples to G.711 codes.
+  * @codes:   Receives @count codes.
+  * @samples: 16-bit PCM samples.
+  * @count:   Number of samples.
+  * @alaw:    true for A-law, false for mu-law.
+  */
+ void
+ compand_g711(uint8_t *codes, const int16_t *samples, size_t count, bool alaw)
+ {
+     size_t i;
+
+     if (alaw) {
+         for (i = 0; i < count; ++i)
+             codes[i] = alaw_table[(uint16_t)samples[i] >> 3];
+     } else {
+         for (i = 0; i < count; ++i)
+             codes[i] = ulaw_table[(uint16_t)samples[i] >> 2];
+     }
+ }
+
+ /**
+  * encode_g711_raw() - Serializes decoded PCM data as headerless G.711 (.ul/.al).
+  * @output:     OutputBuffer that receives the file image.
+  * @pcm_buffer: Pointer to the PcmBuffer containing the samples.
+  * @alaw:       true for A-law, false for mu-law.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ encode_g711_raw(OutputBuffer *output, const PcmBuffer *pcm_buffer, bool alaw)
+ {
+     if (!reserve_output_buffer(output, pcm_buffer->count))
+         return false;
+     compand_g711(output->data + output->size, pcm_buffer->samples, pcm_buffer->count, alaw);
+     output->size += pcm_buffer->count;
+     return true;
+ }
+
+ /* --- IMA ADPCM Encoding --- */
+
+ /**
+  * encode_ima_sample() - Encodes one sample as a 4-bit IMA ADPCM code.
+  * @state:  Encoder state (predictor and step index), updated like the decoder's.
+  * @sample: 16-bit sample to encode.
+  *
+  * Return: The 4-bit code (bit 3 = sign).
+  */
+ uint8_t
+ encode_ima_sample(ImaEncoderState *state, int sample)
+ {
+     int step = ima_step_table[state->step_index];
+     int diff = sample - state->predictor;
+     int delta = step >> 3;
+     uint8_t code = 0;
+
+     if (diff < 0) {
+         code = 8;
+         diff = -diff;
+     }
+     /* Successive approximation of diff / step in three bits */
+     if (diff >= step) { code |= 4; diff -= step; delta += step; }
+     step >>= 1;
+     if (diff >= step) { code |= 2; diff -= step; delta += step; }
+     step >>= 1;
+     if (diff >= step) { code |= 1; delta += step; }
+
+     state->predictor += (code & 8) ? -delta : delta;
+     if (state->predictor > 32767)
+         state->predictor = 32767;
+     else if (state->predictor < -32768)
+         state->predictor = -32768;
+     state->step_index += ima_index_table[code & 7];
+     if (state->step_index < 0)
+         state->step_index = 0;
+     else if (state->step_index > 88)
+         state->step_index = 88;
+     return code;
+ }
+
+ /**
+  * encode_ima_blocks() - Encodes PCM samples as mono IMA ADPCM WAV blocks.
+  * @blocks:  Receives @block_count * IMA_BLOCK_ALIGN bytes.
+  * @samples: 16-bit samples.
+  * @count:   Number of samples.
+  *
+  * Each block starts with the exact first sample and the step index, then
+  * holds IMA_SAMPLES_PER_BLOCK - 1 codes, low nibble first. The step index
+  * carries over between blocks. The last block is padded by repeating the
+  * final sample; the WAV "fact" chunk records the real length.
+  */
+ void
+ encode_ima_blocks(uint8_t *blocks, const int16_t *samples, size_t count)
+ {
+     ImaEncoderState state = {0, 0};
+     size_t position = 0;
+
+     while (position < count) {
+         uint8_t *block = blocks;
+         int first = samples[position];
+         int i;
+
+         state.predictor = first;
+         block[0] = (uint8_t)(first & 0xFF);
+         block[1] = (uint8_t)((first >> 8) & 0xFF);
+         block[2] = (uint8_t)state.step_index;
+         block[3] = 0;
+         for (i = 1; i < IMA_SAMPLES_PER_BLOCK; i += 2) {
+             size_t at = position + (size_t)i;
+             int low = samples[(at < count) ? at : count - 1];
+             int high = samples[(at + 1 < count) ? at + 1 : count - 1];
+             uint8_t code = encode_ima_sample(&state, low);
+             code |= (uint8_t)(encode_ima_sample(&state, high) << 4);
+             block[4 + (i - 1) / 2] = code;
+         }
+         position += IMA_SAMPLES_PER_BLOCK;
+         blocks += IMA_BLOCK_ALIGN;
+     }
+ }
+
+ /* --- WAV Encoding --- */
+
+ /**
+  * get_creation_date() - Formats today's local date for metadata tags.
+  * @buffer: Receives "YYYY-MM-DD".
+  * @size:   Size of @buffer (at least 11).
+  */
+ void
+ get_creation_date(char *buffer, size_t size)
+ {
+     time_t now;
+     struct tm t;
+
+     now = time(NULL);
+ #ifdef _WIN32
+     localtime_s(&t, &now); /* Thread-safe: files may be encoded on worker threads */
+ #else
+     localtime_r(&now, &t);
+ #endif
+     strftime(buffer, size, "%Y-%m-%d", &t);
+ }
+
+ /**
+  * store_s16le() - Stores 16-bit samples as little-endian bytes.
+  * @bytes:   Destination (2 * @count bytes).
+  * @samples: Source samples.
+  * @count:   Number of samples.
+  */
+ void
+ store_s16le(uint8_t *bytes, const int16_t *samples, size_t count)
+ {
+     size_t i;
+
+     for (i = 0; i < count; ++i) {
+         uint16_t sample = (uint16_t)samples[i];
+         bytes[2 * i] = sample & 0xFF;
+         bytes[2 * i + 1] = (sample >> 8) & 0xFF;
+     }
+ }
+
+ /**
+  * encode_s16le_raw() - Serializes decoded PCM data as headerless s16le (.raw).
+  * @output:     OutputBuffer that receives the sample bytes.
+  * @pcm_buffer: Pointer to the PcmBuffer containing the samples.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ encode_s16le_raw(OutputBuffer *output, const PcmBuffer *pcm_buffer)
+ {
+     if (!reserve_output_buffer(output, pcm_buffer->count * 2))
+         return false;
+     store_s16le(output->data + output->size, pcm_buffer->samples, pcm_buffer->count);
+     output->size += pcm_buffer->count * 2;
+     return true;
+ }
+
+ /**
+  * append_info_sub_chunk() - Appends a metadata sub-chunk to the WAV image.
+  * @buffer: Pointer to the OutputBuffer holding the WAV image.
+  * @id:     The 4-character chunk ID.
+  * @text:   The string data for the chunk.
+  *
+  * Return: The number of bytes appended (including ID, size, data, padding),
+  * or 0 on error.
+  */
+ uint32_t
+ append_info_sub_chunk(OutputBuffer *buffer, const char *id, const char *text)
+ {
+     size_t text_len;
+     uint32_t chunk_size;
+     bool needs_padding;
+     uint32_t total_size;
+
+     if (!text)
+         return 0; /* Skip if text is NULL */
+
+     text_len = strlen(text);
+     chunk_size = (uint32_t)text_len + 1; /* Include null terminator */
+     needs_padding = (chunk_size % 2 != 0);
+     total_size = 4 + 4 + chunk_size + (needs_padding ? 1 : 0);
+
+     if (!append_chunk_id(buffer, id)) return 0;
+     if (!append_u32le(buffer, chunk_size)) return 0;
+     if (!append_bytes(buffer, text, text_len + 1)) return 0; /* String + null */
+     if (needs_padding) {
+         uint8_t padding_byte = 0;
+         if (!append_bytes(buffer, &padding_byte, 1)) return 0;
+     }
+
+     return total_size;
+ }
+
+ /**
+  * encode_wav_file() - Serializes decoded PCM data into a WAV image with metadata.
+  * @output:             OutputBuffer that receives the complete file image.
+  * @pcm_buffer:         Pointer to the PcmBuffer containing the samples.
+  * @sample_rate:        Sample rate (e.g., 8000).
+  * @format:             OUTPUT_FORMAT_WAV (16-bit PCM), OUTPUT_FORMAT_ULAW_WAV or
+  *                      OUTPUT_FORMAT_ALAW_WAV (8-bit G.711), or OUTPUT_FORMAT_IMA_WAV
+  *                      (4-bit IMA ADPCM blocks). Compressed formats get a "fact" chunk.
+  * @rom_basename:       Base filename of the input ROM (for Artist tag).
+  * @track_title:        Title for the track (INAM tag).
+  * @track_number_str:   String representation of the absolute track number.
+  * @comment:            Comment string (ICMT tag, can be NULL).
+  *
+  * The file itself is written by the output writer (see submit_output_file()),
+  * so encoding stays on the decode thread while I/O can proceed elsewhere.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ encode_wav_file(OutputBuffer *output, const PcmBuffer *pcm_buffer,
+            uint32_t sample_rate, OutputFormat format, const char *rom_basename,
+            const char *track_title, const char *track_number_str,
+            const char *comment)
+ {
+     bool success = false; /* Assume failure */
+     char date_str[11]; /* YYYY-MM-DD */
+     const char *album = "Nortel Millennium VoiceWare";
+     const char *artist = rom_basename;
+     uint32_t num_samples, bytes_per_sample, data_chunk_size;
+     uint64_t data_chunk_size_64;
+     bool data_needs_padding;
+     uint32_t padded_data_chunk_size;
+     uint32_t info_chunk_total_size, info_chunk_data_size;
+     size_t temp_len;
+     bool temp_pad;
+     uint32_t fmt_chunk_size, fact_chunk_total_size, riff_chunk_size, bytes_per_sec;
+     uint16_t block_align, format_tag, bits_per_sample;
+     bool g711 = (format == OUTPUT_FORMAT_ULAW_WAV || format == OUTPUT_FORMAT_ALAW_WAV);
+     bool ima = (format == OUTPUT_FORMAT_IMA_WAV);
+     uint8_t *sample_bytes;
+
+     /* --- Prepare Metadata --- */
+     get_creation_date(date_str, sizeof(date_str));
+
+     /* --- Calculate Sizes --- */
+     num_samples = (uint32_t)pcm_buffer->count;
+     bits_per_sample = ima ? 4 : g711 ? 8 : ADPCM_BITS;
+     format_tag = ima ? 0x11 : (format == OUTPUT_FORMAT_ULAW_WAV) ? 7 : (format == OUTPUT_FORMAT_ALAW_WAV) ? 6 : 1;
+     bytes_per_sample = bits_per_sample / 8;
+     if (ima) /* Whole blocks */
+         data_chunk_size_64 = ((uint64_t)num_samples + IMA_SAMPLES_PER_BLOCK - 1) / IMA_SAMPLES_PER_BLOCK * IMA_BLOCK_ALIGN;
+     else
+         data_chunk_size_64 = (uint64_t)num_samples * bytes_per_sample;
+
+     /* Check for data chunk size overflow */
+     if (data_chunk_size_64 > UINT32_MAX) {
+         fprintf(stderr, "ERROR: WAV data chunk size exceeds 4GB limit for message '%s'.\n", track_title);
+         goto cleanup;
+     }
+     data_chunk_size = (uint32_t)data_chunk_size_64;
+     data_needs_padding = (data_chunk_size % 2 != 0);
+     padded_data_chunk_size = data_chunk_size + (data_needs_padding ? 1 : 0);
+
+
+     /* Calculate LIST/INFO chunk size */
+     info_chunk_total_size = 4; /* LIST chunk ID "LIST" */
+     info_chunk_data_size = 4; /* Type ID "INFO" */
+
+     /* IALB */
+     temp_len = strlen(album) + 1; temp_pad = temp_len % 2 != 0;
+     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
+     /* IART */
+     temp_len = strlen(artist) + 1; temp_pad = temp_len % 2 != 0;
+     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
+     /* INAM */
+     temp_len = strlen(track_title) + 1; temp_pad = temp_len % 2 != 0;
+     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
+     /* ITRK */
+     temp_len = strlen(track_number_str) + 1; temp_pad = temp_len % 2 != 0;
+     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
+     /* ICRD */
+     temp_len = strlen(date_str) + 1; temp_pad = temp_len % 2 != 0;
+     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
+     /* ICMT */
+     if (comment && strlen(comment) > 0) {
+          temp_len = strlen(comment) + 1; temp_pad = temp_len % 2 != 0;
+          info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
+     }
+
+     info_chunk_total_size += info_chunk_data_size; /* Add size field itself */
+
+
+     /* RIFF Chunk Size */
+     fmt_chunk_size = ima ? 20 : g711 ? 18 : 16; /* Non-PCM formats carry cbSize (+ samples per block) */
+     fact_chunk_total_size = (g711 || ima) ? 4 + 4 + 4 : 0; /* Sample count, required for non-PCM formats */
+     riff_chunk_size = 4 + /* "WAVE" ID */
+               (4 + 4 + fmt_chunk_size) + /* "fmt " chunk */
+               fact_chunk_total_size +     /* "fact" chunk */
+               info_chunk_total_size +     /* "LIST" chunk */
+               (4 + 4 + padded_data_chunk_size); /* "data" chunk */
+
+     /* --- Write RIFF Header --- */
+     if (!append_chunk_id(output, "RIFF")) goto cleanup;
+     if (!append_u32le(output, riff_chunk_size)) goto cleanup;
+     if (!append_chunk_id(output, "WAVE")) goto cleanup;
+
+     /* --- Write "fmt " Chunk --- */
+     if (!append_chunk_id(output, "fmt ")) goto cleanup;
+     if (!append_u32le(output, fmt_chunk_size)) goto cleanup; /* Size of chunk data */
+     if (!append_u16le(output, format_tag)) goto cleanup;    /* wFormatTag (1 = PCM, 6 = A-law, 7 = mu-law) */
+     if (!append_u16le(output, ADPCM_CHANNELS)) goto cleanup; /* nChannels */
+     if (!append_u32le(output, sample_rate)) goto cleanup;    /* nSamplesPerSec */
+     if (ima) {
+         bytes_per_sec = (uint32_t)((uint64_t)sample_rate * IMA_BLOCK_ALIGN / IMA_SAMPLES_PER_BLOCK);
+         block_align = IMA_BLOCK_ALIGN;
+     } else {
+         bytes_per_sec = sample_rate * ADPCM_CHANNELS * bytes_per_sample;
+         block_align = ADPCM_CHANNELS * bytes_per_sample;
+     }
+     if (!append_u32le(output, bytes_per_sec)) goto cleanup; /* nAvgBytesPerSec */
+     if (!append_u16le(output, block_align)) goto cleanup;   /* nBlockAlign */
+     if (!append_u16le(output, bits_per_sample)) goto cleanup; /* wBitsPerSample */
+     if (g711 || ima) {
+         if (ima) {
+             if (!append_u16le(output, 2)) goto cleanup;     /* cbSize */
+             if (!append_u16le(output, IMA_SAMPLES_PER_BLOCK)) goto cleanup; /* wSamplesPerBlock */
+         } else {
+             if (!append_u16le(output, 0)) goto cleanup;     /* cbSize */
+         }
+
+         /* --- Write "fact" Chunk --- */
+         if (!append_chunk_id(output, "fact")) goto cleanup;
+         if (!append_u32le(output, 4)) goto cleanup;
+         if (!append_u32le(output, num_samples)) goto cleanup; /* dwSampleLength */
+     }
+
+     /* --- Write "LIST" (INFO) Chunk --- */
+     if (!append_chunk_id(output, "LIST")) goto cleanup;
+     if (!append_u32le(output, info_chunk_data_size)) goto cleanup; /* Size of LIST data */
+     if (!append_chunk_id(output, "INFO")) goto cleanup; /* List type */
+
+     if (append_info_sub_chunk(output, "IALB", album) == 0) goto cleanup;
+     if (append_info_sub_chunk(output, "IART", artist) == 0) goto cleanup;
+     if (append_info_sub_chunk(output, "INAM", track_title) == 0) goto cleanup;
+     if (append_info_sub_chunk(output, "ITRK", track_number_str) == 0) goto cleanup;
+     if (append_info_sub_chunk(output, "ICRD", date_str) == 0) goto cleanup;
+     if (comment && strlen(comment) > 0) {
+         if (append_info_sub_chunk(output, "ICMT", comment) == 0) goto cleanup;
+     }
+
+     /* --- Write "data" Chunk --- */
+     if (!append_chunk_id(output, "data")) goto cleanup;
+     if (!append_u32le(output, data_chunk_size)) goto cleanup; /* Actual data size */
+
+     /* Write sample data explicitly as Little Endian (plus padding byte if odd) */
+     if (!reserve_output_buffer(output, padded_data_chunk_size)) goto cleanup;
+     sample_bytes = output->data + output->size;
+     if (ima) {
+         encode_ima_blocks(sample_bytes, pcm_buffer->samples, pcm_buffer->count);
+     } else if (g711) {
+         compand_g711(sample_bytes, pcm_buffer->samples, pcm_buffer->count, format == OUTPUT_FORMAT_ALAW_WAV);
+     } else {
+         store_s16le(sample_bytes, pcm_buffer->samples, pcm_buffer->count);
+     }
+     if (data_needs_padding)
+         sample_bytes[data_chunk_size] = 0;
+     output->size += padded_data_chunk_size;
+
+     /* If we reached here, encoding was successful */
+     success = true;
+
+ cleanup:
+     if (!success)
+         fprintf(stderr, "ERROR: Failed to encode WAV data for '%s'.\n", track_title);
+     return success;
+ }
+
+ /* --- FLAC Encoding --- */
+
+ /**
+  * put_bits() - Writes the low @count bits of @value.
+  * @writer: Pointer to the BitWriter.
+  * @value:  Bits to write (MSB first).
+  * @count:  Number of bits (0-32).
+  */
+ void
+ put_bits(BitWriter *writer, uint32_t value, unsigned count)
+ {
+     if (count == 0)
+         return;
+     writer->accumulator = (writer->accumulator << count) | (value & (0xFFFFFFFFu >> (32 - count)));
+     writer->bit_count += count;
+     while (writer->bit_count >= 8) {
+         writer->bit_count -= 8;
+         writer->output->data[writer->output->size++] = (uint8_t)(writer->accumulator >> writer->bit_count);
+     }
+ }
+
+ /**
+  * put_rice() - Writes one Rice-coded residual.
+  * @writer:    Pointer to the BitWriter.
+  * @residual:  Signed residual.
+  * @parameter: Rice parameter.
+  */
+ void
+ put_rice(BitWriter *writer, int32_t residual, unsigned parameter)
+ {
+     uint32_t folded = ((uint32_t)residual << 1) ^ (uint32_t)-(int32_t)((uint32_t)residual >> 31); /* Zigzag */
+     uint32_t quotient = folded >> parameter;
+
+     while (quotient >= 32) {
+         put_bits(writer, 0, 32);
+         quotient -= 32;
+     }
+     put_bits(writer, 1, quotient + 1); /* Unary quotient, terminated by a 1 */
+     put_bits(writer, folded, parameter);
+ }
+
+ /**
+  * flush_bits() - Pads the last partial byte with zero bits.
+  * @writer: Pointer to the BitWriter.
+  */
+ void
+ flush_bits(BitWriter *writer)
+ {
+     if (writer->bit_count > 0)
+         put_bits(writer, 0, 8 - writer->bit_count);
+ }
+
+ /**
+  * flac_crc8() - CRC-8 (polynomial 0x07) of a frame header.
+  * @data:   Bytes to check.
+  * @length: Number of bytes.
+  *
+  * Return: The CRC.
+  */
+ uint8_t
+ flac_crc8(const uint8_t *data, size_t length)
+ {
+     uint8_t crc = 0;
+     size_t i;
+     int bit;
+
+     for (i = 0; i < length; ++i) {
+         crc ^= data[i];
+         for (bit = 0; bit < 8; ++bit)
+             crc = (uint8_t)((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+     }
+     return crc;
+ }
+
+ /**
+  * flac_crc16() - CRC-16 (polynomial 0x8005) of a complete frame.
+  * @data:   Bytes to check.
+  * @length: Number of bytes.
+  *
+  * Return: The CRC.
+  */
+ uint16_t
+ flac_crc16(const uint8_t *data, size_t length)
+ {
+     uint16_t crc = 0;
+     size_t i;
+     int bit;
+
+     for (i = 0; i < length; ++i) {
+         crc ^= (uint16_t)(data[i] << 8);
+         for (bit = 0; bit < 8; ++bit)
+             crc = (uint16_t)((crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1);
+     }
+     return crc;
+ }
+
+ /**
+  * choose_rice_partitions() - Finds the cheapest Rice partitioning of a residual.
+  * @residual:  Residual samples (after the warm-up samples).
+  * @count:     Block size, including the @order warm-up samples.
+  * @order:     Predictor order.
+  * @sums:      Scratch space for (1 << FLAC_MAX_PARTITION_ORDER) partition sums.
+  * @partition_order: Receives the best partition order.
+  *
+  * Partition sizes follow the FLAC rules: the block size must be divisible by
+  * the partition count and the first partition must hold more samples than
+  * the warm-up. Costs use the usual estimate n * (k + 1) + (sum >> k).
+  *
+  * Return: Estimated size of the residual section in bits.
+  */
+ uint64_t
+ choose_rice_partitions(const int32_t *residual, uint32_t count, int order,
+             uint64_t *sums, int *partition_order)
+ {
+     int max_order = 0;
+     int porder;
+     uint64_t best_bits = UINT64_MAX;
+     uint32_t partitions, p, i, start;
+
+     while (max_order < FLAC_MAX_PARTITION_ORDER && (count % (2u << max_order)) == 0 &&
+            (count >> (max_order + 1)) > (uint32_t)order)
+         max_order++;
+
+     /* Sums for the finest partitioning; coarser ones are merged below */
+     partitions = 1u << max_order;
+     for (p = 0, start = 0; p < partitions; ++p) {
+         uint32_t end = (count >> max_order) * (p + 1);
+         uint64_t sum = 0;
+         for (i = (p == 0) ? (uint32_t)order : start; i < end; ++i) {
+             int32_t r = residual[i - order];
+             sum += (uint32_t)(r < 0 ? -(int64_t)r * 2 - 1 : (int64_t)r * 2);
+         }
+         sums[p] = sum;
+         start = end;
+     }
+
+     for (porder = max_order; porder >= 0; --porder) {
+         uint64_t bits = 6; /* Coding method + partition order */
+         partitions = 1u << porder;
+         for (p = 0; p < partitions; ++p) {
+             uint32_t n = (count >> porder) - ((p == 0) ? (uint32_t)order : 0);
+             unsigned parameter = 0;
+             uint64_t cost, best_cost;
+             while (parameter < FLAC_MAX_RICE_PARAMETER && ((uint64_t)n << (parameter + 1)) <= sums[p])
+                 parameter++;
+             best_cost = (uint64_t)n * (parameter + 1) + (sums[p] >> parameter);
+             if (parameter > 0) {
+                 cost = (uint64_t)n * parameter + (sums[p] >> (parameter - 1));
+                 if (cost < best_cost)
+                     best_cost = cost;
+             }
+             bits += 4 + best_cost;
+         }
+         if (bits <= best_bits) {
+             best_bits = bits;
+             *partition_order = porder;
+         }
+         for (p = 0; p < partitions / 2; ++p) /* Merge pairs for the next coarser order */
+             sums[p] = sums[2 * p] + sums[2 * p + 1];
+     }
+     return best_bits;
+ }
+
+ /**
+  * put_rice_residual() - Writes a residual with a given partition order.
+  * @writer:          Pointer to the BitWriter.
+  * @residual:        Residual samples (after the warm-up samples).
+  * @count:           Block size, including the warm-up samples.
+  * @order:           Predictor order.
+  * @partition_order: Partition order from choose_rice_partitions().
+  */
+ void
+ put_rice_residual(BitWriter *writer, const int32_t *residual, uint32_t count, int order, int partition_order)
+ {
+     uint32_t partitions = 1u << partition_order;
+     uint32_t p, i, start = 0;
+
+     put_bits(writer, 0, 2); /* Rice coding with 4-bit parameters */
+     put_bits(writer, (uint32_t)partition_order, 4);
+     for (p = 0; p < partitions; ++p) {
+         uint32_t end = (count >> partition_order) * (p + 1);
+         uint32_t first = (p == 0) ? (uint32_t)order : start;
+         uint32_t n = end - first;
+         uint64_t sum = 0;
+         unsigned parameter = 0;
+
+         for (i = first; i < end; ++i) {
+             int32_t r = residual[i - order];
+             sum += (uint32_t)(r < 0 ? -(int64_t)r * 2 - 1 : (int64_t)r * 2);
+         }
+         while (parameter < FLAC_MAX_RICE_PARAMETER && ((uint64_t)n << (parameter + 1)) <= sum)
+             parameter++;
+         if (parameter > 0 && (uint64_t)n * parameter + (sum >> (parameter - 1)) < (uint64_t)n * (parameter + 1) + (sum >> parameter))
+             parameter--;
+         put_bits(writer, parameter, 4);
+         for (i = first; i < end; ++i)
+             put_rice(writer, residual[i - order], parameter);
+         start = end;
+     }
+ }
+
+ /**
+  * compute_fixed_residual() - Applies one of the fixed FLAC predictors.
+  * @samples:  Block samples.
+  * @count:    Number of samples.
+  * @order:    Predictor order (0-4).
+  * @residual: Receives count - order residuals.
+  */
+ void
+ compute_fixed_residual(const int32_t *samples, uint32_t count, int order, int32_t *residual)
+ {
+     uint32_t i;
+
+     for (i = (uint32_t)order; i < count; ++i) {
+         const int32_t *x = samples + i;
+         int32_t r;
+         switch (order) {
+         case 0: r = x[0]; break;
+         case 1: r = x[0] - x[-1]; break;
+         case 2: r = x[0] - 2 * x[-1] + x[-2]; break;
+         case 3: r = x[0] - 3 * x[-1] + 3 * x[-2] - x[-3]; break;
+         default: r = x[0] - 4 * x[-1] + 6 * x[-2] - 4 * x[-3] + x[-4]; break;
+         }
+         residual[i - order] = r;
+     }
+ }
+
+ /**
+  * compute_lpc_coefficients() - Finds quantized LPC coefficients for a block.
+  * @samples:      Block samples.
+  * @count:        Number of samples.
+  * @sample_bits:  Bits per sample of @samples.
+  * @window:       Scratch space for @count windowed samples.
+  * @choice:       Receives order, precision, shift and coefficients.
+  *
+  * Autocorrelation of the Tukey(0.5)-windowed block, Levinson-Durbin
+  * recursion, and an order chosen from the recursion's prediction error
+  * (expected residual bits plus coefficient bits).
+  *
+  * Return: true if usable coefficients were found.
+  */
+ bool
+ compute_lpc_coefficients(const int32_t *samples, uint32_t count, int sample_bits,
+              double *window, FlacSubframeChoice *choice)
+ {
+     double autocorrelation[FLAC_MAX_LPC_ORDER + 1];
+     double lpc[FLAC_MAX_LPC_ORDER][FLAC_MAX_LPC_ORDER];
+     double error[FLAC_MAX_LPC_ORDER];
+     double current[FLAC_MAX_LPC_ORDER];
+     double err, best_bits = 0.0, cmax;
+     int max_order = FLAC_MAX_LPC_ORDER;
+     int order, best_order = 0;
+     int i, j, log2cmax;
+     uint32_t n, taper;
+     int32_t qmax;
+     double q_error;
+
+     if (count <= (uint32_t)max_order * 2)
+         return false;
+
+     /* Tukey(0.5) window: cosine tapers over the outer quarters */
+     taper = count / 4;
+     for (n = 0; n < count; ++n) {
+         double w = 1.0;
+         if (n < taper)
+             w = 0.5 - 0.5 * cos(3.14159265358979323846 * n / taper);
+         else if (n >= count - taper)
+             w = 0.5 - 0.5 * cos(3.14159265358979323846 * (count - 1 - n) / taper);
+         window[n] = samples[n] * w;
+     }
+     for (j = 0; j <= max_order; ++j) {
+         double sum = 0.0;
+         for (n = (uint32_t)j; n < count; ++n)
+             sum += window[n] * window[n - j];
+         autocorrelation[j] = sum;
+     }
+     if (autocorrelation[0] <= 0.0)
+         return false;
+
+     /* Levinson-Durbin recursion */
+     err = autocorrelation[0];
+     for (i = 0; i < max_order; ++i) {
+         double reflection = -autocorrelation[i + 1];
+         for (j = 0; j < i; ++j)
+             reflection -= current[j] * autocorrelation[i - j];
+         reflection /= err;
+         current[i] = reflection;
+         for (j = 0; j < i / 2; ++j) {
+             double tmp = current[j];
+             current[j] += reflection * current[i - 1 - j];
+             current[i - 1 - j] += reflection * tmp;
+         }
+         if (i & 1)
+             current[j] += current[j] * reflection;
+         err *= 1.0 - reflection * reflection;
+         for (j = 0; j <= i; ++j)
+             lpc[i][j] = -current[j]; /* Predictor: x[n] ~ sum lpc[j] * x[n-1-j] */
+         error[i] = err;
+         if (err <= 0.0) {
+             max_order = i + 1;
+             break;
+         }
+     }
+
+     for (order = 1; order <= max_order; ++order) {
+         double residual_error = error[order - 1] / count;
+         double bits_per_sample = (residual_error > 0.0) ? 0.5 * log(residual_error) / log(2.0) : 0.0;
+         double bits;
+         if (bits_per_sample < 0.0)
+             bits_per_sample = 0.0;
+         bits = bits_per_sample * (count - order) + (double)order * (FLAC_LPC_PRECISION + sample_bits);
+         if (best_order == 0 || bits < best_bits) {
+             best_bits = bits;
+             best_order = order;
+         }
+     }
+
+     /* Quantize with error feedback */
+     cmax = 0.0;
+     for (j = 0; j < best_order; ++j)
+         if (fabs(lpc[best_order - 1][j]) > cmax)
+             cmax = fabs(lpc[best_order - 1][j]);
+     if (cmax <= 0.0)
+         return false;
+     frexp(cmax, &log2cmax);
+     log2cmax--;
+     choice->shift = FLAC_LPC_PRECISION - log2cmax - 1;
+     if (choice->shift > 15)
+         choice->shift = 15;
+     if (choice->shift < 0)
+         return false; /* Negative shifts are not allowed */
+     qmax = (1 << (FLAC_LPC_PRECISION - 1)) - 1;
+     q_error = 0.0;
+     for (j = 0; j < best_order; ++j) {
+         double scaled;
+         long q;
+         q_error += lpc[best_order - 1][j] * (double)(1 << choice->shift);
+         scaled = q_error < 0.0 ? q_error - 0.5 : q_error + 0.5;
+         q = (long)scaled;
+         if (q > qmax)
+             q = qmax;
+         else if (q < -qmax - 1)
+             q = -qmax - 1;
+         q_error -= (double)q;
+         choice->coefficients[j] = (int32_t)q;
+     }
+     choice->order = best_order;
+     choice->precision = FLAC_LPC_PRECISION;
+     return true;
+ }
+
+ /**
+  * compute_lpc_residual() - Applies quantized LPC coefficients.
+  * @samples:  Block samples.
+  * @count:    Number of samples.
+  * @choice:   Coefficients from compute_lpc_coefficients().
+  * @residual: Receives count - order residuals.
+  *
+  * Return: true if every residual fits the 32-bit range FLAC requires.
+  */
+ bool
+ compute_lpc_residual(const int32_t *samples, uint32_t count, const FlacSubframeChoice *choice, int32_t *residual)
+ {
+     uint32_t i;
+     int j;
+
+     for (i = (uint32_t)choice->order; i < count; ++i) {
+         int64_t prediction = 0;
+         int64_t r;
+         for (j = 0; j < choice->order; ++j)
+             prediction += (int64_t)choice->coefficients[j] * samples[i - 1 - j];
+         r = (int64_t)samples[i] - (prediction >> choice->shift);
+         if (r > INT32_MAX || r < INT32_MIN)
+             return false;
+         residual[i - choice->order] = (int32_t)r;
+     }
+     return true;
+ }
+
+ /**
+  * encode_flac_subframe() - Encodes the single (mono) subframe of a frame.
+  * @writer:  Pointer to the BitWriter.
+  * @pcm:     Block samples.
+  * @count:   Number of samples.
+  * @scratch: Scratch buffers.
+  *
+  * Tries CONSTANT (silence), then FIXED orders 0-4 and LPC on the samples
+  * with their common zero low bits ("wasted bits", the decoder's << 7
+  * scaling) removed, and writes whichever is smallest, falling back to
+  * VERBATIM.
+  */
+ void
+ encode_flac_subframe(BitWriter *writer, const int16_t *pcm, uint32_t count, FlacScratch *scratch)
+ {
+     FlacSubframeChoice best, lpc;
+     uint32_t i;
+     uint32_t or_bits = 0;
+     bool constant = true;
+     int wasted = 0;
+     int sample_bits;
+     int order;
+
+     for (i = 0; i < count; ++i) {
+         or_bits |= (uint32_t)(int32_t)pcm[i];
+         if (pcm[i] != pcm[0])
+             constant = false;
+     }
+     if (constant) {
+         put_bits(writer, 0x00, 8); /* Zero pad, CONSTANT, no wasted bits */
+         put_bits(writer, (uint16_t)pcm[0], ADPCM_BITS);
+         return;
+     }
+     while (((or_bits >> wasted) & 1) == 0)
+         wasted++;
+     sample_bits = ADPCM_BITS - wasted;
+     for (i = 0; i < count; ++i)
+         scratch->samples[i] = (int32_t)pcm[i] >> wasted;
+
+     /* VERBATIM is the baseline */
+     memset(&best, 0, sizeof(best));
+     best.type = FLAC_SUBFRAME_VERBATIM;
+     best.bits = (uint64_t)count * sample_bits;
+
+     for (order = 0; order <= 4 && (uint32_t)order < count; ++order) {
+         int partition_order;
+         uint64_t bits;
+         compute_fixed_residual(scratch->samples, count, order, scratch->residual);
+         bits = (uint64_t)order * sample_bits +
+                choose_rice_partitions(scratch->residual, count, order, scratch->sums, &partition_order);
+         if (bits < best.bits) {
+             best.type = FLAC_SUBFRAME_FIXED;
+             best.order = order;
+             best.partition_order = partition_order;
+             best.bits = bits;
+             memcpy(scratch->best_residual, scratch->residual, (count - order) * sizeof(int32_t));
+         }
+     }
+
+     memset(&lpc, 0, sizeof(lpc));
+     if (compute_lpc_coefficients(scratch->samples, count, sample_bits, scratch->window, &lpc) &&
+         compute_lpc_residual(scratch->samples, count, &lpc, scratch->residual)) {
+         int partition_order;
+         uint64_t bits = (uint64_t)lpc.order * (sample_bits + lpc.precision) + 4 + 5 +
+                 choose_rice_partitions(scratch->residual, count, lpc.order, scratch->sums, &partition_order);
+         if (bits < best.bits) {
+             lpc.type = FLAC_SUBFRAME_LPC;
+             lpc.partition_order = partition_order;
+             lpc.bits = bits;
+             best = lpc;
+             memcpy(scratch->best_residual, scratch->residual, (count - lpc.order) * sizeof(int32_t));
+         }
+     }
+
+     /* Subframe header: zero pad, type, wasted-bits flag + unary count */
+     switch (best.type) {
+     case FLAC_SUBFRAME_FIXED: put_bits(writer, 0x08 | (uint32_t)best.order, 7); break;
+     case FLAC_SUBFRAME_LPC:   put_bits(writer, 0x20 | (uint32_t)(best.order - 1), 7); break;
+     default:                  put_bits(writer, 0x01, 7); break;
+     }
+     if (wasted > 0) {
+         put_bits(writer, 1, 1);
+         put_bits(writer, 1, (unsigned)wasted); /* wasted - 1 zeros, then 1 */
+     } else {
+         put_bits(writer, 0, 1);
+     }
+
+     if (best.type == FLAC_SUBFRAME_VERBATIM) {
+         for (i = 0; i < count; ++i)
+             put_bits(writer, (uint32_t)scratch->samples[i], (unsigned)sample_bits);
+         return;
+     }
+     for (i = 0; i < (uint32_t)best.order; ++i) /* Warm-up samples */
+         put_bits(writer, (uint32_t)scratch->samples[i], (unsigned)sample_bits);
+     if (best.type == FLAC_SUBFRAME_LPC) {
+         put_bits(writer, (uint32_t)(best.precision - 1), 4);
+         put_bits(writer, (uint32_t)best.shift, 5);
+         for (i = 0; i < (uint32_t)best.order; ++i)
+             put_bits(writer, (uint32_t)best.coefficients[i], (unsigned)best.precision);
+     }
+     put_rice_residual(writer, scratch->best_residual, count, best.order, best.partition_order);
+ }
+
+ /**
+  * append_vorbis_comment() - Appends one "NAME=value" Vorbis comment.
+  * @buffer: Pointer to the OutputBuffer.
+  * @name:   Field name.
+  * @value:  Field value.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_vorbis_comment(OutputBuffer *buffer, const char *name, const char *value)
+ {
+     size_t name_len = strlen(name);
+     size_t value_len = strlen(value);
+
+     return append_u32le(buffer, (uint32_t)(name_len + 1 + value_len)) &&
+            append_bytes(buffer, name, name_len) &&
+            append_bytes(buffer, "=", 1) &&
+            append_bytes(buffer, value, value_len);
+ }
+
+ /**
+  * get_flac_sample_rate_code() - Returns the frame header code for a sample rate.
+  * @sample_rate: Sample rate in Hz.
+  *
+  * Return: The 4-bit code (0 = "see STREAMINFO" for uncommon rates).
+  */
+ uint32_t
+ get_flac_sample_rate_code(uint32_t sample_rate)
+ {
+     switch (sample_rate) {
+     case 8000:  return 4;
+     case 16000: return 5;
+     case 22050: return 6;
+     case 24000: return 7;
+     case 32000: return 8;
+     case 44100: return 9;
+     case 48000: return 10;
+     default:    return 0;
+     }
+ }
+
+ /**
+  * encode_flac_file() - Serializes decoded PCM data into a FLAC image with metadata.
+  * @output:             OutputBuffer that receives the complete file image.
+  * @pcm_buffer:         Pointer to the PcmBuffer containing the samples.
+  * @sample_rate:        Sample rate (e.g., 8000).
+  * @rom_basename:       Base filename of the input ROM (ARTIST comment).
+  * @track_title:        Title for the track (TITLE comment).
+  * @track_number_str:   String representation of the absolute track number.
+  * @comment:            Comment string (COMMENT field, can be NULL).
+  *
+  * Writes STREAMINFO, a VORBIS_COMMENT block carrying the same tags as the
+  * WAV INFO chunk, and fixed-size frames of FLAC_BLOCK_SIZE samples. The
+  * STREAMINFO MD5 is left zero ("not computed").
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ encode_flac_file(OutputBuffer *output, const PcmBuffer *pcm_buffer,
+             uint32_t sample_rate, const char *rom_basename,
+             const char *track_title, const char *track_number_str,
+             const char *comment)
+ {
+     bool success = false; /* Assume failure */
+     char date_str[11]; /* YYYY-MM-DD */
+     char vendor[64];
+     uint8_t streaminfo[38];
+     size_t streaminfo_offset, comment_offset, comment_length;
+     uint32_t min_frame = 0, max_frame = 0;
+     uint64_t total = pcm_buffer->count;
+     uint64_t position;
+     uint32_t frame_number = 0;
+     uint32_t field_count = (comment && strlen(comment) > 0) ? 6 : 5;
+     FlacScratch *scratch;
+
+     if (total >= ((uint64_t)1 << 36)) {
+         fprintf(stderr, "ERROR: Too many samples for a FLAC file in message '%s'.\n", track_title);
+         return false;
+     }
+     scratch = (FlacScratch *)malloc(sizeof(FlacScratch));
+     if (!scratch) {
+         fprintf(stderr, "ERROR: Failed to allocate FLAC encoder buffers for '%s'.\n", track_title);
+         return false;
+     }
+     get_creation_date(date_str, sizeof(date_str));
+     snprintf(vendor, sizeof(vendor), "nortel-voiceware-decoder %s", GIT_TAG_NAME);
+
+     /* --- Marker and STREAMINFO (frame sizes patched in at the end) --- */
+     if (!append_bytes(output, "fLaC", 4)) goto cleanup;
+     streaminfo_offset = output->size;
+     memset(streaminfo, 0, sizeof(streaminfo));
+     streaminfo[0] = 0x00; /* Not last, type 0 */
+     streaminfo[3] = 34;   /* Block length */
+     streaminfo[4] = (FLAC_BLOCK_SIZE >> 8) & 0xFF;
+     streaminfo[5] = FLAC_BLOCK_SIZE & 0xFF;
+     streaminfo[6] = (FLAC_BLOCK_SIZE >> 8) & 0xFF;
+     streaminfo[7] = FLAC_BLOCK_SIZE & 0xFF;
+     streaminfo[14] = (uint8_t)(sample_rate >> 12);
+     streaminfo[15] = (uint8_t)(sample_rate >> 4);
+     streaminfo[16] = (uint8_t)(((sample_rate & 0x0F) << 4) | ((ADPCM_CHANNELS - 1) << 1) | ((ADPCM_BITS - 1) >> 4));
+     streaminfo[17] = (uint8_t)((((ADPCM_BITS - 1) & 0x0F) << 4) | (uint8_t)(total >> 32));
+     streaminfo[18] = (uint8_t)(total >> 24);
+     streaminfo[19] = (uint8_t)(total >> 16);
+     streaminfo[20] = (uint8_t)(total >> 8);
+     streaminfo[21] = (uint8_t)total;
+     /* streaminfo[22..37]: MD5, zero */
+     if (!append_bytes(output, streaminfo, sizeof(streaminfo))) goto cleanup;
+
+     /* --- VORBIS_COMMENT (last metadata block) --- */
+     comment_offset = output->size;
+     if (!append_bytes(output, "\x84\0\0\0", 4)) goto cleanup; /* Length patched below */
+     if (!append_u32le(output, (uint32_t)strlen(vendor))) goto cleanup;
+     if (!append_bytes(output, vendor, strlen(vendor))) goto cleanup;
+     if (!append_u32le(output, field_count)) goto cleanup;
+     if (!append_vorbis_comment(output, "ALBUM", "Nortel Millennium VoiceWare")) goto cleanup;
+     if (!append_vorbis_comment(output, "ARTIST", rom_basename)) goto cleanup;
+     if (!append_vorbis_comment(output, "TITLE", track_title)) goto cleanup;
+     if (!append_vorbis_comment(output, "TRACKNUMBER", track_number_str)) goto cleanup;
+     if (!append_vorbis_comment(output, "DATE", date_str)) goto cleanup;
+     if (field_count == 6 && !append_vorbis_comment(output, "COMMENT", comment)) goto cleanup;
+     comment_length = output->size - comment_offset - 4;
+     output->data[comment_offset + 1] = (uint8_t)(comment_length >> 16);
+     output->data[comment_offset + 2] = (uint8_t)(comment_length >> 8);
+     output->data[comment_offset + 3] = (uint8_t)comment_length;
+
+     /* --- Frames --- */
+     for (position = 0; position < total; position += FLAC_BLOCK_SIZE, frame_number++) {
+         uint32_t count = (total - position < FLAC_BLOCK_SIZE) ? (uint32_t)(total - position) : FLAC_BLOCK_SIZE;
+         size_t frame_start = output->size;
+         BitWriter writer;
+         uint16_t crc16;
+         uint32_t frame_size;
+
+         /* Worst case is a VERBATIM subframe plus headers */
+         if (!reserve_output_buffer(output, (size_t)count * 4 + 64)) goto cleanup;
+         writer.output = output;
+         writer.accumulator = 0;
+         writer.bit_count = 0;
+
+         /* Frame header */
+         put_bits(&writer, 0xFFF8, 16); /* Sync code, fixed block size */
+         put_bits(&writer, (count == FLAC_BLOCK_SIZE) ? FLAC_BLOCK_SIZE_CODE : 7, 4); /* 7: 16-bit size at end */
+         put_bits(&writer, get_flac_sample_rate_code(sample_rate), 4);
+         put_bits(&writer, ADPCM_CHANNELS - 1, 4); /* Independent channels */
+         put_bits(&writer, 4, 3); /* 16 bits per sample */
+         put_bits(&writer, 0, 1);
+         /* Frame number, UTF-8 style */
+         if (frame_number < 0x80) {
+             put_bits(&writer, frame_number, 8);
+         } else {
+             int extra = (frame_number < 0x800) ? 1 : (frame_number < 0x10000) ? 2 :
+                     (frame_number < 0x200000) ? 3 : (frame_number < 0x4000000) ? 4 : 5;
+             int k;
+             put_bits(&writer, ((0xFF00u >> (extra + 1)) & 0xFF) | (frame_number >> (6 * extra)), 8);
+             for (k = extra - 1; k >= 0; --k)
+                 put_bits(&writer, 0x80 | ((frame_number >> (6 * k)) & 0x3F), 8);
+         }
+         if (count != FLAC_BLOCK_SIZE)
+             put_bits(&writer, count - 1, 16);
+         put_bits(&writer, flac_crc8(output->data + frame_start, output->size - frame_start), 8);
+
+         encode_flac_subframe(&writer, pcm_buffer->samples + position, count, scratch);
+         flush_bits(&writer);
+         crc16 = flac_crc16(output->data + frame_start, output->size - frame_start);
+         put_bits(&writer, crc16, 16);
+
+         frame_size = (uint32_t)(output->size - frame_start);
+         if (min_frame == 0 || frame_size < min_frame)
+             min_frame = frame_size;
+         if (frame_size > max_frame)
+             max_frame = frame_size;
+     }
+
+     /* Patch the frame size range into STREAMINFO */
+     output->data[streaminfo_offset + 8] = (uint8_t)(min_frame >> 16);
+     output->data[streaminfo_offset + 9] = (uint8_t)(min_frame >> 8);
+     output->data[streaminfo_offset + 10] = (uint8_t)min_frame;
+     output->data[streaminfo_offset + 11] = (uint8_t)(max_frame >> 16);
+     output->data[streaminfo_offset + 12] = (uint8_t)(max_frame >> 8);
+     output->data[streaminfo_offset + 13] = (uint8_t)max_frame;
+
+     success = true;
+
+ cleanup:
+     free(scratch);
+     if (!success)
+         fprintf(stderr, "ERROR: Failed to encode FLAC data for '%s'.\n", track_title);
+     return success;
+ }
+
+
+ /* --- Stdout Streaming --- */
+
+ OutputFormat stdout_stream_format = OUTPUT_FORMAT_WAV; /* Sample encoding of the -o - stream */
+ uint64_t stdout_stream_bytes = 0; /* Sample bytes written to stdout so far */
+
+ /**
+  * stdout_stream_start() - Prepares stdout for streaming decoded audio (-o -).
+  * @format:      OUTPUT_FORMAT_WAV, OUTPUT_FORMAT_S16LE, OUTPUT_FORMAT_ULAW_RAW
+  *               or OUTPUT_FORMAT_ALAW_RAW.
+  * @sample_rate: Sample rate of the stream.
+  *
+  * stdout gets a STDOUT_BUFFER_SIZE buffer, so the samples of many short
+  * messages leave in a few large write() calls. A WAV stream starts with a
+  * 16-bit PCM header whose RIFF and data sizes are 0xFFFFFFFF (unknown
+  * length, read until end of stream), which sox and ffmpeg accept from a
+  * pipe. The selected messages follow back to back in ROM order.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ stdout_stream_start(OutputFormat format, uint32_t sample_rate)
+ {
+     OutputBuffer header;
+     bool success;
+
+ #ifdef _WIN32
+     _setmode(_fileno(stdout), _O_BINARY);
+ #endif
+     setvbuf(stdout, NULL, _IOFBF, STDOUT_BUFFER_SIZE);
+     stdout_stream_format = format;
+     stdout_stream_bytes = 0;
+     if (format != OUTPUT_FORMAT_WAV)
+         return true;
+
+     init_output_buffer(&header);
+     success = append_chunk_id(&header, "RIFF") && append_u32le(&header, UINT32_MAX) &&
+           append_chunk_id(&header, "WAVE") &&
+           append_chunk_id(&header, "fmt ") && append_u32le(&header, 16) &&
+           append_u16le(&header, 1) && append_u16le(&header, ADPCM_CHANNELS) &&
+           append_u32le(&header, sample_rate) &&
+           append_u32le(&header, sample_rate * ADPCM_CHANNELS * (ADPCM_BITS / 8)) &&
+           append_u16le(&header, ADPCM_CHANNELS * (ADPCM_BITS / 8)) &&
+           append_u16le(&header, ADPCM_BITS) &&
+           append_chunk_id(&header, "data") && append_u32le(&header, UINT32_MAX) &&
+           fwrite(header.data, 1, header.size, stdout) == header.size;
+     free_output_buffer(&header);
+     if (!success)
+         fprintf(stderr, "ERROR: Failed to write WAV stream header to stdout.\n");
+     return success;
+ }
+
+ /**
+  * stdout_stream_write() - Appends the samples of one message to the stdout stream.
+  * @message: DecodedMessage holding the samples (after resampling).
+  *
+  * Messages must arrive in output order, i.e. from a single thread.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ stdout_stream_write(const DecodedMessage *message)
+ {
+     RunStats stats;
+     OutputBuffer data;
+     uint64_t phase_start = stats_timer_start();
+     bool success;
+
+     init_output_buffer(&data);
+     if (stdout_stream_format == OUTPUT_FORMAT_ULAW_RAW || stdout_stream_format == OUTPUT_FORMAT_ALAW_RAW)
+         success = encode_g711_raw(&data, &message->pcm, stdout_stream_format == OUTPUT_FORMAT_ALAW_RAW);
+     else
+         success = encode_s16le_raw(&data, &message->pcm);
+     if (!success) {
+         fprintf(stderr, "ERROR: Failed to encode samples of '%s' for stdout.\n", message->output_base);
+     } else if (fwrite(data.data, 1, data.size, stdout) != data.size) {
+         fprintf(stderr, "ERROR: Failed to write samples of '%s' to stdout.\n", message->output_base);
+         success = false;
+     } else {
+         stdout_stream_bytes += data.size;
+         status_printf("Streamed to stdout: %s (%zu samples)\n", message->output_base, message->pcm.count);
+     }
+
+     trace_span("write", phase_start, message->segment_index, message->message_index, message->absolute_index);
+     memset(&stats, 0, sizeof(stats));
+     stats_timer_stop(&stats, STATS_PHASE_WRITE, phase_start);
+     stats.bytes_out = success ? data.size : 0;
+     stats_merge(&stats);
+     free_output_buffer(&data);
+     return success;
+ }
+
+ /**
+  * stdout_stream_finish() - Flushes the stdout stream.
+  *
+  * If stdout is a regular file, the WAV header sizes are patched to the
+  * real length so that the result is an ordinary WAV file.
+  *
+  * Return: true if every byte reached stdout, false otherwise.
+  */
+ bool
+ stdout_stream_finish(void)
+ {
+     bool success = (fflush(stdout) == 0);
+
+     if (success && stdout_stream_format == OUTPUT_FORMAT_WAV &&
+         stdout_stream_bytes <= UINT32_MAX - 36 && fseek(stdout, 4, SEEK_SET) == 0) {
+         OutputBuffer sizes;
+
+         init_output_buffer(&sizes);
+         success = append_u32le(&sizes, (uint32_t)stdout_stream_bytes + 36) &&
+               fwrite(sizes.data, 1, 4, stdout) == 4 && fseek(stdout, 40, SEEK_SET) == 0 &&
+               append_u32le(&sizes, (uint32_t)stdout_stream_bytes) &&
+               fwrite(sizes.data + 4, 1, 4, stdout) == 4 && fseek(stdout, 0, SEEK_END) == 0 &&
+               fflush(stdout) == 0;
+         free_output_buffer(&sizes);
+     }
+     if (!success || ferror(stdout)) {
+         fprintf(stderr, "ERROR: Failed to write the audio stream to stdout.\n");
+         return false;
+     }
+     return true;
+ }
+
+
+ /* --- Raw PCM Extraction --- */
+
+ /**
+  * extract_raw_pcm() - Copies a raw PCM message into an output buffer for saving as a .pcm file (--raw-pcm).
+  * @contents:             OutputBuffer that receives the message bytes.
+  * @output_base:          Base filename (for error messages).
+  * @rom_data:             Pointer to the start of the ROM data buffer.
+  * @message_start_offset: Offset of the message's mode byte.
+  * @message_end_offset:   Offset of the byte *after* the last byte of message.
+  *
+  * The data is copied, so the ROM buffer may be released before the output
+  * writer gets to the file.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ extract_raw_pcm(OutputBuffer *contents, const char *output_base, const uint8_t *rom_data,
+         size_t message_start_offset, size_t message_end_offset)
+ {
+     if (message_end_offset <= message_start_offset) {
+          fprintf(stderr, "ERROR: Invalid offsets for saving raw PCM for '%s'.\n", output_base);
+          return false;
+     }
+     return append_bytes(contents, rom_data + message_start_offset, message_end_offset - message_start_offset);
+ }
+
+
+ /* --- List Output --- */
+
+ ListFormat list_format = LIST_FORMAT_MAP; /* Record format of the listing (--list-format) */
+ OutputBuffer list_output; /* Listing of the current ROM, written by flush_list_output() */
+ bool list_header_written = false; /* CSV/TSV column row already emitted */
+
+ /**
+  * append_text() - Appends a NUL-terminated string to an OutputBuffer.
+  * @buffer: Pointer to the OutputBuffer.
+  * @text:   String to append (without its NUL).
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_text(OutputBuffer *buffer, const char *text)
+ {
+     return append_bytes(buffer, text, strlen(text));
+ }
+
+ /**
+  * append_formatted() - Appends a short printf-formatted string to an OutputBuffer.
+  * @buffer: Pointer to the OutputBuffer.
+  * @format: Printf-style format string (result below 128 bytes).
+  * @...:    Arguments for the format string.
+  *
+  * Return: true on success, false on memory allocation failure or overflow.
+  */
+ bool
+ append_formatted(OutputBuffer *buffer, const char *format, ...)
+ {
+     char text[128];
+     va_list args;
+     int length;
+
+     va_start(args, format);
+     length = vsnprintf(text, sizeof(text), format, args);
+     va_end(args);
+     if (length < 0 || (size_t)length >= sizeof(text))
+         return false;
+     return append_bytes(buffer, text, (size_t)length);
+ }
+
+ /**
+  * append_json_string() - Appends a string as a quoted JSON string.
+  * @buffer: Pointer to the OutputBuffer.
+  * @text:   String to append, or NULL for JSON null.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_json_string(OutputBuffer *buffer, const char *text)
+ {
+     const char *run;
+
+     if (!text)
+         return append_text(buffer, "null");
+     if (!append_bytes(buffer, "\"", 1))
+         return false;
+     for (run = text; *text; ++text) {
+         unsigned char c = (unsigned char)*text;
+
+         if (c >= 0x20 && c != '"' && c != '\\')
+             continue;
+         /* Copy the plain run, then the escaped character */
+         if (!append_bytes(buffer, run, (size_t)(text - run)))
+             return false;
+         if ((c == '"' || c == '\\') ? !append_formatted(buffer, "\\%c", c) : !append_formatted(buffer, "\\u%04x", c))
+             return false;
+         run = text + 1;
+     }
+     return append_bytes(buffer, run, (size_t)(text - run)) && append_bytes(buffer, "\"", 1);
+ }
+
+ /**
+  * append_delimited_field() - Appends a string field of a CSV or TSV record.
+  * @buffer: Pointer to the OutputBuffer.
+  * @text:   Field value (NULL is an empty field).
+  *
+  * CSV fields containing a comma, quote or line break are quoted with inner
+  * quotes doubled (RFC 4180). TSV cannot quote, so tabs and line breaks are
+  * replaced by spaces.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_delimited_field(OutputBuffer *buffer, const char *text)
+ {
+     size_t start;
+     char *p;
+
+     if (!text)
+         return true;
+     if (list_format == LIST_FORMAT_TSV) {
+         start = buffer->size;
+         if (!append_text(buffer, text))
+             return false;
+         for (p = (char *)buffer->data + start; p < (char *)buffer->data + buffer->size; ++p) {
+             if (*p == '\t' || *p == '\r' || *p == '\n')
+                 *p = ' ';
+         }
+         return true;
+     }
+     if (!strpbrk(text, ",\"\r\n"))
+         return append_text(buffer, text);
+     if (!append_bytes(buffer, "\"", 1))
+         return false;
+     for (; *text; ++text) {
+         if (!append_bytes(buffer, text, 1) || (*text == '"' && !append_bytes(buffer, "\"", 1)))
+             return false;
+     }
+     return append_bytes(buffer, "\"", 1);
+ }
+
+ /**
+  * hash_message_bytes() - Computes the 64-bit FNV-1a hash of a message.
+  * @data:   Message bytes (mode byte included).
+  * @length: Number of bytes.
+  *
+  * Return: The hash value.
+  */
+ uint64_t
+ hash_message_bytes(const uint8_t *data, size_t length)
+ {
+     uint64_t hash = 0xCBF29CE484222325ULL; /* FNV offset basis */
+     size_t i;
+
+     for (i = 0; i < length; ++i) {
+         hash ^= data[i];
+         hash *= 0x100000001B3ULL; /* FNV prime */
+     }
+     return hash;
+ }
+
+ /**
+  * measure_message() - Finds the extent and sample count of a message.
+  * @rom_data: Pointer to the start of the ROM data buffer.
+  * @rom_size: Total size of the ROM data.
+  * @start:    Offset of the message mode byte (below @rom_size).
+  * @limit:    Offset of the next message or the segment end.
+  * @last:     True if the message is the last of its segment (@limit is the segment end).
+  * @end:      Receives the offset after the last byte of the message.
+  * @samples:  Receives the number of samples the message decodes to.
+  *
+  * An ADPCM message is walked up to its end command (measure_adpcm_stream()),
+  * a PCM message is trimmed like in decode_message(), and a message of
+  * unknown mode runs to the next message.
+  *
+  * Return: The mode name: "adpcm", "pcm" or "unknown".
+  */
+ const char *
+ measure_message(const uint8_t *rom_data, size_t rom_size, size_t start, size_t limit, bool last,
+                 size_t *end, size_t *samples)
+ {
+     if (limit > rom_size)
+         limit = rom_size;
+     if (limit <= start)
+         limit = start + 1;
+     *samples = 0;
+     if (rom_data[start] == MODE_ADPCM) {
+         *samples = measure_adpcm_stream(rom_data, rom_size, start + 1, end);
+         return "adpcm";
+     }
+     if (rom_data[start] == MODE_PCM) {
+         *samples = find_pcm_extent(rom_data + start + 1, limit - start - 1, last);
+         *end = start + 1 + *samples;
+         return "pcm";
+     }
+     *end = limit;
+     return "unknown";
+ }
+
+ /**
+  * list_rom_header() - Starts the listing of a ROM.
+  * @rom_basename: Base filename of the input ROM file.
+  *
+  * Mapping file format gets a '# ROM: <basename>' comment per ROM (not in
+  * quiet mode, unless automapping); CSV and TSV get one column row per run; JSON Lines needs none.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ list_rom_header(const char *rom_basename)
+ {
+     if (active_automap) /* Name suffixes count per ROM */
+         memset(active_automap->uses, 0, active_automap->count * sizeof(unsigned));
+     if (list_format == LIST_FORMAT_MAP) {
+         return (quiet_mode && !active_automap) ||
+                (append_text(&list_output, "# ROM: ") && append_text(&list_output, rom_basename) &&
+                 append_text(&list_output, "\n\n"));
+     }
+     if (list_format == LIST_FORMAT_JSONL || list_header_written)
+         return true;
+     list_header_written = true;
+     return append_text(&list_output, (list_format == LIST_FORMAT_CSV) ?
+                        "rom,segment,index,absolute_index,offset,length,mode,samples,hash,name,comment\n" :
+                        "rom\tsegment\tindex\tabsolute_index\toffset\tlength\tmode\tsamples\thash\tname\tcomment\n");
+ }
+
+ /**
+  * append_map_line() - Appends a listing line in mapping file format.
+  * @segment_index_0_based: 0-based segment index.
+  * @msg_idx_in_seg:        0-based message index within the segment.
+  * @output_base:           Mapped or default output filename base.
+  * @user_comment:          Mapped comment (or NULL).
+  * @is_pcm:                true for a PCM message, tagged '(PCM)' unless the comment says so.
+  *
+  * The comment is padded with tabs to column LIST_FILENAME_ALIGN_WIDTH
+  * (assuming TAB_WIDTH-column tabs), with at least one tab.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_map_line(int segment_index_0_based, uint32_t msg_idx_in_seg, const char *output_base,
+                 const char *user_comment, bool is_pcm)
+ {
+     bool has_user_comment = user_comment && user_comment[0] != '\0';
+     bool pcm_tag = is_pcm && !(user_comment && strstr(user_comment, "(PCM)"));
+     int num_stops = (int)(strlen(output_base) / TAB_WIDTH);
+     int target_stops = (LIST_FILENAME_ALIGN_WIDTH + TAB_WIDTH - 1) / TAB_WIDTH;
+     int tabs_to_print = (num_stops < target_stops) ? (target_stops - num_stops) : 1;
+
+     if (!append_formatted(&list_output, "%d\t%u\t", segment_index_0_based, msg_idx_in_seg) ||
+         !append_text(&list_output, output_base))
+         return false;
+     while (tabs_to_print-- > 0) {
+         if (!append_bytes(&list_output, "\t", 1))
+             return false;
+     }
+     if (!append_text(&list_output, pcm_tag ? "# (PCM)" : "#"))
+         return false;
+     if (has_user_comment)
+         return append_bytes(&list_output, " ", 1) && append_text(&list_output, user_comment) &&
+                append_bytes(&list_output, "\n", 1);
+     return append_text(&list_output, pcm_tag ? "\n" : " \n");
+ }
+
+ /**
+  * get_catalog_mode_name() - Returns the listing name of a cataloged message's mode.
+  * @catalog: Pointer to the MessageCatalog.
+  * @i:       Position of the message in @catalog.
+  *
+  * Return: "invalid" (offset out of bounds), "adpcm", "pcm" or "unknown".
+  */
+ const char *
+ get_catalog_mode_name(const MessageCatalog *catalog, size_t i)
+ {
+     if (catalog->start[i] >= catalog->rom_size)
+         return "invalid";
+     if (catalog->mode[i] == MODE_ADPCM)
+         return "adpcm";
+     return (catalog->mode[i] == MODE_PCM) ? "pcm" : "unknown";
+ }
+
+ /**
+  * list_message() - Appends the listing record of one message to list_output.
+  * @catalog:      Pointer to the MessageCatalog holding the message.
+  * @i:            Position of the message in @catalog.
+  * @mapping:      Mapping entry (or NULL).
+  * @rom_basename: Base filename of the input ROM file.
+  *
+  * The record formats carry the message extent, sample count and 64-bit
+  * FNV-1a hash from the catalog.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ list_message(const MessageCatalog *catalog, size_t i, const MessageMapping *mapping, const char *rom_basename)
+ {
+     int segment_index_0_based = (int)catalog->segment[i];
+     uint32_t msg_idx_in_seg = catalog->index[i];
+     int absolute_msg_idx = (int)catalog->absolute[i];
+     uint32_t message_offset_in_segment = (uint32_t)(catalog->start[i] - catalog->segment_start[i]);
+     size_t length = catalog->end[i] - catalog->start[i];
+     const char *mode_name = get_catalog_mode_name(catalog, i);
+     char default_filename_base[25];
+     const char *output_base = default_filename_base;
+     const char *comment = mapping ? mapping->comment : NULL;
+     unsigned long long hash = (unsigned long long)catalog->hash[i];
+     OutputBuffer *out = &list_output;
+     const char *sep = (list_format == LIST_FORMAT_CSV) ? "," : "\t";
+
+     if (mapping) {
+         output_base = mapping->output_filename_base;
+     } else {
+         snprintf(default_filename_base, sizeof(default_filename_base), "message_%d_%03d",
+              segment_index_0_based, msg_idx_in_seg);
+     }
+
+     if (catalog->start[i] >= catalog->rom_size)
+         fprintf(stderr, "WARN: Cannot read mode byte for list entry (Seg %d, Idx %u) - offset out of bounds.\n",
+             segment_index_0_based, msg_idx_in_seg);
+     if (list_format == LIST_FORMAT_MAP)
+         return append_map_line(segment_index_0_based, msg_idx_in_seg, output_base, comment,
+                                catalog->start[i] < catalog->rom_size && catalog->mode[i] == MODE_PCM);
+
+     if (list_format == LIST_FORMAT_JSONL) {
+         return append_text(out, "{\"rom\":") && append_json_string(out, rom_basename) &&
+                append_formatted(out, ",\"segment\":%d,\"index\":%u,\"absolute_index\":%d,\"offset\":%u,\"length\":%zu,",
+                                 segment_index_0_based, msg_idx_in_seg, absolute_msg_idx,
+                                 message_offset_in_segment, length) &&
+                append_formatted(out, "\"mode\":\"%s\",\"samples\":%zu,\"hash\":\"%016llx\",\"name\":",
+                                 mode_name, catalog->samples[i], hash) &&
+                append_json_string(out, output_base) && append_text(out, ",\"comment\":") &&
+                append_json_string(out, comment) && append_text(out, "}\n");
+     }
+     return append_delimited_field(out, rom_basename) &&
+            append_formatted(out, "%s%d%s%u%s%d%s%u%s%zu%s%s%s%zu%s%016llx%s", sep, segment_index_0_based,
+                             sep, msg_idx_in_seg, sep, absolute_msg_idx, sep, message_offset_in_segment,
+                             sep, length, sep, mode_name, sep, catalog->samples[i],
+                             sep, hash, sep) &&
+            append_delimited_field(out, output_base) && append_text(out, sep) &&
+            append_delimited_field(out, comment) && append_text(out, "\n");
+ }
+
+ /**
+  * flush_list_output() - Writes the assembled listing to stdout in one call.
+  *
+  * Return: true on success, false on write error.
+  */
+ bool
+ flush_list_output(void)
+ {
+     bool success = true;
+
+     if (list_output.size > 0) {
+         fflush(stdout); /* Status lines printed so far come first */
+         success = fwrite(list_output.data, 1, list_output.size, stdout) == list_output.size &&
+                   fflush(stdout) == 0;
+         if (!success)
+             fprintf(stderr, "ERROR: Failed to write the message listing to stdout.\n");
+     }
+     free_output_buffer(&list_output);
+     return success;
+ }
+
+
+ /* --- Message Processing --- */
+
+ OutputFormat output_format = OUTPUT_FORMAT_WAV; /* Container for decoded messages (--format) */
+
+ /**
+  * decode_message() - Decodes a single ADPCM or PCM message (or extracts raw PCM data).
+  * NOTE: This function is NOT called when list_mode is active.
+  * @rom_data:             Pointer to the start of the ROM data buffer.
+  * @rom_size:             Total size of the ROM data.
+  * @segment_start_offset: Byte offset of the current segment's start.
+  * @segment_index_0_based: 0-based index of the current segment.
+  * @msg_idx_in_segment:   0-based index of the message within the segment.
+  * @absolute_msg_idx:     0-based absolute index of the message.
+  * @message_offset_in_segment: Offset (bytes) from segment start to mode byte.
+  * @next_message_offset_in_segment: Offset (bytes) of the *next* message.
+  * @mapping:              Pointer to mapping info (or NULL if none).
+  * @arena:                Arena for the decoded samples, or NULL for a heap buffer.
+  * @message:              DecodedMessage to fill; release with free_decoded_message().
+  *                        It must not be moved while in use (@message->output_base
+  *                        may point into it).
+  *
+  * The result no longer references @rom_data, so the ROM buffer may be
+  * released before the message is encoded. With an @arena, the message is
+  * measured first and its samples are taken from the arena in one piece, so
+  * decoding makes no heap calls once the arena is large enough; the samples
+  * then live until the arena is reset.
+  *
+  * Return: true if processing should continue, false on fatal error.
+  */
+ bool
+ decode_message(const uint8_t *rom_data, size_t rom_size,
+            size_t segment_start_offset, int segment_index_0_based,
+            int msg_idx_in_segment, int absolute_msg_idx,
+            uint32_t message_offset_in_segment, uint32_t next_message_offset_in_segment,
+            const MessageMapping *mapping, Arena *arena, DecodedMessage *message)
+ {
+     size_t start_address = segment_start_offset + message_offset_in_segment;
+     uint8_t message_mode;
+     size_t current_pos;
+     RunStats stats; /* Local --stats delta, merged once at the end */
+     uint64_t phase_start;
+
+     memset(&stats, 0, sizeof(stats));
+     memset(message, 0, sizeof(*message));
+     init_pcm_buffer(&message->pcm);
+     init_output_buffer(&message->raw);
+     message->segment_index = segment_index_0_based;
+     message->message_index = msg_idx_in_segment;
+     message->absolute_index = absolute_msg_idx;
+
+     /* Basic bounds check for start address */
+     if (start_address >= rom_size) {
+         fprintf(stderr, "WARN: Calculated start address (0x%zX) for message %d (Seg %d, Idx %d) is out of bounds (ROM size 0x%zX). Skipping.\n",
+             start_address, absolute_msg_idx, segment_index_0_based, msg_idx_in_segment, rom_size);
+         return true; /* Continue processing other messages */
+     }
+
+     message_mode = rom_data[start_address];
+     current_pos = start_address + 1; /* Position for reading commands/data */
+
+     /* Generate default filename: message_S_XXX (0-based indices) */
+     snprintf(message->default_filename_base, sizeof(message->default_filename_base), "message_%d_%03d",
+          segment_index_0_based, msg_idx_in_segment);
+
+     message->output_base = message->default_filename_base;
+     if (mapping) {
+         message->output_base = mapping->output_filename_base;
+         message->comment = mapping->comment;
+     }
+
+     status_printf("Processing Message: Absolute Index %d (Segment %d, Index %d), Mode 0x%02X, Offset 0x%zX\n",
+            absolute_msg_idx, segment_index_0_based, msg_idx_in_segment, message_mode, start_address);
+
+     if (message_mode == MODE_ADPCM) {
+         PcmBuffer *pcm_buffer = &message->pcm;
+         AdpcmWalkHooks hooks;
+         bool decoding_ok;
+
+         hooks.stats = &stats;
+         hooks.message_index = absolute_msg_idx;
+         hooks.log_commands = true;
+         verbose_printf("  Type: ADPCM\n");
+         phase_start = stats_timer_start();
+         if (arena && !reserve_pcm_samples(pcm_buffer, arena, measure_adpcm_stream(rom_data, rom_size, current_pos, NULL)))
+             decoding_ok = false;
+         else
+             decoding_ok = walk_adpcm_stream(rom_data, rom_size, current_pos, &hooks, pcm_buffer, NULL, NULL);
+         stats_timer_stop(&stats, STATS_PHASE_DECODE, phase_start);
+         trace_span("decode", phase_start, segment_index_0_based, msg_idx_in_segment, absolute_msg_idx);
+         stats.messages = 1;
+         stats.samples = pcm_buffer->count;
+         stats.reallocations = pcm_buffer->reallocations;
+
+         if (decoding_ok && pcm_buffer->count > 0) {
+             message->kind = OUTPUT_FILE_WAV;
+             message->has_output = true;
+         } else if (decoding_ok && pcm_buffer->count == 0) {
+             status_printf("  Message %d resulted in 0 PCM samples. No WAV file written.\n", absolute_msg_idx);
+         } else {
+              fprintf(stderr, "ERROR: Decoding failed for message %d. No WAV file written.\n", absolute_msg_idx);
+         }
+
+     } else if (message_mode == MODE_PCM) {
+         size_t message_end_offset;
+         size_t sample_count;
+
+         /* The next message (or the segment end) bounds the search for the real end */
+         message_end_offset = segment_start_offset + next_message_offset_in_segment;
+         if (message_end_offset > rom_size) /* Clamp to ROM size */
+             message_end_offset = rom_size;
+
+         if (message_end_offset <= current_pos) {
+             fprintf(stderr, "WARN: Cannot determine valid data range for PCM message %d. Skipping.\n", absolute_msg_idx);
+         } else {
+             phase_start = stats_timer_start();
+             /* The segment header starts with the index of its last message */
+             sample_count = find_pcm_extent(rom_data + current_pos, message_end_offset - current_pos,
+                                            msg_idx_in_segment == rom_data[segment_start_offset]);
+             verbose_printf("  Type: PCM (%zu samples, %zu fill bytes trimmed)\n",
+                        sample_count, message_end_offset - current_pos - sample_count);
+
+             if (sample_count == 0) {
+                 status_printf("  Message %d resulted in 0 PCM samples. No file written.\n", absolute_msg_idx);
+             } else if (raw_pcm_mode) {
+                 if (extract_raw_pcm(&message->raw, message->output_base, rom_data, start_address, current_pos + sample_count)) {
+                     message->kind = OUTPUT_FILE_RAW_PCM;
+                     message->has_output = true;
+                 }
+                 /* Else: error already printed */
+             } else if (reserve_pcm_samples(&message->pcm, arena, sample_count)) {
+                 convert_pcm_samples(message->pcm.samples, rom_data + current_pos, sample_count);
+                 message->pcm.count = sample_count;
+                 message->kind = OUTPUT_FILE_WAV;
+                 message->has_output = true;
+                 stats.samples = sample_count;
+                 stats.reallocations = message->pcm.reallocations;
+             } else {
+                 fprintf(stderr, "ERROR: Decoding failed for message %d. No WAV file written.\n", absolute_msg_idx);
+             }
+             stats_timer_stop(&stats, STATS_PHASE_DECODE, phase_start);
+             trace_span("decode", phase_start, segment_index_0_based, msg_idx_in_segment, absolute_msg_idx);
+             stats.messages = 1;
+         }
+
+     } else {
+         fprintf(stderr, "WARN: Unknown message mode 0x%02X for message %d at offset 0x%zX. Skipping.\n",
+             message_mode, absolute_msg_idx, start_address);
+     }
+
+     stats_merge(&stats);
+     return true; /* Continue processing next message */
+ }
+
+ /**
+  * encode_message() - Encodes a decoded message and hands it to the output writer.
+  * @message:      DecodedMessage from decode_message().
+  * @rom_basename: Base filename of the input ROM file.
+  * @output_dir:   Directory for output files (NULL for current directory).
+  *
+  * Write errors are reported but do not stop processing.
+  */
+ void
+ encode_message(DecodedMessage *message, const char *rom_basename, const char *output_dir)
+ {
+     RunStats stats;
+     char track_num_str[12];
+     OutputBuffer audio_data;
+     const char *extension;
+     OutputFileKind kind;
+     uint64_t phase_start;
+     bool encoded;
+
+     if (!message->has_output)
+         return;
+
+     if (message->kind == OUTPUT_FILE_RAW_PCM) {
+         submit_output_file(output_dir, message->output_base, ".pcm", OUTPUT_FILE_RAW_PCM, &message->raw, 0,
+                    message->segment_index, message->message_index, message->absolute_index);
+         return;
+     }
+
+     snprintf(track_num_str, sizeof(track_num_str), "%d", message->absolute_index);
+
+     memset(&stats, 0, sizeof(stats));
+     phase_start = stats_timer_start();
+     if (resampler.coefficients) {
+         PcmBuffer resampled;
+         init_pcm_buffer(&resampled);
+         if (!resample_pcm(&resampler, &message->pcm, &resampled))
+             return; /* Error already printed */
+         trace_span("resample", phase_start, message->segment_index, message->message_index, message->absolute_index);
+         free_pcm_buffer(&message->pcm);
+         message->pcm = resampled;
+     }
+     if (stdout_mode) {
+         stats_timer_stop(&stats, STATS_PHASE_ENCODE, phase_start);
+         stats_merge(&stats);
+         stdout_stream_write(message); /* Errors already printed; reported again at exit */
+         return;
+     }
+     init_output_buffer(&audio_data);
+     switch (output_format) {
+     case OUTPUT_FORMAT_FLAC:
+         encoded = encode_flac_file(&audio_data, &message->pcm, output_sample_rate,
+                        rom_basename, message->output_base, track_num_str, message->comment);
+         extension = ".flac";
+         kind = OUTPUT_FILE_FLAC;
+         break;
+     case OUTPUT_FORMAT_ULAW_RAW:
+     case OUTPUT_FORMAT_ALAW_RAW:
+         encoded = encode_g711_raw(&audio_data, &message->pcm, output_format == OUTPUT_FORMAT_ALAW_RAW);
+         if (!encoded)
+             fprintf(stderr, "ERROR: Failed to encode G.711 data for '%s'.\n", message->output_base);
+         extension = (output_format == OUTPUT_FORMAT_ALAW_RAW) ? ".al" : ".ul";
+         kind = OUTPUT_FILE_G711;
+         break;
+     case OUTPUT_FORMAT_S16LE:
+         encoded = encode_s16le_raw(&audio_data, &message->pcm);
+         if (!encoded)
+             fprintf(stderr, "ERROR: Failed to encode s16le data for '%s'.\n", message->output_base);
+         extension = ".raw";
+         kind = OUTPUT_FILE_S16LE;
+         break;
+     default:
+         encoded = encode_wav_file(&audio_data, &message->pcm, output_sample_rate, output_format,
+                       rom_basename, message->output_base, track_num_str, message->comment);
+         extension = ".wav";
+         kind = OUTPUT_FILE_WAV;
+         break;
+     }
+     stats_timer_stop(&stats, STATS_PHASE_ENCODE, phase_start);
+     trace_span("encode", phase_start, message->segment_index, message->message_index, message->absolute_index);
+     stats_merge(&stats);
+     if (encoded) {
+         submit_output_file(output_dir, message->output_base, extension, kind, &audio_data, message->pcm.count,
+                    message->segment_index, message->message_index, message->absolute_index);
+         /* Errors already printed; writing continues with the next message */
+     }
+     free_output_buffer(&audio_data);
+ }
+
+ /**
+  * free_decoded_message() - Frees the buffers of a DecodedMessage.
+  * @message: Pointer to the DecodedMessage.
+  */
+ void
+ free_decoded_message(DecodedMessage *message)
+ {
+     free_pcm_buffer(&message->pcm);
+     free_output_buffer(&message->raw);
+     message->has_output = false;
+ }
+
+ /**
+  * process_message() - Processes a single message (ADPCM/PCM decoding or raw PCM saving).
+  * NOTE: This function is NOT called when list_mode is active.
+  * @rom_data:             Pointer to the start of the ROM data buffer.
+  * @rom_size:             Total size of the ROM data.
+  * @segment_start_offset: Byte offset of the current segment's start.
+  * @segment_index_0_based: 0-based index of the current segment.
+  * @msg_idx_in_segment:   0-based index of the message within the segment.
+  * @absolute_msg_idx:     0-based absolute index of the message.
+  * @message_offset_in_segment: Offset (bytes) from segment start to mode byte.
+  * @next_message_offset_in_segment: Offset (bytes) of the *next* message.
+  * @mapping:              Pointer to mapping info (or NULL if none).
+  * @rom_basename:         Base filename of the input ROM file.
+  * @output_dir:           Directory for output files (NULL for current directory).
+  *
+  * Runs the decode and encode stages back to back on the calling thread
+  * (see the Pipeline section for the staged variant). In arena mode the
+  * samples come from the thread's arena, which is reset afterwards.
+  *
+  * Return: true if processing should continue, false on fatal error.
+  */
+ bool
+ process_message(const uint8_t *rom_data, size_t rom_size,
+         size_t segment_start_offset, int segment_index_0_based,
+         int msg_idx_in_segment, int absolute_msg_idx,
+         uint32_t message_offset_in_segment, uint32_t next_message_offset_in_segment,
+         const MessageMapping *mapping, const char *rom_basename, const char *output_dir)
+ {
+     DecodedMessage message;
+     Arena *arena = arena_mode ? get_thread_arena() : NULL; /* NULL: fall back to the heap */
+     size_t heap_calls = arena ? arena->heap_calls : 0;
+     bool success;
+
+     success = decode_message(rom_data, rom_size, segment_start_offset, segment_index_0_based,
+                  msg_idx_in_segment, absolute_msg_idx,
+                  message_offset_in_segment, next_message_offset_in_segment, mapping, arena, &message);
+     if (success)
+         encode_message(&message, rom_basename, output_dir);
+     free_decoded_message(&message);
+     if (arena) {
+         RunStats stats;
+
+         arena_reset(arena);
+         memset(&stats, 0, sizeof(stats));
+         stats.arena_blocks = arena->heap_calls - heap_calls;
+         stats_merge(&stats);
+     }
+     return success;
+ }
+
+ /**
+  * process_catalog_message() - Decodes and encodes one cataloged message.
+  * @catalog:      Pointer to the MessageCatalog holding the message.
+  * @i:            Position of the message in @catalog.
+  * @rom_basename: Base filename of the input ROM file.
+  * @output_dir:   Directory for output files (NULL for current directory).
+  *
+  * Return: true if processing should continue, false on fatal error.
+  */
+ bool
+ process_catalog_message(const MessageCatalog *catalog, size_t i, const char *rom_basename, const char *output_dir)
+ {
+     return process_message(catalog->rom_data, catalog->rom_size, catalog->segment_start[i],
+                            (int)catalog->segment[i], catalog->index[i], (int)catalog->absolute[i],
+                            (uint32_t)(catalog->start[i] - catalog->segment_start[i]),
+                            (uint32_t)(catalog->limit[i] - catalog->segment_start[i]),
+                            catalog->mapping[i], rom_basename, output_dir);
+ }
+
+ /**
+  * handle_message_iteration() - Handles a single message during iteration (list or decode).
+  * @catalog:            Pointer to the MessageCatalog holding the message.
+  * @i:                  Position of the message in @catalog.
+  * @rom_basename:       Base filename of the input ROM file.
+  * @output_dir:         Directory for output files (NULL for current directory).
+  * @list_mode:          True if list mode is active.
+  * @quiet_mode:         True if quiet mode is active.
+  * @target_message_idx: Target absolute message index for decoding (-1 for all).
+  *
+  * Return: Enum indicating status (continue, target found, error).
+  */
+ HandleMessageResult
+ handle_message_iteration(const MessageCatalog *catalog, size_t i, const char *rom_basename,
+                          const char *output_dir, bool list_mode, bool quiet_mode, long target_message_idx)
+ {
+     MessageMapping mapping_entry;
+     const MessageMapping *mapping = catalog->mapping[i];
+     int absolute_msg_idx = (int)catalog->absolute[i];
+
+     /* --- LIST MODE --- */
+     if (list_mode) {
+         if (active_automap)
+             mapping = automap_message(active_automap, catalog, i, &mapping_entry) ? &mapping_entry : NULL;
+         /* Mapping file lines are informational output; records and automapped maps are data */
+         if ((!quiet_mode || list_format != LIST_FORMAT_MAP || active_automap) &&
+             !list_message(catalog, i, mapping, rom_basename)) {
+             fprintf(stderr, "ERROR: Failed to build the listing entry for message %d.\n", absolute_msg_idx);
+             return MSG_HANDLED_ERROR;
+         }
+         return MSG_HANDLED_CONTINUE; /* List mode always continues */
+     }
+     /* --- DECODE MODE --- */
+     else {
+         if (target_message_idx < 0 || absolute_msg_idx == target_message_idx) {
+             bool success;
+
+             if (active_pipeline) {
+                 success = pipeline_submit_message(active_pipeline, catalog->rom_data, catalog->rom_size,
+                                   catalog->segment_start[i], (int)catalog->segment[i], catalog->index[i],
+                                   absolute_msg_idx, (uint32_t)(catalog->start[i] - catalog->segment_start[i]),
+                                   (uint32_t)(catalog->limit[i] - catalog->segment_start[i]), mapping);
+             } else {
+                 success = process_catalog_message(catalog, i, rom_basename, output_dir);
+             }
+
+             if (!success)
+                 return MSG_HANDLED_ERROR;
+
+             if (target_message_idx >= 0 && absolute_msg_idx == target_message_idx)
+                 return MSG_HANDLED_TARGET_FOUND;
+
+         }
+         return MSG_HANDLED_CONTINUE; /* Continue if not target or target processed ok */
+     }
+ }
+
+
+ /* --- Pipeline --- */
+
+ Pipeline *active_pipeline = NULL; /* Set while a staged pipeline consumes the messages */
+
+ /**
+  * init_bounded_queue() - Initializes a bounded lock-free queue.
+  * @queue:    Pointer to the BoundedQueue.
+  * @capacity: Number of slots (must be a power of two).
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ init_bounded_queue(BoundedQueue *queue, size_t capacity)
+ {
+     size_t i;
+
+     memset(queue, 0, sizeof(*queue));
+     queue->cells = (QueueCell *)malloc(capacity * sizeof(QueueCell));
+     if (!queue->cells)
+         return false;
+     for (i = 0; i < capacity; ++i) {
+         queue->cells[i].sequence = i;
+         queue->cells[i].item = NULL;
+     }
+     queue->mask = capacity - 1;
+     return true;
+ }
+
+ /**
+  * free_bounded_queue() - Releases the slots of a BoundedQueue.
+  * @queue: Pointer to the BoundedQueue (must be empty).
+  */
+ void
+ free_bounded_queue(BoundedQueue *queue)
+ {
+     free(queue->cells);
+     queue->cells = NULL;
+ }
+
+ /**
+  * queue_try_push() - Appends an item unless the queue is full.
+  * @queue: Pointer to the BoundedQueue.
+  * @item:  Item to append.
+  *
+  * Bounded MPMC queue after Dmitry Vyukov: each slot carries a sequence
+  * number that tells producers and consumers whose turn it is, so the only
+  * contended operation is one compare-and-swap on the position counter.
+  *
+  * Return: true if appended, false if the queue is full.
+  */
+ bool
+ queue_try_push(BoundedQueue *queue, void *item)
+ {
+     size_t pos = atomic_load_size(&queue->enqueue_pos);
+     QueueCell *cell;
+
+     for (;;) {
+         size_t sequence;
+         ptrdiff_t diff;
+
+         cell = &queue->cells[pos & queue->mask];
+         sequence = atomic_load_size(&cell->sequence);
+         diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+         if (diff == 0) {
+             if (atomic_cas_size(&queue->enqueue_pos, pos, pos + 1))
+                 break;
+             pos = atomic_load_size(&queue->enqueue_pos);
+         } else if (diff < 0) {
+             return false; /* Full */
+         } else {
+             pos = atomic_load_size(&queue->enqueue_pos);
+         }
+     }
+     cell->item = item;
+     atomic_store_size(&cell->sequence, pos + 1);
+     return true;
+ }
+
+ /**
+  * queue_try_pop() - Removes the oldest item if there is one.
+  * @queue: Pointer to the BoundedQueue.
+  * @item:  Receives the item.
+  *
+  * Return: true if an item was removed, false if the queue is empty.
+  */
+ bool
+ queue_try_pop(BoundedQueue *queue, void **item)
+ {
+     size_t pos = atomic_load_size(&queue->dequeue_pos);
+     QueueCell *cell;
+
+     for (;;) {
+         size_t sequence;
+         ptrdiff_t diff;
+
+         cell = &queue->cells[pos & queue->mask];
+         sequence = atomic_load_size(&cell->sequence);
+         diff = (ptrdiff_t)sequence - (ptrdiff_t)(pos + 1);
+         if (diff == 0) {
+             if (atomic_cas_size(&queue->dequeue_pos, pos, pos + 1))
+                 break;
+             pos = atomic_load_size(&queue->dequeue_pos);
+         } else if (diff < 0) {
+             return false; /* Empty */
+         } else {
+             pos = atomic_load_size(&queue->dequeue_pos);
+         }
+     }
+     *item = cell->item;
+     atomic_store_size(&cell->sequence, pos + queue->mask + 1);
+     return true;
+ }
+
+ /**
+  * queue_push() - Appends an item, waiting while the queue is full (backpressure).
+  * @queue: Pointer to the BoundedQueue.
+  * @item:  Item to append.
+  */
+ void
+ queue_push(BoundedQueue *queue, void *item)
+ {
+     unsigned round = 0;
+
+     while (!queue_try_push(queue, item))
+         backoff_wait(&round);
+ }
+
+ /**
+  * queue_pop() - Removes the oldest item, waiting until one arrives or the queue is closed.
+  * @queue: Pointer to the BoundedQueue.
+  * @item:  Receives the item.
+  *
+  * Return: true if an item was removed, false once the queue is closed and drained.
+  */
+ bool
+ queue_pop(BoundedQueue *queue, void **item)
+ {
+     unsigned round = 0;
+
+     for (;;) {
+         if (queue_try_pop(queue, item))
+             return true;
+         if (atomic_load_size(&queue->closed))
+             return queue_try_pop(queue, item); /* Items pushed before closing are visible now */
+         backoff_wait(&round);
+     }
+ }
+
+ /**
+  * queue_close() - Marks a queue as complete; no items may be pushed afterwards.
+  * @queue: Pointer to the BoundedQueue.
+  */
+ void
+ queue_close(BoundedQueue *queue)
+ {
+     atomic_store_size(&queue->closed, 1);
+ }
+
+ /**
+  * release_shared_segment() - Drops one reference to a SharedSegment.
+  * @segment: Pointer to the SharedSegment (may be NULL).
+  */
+ void
+ release_shared_segment(SharedSegment *segment)
+ {
+     if (segment && atomic_add_size(&segment->references, (size_t)-1) == 0) {
+         free(segment->data);
+         free(segment);
+     }
+ }
+
+ /**
+  * pipeline_decoder() - Decode stage worker: MessageJob in, DecodedMessage out.
+  * @arg: Pointer to the Pipeline.
+  *
+  * The last decoder to finish closes the encode queue.
+  */
+ void
+ pipeline_decoder(void *arg)
+ {
+     Pipeline *pipeline = (Pipeline *)arg;
+     void *item;
+
+     while (queue_pop(&pipeline->decode_queue, &item)) {
+         MessageJob *job = (MessageJob *)item;
+         DecodedMessage *message = (DecodedMessage *)malloc(sizeof(DecodedMessage));
+
+         if (!message) {
+             fprintf(stderr, "ERROR: Memory allocation failed for decoded message %d.\n", job->absolute_msg_idx);
+             atomic_store_size(&pipeline->failed, 1);
+         } else if (!decode_message(job->rom_data, job->rom_size, job->segment_start, job->segment_index,
+                        job->msg_idx_in_seg, job->absolute_msg_idx,
+                        job->message_offset, job->next_message_offset,
+                        job->has_mapping ? &job->mapping : NULL, NULL, message)) {
+             atomic_store_size(&pipeline->failed, 1);
+             free_decoded_message(message);
+             free(message);
+         } else if (!message->has_output) {
+             free_decoded_message(message);
+             free(message);
+         } else {
+             queue_push(&pipeline->encode_queue, message);
+         }
+         release_shared_segment(job->segment); /* Decoded data no longer refers to the ROM */
+         free(job);
+     }
+     if (atomic_add_size(&pipeline->active_decoders, (size_t)-1) == 0)
+         queue_close(&pipeline->encode_queue);
+ }
+
+ /**
+  * pipeline_encoder() - Encode stage worker: DecodedMessage in, output file out.
+  * @arg: Pointer to the Pipeline.
+  *
+  * Finished files go to the output writer, which forms the write stage.
+  */
+ void
+ pipeline_encoder(void *arg)
+ {
+     Pipeline *pipeline = (Pipeline *)arg;
+     void *item;
+
+     while (queue_pop(&pipeline->encode_queue, &item)) {
+         DecodedMessage *message = (DecodedMessage *)item;
+
+         encode_message(message, pipeline->rom_basename, pipeline->output_dir);
+         free_decoded_message(message);
+         free(message);
+     }
+ }
+
+ /**
+  * pipeline_start() - Starts the decode and encode stages for one ROM.
+  * @pipeline:      Pointer to the Pipeline to initialize.
+  * @decoder_count: Number of decoder threads.
+  * @rom_basename:  Base filename of the input ROM file.
+  * @output_dir:    Directory for output files (NULL for current directory).
+  * @copy_input:    true if the ROM buffer is reused while jobs are pending
+  *                 (streaming), so each segment must be copied.
+  *
+  * The calling thread becomes the reader stage: it keeps walking segments and
+  * submits each message with pipeline_submit_message(). One encoder thread is
+  * started per four decoders. While the pipeline is active, message
+  * processing is routed to it through active_pipeline.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ pipeline_start(Pipeline *pipeline, int decoder_count, const char *rom_basename,
+            const char *output_dir, bool copy_input)
+ {
+     int encoder_count = (decoder_count + 3) / 4;
+     int i;
+
+     memset(pipeline, 0, sizeof(*pipeline));
+     pipeline->rom_basename = rom_basename;
+     pipeline->output_dir = output_dir;
+     pipeline->copy_input = copy_input;
+     if (!init_bounded_queue(&pipeline->decode_queue, PIPELINE_QUEUE_DEPTH) ||
+         !init_bounded_queue(&pipeline->encode_queue, PIPELINE_QUEUE_DEPTH)) {
+         fprintf(stderr, "ERROR: Failed to allocate pipeline queues.\n");
+         free_bounded_queue(&pipeline->decode_queue);
+         free_bounded_queue(&pipeline->encode_queue);
+         return false;
+     }
+
+     pipeline->active_decoders = (size_t)decoder_count;
+     for (i = 0; i < decoder_count; ++i) {
+         if (!thread_create(&pipeline->threads[pipeline->thread_count], pipeline_decoder, pipeline))
+             break;
+         pipeline->thread_count++;
+     }
+     if (pipeline->thread_count < decoder_count) {
+         /* Account for decoders that never started, so the encode queue still gets closed */
+         atomic_add_size(&pipeline->active_decoders, (size_t)(pipeline->thread_count - decoder_count));
+         if (pipeline->thread_count == 0) {
+             fprintf(stderr, "ERROR: Could not start pipeline decoder threads.\n");
+             free_bounded_queue(&pipeline->decode_queue);
+             free_bounded_queue(&pipeline->encode_queue);
+             return false;
+         }
+         fprintf(stderr, "WARN: Started only %d of %d decoder thread(s).\n", pipeline->thread_count, decoder_count);
+     }
+     for (i = 0; i < encoder_count; ++i) {
+         if (!thread_create(&pipeline->threads[pipeline->thread_count], pipeline_encoder, pipeline))
+             break;
+         pipeline->thread_count++;
+         pipeline->encoder_count++;
+     }
+     if (pipeline->encoder_count == 0) {
+         /* Nothing would drain the encode queue; shut down the decoders again */
+         fprintf(stderr, "ERROR: Could not start pipeline encoder thread.\n");
+         queue_close(&pipeline->decode_queue);
+         for (i = 0; i < pipeline->thread_count; ++i)
+             thread_join(pipeline->threads[i]);
+         free_bounded_queue(&pipeline->decode_queue);
+         free_bounded_queue(&pipeline->encode_queue);
+         return false;
+     }
+
+     verbose_printf("Pipeline: %d decoder(s), %d encoder(s), queue depth %d.\n",
+                pipeline->thread_count - pipeline->encoder_count, pipeline->encoder_count, PIPELINE_QUEUE_DEPTH);
+     active_pipeline = pipeline;
+     return true;
+ }
+
+ /**
+  * pipeline_submit_message() - Reader stage: queues one message for decoding.
+  * @pipeline:             Pointer to the active Pipeline.
+  * @rom_data:             Pointer to the start of the ROM data buffer.
+  * @rom_size:             Total size of the ROM data.
+  * @segment_start_offset: Byte offset of the current segment's start.
+  * @segment_index_0_based: 0-based index of the current segment.
+  * @msg_idx_in_segment:   0-based index of the message within the segment.
+  * @absolute_msg_idx:     0-based absolute index of the message.
+  * @message_offset_in_segment: Offset (bytes) from segment start to mode byte.
+  * @next_message_offset_in_segment: Offset (bytes) of the *next* message.
+  * @mapping:              Pointer to mapping info (or NULL if none).
+  *
+  * Blocks while PIPELINE_QUEUE_DEPTH messages are already waiting. With
+  * copy_input, the segment (from its start to @rom_size) is copied once into
+  * a reference-counted SharedSegment that lives until its last message has
+  * been decoded, so memory stays bounded by the queue depth.
+  *
+  * Return: true if processing should continue, false on fatal error.
+  */
+ bool
+ pipeline_submit_message(Pipeline *pipeline, const uint8_t *rom_data, size_t rom_size,
+             size_t segment_start_offset, int segment_index_0_based,
+             int msg_idx_in_segment, int absolute_msg_idx,
+             uint32_t message_offset_in_segment, uint32_t next_message_offset_in_segment,
+             const MessageMapping *mapping)
+ {
+     MessageJob *job;
+
+     if (atomic_load_size(&pipeline->failed))
+         return false;
+
+     job = (MessageJob *)calloc(1, sizeof(MessageJob));
+     if (!job) {
+         fprintf(stderr, "ERROR: Memory allocation failed for message job %d.\n", absolute_msg_idx);
+         return false;
+     }
+
+     if (pipeline->copy_input) {
+         SharedSegment *segment = pipeline->current_segment;
+
+         if (!segment || pipeline->current_segment_index != segment_index_0_based) {
+             release_shared_segment(segment); /* The reader's own reference */
+             pipeline->current_segment = NULL;
+             segment = (SharedSegment *)malloc(sizeof(SharedSegment));
+             if (segment)
+                 segment->data = (uint8_t *)malloc(rom_size - segment_start_offset);
+             if (!segment || !segment->data) {
+                 fprintf(stderr, "ERROR: Memory allocation failed for segment %d copy.\n", segment_index_0_based);
+                 free(segment);
+                 free(job);
+                 return false;
+             }
+             memcpy(segment->data, rom_data + segment_start_offset, rom_size - segment_start_offset);
+             segment->size = rom_size - segment_start_offset;
+             segment->references = 1;
+             pipeline->current_segment = segment;
+             pipeline->current_segment_index = segment_index_0_based;
+         }
+         atomic_add_size(&segment->references, 1);
+         job->segment = segment;
+         job->rom_data = segment->data;
+         job->rom_size = segment->size;
+         job->segment_start = 0;
+     } else {
+         job->rom_data = rom_data;
+         job->rom_size = rom_size;
+         job->segment_start = segment_start_offset;
+     }
+     job->segment_index = segment_index_0_based;
+     job->msg_idx_in_seg = msg_idx_in_segment;
+     job->absolute_msg_idx = absolute_msg_idx;
+     job->message_offset = message_offset_in_segment;
+     job->next_message_offset = next_message_offset_in_segment;
+     job->has_mapping = (mapping != NULL);
+     if (mapping)
+         job->mapping = *mapping; /* The caller's entry does not outlive the call */
+
+     queue_push(&pipeline->decode_queue, job);
+     return true;
+ }
+
+ /**
+  * pipeline_finish() - Drains all stages and stops the pipeline threads.
+  * @pipeline: Pointer to the active Pipeline.
+  *
+  * Files still queued in the output writer are written by
+  * output_writer_finish().
+  *
+  * Return: true on success, false if a stage failed.
+  */
+ bool
+ pipeline_finish(Pipeline *pipeline)
+ {
+     int i;
+
+     queue_close(&pipeline->decode_queue);
+     for (i = 0; i < pipeline->thread_count; ++i)
+         thread_join(pipeline->threads[i]);
+     release_shared_segment(pipeline->current_segment);
+     pipeline->current_segment = NULL;
+     free_bounded_queue(&pipeline->decode_queue);
+     free_bounded_queue(&pipeline->encode_queue);
+     if (active_pipeline == pipeline)
+         active_pipeline = NULL;
+     return atomic_load_size(&pipeline->failed) == 0;
+ }
+
+
+ /* --- Argument Parsing Function --- */
+
+ /**
+  * parse_arguments() - Parses command line arguments.
+  * @argc:    Argument count.
+  * @argv:    Argument vector.
+  * @options: Pointer to the ProgramOptions to populate. On success the
+  *           caller must release options->rom_filepaths with free().
+  *
+  * Return: true on success, false on error or if help requested.
+  */
+ bool
+ parse_arguments(int argc, char *argv[], ProgramOptions *options)
+ {
+     int i;
+
+     /* Initialize defaults */
+     memset(options, 0, sizeof(*options));
+     options->target_message_idx = -1;
+     options->encode_quality = ENCODE_QUALITY_TRELLIS;
+     options->rom_filepaths = (const char **)malloc((size_t)argc * sizeof(const char *));
+     if (!options->rom_filepaths) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for argument list.\n");
+         return false;
+     }
+
+     for (i = 1; i < argc; ++i) {
+         if (strcmp(argv[i], "-m") == 0) {
+             if (++i < argc) {
+                 options->map_filepath = argv[i];
+             } else {
+                 fprintf(stderr, "ERROR: Option -m requires a filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "-i") == 0) {
+             if (++i < argc) {
+                 char *endptr;
+                 options->target_message_idx = strtol(argv[i], &endptr, 10);
+                 if (*endptr != '\0' || options->target_message_idx < 0) {
+                     fprintf(stderr, "ERROR: Invalid message index '%s' for -i option.\n", argv[i]);
+                     goto usage_error;
+                 }
+             } else {
+                 fprintf(stderr, "ERROR: Option -i requires a message index argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "-o") == 0) {
+             if (++i < argc) {
+                 options->output_dir = argv[i];
+             } else {
+                 fprintf(stderr, "ERROR: Option -o requires a directory argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "-j") == 0) {
+             if (++i < argc) {
+                 char *endptr;
+                 long threads = strtol(argv[i], &endptr, 10);
+                 if (*endptr != '\0' || threads < 1 || threads > MAX_WORKER_THREADS) {
+                     fprintf(stderr, "ERROR: Invalid thread count '%s' for -j option (1-%d).\n", argv[i], MAX_WORKER_THREADS);
+                     goto usage_error;
+                 }
+                 options->thread_count = (int)threads;
+             } else {
+                 fprintf(stderr, "ERROR: Option -j requires a thread count argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--rate") == 0) {
+             if (++i < argc) {
+                 char *endptr;
+                 long rate = strtol(argv[i], &endptr, 10);
+                 if (*endptr != '\0' || rate < MIN_OUTPUT_SAMPLE_RATE || rate > MAX_OUTPUT_SAMPLE_RATE) {
+                     fprintf(stderr, "ERROR: Invalid sample rate '%s' for --rate option (%d-%d).\n",
+                         argv[i], MIN_OUTPUT_SAMPLE_RATE, MAX_OUTPUT_SAMPLE_RATE);
+                     goto usage_error;
+                 }
+                 options->output_rate = (uint32_t)rate;
+             } else {
+                 fprintf(stderr, "ERROR: Option --rate requires a sample rate argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--compile-map") == 0) {
+             if (++i < argc) {
+                 options->compile_map_filepath = argv[i];
+             } else {
+                 fprintf(stderr, "ERROR: Option --compile-map requires a filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--automap") == 0) {
+             if (++i < argc) {
+                 options->automap_filepath = argv[i];
+                 options->list_mode = true;
+             } else {
+                 fprintf(stderr, "ERROR: Option --automap requires a reference ROM filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--fp-index") == 0) {
+             if (++i < argc) {
+                 options->fp_index_filepath = argv[i];
+                 options->batch_mode = true;
+             } else {
+                 fprintf(stderr, "ERROR: Option --fp-index requires a filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--bench-encode") == 0) {
+             if (++i < argc) {
+                 options->bench_encode_filepath = argv[i];
+                 options->batch_mode = true;
+             } else {
+                 fprintf(stderr, "ERROR: Option --bench-encode requires a filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--fp-query") == 0) {
+             if (++i < argc) {
+                 options->fp_query_filepath = argv[i];
+             } else {
+                 fprintf(stderr, "ERROR: Option --fp-query requires a filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--diff") == 0) {
+             if (++i < argc) {
+                 options->diff_filepath = argv[i];
+             } else {
+                 fprintf(stderr, "ERROR: Option --diff requires a filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--encode") == 0) {
+             options->encode_mode = true;
+         } else if (strcmp(argv[i], "--build-rom") == 0) {
+             if (++i < argc) {
+                 options->build_rom_filepath = argv[i];
+             } else {
+                 fprintf(stderr, "ERROR: Option --build-rom requires a ROM filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--patch") == 0) {
+             if (++i < argc) {
+                 options->patch_filepath = argv[i];
+             } else {
+                 fprintf(stderr, "ERROR: Option --patch requires a message filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strncmp(argv[i], "--quality=", 10) == 0) {
+             const char *name = argv[i] + 10;
+             if (strcmp(name, "greedy") == 0) {
+                 options->encode_quality = ENCODE_QUALITY_GREEDY;
+             } else if (strcmp(name, "lookahead") == 0) {
+                 options->encode_quality = ENCODE_QUALITY_LOOKAHEAD;
+             } else if (strcmp(name, "trellis") == 0) {
+                 options->encode_quality = ENCODE_QUALITY_TRELLIS;
+             } else {
+                 fprintf(stderr, "ERROR: Unknown encoder quality '%s' (expected greedy, lookahead or trellis).\n", name);
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--manifest") == 0) {
+             if (++i < argc) {
+                 options->manifest_filepath = argv[i];
+                 options->batch_mode = true;
+             } else {
+                 fprintf(stderr, "ERROR: Option --manifest requires a filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strncmp(argv[i], "--format=", 9) == 0) {
+             const char *name = argv[i] + 9;
+             if (strcmp(name, "wav") == 0) {
+                 options->output_format = OUTPUT_FORMAT_WAV;
+             } else if (strcmp(name, "flac") == 0) {
+                 options->output_format = OUTPUT_FORMAT_FLAC;
+             } else if (strcmp(name, "ulaw") == 0) {
+                 options->output_format = OUTPUT_FORMAT_ULAW_WAV;
+             } else if (strcmp(name, "alaw") == 0) {
+                 options->output_format = OUTPUT_FORMAT_ALAW_WAV;
+             } else if (strcmp(name, "ul") == 0) {
+                 options->output_format = OUTPUT_FORMAT_ULAW_RAW;
+             } else if (strcmp(name, "al") == 0) {
+                 options->output_format = OUTPUT_FORMAT_ALAW_RAW;
+             } else if (strcmp(name, "ima") == 0) {
+                 options->output_format = OUTPUT_FORMAT_IMA_WAV;
+             } else if (strcmp(name, "s16le") == 0) {
+                 options->output_format = OUTPUT_FORMAT_S16LE;
+             } else {
+                 fprintf(stderr, "ERROR: Unknown output format '%s' (expected wav, flac, ulaw, alaw, ul, al, ima or s16le).\n", name);
+                 goto usage_error;
+             }
+         } else if (strncmp(argv[i], "--list-format=", 14) == 0) {
+             const char *name = argv[i] + 14;
+             if (strcmp(name, "map") == 0) {
+                 options->list_format = LIST_FORMAT_MAP;
+             } else if (strcmp(name, "jsonl") == 0) {
+                 options->list_format = LIST_FORMAT_JSONL;
+             } else if (strcmp(name, "csv") == 0) {
+                 options->list_format = LIST_FORMAT_CSV;
+             } else if (strcmp(name, "tsv") == 0) {
+                 options->list_format = LIST_FORMAT_TSV;
+             } else {
+                 fprintf(stderr, "ERROR: Unknown list format '%s' (expected map, jsonl, csv or tsv).\n", name);
+                 goto usage_error;
+             }
+             options->list_mode = true;
+         } else if (strncmp(argv[i], "--writer=", 9) == 0) {
+             const char *name = argv[i] + 9;
+             if (strcmp(name, "sync") == 0) {
+                 options->output_backend = OUTPUT_BACKEND_SYNC;
+             } else if (strcmp(name, "thread") == 0) {
+                 options->output_backend = OUTPUT_BACKEND_THREAD;
+             } else if (strcmp(name, "uring") == 0) {
+                 options->output_backend = OUTPUT_BACKEND_URING;
+             } else if (strcmp(name, "auto") == 0) {
+                 options->output_backend = OUTPUT_BACKEND_AUTO;
+             } else {
+                 fprintf(stderr, "ERROR: Unknown output writer '%s' (expected sync, thread, uring or auto).\n", name);
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "--trace") == 0) {
+             if (++i < argc) {
+                 options->trace_filepath = argv[i];
+             } else {
+                 fprintf(stderr, "ERROR: Option --trace requires a filepath argument.\n");
+                 goto usage_error;
+             }
+         } else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0) {
+             options->batch_mode = true;
+         } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--list") == 0) {
+             options->list_mode = true;
+         } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--scan") == 0) {
+             options->scan_mode = true;
+         } else if (strcmp(argv[i], "--stream") == 0) {
+             options->stream_mode = true;
+         } else if (strcmp(argv[i], "--raw-pcm") == 0) {
+             options->raw_pcm_mode = true;
+         } else if (strcmp(argv[i], "--arena") == 0) {
+             options->arena_mode = true;
+         } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+             options->stats_mode = true;
+         } else if (strcmp(argv[i], "--stats=json") == 0) {
+             options->stats_mode = true;
+             options->stats_json = true;
+         } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
+             options->quiet_mode = true;
+         } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+             options->verbose_mode = true;
+         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+              print_usage(argv[0]);
+              goto fail; /* Indicate help requested, not an error */
+         } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+             fprintf(stderr, "ERROR: Unknown option '%s'.\n", argv[i]);
+             goto usage_error;
+         } else {
+             options->rom_filepaths[options->rom_filepath_count++] = argv[i];
+         }
+     }
+
+     /* Compiling a mapping file needs only the text mapping file */
+     if (options->compile_map_filepath) {
+         if (!options->map_filepath || options->rom_filepath_count > 0 || options->batch_mode) {
+             fprintf(stderr, "ERROR: --compile-map takes only -m <map_filepath> (no ROM or batch options).\n");
+             goto usage_error;
+         }
+         if (options->quiet_mode)
+             options->verbose_mode = false;
+         return true;
+     }
+
+     /* Building a ROM takes the mapping file and an optional message directory */
+     if (options->build_rom_filepath) {
+         if (!options->map_filepath || options->rom_filepath_count > 1 || options->batch_mode || options->list_mode ||
+             options->stream_mode || options->scan_mode || options->target_message_idx >= 0 || options->output_dir ||
+             options->diff_filepath || options->fp_query_filepath || options->encode_mode) {
+             fprintf(stderr, "ERROR: --build-rom takes -m <map_filepath> and an optional message directory (no other modes).\n");
+             goto usage_error;
+         }
+         if (options->quiet_mode)
+             options->verbose_mode = false;
+         return true;
+     }
+
+     /* Encoding takes WAV files instead of ROMs */
+     if (options->encode_mode) {
+         if (options->rom_filepath_count == 0 || options->batch_mode || options->list_mode || options->stream_mode ||
+             options->map_filepath || options->target_message_idx >= 0 || options->diff_filepath ||
+             options->fp_query_filepath || (options->output_dir && strcmp(options->output_dir, "-") == 0)) {
+             fprintf(stderr, "ERROR: --encode takes WAV files and -o <output_dir> (no ROM, -b, -i, -l, -m or --stream).\n");
+             goto usage_error;
+         }
+         if (options->quiet_mode)
+             options->verbose_mode = false;
+         if (options->thread_count == 0)
+             options->thread_count = get_cpu_count();
+         if (options->thread_count > MAX_WORKER_THREADS)
+             options->thread_count = MAX_WORKER_THREADS;
+         return true;
+     }
+
+     if (options->rom_filepath_count == 0 && !options->manifest_filepath) {
+         fprintf(stderr, "ERROR: Input ROM filepath is required.\n");
+         goto usage_error;
+     }
+     if (options->rom_filepath_count > 1 && !options->batch_mode) {
+         fprintf(stderr, "ERROR: Unexpected argument '%s'. ROM filepath already specified? (Use -b for batch mode.)\n",
+             options->rom_filepaths[1]);
+         goto usage_error;
+     }
+
+     /* Quiet mode overrides verbose mode */
+     if (options->quiet_mode)
+         options->verbose_mode = false;
+
+     if (options->automap_filepath && !options->map_filepath) {
+         fprintf(stderr, "ERROR: --automap requires -m <map_filepath> for the reference ROM.\n");
+         goto usage_error;
+     }
+     if (options->fp_query_filepath &&
+         (options->batch_mode || options->list_mode || options->stream_mode || options->target_message_idx < 0)) {
+         fprintf(stderr, "ERROR: --fp-query takes one ROM file and -i <message_index> (no -b, -l or --stream).\n");
+         goto usage_error;
+     }
+     if (options->diff_filepath &&
+         (options->batch_mode || options->list_mode || options->stream_mode || options->fp_query_filepath ||
+          (options->output_dir && strcmp(options->output_dir, "-") == 0) || options->target_message_idx >= 0)) {
+         fprintf(stderr, "ERROR: --diff takes one ROM file (no -b, -i, -l, --automap, --fp-query, --stream or -o -).\n");
+         goto usage_error;
+     }
+
+     if (options->patch_filepath &&
+         (options->rom_filepath_count != 1 || options->batch_mode || options->list_mode || options->stream_mode ||
+          options->target_message_idx < 0 || options->output_dir || options->map_filepath || options->diff_filepath ||
+          options->fp_query_filepath || strcmp(options->rom_filepaths[0], "-") == 0)) {
+         fprintf(stderr, "ERROR: --patch takes one ROM file and -i <message_index> (no -b, -l, -m, -o or --stream).\n");
+         goto usage_error;
+     }
+
+     if (options->bench_encode_filepath &&
+         (options->list_mode || options->stream_mode || options->target_message_idx >= 0 || options->output_dir ||
+          options->fp_index_filepath || options->automap_filepath)) {
+         fprintf(stderr, "ERROR: --bench-encode takes ROM files (no -i, -l, -o, --automap, --fp-index or --stream).\n");
+         goto usage_error;
+     }
+     /* The benchmark JSON on stdout moves status messages to stderr */
+     if (options->bench_encode_filepath && strcmp(options->bench_encode_filepath, "-") == 0)
+         options->stdout_mode = true;
+
+     /* Standard input can only be streamed */
+     if (!options->batch_mode && strcmp(options->rom_filepaths[0], "-") == 0)
+         options->stream_mode = true;
+
+     if (options->stream_mode && options->batch_mode) {
+         fprintf(stderr, "ERROR: --stream cannot be combined with batch mode.\n");
+         goto usage_error;
+     }
+
+     /* '-o -' streams the audio of the selected messages to stdout */
+     if (options->output_dir && strcmp(options->output_dir, "-") == 0) {
+         options->output_dir = NULL;
+         options->stdout_mode = true;
+         if (options->batch_mode || options->list_mode || options->raw_pcm_mode) {
+             fprintf(stderr, "ERROR: -o - cannot be combined with batch mode, -l or --raw-pcm.\n");
+             goto usage_error;
+         }
+         if (options->output_format != OUTPUT_FORMAT_WAV && options->output_format != OUTPUT_FORMAT_S16LE &&
+             options->output_format != OUTPUT_FORMAT_ULAW_RAW && options->output_format != OUTPUT_FORMAT_ALAW_RAW) {
+             fprintf(stderr, "ERROR: -o - supports --format=wav, s16le, ul or al.\n");
+             goto usage_error;
+         }
+         options->thread_count = 1; /* Messages are written in ROM order */
+     }
+
+     /* If listing, ignore target index */
+     if (options->list_mode && options->target_message_idx >= 0) {
+         if (!options->quiet_mode)
+             printf("INFO: Option -i ignored when -l or --list is specified.\n");
+         options->target_message_idx = -1; /* Ensure we don't accidentally use it later */
+     }
+
+     /* Default to all processors in batch mode, serial decoding otherwise */
+     if (options->thread_count == 0)
+         options->thread_count = options->batch_mode ? get_cpu_count() : 1;
+     if (options->thread_count > MAX_WORKER_THREADS)
+         options->thread_count = MAX_WORKER_THREADS;
+
+     return true;
+
+ usage_error:
+     print_usage(argv[0]);
+ fail:
+     free(options->rom_filepaths);
+     options->rom_filepaths = NULL;
+     return false;
+ }
+
+ /**
+  * load_rom_data() - Loads ROM file content into memory.
+  * @rom_filepath: Path to the ROM file.
+  * @rom_data_ptr: Pointer to store the allocated buffer address.
+  * @rom_size_ptr: Pointer to store the size of the loaded ROM.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ load_rom_data(const char *rom_filepath, uint8_t **rom_data_ptr, size_t *rom_size_ptr)
+ {
+     FILE *rom_fp;
+     int64_t file_size;
+     uint64_t phase_start = stats_timer_start();
+
+     verbose_printf("Loading ROM file...\n");
+     rom_fp = fopen(rom_filepath, "rb");
+     if (!rom_fp) {
+         fprintf(stderr, "ERROR: Cannot open ROM file '%s'.\n", rom_filepath);
+         return false;
+     }
+
+     /* Use 64-bit file positions so multi-GB concatenated dumps load everywhere */
+ #ifdef _MSC_VER
+     _fseeki64(rom_fp, 0, SEEK_END);
+     file_size = _ftelli64(rom_fp);
+     _fseeki64(rom_fp, 0, SEEK_SET);
+ #else
+     fseeko(rom_fp, 0, SEEK_END);
+     file_size = (int64_t)ftello(rom_fp);
+     fseeko(rom_fp, 0, SEEK_SET);
+ #endif
+
+     if (file_size <= 0 || (uint64_t)file_size > (uint64_t)SIZE_MAX) {
+          fprintf(stderr, "ERROR: Invalid ROM file size (%lld).\n", (long long)file_size);
+          fclose(rom_fp);
+          return false;
+     }
+     *rom_size_ptr = (size_t)file_size;
+
+
+     *rom_data_ptr = (uint8_t *)malloc(*rom_size_ptr);
+     if (!*rom_data_ptr) {
+         fprintf(stderr, "ERROR: Failed to allocate %zu bytes for ROM data.\n", *rom_size_ptr);
+         fclose(rom_fp);
+         return false;
+     }
+
+     if (fread(*rom_data_ptr, 1, *rom_size_ptr, rom_fp) != *rom_size_ptr) {
+         fprintf(stderr, "ERROR: Failed to read ROM file '%s'.\n", rom_filepath);
+         fclose(rom_fp);
+         free(*rom_data_ptr);
+         *rom_data_ptr = NULL;
+         return false;
+     }
+     fclose(rom_fp);
+     stats_record_phase(STATS_PHASE_ROM_LOAD, phase_start, *rom_size_ptr);
+     verbose_printf("ROM loaded (%zu bytes).\n", *rom_size_ptr);
+     return true;
+ }
+
+ /**
+  * load_mapping_data() - Loads mapping file data.
+  * @map_filepath: Path to the mapping file (can be NULL).
+  * @mapping_table: Pointer to the mapping table structure.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ load_mapping_data(const char *map_filepath, MappingTable *mapping_table)
+ {
+     init_mapping_table(mapping_table);
+     if (map_filepath) {
+         uint64_t phase_start = stats_timer_start();
+
+         verbose_printf("Loading mappings (expecting 0-based segment index)...\n");
+         if (!load_mappings(map_filepath, mapping_table)) {
+             /* Error message already printed by load_mappings */
+             return false;
+         }
+         stats_record_phase(STATS_PHASE_MAP_PARSE, phase_start, 0);
+         verbose_printf("Loaded %zu mappings.\n", mapping_table->count);
+     }
+     return true;
+ }
+
+
+ /* --- Segment Directory --- */
+
+ /**
+  * init_segment_directory() - Initializes a SegmentDirectory.
+  * @dir: Pointer to the SegmentDirectory.
+  */
+ void
+ init_segment_directory(SegmentDirectory *dir)
+ {
+     dir->segments = NULL;
+     dir->count = 0;
+     dir->capacity = 0;
+ }
+
+ /**
+  * add_segment_entry() - Appends a segment to the directory.
+  * @dir:   Pointer to the SegmentDirectory.
+  * @entry: The SegmentEntry to add.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ add_segment_entry(SegmentDirectory *dir, SegmentEntry entry)
+ {
+     if (dir->count >= dir->capacity) {
+         size_t new_capacity = (dir->capacity == 0) ? 16 : dir->capacity * 2;
+         SegmentEntry *new_segments = (SegmentEntry *)realloc(dir->segments, new_capacity * sizeof(SegmentEntry));
+         if (!new_segments) {
+             fprintf(stderr, "ERROR: Failed to allocate memory for segment directory.\n");
+             return false;
+         }
+         dir->segments = new_segments;
+         dir->capacity = new_capacity;
+     }
+     dir->segments[dir->count++] = entry;
+     return true;
+ }
+
+ /**
+  * free_segment_directory() - Frees memory associated with a SegmentDirectory.
+  * @dir: Pointer to the SegmentDirectory.
+  */
+ void
+ free_segment_directory(SegmentDirectory *dir)
+ {
+     free(dir->segments);
+     dir->segments = NULL;
+     dir->count = 0;
+     dir->capacity = 0;
+ }
+
+ /**
+  * lowest_set_bit() - Returns the index of the least significant set bit.
+  * @mask: Non-zero bit mask.
+  *
+  * Return: Bit index (0-31).
+  */
+ unsigned int
+ lowest_set_bit(uint32_t mask)
+ {
+ #ifdef _MSC_VER
+     unsigned long index;
+     _BitScanForward(&index, mask);
+     return (unsigned int)index;
+ #else
+     return (unsigned int)__builtin_ctz(mask);
+ #endif
+ }
+
+ /**
+  * find_rom_magic() - Finds the next candidate segment header in a buffer.
+  * @data: Pointer to the buffer to search.
+  * @size: Size of the buffer in bytes.
+  * @from: Offset of the first header position to consider.
+  *
+  * Searches for the pattern 'xx 5A A5 69 55' (last_msg_idx followed by
+  * ROM_MAGIC). Sixteen candidate positions are tested per iteration with
+  * SSE2 or NEON compares where available; the remainder (or the whole buffer
+  * on other targets) is handled with memchr() on the first magic byte.
+  *
+  * Return: Offset of the header start (the last_msg_idx byte), or @size if
+  * no further candidate exists.
+  */
+ size_t
+ find_rom_magic(const uint8_t *data, size_t size, size_t from)
+ {
+     size_t pos; /* Position of the 0x5A byte, i.e. header start + 1 */
+
+     if (size < 5 || from > size - 5)
+         return size;
+     pos = from + 1;
+
+ #if defined(HAVE_SSE2)
+     {
+         const __m128i m0 = _mm_set1_epi8((char)ROM_MAGIC[0]);
+         const __m128i m1 = _mm_set1_epi8((char)ROM_MAGIC[1]);
+         const __m128i m2 = _mm_set1_epi8((char)ROM_MAGIC[2]);
+         const __m128i m3 = _mm_set1_epi8((char)ROM_MAGIC[3]);
+
+         while (pos + 16 + 3 <= size) {
+             __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + pos)), m0);
+             uint32_t mask = (uint32_t)_mm_movemask_epi8(eq);
+
+             if (mask) {
+                 eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + pos + 1)), m1));
+                 eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + pos + 2)), m2));
+                 eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + pos + 3)), m3));
+                 mask = (uint32_t)_mm_movemask_epi8(eq);
+                 if (mask)
+                     return pos + lowest_set_bit(mask) - 1;
+             }
+             pos += 16;
+         }
+     }
+ #elif defined(HAVE_NEON)
+     {
+         const uint8x16_t m0 = vdupq_n_u8(ROM_MAGIC[0]);
+         const uint8x16_t m1 = vdupq_n_u8(ROM_MAGIC[1]);
+         const uint8x16_t m2 = vdupq_n_u8(ROM_MAGIC[2]);
+         const uint8x16_t m3 = vdupq_n_u8(ROM_MAGIC[3]);
+
+         while (pos + 16 + 3 <= size) {
+             uint8x16_t eq = vceqq_u8(vld1q_u8(data + pos), m0);
+
+             if (vmaxvq_u8(eq)) {
+                 eq = vandq_u8(eq, vceqq_u8(vld1q_u8(data + pos + 1), m1));
+                 eq = vandq_u8(eq, vceqq_u8(vld1q_u8(data + pos + 2), m2));
+                 eq = vandq_u8(eq, vceqq_u8(vld1q_u8(data + pos + 3), m3));
+                 if (vmaxvq_u8(eq)) {
+                     uint8_t lanes[16];
+                     unsigned int k;
+                     vst1q_u8(lanes, eq);
+                     for (k = 0; k < 16; ++k) {
+                         if (lanes[k])
+                             return pos + k - 1;
+                     }
+                 }
+             }
+             pos += 16;
+         }
+     }
+ #endif
+
+     /* Scalar tail (or whole buffer without SIMD support) */
+     while (pos + 4 <= size) {
+         const uint8_t *hit = (const uint8_t *)memchr(data + pos, ROM_MAGIC[0], size - 3 - pos);
+         if (!hit)
+             break;
+         pos = (size_t)(hit - data);
+         if (memcmp(hit, ROM_MAGIC, 4) == 0)
+             return pos - 1;
+         pos++;
+     }
+     return size;
+ }
+
+ /**
+  * validate_segment_header() - Checks the plausibility of a candidate segment header.
+  * @rom_data:          Pointer to the start of the ROM data buffer.
+  * @rom_size:          Total size of the ROM data.
+  * @start:             Offset of the candidate header (last_msg_idx byte).
+  * @message_count_ptr: Pointer to store the number of messages in the segment.
+  * @last_offset_ptr:   Pointer to store the byte offset (relative to @start)
+  *                     of the highest message start in the offset table.
+  *
+  * A candidate is accepted if the magic matches, the offset table fits,
+  * every offset points past the table and inside the available data,
+  * offsets never decrease, and every message starts with a known mode byte.
+  *
+  * Return: true if the header looks like a real segment, false otherwise.
+  */
+ bool
+ validate_segment_header(const uint8_t *rom_data, size_t rom_size, size_t start,
+             uint32_t *message_count_ptr, uint32_t *last_offset_ptr)
+ {
+     uint32_t message_count, k;
+     size_t table_end, limit;
+     uint32_t prev_offset = 0;
+
+     if (start + 5 > rom_size || memcmp(rom_data + start + 1, ROM_MAGIC, 4) != 0)
+         return false;
+
+     message_count = (uint32_t)rom_data[start] + 1;
+     table_end = 5 + (size_t)message_count * 2;
+     limit = rom_size - start;
+     if (limit > ROM_SEGMENT_SIZE)
+         limit = ROM_SEGMENT_SIZE;
+     if (table_end > limit)
+         return false;
+
+     for (k = 0; k < message_count; ++k) {
+         uint32_t offset = (uint32_t)read_u16be(rom_data + start + 5 + k * 2) * 2;
+         uint8_t mode;
+
+         if (offset < table_end || offset >= limit || offset < prev_offset)
+             return false;
+         mode = rom_data[start + offset];
+         if (mode != MODE_ADPCM && mode != MODE_PCM)
+             return false;
+         prev_offset = offset;
+     }
+
+     *message_count_ptr = message_count;
+     *last_offset_ptr = prev_offset;
+     return true;
+ }
+
+ /**
+  * build_segment_directory_fixed() - Builds the segment directory assuming the
+  * standard layout of one segment every ROM_SEGMENT_SIZE bytes.
+  * @rom_data: Pointer to the start of the ROM data buffer.
+  * @rom_size: Total size of the ROM data.
+  * @dir:      Pointer to the SegmentDirectory to populate.
+  *
+  * Stops at the first segment with an invalid magic number. Segments found
+  * before a fatal error are kept in @dir so they can still be processed.
+  *
+  * Return: true on success, false on a fatal ROM structure error.
+  */
+ bool
+ build_segment_directory_fixed(const uint8_t *rom_data, size_t rom_size, SegmentDirectory *dir)
+ {
+     size_t segment_start;
+     int segment_index_0_based = 0;
+
+     for (segment_start = 0; segment_start < rom_size; segment_start += ROM_SEGMENT_SIZE, ++segment_index_0_based) {
+         SegmentEntry entry;
+         size_t offset_table_size;
+
+         /* Check header */
+         if (segment_start + 5 > rom_size) {
+             if (segment_index_0_based > 0) {
+                  verbose_printf("  INFO: Incomplete segment data at end of file. Stopping.\n");
+                  break;
+             }
+             fprintf(stderr, "ERROR: ROM file too small for even one segment header.\n");
+             return false;
+         }
+         if (memcmp(rom_data + segment_start + 1, ROM_MAGIC, 4) != 0) {
+             if (segment_index_0_based == 0) {
+                 fprintf(stderr, "ERROR: Invalid magic number in first segment (Segment 0) header.\n");
+                 return false;
+             }
+             verbose_printf("  INFO: Invalid magic number found at segment %d start. Assuming end of ROM data.\n", segment_index_0_based);
+             break;
+         }
+
+         entry.start = segment_start;
+         entry.size = rom_size - segment_start;
+         if (entry.size > ROM_SEGMENT_SIZE)
+             entry.size = ROM_SEGMENT_SIZE;
+         entry.message_count = (uint32_t)rom_data[segment_start] + 1;
+
+         /* Check offset table size */
+         offset_table_size = entry.message_count * sizeof(uint16_t);
+         if (segment_start + 5 + offset_table_size > segment_start + entry.size) {
+             fprintf(stderr, "ERROR: Offset table size (%zu bytes for %u messages) exceeds segment/ROM bounds for segment %d.\n",
+                 offset_table_size, entry.message_count, segment_index_0_based);
+             return false;
+         }
+
+         if (!add_segment_entry(dir, entry))
+             return false;
+     }
+     return true;
+ }
+
+ /**
+  * scan_segment_directory() - Builds the segment directory by scanning the
+  * whole ROM image for plausible segment headers (recovery mode).
+  * @rom_data: Pointer to the start of the ROM data buffer.
+  * @rom_size: Total size of the ROM data.
+  * @dir:      Pointer to the SegmentDirectory to populate.
+  *
+  * Every occurrence of the header signature is validated with
+  * validate_segment_header(). A segment extends to the next accepted header,
+  * ROM_SEGMENT_SIZE, or the end of the data, whichever comes first.
+  * Candidates before the last message start of the previous segment are
+  * ignored, since they lie inside that segment's own message data.
+  *
+  * Return: true if at least one segment was found, false otherwise.
+  */
+ bool
+ scan_segment_directory(const uint8_t *rom_data, size_t rom_size, SegmentDirectory *dir)
+ {
+     size_t pos = 0;
+     size_t expected_start = 0; /* Where the next segment would start if contiguous */
+     size_t candidates = 0;
+
+     while ((pos = find_rom_magic(rom_data, rom_size, pos)) < rom_size) {
+         SegmentEntry entry;
+         uint32_t last_offset;
+
+         candidates++;
+         if (!validate_segment_header(rom_data, rom_size, pos, &entry.message_count, &last_offset)) {
+             verbose_printf("  Scan: Rejected candidate header at 0x%zX (implausible offset table).\n", pos);
+             pos++;
+             continue;
+         }
+
+         /* Truncate the previous segment if this one starts before its nominal end */
+         if (dir->count > 0) {
+             SegmentEntry *prev = &dir->segments[dir->count - 1];
+             if (pos < prev->start + prev->size)
+                 prev->size = pos - prev->start;
+         }
+
+         if (pos != expected_start)
+             verbose_printf("  Scan: Skipped %zu bytes of unrecognized data before 0x%zX.\n",
+                        (pos > expected_start) ? pos - expected_start : 0, pos);
+
+         entry.start = pos;
+         entry.size = rom_size - pos;
+         if (entry.size > ROM_SEGMENT_SIZE)
+             entry.size = ROM_SEGMENT_SIZE;
+         verbose_printf("  Scan: Segment %zu at 0x%zX (%u messages).\n", dir->count, pos, entry.message_count);
+         if (!add_segment_entry(dir, entry))
+             return false;
+
+         expected_start = pos + entry.size;
+         pos += last_offset + 1;
+     }
+
+     verbose_printf("Scan complete: %zu candidate headers, %zu segments accepted.\n", candidates, dir->count);
+     if (dir->count == 0) {
+         fprintf(stderr, "ERROR: No valid segment headers found while scanning ROM data.\n");
+         return false;
+     }
+     return true;
+ }
+
+
+ /* --- Message Catalog --- */
+
+ /**
+  * init_message_catalog() - Initializes an empty MessageCatalog.
+  * @catalog: Pointer to the MessageCatalog.
+  */
+ void
+ init_message_catalog(MessageCatalog *catalog)
+ {
+     memset(catalog, 0, sizeof(*catalog));
+ }
+
+ /**
+  * free_message_catalog() - Frees memory associated with a MessageCatalog.
+  * @catalog: Pointer to the MessageCatalog.
+  */
+ void
+ free_message_catalog(MessageCatalog *catalog)
+ {
+     free(catalog->block);
+     init_message_catalog(catalog);
+ }
+
+ /**
+  * reserve_message_catalog() - Makes room for a number of messages.
+  * @catalog: Pointer to the MessageCatalog.
+  * @count:   Number of messages to hold.
+  *
+  * All arrays share one block, widest element type first. The capacity is
+  * a multiple of 8, so every array starts 8-byte aligned. Existing entries
+  * are not kept.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ reserve_message_catalog(MessageCatalog *catalog, size_t count)
+ {
+     size_t entry_size = sizeof(uint64_t) + 5 * sizeof(size_t) + sizeof(const MessageMapping *) +
+                         sizeof(MessageMapping) + 2 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t);
+     size_t capacity = (count + 7) & ~(size_t)7;
+     uint8_t *block;
+
+     if (count <= catalog->capacity && catalog->block)
+         return true;
+     if (capacity == 0)
+         capacity = 8;
+     block = (uint8_t *)malloc(capacity * entry_size);
+     if (!block) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the message catalog (%zu messages).\n", count);
+         return false;
+     }
+     free(catalog->block);
+     catalog->block = block;
+     catalog->capacity = capacity;
+     catalog->hash = (uint64_t *)block;
+     block += capacity * sizeof(uint64_t);
+     catalog->segment_start = (size_t *)block;
+     block += capacity * sizeof(size_t);
+     catalog->start = (size_t *)block;
+     block += capacity * sizeof(size_t);
+     catalog->limit = (size_t *)block;
+     block += capacity * sizeof(size_t);
+     catalog->end = (size_t *)block;
+     block += capacity * sizeof(size_t);
+     catalog->samples = (size_t *)block;
+     block += capacity * sizeof(size_t);
+     catalog->mapping = (const MessageMapping **)block;
+     block += capacity * sizeof(const MessageMapping *);
+     catalog->compiled = (MessageMapping *)block;
+     block += capacity * sizeof(MessageMapping);
+     catalog->segment = (uint32_t *)block;
+     block += capacity * sizeof(uint32_t);
+     catalog->absolute = (uint32_t *)block;
+     block += capacity * sizeof(uint32_t);
+     catalog->index = (uint16_t *)block;
+     block += capacity * sizeof(uint16_t);
+     catalog->mode = block;
+     return true;
+ }
+
+ /**
+  * build_message_catalog() - Catalogs every message of the segments in one pass.
+  * @catalog:       Pointer to the MessageCatalog (its previous contents are replaced).
+  * @rom_data:      ROM data holding the segments.
+  * @rom_size:      Size of @rom_data.
+  * @segments:      Segments to catalog, in ROM order (offset tables already validated).
+  * @segment_base:  Segment index of the first entry of @segments.
+  * @absolute_base: Absolute index of the first message.
+  * @mapping_table: Mappings to attach (or NULL).
+  *
+  * Each offset table is read once. Messages whose mode byte lies outside
+  * @rom_data are kept with an empty extent, so no consumer has to check
+  * the bounds again. Text mapping tables are matched to the messages in one
+  * pass over their entries (the first entry of a position wins, as in
+  * find_mapping()); compiled ones are looked up directly.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ build_message_catalog(MessageCatalog *catalog, const uint8_t *rom_data, size_t rom_size,
+                       const SegmentDirectory *segments, int segment_base, int absolute_base,
+                       const MappingTable *mapping_table)
+ {
+     uint64_t phase_start = stats_timer_start();
+     size_t count = 0, n = 0, i, segment_pos;
+
+     for (segment_pos = 0; segment_pos < segments->count; ++segment_pos)
+         count += segments->segments[segment_pos].message_count;
+     if (!reserve_message_catalog(catalog, count))
+         return false;
+     catalog->rom_data = rom_data;
+     catalog->rom_size = rom_size;
+
+     for (segment_pos = 0; segment_pos < segments->count; ++segment_pos) {
+         const SegmentEntry *segment = &segments->segments[segment_pos];
+         const uint8_t *table = rom_data + segment->start + 5;
+         uint32_t k;
+
+         for (k = 0; k < segment->message_count; ++k, ++n) {
+             size_t start = segment->start + (size_t)read_u16be(table + k * 2) * 2;
+             size_t end = start, samples = 0;
+
+             catalog->segment_start[n] = segment->start;
+             catalog->start[n] = start;
+             catalog->limit[n] = segment->start + ((k + 1 < segment->message_count) ?
+                                                   (size_t)read_u16be(table + (k + 1) * 2) * 2 : segment->size);
+             catalog->mode[n] = ROM_ERASED_BYTE;
+             if (start < rom_size) {
+                 catalog->mode[n] = rom_data[start];
+                 measure_message(rom_data, rom_size, start, catalog->limit[n], k + 1 == segment->message_count,
+                                 &end, &samples);
+             }
+             catalog->end[n] = end;
+             catalog->samples[n] = samples;
+             catalog->hash[n] = hash_message_bytes(rom_data + (start < rom_size ? start : 0), end - start);
+             catalog->mapping[n] = NULL;
+             catalog->segment[n] = (uint32_t)(segment_base + (int)segment_pos);
+             catalog->absolute[n] = (uint32_t)absolute_base + (uint32_t)n;
+             catalog->index[n] = (uint16_t)k;
+         }
+     }
+     catalog->count = n;
+
+     if (mapping_table && mapping_table->binary) {
+         for (i = 0; i < n; ++i) {
+             if (find_compiled_mapping(mapping_table, (int)catalog->segment[i], catalog->index[i], &catalog->compiled[i]))
+                 catalog->mapping[i] = &catalog->compiled[i];
+         }
+     } else if (mapping_table && mapping_table->count > 0) {
+         size_t *first = (size_t *)malloc((segments->count + 1) * sizeof(size_t));
+
+         if (!first) {
+             fprintf(stderr, "ERROR: Failed to allocate memory for the message catalog.\n");
+             return false;
+         }
+         first[0] = 0;
+         for (segment_pos = 0; segment_pos < segments->count; ++segment_pos)
+             first[segment_pos + 1] = first[segment_pos] + segments->segments[segment_pos].message_count;
+         for (i = 0; i < mapping_table->count; ++i) {
+             const MessageMapping *entry = &mapping_table->mappings[i];
+             long segment_pos_mapped = (long)entry->segment_index - segment_base;
+
+             if (segment_pos_mapped < 0 || (size_t)segment_pos_mapped >= segments->count ||
+                 entry->message_index_in_seg < 0 ||
+                 (size_t)entry->message_index_in_seg >= first[segment_pos_mapped + 1] - first[segment_pos_mapped])
+                 continue;
+             if (!catalog->mapping[first[segment_pos_mapped] + (size_t)entry->message_index_in_seg])
+                 catalog->mapping[first[segment_pos_mapped] + (size_t)entry->message_index_in_seg] = entry;
+         }
+         free(first);
+     }
+
+     stats_record_phase(STATS_PHASE_SEGMENT_PARSE, phase_start, 0);
+     verbose_printf("Catalog: %zu message(s) in %zu segment(s).\n", n, segments->count);
+     return true;
+ }
+
+ /**
+  * find_catalog_message() - Finds a message of the catalog by its absolute index.
+  * @catalog:          Pointer to the MessageCatalog.
+  * @absolute_msg_idx: 0-based absolute message index.
+  *
+  * Return: Position in @catalog, or @catalog->count if the index is not cataloged.
+  */
+ size_t
+ find_catalog_message(const MessageCatalog *catalog, long absolute_msg_idx)
+ {
+     if (catalog->count == 0 || absolute_msg_idx < (long)catalog->absolute[0] ||
+         absolute_msg_idx - (long)catalog->absolute[0] >= (long)catalog->count)
+         return catalog->count;
+     return (size_t)(absolute_msg_idx - (long)catalog->absolute[0]);
+ }
+
+ /**
+  * process_catalog() - Lists or decodes the messages of a catalog.
+  * @catalog:            Pointer to the MessageCatalog.
+  * @rom_basename:       Base filename of the input ROM file.
+  * @output_dir:         Directory for output files (NULL for current directory).
+  * @target_message_idx: Target absolute message index for decoding (-1 for all).
+  *
+  * A decode target is looked up by position; no other message is visited.
+  *
+  * Return: Enum indicating status (continue, target found, error).
+  */
+ HandleMessageResult
+ process_catalog(const MessageCatalog *catalog, const char *rom_basename, const char *output_dir,
+                 long target_message_idx)
+ {
+     HandleMessageResult result = MSG_HANDLED_CONTINUE;
+     size_t first = 0, last = catalog->count, i;
+
+     if (!list_mode && target_message_idx >= 0) {
+         first = find_catalog_message(catalog, target_message_idx);
+         last = (first < catalog->count) ? first + 1 : first;
+     }
+     for (i = first; i < last && result == MSG_HANDLED_CONTINUE; ++i) {
+         if (i == first || catalog->index[i] == 0) {
+             size_t next = i + 1;
+
+             while (next < catalog->count && catalog->segment[next] == catalog->segment[i])
+                 ++next;
+             verbose_printf("Processing Segment %u (Offset 0x%zX)...\n", catalog->segment[i], catalog->segment_start[i]);
+             verbose_printf("  Segment Header OK: Last Message Index %zu (%zu messages)\n",
+                        catalog->index[i] + (next - i) - 1, catalog->index[i] + (next - i));
+         }
+         result = handle_message_iteration(catalog, i, rom_basename, output_dir, list_mode, quiet_mode,
+                                           target_message_idx);
+     }
+     return result;
+ }
+
+
+ /* --- Streaming Input --- */
+
+ /**
+  * discard_window_bytes() - Drops bytes from the front of the streaming window.
+  * @window:     Pointer to the window buffer.
+  * @filled_ptr: Pointer to the number of valid bytes in the window (updated).
+  * @count:      Number of bytes to drop.
+  */
+ void
+ discard_window_bytes(uint8_t *window, size_t *filled_ptr, size_t count)
+ {
+     if (count >= *filled_ptr) {
+         *filled_ptr = 0;
+         return;
+     }
+     memmove(window, window + count, *filled_ptr - count);
+     *filled_ptr -= count;
+ }
+
+ /**
+  * stream_rom_segments() - Lists or decodes messages while reading the ROM
+  * data through a fixed-size window (streaming mode).
+  * @fp:                 Input stream (file or pipe), opened in binary mode.
+  * @mapping_table:      Pointer to the loaded mapping table.
+  * @rom_basename:       Base filename of the input ROM (for Artist tag).
+  * @output_dir:         Directory for output files (NULL for current directory).
+  * @target_message_idx: Target absolute message index for decoding (-1 for all).
+  * @target_found_ptr:   Pointer to store whether the target message was processed.
+  *
+  * The window holds STREAM_WINDOW_SIZE bytes (two segments). Each segment is
+  * moved to the front of the window, cataloged, processed with
+  * process_catalog() and then discarded, so memory use does not depend on
+  * the size of the input.
+  * With scan_mode the window is searched for the next plausible header;
+  * otherwise a header is expected every ROM_SEGMENT_SIZE bytes.
+  *
+  * Return: true on success, false on a read or ROM structure error.
+  */
+ bool
+ stream_rom_segments(FILE *fp, const MappingTable *mapping_table, const char *rom_basename,
+             const char *output_dir, long target_message_idx, bool *target_found_ptr)
+ {
+     uint8_t *window;
+     size_t filled = 0;
+     bool at_eof = false;
+     bool success = true;
+     int segment_index_0_based = 0;
+     int absolute_msg_base = 0;
+     uint64_t stream_offset = 0; /* Input offset of window[0] */
+     SegmentDirectory directory; /* The segment at the front of the window */
+     MessageCatalog catalog; /* Reused for every segment */
+
+     *target_found_ptr = false;
+     memset(&directory, 0, sizeof(directory));
+     init_message_catalog(&catalog);
+     window = (uint8_t *)malloc(STREAM_WINDOW_SIZE);
+     if (!window) {
+         fprintf(stderr, "ERROR: Failed to allocate %d bytes for streaming window.\n", STREAM_WINDOW_SIZE);
+         return false;
+     }
+
+     for (;;) {
+         SegmentEntry entry;
+         uint32_t last_offset;
+         HandleMessageResult result;
+         size_t filled_before = filled;
+         uint64_t phase_start = stats_timer_start();
+
+         /* Top up the window */
+         while (!at_eof && filled < STREAM_WINDOW_SIZE) {
+             size_t n = fread(window + filled, 1, STREAM_WINDOW_SIZE - filled, fp);
+             filled += n;
+             if (n == 0) {
+                 if (ferror(fp)) {
+                     fprintf(stderr, "ERROR: Read error on ROM input stream at offset 0x%llX.\n",
+                         (unsigned long long)(stream_offset + filled));
+                     success = false;
+                 }
+                 at_eof = true;
+             }
+         }
+         stats_record_phase(STATS_PHASE_ROM_LOAD, phase_start, filled - filled_before);
+         if (!success)
+             break;
+
+         phase_start = stats_timer_start();
+         if (scan_mode) {
+             /* Candidates past search_limit are revisited once more data is in the window */
+             size_t search_limit = at_eof ? filled : filled - ROM_SEGMENT_SIZE + 1;
+             size_t pos = 0;
+             bool found = false;
+
+             while ((pos = find_rom_magic(window, filled, pos)) < search_limit) {
+                 if (validate_segment_header(window, filled, pos, &entry.message_count, &last_offset)) {
+                     found = true;
+                     break;
+                 }
+                 verbose_printf("  Scan: Rejected candidate header at 0x%llX (implausible offset table).\n",
+                            (unsigned long long)(stream_offset + pos));
+                 pos++;
+             }
+             if (!found) {
+                 if (at_eof) {
+                     if (segment_index_0_based == 0) {
+                         fprintf(stderr, "ERROR: No valid segment headers found in ROM input stream.\n");
+                         success = false;
+                     }
+                     break;
+                 }
+                 pos = search_limit;
+             }
+             if (pos > 0) {
+                 /* Move the segment (or the unsearched rest) to the front of the window */
+                 verbose_printf("  Scan: Skipped %zu bytes of unrecognized data at 0x%llX.\n",
+                            pos, (unsigned long long)stream_offset);
+                 discard_window_bytes(window, &filled, pos);
+                 stream_offset += pos;
+                 continue;
+             }
+
+             entry.start = 0;
+             entry.size = (filled > ROM_SEGMENT_SIZE) ? ROM_SEGMENT_SIZE : filled;
+
+             /* End the segment early if another plausible header follows */
+             pos = last_offset + 1;
+             while ((pos = find_rom_magic(window, filled, pos)) < entry.size) {
+                 uint32_t next_count, next_last_offset;
+                 if (validate_segment_header(window, filled, pos, &next_count, &next_last_offset)) {
+                     entry.size = pos;
+                     break;
+                 }
+                 pos++;
+             }
+         } else {
+             if (filled < 5) {
+                 if (segment_index_0_based == 0) {
+                     fprintf(stderr, "ERROR: ROM input too small for even one segment header.\n");
+                     success = false;
+                 } else if (filled > 0) {
+                     verbose_printf("  INFO: Incomplete segment data at end of input. Stopping.\n");
+                 }
+                 break;
+             }
+             if (memcmp(window + 1, ROM_MAGIC, 4) != 0) {
+                 if (segment_index_0_based == 0) {
+                     fprintf(stderr, "ERROR: Invalid magic number in first segment (Segment 0) header.\n");
+                     success = false;
+                 } else {
+                     verbose_printf("  INFO: Invalid magic number found at segment %d start. Assuming end of ROM data.\n", segment_index_0_based);
+                 }
+                 break;
+             }
+             entry.start = 0;
+             entry.size = (filled > ROM_SEGMENT_SIZE) ? ROM_SEGMENT_SIZE : filled;
+             entry.message_count = (uint32_t)window[0] + 1;
+             if (5 + entry.message_count * sizeof(uint16_t) > entry.size) {
+                 fprintf(stderr, "ERROR: Offset table size (%zu bytes for %u messages) exceeds segment/ROM bounds for segment %d.\n",
+                     entry.message_count * sizeof(uint16_t), entry.message_count, segment_index_0_based);
+                 success = false;
+                 break;
+             }
+         }
+
+         stats_record_phase(STATS_PHASE_SEGMENT_PARSE, phase_start, 0);
+         verbose_printf("Streaming segment %d from input offset 0x%llX (%zu bytes).\n",
+                    segment_index_0_based, (unsigned long long)stream_offset, entry.size);
+         directory.segments = &entry;
+         directory.count = 1;
+         if (!build_message_catalog(&catalog, window, entry.size, &directory, segment_index_0_based,
+                                    absolute_msg_base, mapping_table)) {
+             success = false;
+             break;
+         }
+         result = process_catalog(&catalog, rom_basename, output_dir, target_message_idx);
+         absolute_msg_base += (int)entry.message_count;
+         ++segment_index_0_based;
+
+         if (result == MSG_HANDLED_ERROR) {
+             success = false;
+             break;
+         } else if (result == MSG_HANDLED_TARGET_FOUND) {
+             *target_found_ptr = true;
+             break;
+         }
+
+         discard_window_bytes(window, &filled, entry.size);
+         stream_offset += entry.size;
+     }
+
+     free_message_catalog(&catalog);
+     free(window);
+     return success;
+ }
+
+ /**
+  * open_rom_stream() - Opens the ROM input for streaming mode.
+  * @rom_filepath: Path to the ROM file, or "-" for standard input.
+  *
+  * Return: Binary input stream, or NULL on failure.
+  */
+ FILE *
+ open_rom_stream(const char *rom_filepath)
+ {
+     FILE *fp;
+
+     if (strcmp(rom_filepath, "-") == 0) {
+ #ifdef _WIN32
+         _setmode(_fileno(stdin), _O_BINARY);
+ #endif
+         return stdin;
+     }
+     fp = fopen(rom_filepath, "rb");
+     if (!fp)
+         fprintf(stderr, "ERROR: Cannot open ROM file '%s'.\n", rom_filepath);
+     return fp;
+ }
+
+
+ /* --- Automap --- */
+
+ AutomapIndex *active_automap = NULL; /* Set while listing names come from --automap */
+
+ /**
+  * init_automap_index() - Initializes an empty AutomapIndex.
+  * @index: Pointer to the AutomapIndex.
+  */
+ void
+ init_automap_index(AutomapIndex *index)
+ {
+     memset(index, 0, sizeof(*index));
+     init_pcm_buffer(&index->envelopes);
+     init_pcm_buffer(&index->scratch);
+     init_pcm_buffer(&index->query);
+ }
+
+ /**
+  * free_automap_index() - Frees memory associated with an AutomapIndex.
+  * @index: Pointer to the AutomapIndex.
+  */
+ void
+ free_automap_index(AutomapIndex *index)
+ {
+     free(index->entries);
+     free((void *)index->by_length);
+     free((void *)index->names);
+     free(index->uses);
+     free_pcm_buffer(&index->envelopes);
+     free_pcm_buffer(&index->scratch);
+     free_pcm_buffer(&index->query);
+     init_automap_index(index);
+ }
+
+ /**
+  * append_message_envelope() - Appends the loudness envelope of a message.
+  * @index:    AutomapIndex whose scratch buffer receives the decoded samples.
+  * @rom_data: Pointer to the start of the ROM data buffer.
+  * @rom_size: Total size of the ROM data.
+  * @start:    Offset of the message mode byte.
+  * @end:      Offset after the last byte of the message (measure_message()).
+  * @envelope: PcmBuffer the envelope frames are appended to.
+  *
+  * Each frame is log2(1 + mean magnitude) of AUTOMAP_FRAME_SIZE samples in
+  * 8.8 fixed point. The envelope follows the loudness contour of a prompt
+  * and stays close when the same recording is re-encoded or re-leveled.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_message_envelope(AutomapIndex *index, const uint8_t *rom_data, size_t rom_size,
+                         size_t start, size_t end, PcmBuffer *envelope)
+ {
+     PcmBuffer *pcm = &index->scratch;
+     size_t frame, i;
+
+     if (!decode_message_samples(rom_data, rom_size, start, end, pcm))
+         return false;
+
+     for (frame = 0; frame + AUTOMAP_FRAME_SIZE <= pcm->count; frame += AUTOMAP_FRAME_SIZE) {
+         uint32_t magnitude = 0;
+
+         for (i = 0; i < AUTOMAP_FRAME_SIZE; ++i)
+             magnitude += (uint32_t)abs(pcm->samples[frame + i]);
+         if (!add_pcm_sample(envelope, (int16_t)(256.0 * log2(1.0 + (double)magnitude / AUTOMAP_FRAME_SIZE) + 0.5)))
+             return false;
+     }
+     return true;
+ }
+
+ /**
+  * envelope_similarity() - Scores how alike two loudness envelopes are.
+  * @a:        First envelope.
+  * @a_frames: Number of frames in @a.
+  * @b:        Second envelope.
+  * @b_frames: Number of frames in @b.
+  *
+  * Return: Correlation of the common frames, scaled by the length ratio
+  * (1.0 for identical envelopes, 0 if either is flat).
+  */
+ double
+ envelope_similarity(const int16_t *a, size_t a_frames, const int16_t *b, size_t b_frames)
+ {
+     size_t n = (a_frames < b_frames) ? a_frames : b_frames;
+     size_t longest = (a_frames < b_frames) ? b_frames : a_frames;
+     double mean_a = 0.0, mean_b = 0.0, covariance = 0.0, variance_a = 0.0, variance_b = 0.0;
+     size_t i;
+
+     if (n == 0)
+         return 0.0;
+     for (i = 0; i < n; ++i) {
+         mean_a += a[i];
+         mean_b += b[i];
+     }
+     mean_a /= (double)n;
+     mean_b /= (double)n;
+     for (i = 0; i < n; ++i) {
+         double da = a[i] - mean_a, db = b[i] - mean_b;
+
+         covariance += da * db;
+         variance_a += da * da;
+         variance_b += db * db;
+     }
+     if (variance_a <= 0.0 || variance_b <= 0.0)
+         return 0.0;
+     return covariance / sqrt(variance_a * variance_b) * (double)n / (double)longest;
+ }
+
+ /**
+  * compare_automap_by_hash() - qsort() comparator ordering entries by hash, then ROM order.
+  */
+ int
+ compare_automap_by_hash(const void *a, const void *b)
+ {
+     const AutomapEntry *entry_a = (const AutomapEntry *)a;
+     const AutomapEntry *entry_b = (const AutomapEntry *)b;
+
+     if (entry_a->hash != entry_b->hash)
+         return (entry_a->hash < entry_b->hash) ? -1 : 1;
+     return (entry_a->order < entry_b->order) ? -1 : (entry_a->order > entry_b->order);
+ }
+
+ /**
+  * compare_automap_by_length() - qsort() comparator ordering entry pointers by envelope length, then ROM order.
+  */
+ int
+ compare_automap_by_length(const void *a, const void *b)
+ {
+     const AutomapEntry *entry_a = *(const AutomapEntry *const *)a;
+     const AutomapEntry *entry_b = *(const AutomapEntry *const *)b;
+
+     if (entry_a->frames != entry_b->frames)
+         return (entry_a->frames < entry_b->frames) ? -1 : 1;
+     return (entry_a->order < entry_b->order) ? -1 : (entry_a->order > entry_b->order);
+ }
+
+ /**
+  * compare_automap_names() - qsort()/bsearch() comparator ordering name pointers with strcmp().
+  */
+ int
+ compare_automap_names(const void *a, const void *b)
+ {
+     return strcmp(*(const char *const *)a, *(const char *const *)b);
+ }
+
+ /**
+  * automap_name_exists() - Checks whether a reference message carries a name.
+  * @index: Pointer to the AutomapIndex.
+  * @name:  Name to look for.
+  *
+  * Return: true if some entry of the reference mapping has @name.
+  */
+ bool
+ automap_name_exists(const AutomapIndex *index, const char *name)
+ {
+     return index->count > 0 &&
+            bsearch(&name, (const void *)index->names, index->count, sizeof(const char *), compare_automap_names) != NULL;
+ }
+
+ /**
+  * automap_preference() - Ranks a reference entry among equally good matches.
+  * @index:   Pointer to the AutomapIndex.
+  * @entry:   Candidate entry.
+  * @catalog: Pointer to the MessageCatalog holding the message being named.
+  * @i:       Position of the message in @catalog.
+  *
+  * Return: 0 for an unused entry at the message's own (segment, index),
+  * 1 for another unused entry, 2 for the used entry at that position, 3 otherwise.
+  */
+ int
+ automap_preference(const AutomapIndex *index, const AutomapEntry *entry, const MessageCatalog *catalog, size_t i)
+ {
+     bool same_position = entry->segment == catalog->segment[i] && entry->index == catalog->index[i];
+
+     if (index->uses[entry - index->entries] == 0)
+         return same_position ? 0 : 1;
+     return same_position ? 2 : 3;
+ }
+
+ /**
+  * build_automap_index() - Indexes the mapped messages of a reference ROM.
+  * @index:         Pointer to the (empty) AutomapIndex to fill.
+  * @rom_filepath:  Path to the reference ROM.
+  * @mapping_table: Mapping of the reference ROM. Must outlive @index, which
+  *                 points to its names and comments.
+  *
+  * Every mapped message contributes its payload hash and loudness envelope.
+  * Lookups then cost a binary search for the hash and, failing that, a
+  * comparison with the references of similar length only, so labelling many
+  * ROMs stays linear in their size.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ build_automap_index(AutomapIndex *index, const char *rom_filepath, const MappingTable *mapping_table)
+ {
+     uint8_t *rom_data = NULL;
+     size_t rom_size = 0;
+     SegmentDirectory directory;
+     MessageCatalog catalog;
+     size_t i;
+     bool success = false;
+
+     init_segment_directory(&directory);
+     init_message_catalog(&catalog);
+     if (!load_rom_data(rom_filepath, &rom_data, &rom_size))
+         goto cleanup;
+     if (!(scan_mode ? scan_segment_directory(rom_data, rom_size, &directory) :
+           build_segment_directory_fixed(rom_data, rom_size, &directory)) && directory.count == 0)
+         goto cleanup;
+
+     if (!build_message_catalog(&catalog, rom_data, rom_size, &directory, 0, 0, mapping_table))
+         goto cleanup;
+
+     for (i = 0; i < catalog.count; ++i) {
+         AutomapEntry *entry;
+
+         if (catalog.start[i] >= rom_size || !catalog.mapping[i])
+             continue;
+         if (index->count >= index->capacity) {
+             size_t new_capacity = (index->capacity == 0) ? 256 : index->capacity * 2;
+             AutomapEntry *new_entries = (AutomapEntry *)realloc(index->entries, new_capacity * sizeof(AutomapEntry));
+             if (!new_entries) {
+                 fprintf(stderr, "ERROR: Failed to allocate memory for the automap index.\n");
+                 goto cleanup;
+             }
+             index->entries = new_entries;
+             index->capacity = new_capacity;
+         }
+
+         entry = &index->entries[index->count];
+         entry->hash = catalog.hash[i];
+         entry->order = index->count;
+         entry->segment = catalog.segment[i];
+         entry->index = catalog.index[i];
+         entry->envelope = index->envelopes.count;
+         if (!append_message_envelope(index, rom_data, rom_size, catalog.start[i], catalog.end[i], &index->envelopes))
+             goto cleanup;
+         entry->frames = index->envelopes.count - entry->envelope;
+         entry->name = catalog.mapping[i]->output_filename_base;
+         entry->comment = catalog.mapping[i]->comment;
+         index->count++;
+     }
+
+     index->by_length = (const AutomapEntry **)malloc((index->count ? index->count : 1) * sizeof(AutomapEntry *));
+     index->names = (const char **)malloc((index->count ? index->count : 1) * sizeof(const char *));
+     index->uses = (unsigned *)calloc(index->count ? index->count : 1, sizeof(unsigned));
+     if (!index->by_length || !index->names || !index->uses) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the automap index.\n");
+         goto cleanup;
+     }
+     qsort(index->entries, index->count, sizeof(AutomapEntry), compare_automap_by_hash);
+     for (i = 0; i < index->count; ++i)
+         index->by_length[i] = &index->entries[i];
+     qsort((void *)index->by_length, index->count, sizeof(AutomapEntry *), compare_automap_by_length);
+     for (i = 0; i < index->count; ++i)
+         index->names[i] = index->entries[i].name;
+     qsort((void *)index->names, index->count, sizeof(const char *), compare_automap_names);
+
+     status_printf("Automap: Indexed %zu mapped message(s) of %s.\n", index->count, rom_filepath);
+     success = true;
+
+ cleanup:
+     if (!success)
+         fprintf(stderr, "ERROR: Cannot build the automap index from '%s'.\n", rom_filepath);
+     free(rom_data);
+     free_segment_directory(&directory);
+     free_message_catalog(&catalog);
+     return success;
+ }
+
+ /**
+  * automap_message() - Names a message after its match in the automap reference.
+  * @index:   Pointer to the AutomapIndex.
+  * @catalog: Pointer to the MessageCatalog holding the message.
+  * @i:       Position of the message in @catalog.
+  * @mapping: Receives the name and comment of the match.
+  *
+  * An identical payload wins; otherwise the reference of similar length
+  * (AUTOMAP_LENGTH_TOLERANCE) with the most similar envelope is taken if it
+  * reaches AUTOMAP_FUZZY_THRESHOLD, and its comment notes the score. Among
+  * equally good references, automap_preference() picks the one at the same
+  * (segment, index), then the first one not assigned yet. A name
+  * already given to an earlier message of the same ROM gets a '_2', '_3',
+  * ... suffix, skipping any that another reference message is named.
+  * Returned strings stay valid until the next call.
+  *
+  * Return: true if the message matched, false if it keeps its default name.
+  */
+ bool
+ automap_message(AutomapIndex *index, const MessageCatalog *catalog, size_t i, MessageMapping *mapping)
+ {
+     size_t start = catalog->start[i];
+     size_t end = catalog->end[i];
+     size_t low, high;
+     const AutomapEntry *match = NULL;
+     double best_score = 0.0;
+     uint64_t hash = catalog->hash[i];
+
+     if (start >= catalog->rom_size) {
+         index->unmatched++;
+         return false;
+     }
+
+     /* Exact: the run of entries with this hash (lower bound), in ROM order */
+     low = 0;
+     high = index->count;
+     while (low < high) {
+         size_t mid = low + (high - low) / 2;
+         if (index->entries[mid].hash < hash)
+             low = mid + 1;
+         else
+             high = mid;
+     }
+     for (; low < index->count && index->entries[low].hash == hash; ++low) {
+         if (!match || automap_preference(index, &index->entries[low], catalog, i) <
+                       automap_preference(index, match, catalog, i))
+             match = &index->entries[low];
+     }
+
+     /* Fuzzy: envelopes of the references with a similar length */
+     if (!match) {
+         size_t frames, min_frames;
+
+         index->query.count = 0;
+         if (!append_message_envelope(index, catalog->rom_data, catalog->rom_size, start, end, &index->query))
+             return false;
+         frames = index->query.count;
+         if (frames >= AUTOMAP_MIN_FRAMES) {
+             min_frames = (size_t)(frames * (1.0 - AUTOMAP_LENGTH_TOLERANCE));
+             low = 0;
+             high = index->count;
+             while (low < high) {
+                 size_t mid = low + (high - low) / 2;
+                 if (index->by_length[mid]->frames < min_frames)
+                     low = mid + 1;
+                 else
+                     high = mid;
+             }
+             for (; low < index->count && index->by_length[low]->frames <= frames * (1.0 + AUTOMAP_LENGTH_TOLERANCE); ++low) {
+                 const AutomapEntry *candidate = index->by_length[low];
+                 double score = envelope_similarity(index->query.samples, frames,
+                                                    index->envelopes.samples + candidate->envelope, candidate->frames);
+                 if (score > best_score ||
+                     (score == best_score && match &&
+                      automap_preference(index, candidate, catalog, i) < automap_preference(index, match, catalog, i))) {
+                     best_score = score;
+                     match = candidate;
+                 }
+             }
+         }
+         if (best_score < AUTOMAP_FUZZY_THRESHOLD)
+             match = NULL;
+     }
+
+     if (!match) {
+         index->unmatched++;
+         return false;
+     }
+
+     mapping->output_filename_base = match->name;
+     mapping->comment = match->comment;
+     if (++index->uses[match - index->entries] > 1) {
+         unsigned *suffix = &index->uses[match - index->entries];
+
+         /* Skip suffixes that would repeat another reference message's name */
+         for (;; ++*suffix) {
+             snprintf(index->name_buffer, sizeof(index->name_buffer), "%s_%u", match->name, *suffix);
+             if (!automap_name_exists(index, index->name_buffer))
+                 break;
+         }
+         mapping->output_filename_base = index->name_buffer;
+     }
+     if (best_score > 0.0) {
+         snprintf(index->comment_buffer, sizeof(index->comment_buffer), "%s%s(fuzzy match %.0f%%)",
+                  match->comment ? match->comment : "", match->comment ? " " : "", best_score * 100.0);
+         mapping->comment = index->comment_buffer;
+         index->fuzzy_matches++;
+     } else {
+         index->exact_matches++;
+     }
+     return true;
+ }
+
+
+ /* --- Batch Processing --- */
+
+ /**
+  * file_exists() - Checks whether a file can be opened for reading.
+  * @filepath: Path to check.
+  *
+  * Return: true if the file exists and is readable.
+  */
+ bool
+ file_exists(const char *filepath)
+ {
+     FILE *fp = fopen(filepath, "rb");
+
+     if (!fp)
+         return false;
+     fclose(fp);
+     return true;
+ }
+
+ /**
+  * is_directory() - Checks whether a path names a directory.
+  * @path: Path to check.
+  *
+  * Return: true if @path is an existing directory.
+  */
+ bool
+ is_directory(const char *path)
+ {
+ #ifdef _WIN32
+     DWORD attributes = GetFileAttributesA(path);
+     return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+ #else
+     struct stat st;
+     return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+ #endif
+ }
+
+ /**
+  * make_directories() - Creates a directory and any missing parents.
+  * @path: Directory path to create.
+  *
+  * Return: true if the directory exists afterwards, false on failure.
+  */
+ bool
+ make_directories(const char *path)
+ {
+     char buffer[FILENAME_MAX];
+     size_t i, len;
+
+     len = strlen(path);
+     if (len == 0 || len >= sizeof(buffer)) {
+         fprintf(stderr, "ERROR: Invalid output directory '%s'.\n", path);
+         return false;
+     }
+     memcpy(buffer, path, len + 1);
+
+     /* Create each prefix ending at a separator, then the full path */
+     for (i = 1; i <= len; ++i) {
+         if (buffer[i] == '/' || buffer[i] == '\\' || buffer[i] == '\0') {
+             char saved = buffer[i];
+             buffer[i] = '\0';
+             if (!is_directory(buffer)) {
+ #ifdef _WIN32
+                 _mkdir(buffer);
+ #else
+                 mkdir(buffer, 0777);
+ #endif
+             }
+             buffer[i] = saved;
+         }
+     }
+
+     if (!is_directory(path)) {
+         fprintf(stderr, "ERROR: Cannot create output directory '%s'.\n", path);
+         return false;
+     }
+     return true;
+ }
+
+ /**
+  * get_filename_stem() - Copies a path's base filename without its extension.
+  * @filepath: The full path string.
+  * @buffer:   Destination buffer.
+  * @size:     Size of the destination buffer.
+  */
+ void
+ get_filename_stem(const char *filepath, char *buffer, size_t size)
+ {
+     char *dot;
+
+     snprintf(buffer, size, "%s", get_base_filename(filepath));
+     dot = strrchr(buffer, '.');
+     if (dot && dot != buffer)
+         *dot = '\0';
+ }
+
+ /**
+  * struct batch_rom - One ROM image processed in batch mode.
+  * @rom_filepath:  Malloc'd path to the ROM file.
+  * @map_filepath:  Malloc'd path to the ROM's mapping file (or NULL).
+  * @output_dir:    Malloc'd output directory (or NULL for the current directory).
+  * @rom_basename:  Base filename of the ROM (points into @rom_filepath).
+  * @rom_data:      Malloc'd ROM contents (NULL until loaded).
+  * @rom_size:      Size of @rom_data.
+  * @mapping_table: Mappings loaded from @map_filepath.
+  * @segments:      Segment directory of the ROM.
+  * @catalog:       Message catalog of the ROM.
+  * @first_job:     Index of this ROM's first job in the job list.
+  * @job_count:     Number of decode jobs created for this ROM.
+  */
+ typedef struct {
+     char *rom_filepath;
+     char *map_filepath;
+     char *output_dir;
+     const char *rom_basename;
+     uint8_t *rom_data;
+     size_t rom_size;
+     MappingTable mapping_table;
+     SegmentDirectory segments;
+     MessageCatalog catalog;
+     size_t first_job;
+     size_t job_count;
+ } BatchRom;
+
+ /**
+  * struct batch_rom_list - Dynamic array of ROMs processed in batch mode.
+  * @roms:     Pointer to array of BatchRom structs.
+  * @count:    Number of ROMs currently stored.
+  * @capacity: Allocated capacity of the roms array.
+  */
+ typedef struct {
+     BatchRom *roms;
+     size_t count;
+     size_t capacity;
+ } BatchRomList;
+
+ /**
+  * struct decode_job - One message to decode, scheduled on the worker pool.
+  * @rom:     ROM the message belongs to.
+  * @message: Position of the message in the ROM's catalog.
+  * @cost:    Estimated amount of work, used for scheduling.
+  */
+ typedef struct {
+     const BatchRom *rom;
+     size_t message;
+     size_t cost;
+ } DecodeJob;
+
+ /**
+  * struct decode_job_list - Dynamic array of decode jobs.
+  * @jobs:     Pointer to array of DecodeJob structs.
+  * @count:    Number of jobs currently stored.
+  * @capacity: Allocated capacity of the jobs array.
+  */
+ typedef struct {
+     DecodeJob *jobs;
+     size_t count;
+     size_t capacity;
+ } DecodeJobList;
+
+ /**
+  * struct work_deque - Jobs dealt to one worker of a WorkPool.
+  * @jobs:      Job numbers, longest first (points into WorkPool.order).
+  * @head:      Next job to run; the owner and thieves both take from here.
+  * @end:       Number of jobs in @jobs.
+  * @remaining: Total cost of the jobs not taken yet.
+  * @lock:      Protects @head and @remaining.
+  * @capture:   Status lines of the job the owner is running.
+  * @pad:       Keeps the deques of different workers on separate cache lines.
+  */
+ typedef struct {
+     size_t *jobs;
+     size_t head;
+     size_t end;
+     size_t remaining;
+     MutexLock lock;
+     OutputBuffer capture;
+     char pad[64];
+ } WorkDeque;
+
+ /**
+  * struct work_pool - Work-stealing pool that runs the jobs of a DecodeJobList longest first.
+  * @run:          Runs one job on a worker; returns false on failure.
+  * @arg:          Argument passed to @run.
+  * @list:         The jobs; their costs decide the dispatch order.
+  * @count:        Number of jobs.
+  * @order:        Job numbers, grouped by deque.
+  * @deques:       One deque per worker.
+  * @worker_count: Number of deques.
+  * @next_worker:  Hands each starting thread its deque.
+  * @reports:      Status lines of the finished jobs that are not printed yet (or NULL).
+  * @done:         Per job, true once it has finished.
+  * @next_report:  First job whose status lines have not been printed.
+  * @failed:       Number of jobs for which @run returned false.
+  * @lock:         Protects @reports, @done, @next_report and @failed.
+  */
+ typedef struct {
+     bool (*run)(void *arg, size_t job, int worker);
+     void *arg;
+     const DecodeJobList *list;
+     size_t count;
+     size_t *order;
+     WorkDeque *deques;
+     int worker_count;
+     volatile size_t next_worker;
+     char **reports;
+     bool *done;
+     size_t next_report;
+     size_t failed;
+     MutexLock lock;
+ } WorkPool;
+
+ /**
+  * add_batch_rom() - Appends a ROM to the batch list.
+  * @list:         Pointer to the BatchRomList.
+  * @rom_filepath: Path to the ROM file.
+  * @map_filepath: Path to the ROM's mapping file (or NULL).
+  * @output_dir:   Output directory for the ROM (or NULL for the current directory).
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ add_batch_rom(BatchRomList *list, const char *rom_filepath,
+           const char *map_filepath, const char *output_dir)
+ {
+     BatchRom *rom;
+
+     if (list->count >= list->capacity) {
+         size_t new_capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+         BatchRom *new_roms = (BatchRom *)realloc(list->roms, new_capacity * sizeof(BatchRom));
+         if (!new_roms) {
+             fprintf(stderr, "ERROR: Failed to allocate memory for batch ROM list.\n");
+             return false;
+         }
+         list->roms = new_roms;
+         list->capacity = new_capacity;
+     }
+
+     rom = &list->roms[list->count];
+     memset(rom, 0, sizeof(*rom));
+     init_mapping_table(&rom->mapping_table);
+     init_segment_directory(&rom->segments);
+     init_message_catalog(&rom->catalog);
+     rom->rom_filepath = strdup(rom_filepath);
+     rom->map_filepath = map_filepath ? strdup(map_filepath) : NULL;
+     rom->output_dir = output_dir ? strdup(output_dir) : NULL;
+     if (!rom->rom_filepath || (map_filepath && !rom->map_filepath) || (output_dir && !rom->output_dir)) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for batch ROM entry.\n");
+         free(rom->rom_filepath);
+         free(rom->map_filepath);
+         free(rom->output_dir);
+         return false;
+     }
+     rom->rom_basename = get_base_filename(rom->rom_filepath);
+     list->count++;
+     return true;
+ }
+
+ /**
+  * free_batch_rom_list() - Frees all ROMs and memory of a BatchRomList.
+  * @list: Pointer to the BatchRomList.
+  */
+ void
+ free_batch_rom_list(BatchRomList *list)
+ {
+     size_t i;
+
+     for (i = 0; i < list->count; ++i) {
+         BatchRom *rom = &list->roms[i];
+         free(rom->rom_filepath);
+         free(rom->map_filepath);
+         free(rom->output_dir);
+         free(rom->rom_data);
+         free_mapping_table(&rom->mapping_table);
+         free_segment_directory(&rom->segments);
+         free_message_catalog(&rom->catalog);
+     }
+     free(list->roms);
+     list->roms = NULL;
+     list->count = 0;
+     list->capacity = 0;
+ }
+
+ /**
+  * add_batch_input() - Adds one ROM to the batch with its own output
+  * subdirectory and mapping file.
+  * @list:            Pointer to the BatchRomList.
+  * @rom_filepath:    Path to the ROM file.
+  * @map_filepath:    Mapping file from the manifest (or NULL).
+  * @output_subdir:   Output subdirectory from the manifest (or NULL).
+  * @options:         Parsed command line options.
+  *
+  * Without an explicit mapping, '<rom path without extension>.map' is used if
+  * it exists, otherwise the global -m mapping. Without an explicit
+  * subdirectory, the ROM's base name without extension is used; a numeric
+  * suffix keeps names unique when several inputs share a base name.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ add_batch_input(BatchRomList *list, const char *rom_filepath, const char *map_filepath,
+         const char *output_subdir, const ProgramOptions *options)
+ {
+     char sibling_map[FILENAME_MAX];
+     char stem[FILENAME_MAX];
+     char output_dir[FILENAME_MAX];
+     const char *dot;
+     size_t i, suffix = 1;
+
+     if (options->automap_filepath) {
+         map_filepath = NULL; /* Names come from the automap reference */
+     } else if (!map_filepath) {
+         dot = strrchr(get_base_filename(rom_filepath), '.');
+         if (dot)
+             snprintf(sibling_map, sizeof(sibling_map), "%.*s.map", (int)(dot - rom_filepath), rom_filepath);
+         else
+             snprintf(sibling_map, sizeof(sibling_map), "%s.map", rom_filepath);
+         map_filepath = file_exists(sibling_map) ? sibling_map : options->map_filepath;
+     }
+
+     if (output_subdir)
+         snprintf(stem, sizeof(stem), "%s", output_subdir);
+     else
+         get_filename_stem(rom_filepath, stem, sizeof(stem));
+     if (!build_output_path(output_dir, sizeof(output_dir), options->output_dir ? options->output_dir : ".", stem, ""))
+         goto path_too_long;
+
+     /* Keep output directories unique */
+     for (i = 0; i < list->count; ++i) {
+         if (strcmp(list->roms[i].output_dir, output_dir) == 0) {
+             char suffix_str[24];
+             snprintf(suffix_str, sizeof(suffix_str), "_%zu", ++suffix);
+             if (!build_output_path(output_dir, sizeof(output_dir), options->output_dir ? options->output_dir : ".", stem, suffix_str))
+                 goto path_too_long;
+             i = (size_t)-1; /* Restart the check with the new name */
+         }
+     }
+
+     return add_batch_rom(list, rom_filepath, map_filepath, output_dir);
+
+ path_too_long:
+     fprintf(stderr, "ERROR: Output directory path for '%s' is too long.\n", rom_filepath);
+     return false;
+ }
+
+ /**
+  * compare_strings() - qsort() comparator for arrays of C strings.
+  */
+ int
+ compare_strings(const void *a, const void *b)
+ {
+     return strcmp(*(const char *const *)a, *(const char *const *)b);
+ }
+
+ /**
+  * add_batch_directory() - Adds every ROM file in a directory to the batch.
+  * @list:      Pointer to the BatchRomList.
+  * @directory: Directory to list (not recursive).
+  * @options:   Parsed command line options.
+  *
+  * Files are added in name order. Mapping files (*.map) and hidden files
+  * are skipped; other non-ROM files are rejected later when loading.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ add_batch_directory(BatchRomList *list, const char *directory, const ProgramOptions *options)
+ {
+     char **names = NULL;
+     size_t name_count = 0, name_capacity = 0, i;
+     char path[FILENAME_MAX];
+     bool success = true;
+ #ifdef _WIN32
+     WIN32_FIND_DATAA find_data;
+     HANDLE find_handle;
+
+     snprintf(path, sizeof(path), "%s\\*", directory);
+     find_handle = FindFirstFileA(path, &find_data);
+     if (find_handle == INVALID_HANDLE_VALUE) {
+         fprintf(stderr, "ERROR: Cannot list directory '%s'.\n", directory);
+         return false;
+     }
+     do {
+         const char *name = find_data.cFileName;
+         if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+             continue;
+ #else
+     DIR *dir = opendir(directory);
+     struct dirent *dir_entry;
+
+     if (!dir) {
+         fprintf(stderr, "ERROR: Cannot list directory '%s'.\n", directory);
+         return false;
+     }
+     while ((dir_entry = readdir(dir)) != NULL) {
+         const char *name = dir_entry->d_name;
+ #endif
+         const char *dot = strrchr(name, '.');
+
+         if (name[0] == '.' || (dot && (strcmp(dot, ".map") == 0 || strcmp(dot, ".MAP") == 0)))
+             continue;
+         if (!build_output_path(path, sizeof(path), directory, name, "") || is_directory(path))
+             continue;
+
+         if (name_count >= name_capacity) {
+             size_t new_capacity = (name_capacity == 0) ? 64 : name_capacity * 2;
+             char **new_names = (char **)realloc(names, new_capacity * sizeof(char *));
+             if (!new_names) {
+                 success = false;
+                 break;
+             }
+             names = new_names;
+             name_capacity = new_capacity;
+         }
+         names[name_count] = strdup(path);
+         if (!names[name_count]) {
+             success = false;
+             break;
+         }
+         name_count++;
+ #ifdef _WIN32
+     } while (FindNextFileA(find_handle, &find_data));
+     FindClose(find_handle);
+ #else
+     }
+     closedir(dir);
+ #endif
+
+     if (!success)
+         fprintf(stderr, "ERROR: Failed to allocate memory while listing directory '%s'.\n", directory);
+
+     if (names)
+         qsort(names, name_count, sizeof(char *), compare_strings);
+     for (i = 0; i < name_count; ++i) {
+         if (success && !add_batch_input(list, names[i], NULL, NULL, options))
+             success = false;
+         free(names[i]);
+     }
+     free(names);
+
+     if (success && name_count == 0)
+         fprintf(stderr, "WARN: No ROM files found in directory '%s'.\n", directory);
+     return success;
+ }
+
+ /**
+  * load_batch_manifest() - Adds the ROMs listed in a manifest file to the batch.
+  * @list:     Pointer to the BatchRomList.
+  * @filepath: Path to the manifest file.
+  * @options:  Parsed command line options.
+  *
+  * Format per line: RomPath[\tMapPath[\tOutputSubdir]]. Lines starting with
+  * '#' and blank lines are ignored; '-' or an empty field selects the default.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ load_batch_manifest(BatchRomList *list, const char *filepath, const ProgramOptions *options)
+ {
+     FILE *fp;
+     char line[3 * FILENAME_MAX];
+     int line_num = 0;
+     bool success = true;
+
+     fp = fopen(filepath, "r");
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot open manifest file '%s'.\n", filepath);
+         return false;
+     }
+
+     while (success && fgets(line, sizeof(line), fp)) {
+         char *fields[3] = {NULL, NULL, NULL};
+         char *cursor = line;
+         char *end;
+         int field;
+
+         line_num++;
+         end = line + strlen(line);
+         while (end > line && isspace((unsigned char)end[-1]))
+             *--end = '\0';
+         while (isspace((unsigned char)*cursor))
+             cursor++;
+         if (*cursor == '\0' || *cursor == '#')
+             continue;
+
+         for (field = 0; field < 3 && cursor; ++field) {
+             char *tab = strchr(cursor, '\t');
+             if (tab)
+                 *tab = '\0';
+             if (*cursor != '\0' && strcmp(cursor, "-") != 0)
+                 fields[field] = cursor;
+             cursor = tab ? tab + 1 : NULL;
+         }
+         if (!fields[0]) {
+             fprintf(stderr, "ERROR: Missing ROM path in manifest file '%s' at line %d.\n", filepath, line_num);
+             success = false;
+             break;
+         }
+         success = add_batch_input(list, fields[0], fields[1], fields[2], options);
+     }
+
+     fclose(fp);
+     return success;
+ }
+
+ /**
+  * collect_batch_inputs() - Adds all ROM inputs of the command line to the batch.
+  * @list:    Pointer to the BatchRomList.
+  * @options: Parsed command line options.
+  *
+  * Inputs are ROM files, directories of ROM files, and manifest entries.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ collect_batch_inputs(BatchRomList *list, const ProgramOptions *options)
+ {
+     int p;
+
+     for (p = 0; p < options->rom_filepath_count; ++p) {
+         const char *path = options->rom_filepaths[p];
+         bool ok = is_directory(path) ? add_batch_directory(list, path, options)
+                          : add_batch_input(list, path, NULL, NULL, options);
+         if (!ok)
+             return false;
+     }
+     return !options->manifest_filepath || load_batch_manifest(list, options->manifest_filepath, options);
+ }
+
+ /**
+  * load_batch_rom() - Loads a batch ROM's data, mapping, segment directory and catalog.
+  * @rom: Pointer to the BatchRom.
+  *
+  * Return: true on success, false if the ROM cannot be used.
+  */
+ bool
+ load_batch_rom(BatchRom *rom)
+ {
+     uint64_t phase_start;
+     bool found;
+
+     if (!load_rom_data(rom->rom_filepath, &rom->rom_data, &rom->rom_size))
+         return false;
+     if (rom->map_filepath) {
+         verbose_printf("Loading mappings for %s from %s...\n", rom->rom_basename, rom->map_filepath);
+         phase_start = stats_timer_start();
+         if (!load_mappings(rom->map_filepath, &rom->mapping_table))
+             return false;
+         stats_record_phase(STATS_PHASE_MAP_PARSE, phase_start, 0);
+     }
+     phase_start = stats_timer_start();
+     if (scan_mode)
+         found = scan_segment_directory(rom->rom_data, rom->rom_size, &rom->segments);
+     else
+         found = build_segment_directory_fixed(rom->rom_data, rom->rom_size, &rom->segments) ||
+             rom->segments.count > 0;
+     stats_record_phase(STATS_PHASE_SEGMENT_PARSE, phase_start, 0);
+     return found && build_message_catalog(&rom->catalog, rom->rom_data, rom->rom_size, &rom->segments, 0, 0,
+                                           &rom->mapping_table);
+ }
+
+ /**
+  * add_decode_job() - Appends a job to a DecodeJobList.
+  * @list: Pointer to the DecodeJobList.
+  * @job:  The DecodeJob to add.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ add_decode_job(DecodeJobList *list, DecodeJob job)
+ {
+     if (list->count >= list->capacity) {
+         size_t new_capacity = (list->capacity == 0) ? 256 : list->capacity * 2;
+         DecodeJob *new_jobs = (DecodeJob *)realloc(list->jobs, new_capacity * sizeof(DecodeJob));
+         if (!new_jobs) {
+             fprintf(stderr, "ERROR: Failed to allocate memory for decode job list.\n");
+             return false;
+         }
+         list->jobs = new_jobs;
+         list->capacity = new_capacity;
+     }
+     list->jobs[list->count++] = job;
+     return true;
+ }
+
+ /**
+  * collect_decode_jobs() - Creates one decode job per selected message of a ROM.
+  * @rom:                Pointer to the loaded BatchRom.
+  * @target_message_idx: Target absolute message index (-1 for all).
+  * @list:               Pointer to the DecodeJobList to append to.
+  *
+  * The cost of a job is the exact sample count from the catalog (plus one,
+  * so a message without audio still counts), which is what decoding,
+  * resampling and encoding scale with.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ collect_decode_jobs(const BatchRom *rom, long target_message_idx, DecodeJobList *list)
+ {
+     const MessageCatalog *catalog = &rom->catalog;
+     size_t i = 0, last = catalog->count;
+
+     if (target_message_idx >= 0) {
+         i = find_catalog_message(catalog, target_message_idx);
+         last = (i < catalog->count) ? i + 1 : i;
+     }
+     for (; i < last; ++i) {
+         DecodeJob job;
+
+         job.rom = rom;
+         job.message = i;
+         job.cost = catalog->samples[i] + 1;
+         if (!add_decode_job(list, job))
+             return false;
+     }
+     return true;
+ }
+
+ /**
+  * compare_jobs_by_cost() - qsort() comparator ordering job pointers longest first.
+  *
+  * Ties keep ROM and message order so runs are reproducible.
+  */
+ int
+ compare_jobs_by_cost(const void *a, const void *b)
+ {
+     const DecodeJob *job_a = *(const DecodeJob *const *)a;
+     const DecodeJob *job_b = *(const DecodeJob *const *)b;
+
+     if (job_a->cost != job_b->cost)
+         return (job_a->cost > job_b->cost) ? -1 : 1;
+     return (job_a < job_b) ? -1 : (job_a > job_b);
+ }
+
+ /**
+  * free_work_pool() - Frees memory associated with a WorkPool.
+  * @pool: Pointer to the WorkPool.
+  */
+ void
+ free_work_pool(WorkPool *pool)
+ {
+     size_t i;
+     int w;
+
+     if (pool->deques) {
+         for (w = 0; w < pool->worker_count; ++w) {
+             mutex_destroy(&pool->deques[w].lock);
+             free_output_buffer(&pool->deques[w].capture);
+         }
+         mutex_destroy(&pool->lock);
+     }
+     if (pool->reports) {
+         for (i = 0; i < pool->count; ++i)
+             free(pool->reports[i]);
+     }
+     free(pool->reports);
+     free(pool->done);
+     free(pool->deques);
+     free(pool->order);
+     memset(pool, 0, sizeof(*pool));
+ }
+
+ /**
+  * init_work_pool() - Deals the jobs of a list to the workers of a WorkPool.
+  * @pool:         Pointer to the WorkPool to initialize.
+  * @list:         Jobs to run (in ROM and message order).
+  * @worker_count: Number of workers (at most the number of jobs are used).
+  * @run:          Runs one job on a worker; returns false on failure.
+  * @arg:          Argument passed to @run.
+  *
+  * Longest-processing-time-first list scheduling: the jobs are taken by
+  * decreasing cost and each goes to the worker with the least work dealt so
+  * far, so every deque holds about the same total cost, longest job first.
+  * Workers that run out steal from the others (work_pool_take()), which
+  * absorbs the difference between cost and actual run time. Unless quiet,
+  * the status lines of every job are held back and printed in job order.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ init_work_pool(WorkPool *pool, const DecodeJobList *list, int worker_count,
+                bool (*run)(void *arg, size_t job, int worker), void *arg)
+ {
+     const DecodeJob **sorted = NULL;
+     int *owner = NULL;
+     size_t total = 0, largest = 0, offset = 0, i;
+     int w;
+
+     memset(pool, 0, sizeof(*pool));
+     pool->run = run;
+     pool->arg = arg;
+     pool->list = list;
+     pool->count = list->count;
+     pool->worker_count = (worker_count < (int)list->count) ? worker_count : (int)list->count;
+     if (pool->worker_count < 1)
+         pool->worker_count = 1;
+
+     pool->order = (size_t *)malloc((list->count ? list->count : 1) * sizeof(size_t));
+     pool->deques = (WorkDeque *)calloc((size_t)pool->worker_count, sizeof(WorkDeque));
+     pool->done = (bool *)calloc(list->count ? list->count : 1, sizeof(bool));
+     pool->reports = quiet_mode ? NULL : (char **)calloc(list->count ? list->count : 1, sizeof(char *));
+     sorted = (const DecodeJob **)malloc((list->count ? list->count : 1) * sizeof(DecodeJob *));
+     owner = (int *)malloc((list->count ? list->count : 1) * sizeof(int));
+     if (!pool->order || !pool->deques || !pool->done || (!quiet_mode && !pool->reports) || !sorted || !owner) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the worker pool.\n");
+         free(sorted);
+         free(owner);
+         free(pool->reports);
+         free(pool->done);
+         free(pool->deques);
+         free(pool->order);
+         memset(pool, 0, sizeof(*pool));
+         return false;
+     }
+
+     for (i = 0; i < list->count; ++i)
+         sorted[i] = &list->jobs[i];
+     qsort((void *)sorted, list->count, sizeof(DecodeJob *), compare_jobs_by_cost);
+
+     /* Deal longest first to the least loaded worker (ties: lowest worker) */
+     for (i = 0; i < list->count; ++i) {
+         int least = 0;
+
+         for (w = 1; w < pool->worker_count; ++w) {
+             if (pool->deques[w].remaining < pool->deques[least].remaining)
+                 least = w;
+         }
+         owner[i] = least;
+         pool->deques[least].remaining += sorted[i]->cost;
+         pool->deques[least].end++;
+         total += sorted[i]->cost;
+     }
+     for (w = 0; w < pool->worker_count; ++w) {
+         pool->deques[w].jobs = pool->order + offset;
+         offset += pool->deques[w].end;
+         if (pool->deques[w].remaining > largest)
+             largest = pool->deques[w].remaining;
+         mutex_init(&pool->deques[w].lock);
+         init_output_buffer(&pool->deques[w].capture);
+     }
+     for (i = 0; i < list->count; ++i) {
+         WorkDeque *deque = &pool->deques[owner[i]];
+         deque->jobs[deque->head++] = (size_t)(sorted[i] - list->jobs);
+     }
+     for (w = 0; w < pool->worker_count; ++w)
+         pool->deques[w].head = 0;
+     mutex_init(&pool->lock);
+
+     verbose_printf("Work pool: %zu job(s) dealt to %d worker(s), largest share %.1f%% of an even split.\n",
+                list->count, pool->worker_count,
+                total ? 100.0 * (double)largest * pool->worker_count / (double)total : 100.0);
+     free(sorted);
+     free(owner);
+     return true;
+ }
+
+ /**
+  * work_pool_take() - Hands a worker its next job.
+  * @pool:   Pointer to the WorkPool.
+  * @worker: Worker asking for a job.
+  * @job:    Receives the job number.
+  *
+  * A worker runs its own deque longest first. Once it is empty, it steals
+  * the longest pending job of the deque with the most work left, so the
+  * remaining long jobs start as early as possible.
+  *
+  * Return: true if a job was handed out, false once all deques are empty.
+  */
+ bool
+ work_pool_take(WorkPool *pool, int worker, size_t *job)
+ {
+     int victim = worker;
+
+     for (;;) {
+         WorkDeque *deque = &pool->deques[victim];
+         size_t most = 0;
+         int w;
+
+         mutex_lock(&deque->lock);
+         if (deque->head < deque->end) {
+             *job = deque->jobs[deque->head++];
+             deque->remaining -= pool->list->jobs[*job].cost;
+             mutex_unlock(&deque->lock);
+             return true;
+         }
+         mutex_unlock(&deque->lock);
+
+         victim = -1;
+         for (w = 0; w < pool->worker_count; ++w) {
+             size_t remaining, left;
+
+             mutex_lock(&pool->deques[w].lock);
+             remaining = pool->deques[w].remaining;
+             left = pool->deques[w].end - pool->deques[w].head;
+             mutex_unlock(&pool->deques[w].lock);
+             if (left > 0 && (victim < 0 || remaining > most)) {
+                 most = remaining;
+                 victim = w;
+             }
+         }
+         if (victim < 0)
+             return false;
+     }
+ }
+
+ /**
+  * work_pool_worker() - Worker thread body: runs jobs until all deques are empty.
+  * @arg: Pointer to the shared WorkPool.
+  *
+  * The status lines of a job are captured and, once every earlier job has
+  * finished, printed in job order.
+  */
+ void
+ work_pool_worker(void *arg)
+ {
+     WorkPool *pool = (WorkPool *)arg;
+     int worker = (int)(atomic_add_size(&pool->next_worker, 1) - 1);
+     WorkDeque *deque;
+     size_t job;
+
+     if (worker >= pool->worker_count)
+         return;
+     deque = &pool->deques[worker];
+     while (work_pool_take(pool, worker, &job)) {
+         char *report = NULL;
+         bool success;
+
+         deque->capture.size = 0;
+         thread_status_capture = pool->reports ? &deque->capture : NULL;
+         success = pool->run(pool->arg, job, worker);
+         thread_status_capture = NULL;
+         if (deque->capture.size > 0) {
+             report = (char *)malloc(deque->capture.size + 1);
+             if (report) {
+                 memcpy(report, deque->capture.data, deque->capture.size);
+                 report[deque->capture.size] = '\0';
+             } else {
+                 fwrite(deque->capture.data, 1, deque->capture.size, get_status_stream()); /* Out of order */
+             }
+         }
+
+         mutex_lock(&pool->lock);
+         if (!success)
+             pool->failed++;
+         pool->done[job] = true;
+         if (pool->reports) {
+             pool->reports[job] = report;
+             while (pool->next_report < pool->count && pool->done[pool->next_report]) {
+                 if (pool->reports[pool->next_report]) {
+                     fputs(pool->reports[pool->next_report], get_status_stream());
+                     free(pool->reports[pool->next_report]);
+                     pool->reports[pool->next_report] = NULL;
+                 }
+                 pool->next_report++;
+             }
+         }
+         mutex_unlock(&pool->lock);
+     }
+ }
+
+ /**
+  * run_work_pool() - Runs all jobs of a WorkPool and waits for them.
+  * @pool: Pointer to the WorkPool (from init_work_pool()).
+  *
+  * Return: Number of jobs that failed.
+  */
+ size_t
+ run_work_pool(WorkPool *pool)
+ {
+     run_worker_threads(pool->worker_count, work_pool_worker, pool);
+     return pool->failed;
+ }
+
+ /**
+  * run_decode_job() - WorkPool job: decodes and encodes one message.
+  * @arg:    Pointer to the DecodeJobList.
+  * @job:    Job number.
+  * @worker: Worker running the job (unused).
+  *
+  * Return: true on success, false on a fatal error.
+  */
+ bool
+ run_decode_job(void *arg, size_t job, int worker)
+ {
+     const DecodeJob *decode_job = &((const DecodeJobList *)arg)->jobs[job];
+
+     (void)worker;
+     return process_catalog_message(&decode_job->rom->catalog, decode_job->message,
+                                    decode_job->rom->rom_basename, decode_job->rom->output_dir);
+ }
+
+ /**
+  * run_catalog_pool() - Decodes every message of a single ROM on a WorkPool.
+  * @catalog:      Pointer to the MessageCatalog of the loaded ROM.
+  * @rom_basename: Base filename of the input ROM file.
+  * @output_dir:   Directory for output files (NULL for current directory).
+  * @thread_count: Number of worker threads.
+  *
+  * The catalog already holds the exact sample count of every message, so
+  * the messages are dealt longest first exactly like batch jobs and short
+  * messages fill the gaps at the end of the run. Status lines still appear
+  * in message order.
+  *
+  * Return: true on success, false if any message failed.
+  */
+ bool
+ run_catalog_pool(const MessageCatalog *catalog, const char *rom_basename, const char *output_dir,
+                  int thread_count)
+ {
+     BatchRom rom;
+     DecodeJobList jobs = {NULL, 0, 0};
+     WorkPool pool;
+     bool success = false;
+
+     memset(&rom, 0, sizeof(rom));
+     rom.catalog = *catalog; /* Borrowed view: nothing is freed through @rom */
+     rom.rom_basename = rom_basename;
+     rom.output_dir = (char *)output_dir;
+     if (!collect_decode_jobs(&rom, -1, &jobs) || !init_work_pool(&pool, &jobs, thread_count, run_decode_job, &jobs))
+         goto cleanup;
+     success = run_work_pool(&pool) == 0;
+     free_work_pool(&pool);
+
+ cleanup:
+     free(jobs.jobs);
+     return success;
+ }
+
+ /**
+  * list_batch_rom() - Writes the listing of one loaded batch ROM to stdout.
+  * @rom: Pointer to the loaded BatchRom.
+  *
+  * Return: true on success, false on error.
+  */
+ bool
+ list_batch_rom(const BatchRom *rom)
+ {
+     bool success = list_rom_header(rom->rom_basename) &&
+                    process_catalog(&rom->catalog, rom->rom_basename, rom->output_dir, -1) != MSG_HANDLED_ERROR;
+
+     return flush_list_output() && success; /* Whatever was listed is still written */
+ }
+
+ /**
+  * run_batch() - Lists or decodes several ROMs using one shared worker pool.
+  * @options: Parsed command line options.
+  *
+  * Inputs are ROM files, directories of ROM files, and manifest entries.
+  * Each ROM gets its own output subdirectory and mapping file.
+  * Decode jobs of all ROMs are pooled on a work-stealing WorkPool and
+  * dispatched longest first by exact sample count, so short messages fill
+  * the gaps at the end of the run. Status lines still appear in ROM and
+  * message order.
+  *
+  * Return: EXIT_SUCCESS or EXIT_FAILURE.
+  */
+ int
+ run_batch(const ProgramOptions *options)
+ {
+     BatchRomList roms = {NULL, 0, 0};
+     DecodeJobList jobs = {NULL, 0, 0};
+     WorkPool pool;
+     int exit_code = EXIT_SUCCESS;
+     size_t i;
+
+     if (!collect_batch_inputs(&roms, options)) {
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     status_printf("Batch: %zu ROM(s), %d worker thread(s)\n", roms.count, options->thread_count);
+
+     /* --- Load ROMs and Build the Job List --- */
+     for (i = 0; i < roms.count; ++i) {
+         BatchRom *rom = &roms.roms[i];
+
+         verbose_printf("Loading batch ROM %zu: %s\n", i, rom->rom_filepath);
+         if (!load_batch_rom(rom)) {
+             fprintf(stderr, "ERROR: Skipping '%s' (not a usable ROM image).\n", rom->rom_filepath);
+             exit_code = EXIT_FAILURE;
+             free(rom->rom_data);
+             rom->rom_data = NULL;
+             continue;
+         }
+
+         if (list_mode) {
+             if (!list_batch_rom(rom))
+                 exit_code = EXIT_FAILURE;
+             free(rom->rom_data); /* Listing needs no further access */
+             rom->rom_data = NULL;
+             continue;
+         }
+
+         if (rom->output_dir && !make_directories(rom->output_dir)) {
+             exit_code = EXIT_FAILURE;
+             continue;
+         }
+         rom->first_job = jobs.count;
+         if (!collect_decode_jobs(rom, options->target_message_idx, &jobs)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
+         }
+         rom->job_count = jobs.count - rom->first_job;
+         if (options->target_message_idx >= 0 && rom->job_count == 0) {
+             fprintf(stderr, "ERROR: Target message index %ld not found in '%s'.\n",
+                 options->target_message_idx, rom->rom_filepath);
+             exit_code = EXIT_FAILURE;
+         }
+         status_printf("Queued %zu message(s) from %s (output: %s)\n", rom->job_count, rom->rom_filepath,
+                   rom->output_dir ? rom->output_dir : ".");
+     }
+     if (list_mode || jobs.count == 0)
+         goto cleanup;
+
+     /* --- Decode: Longest Jobs First on a Work-Stealing Pool --- */
+     if (!init_work_pool(&pool, &jobs, options->thread_count, run_decode_job, &jobs)) {
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     if (run_work_pool(&pool) > 0)
+         exit_code = EXIT_FAILURE;
+     free_work_pool(&pool);
+     status_printf("Batch complete: %zu message(s) from %zu ROM(s).\n", jobs.count, roms.count);
+
+ cleanup:
+     free(jobs.jobs);
+     free_batch_rom_list(&roms);
+     return exit_code;
+ }
+
+
+ /* --- Fingerprint Index --- */
+
+ double fp_window[FP_FRAME_SIZE]; /* Hann window of a fingerprint frame */
+ double fp_twiddle_cos[FP_FRAME_SIZE / 2]; /* FFT twiddle factors */
+ double fp_twiddle_sin[FP_FRAME_SIZE / 2];
+ size_t fp_band_edges[FP_BANDS + 1]; /* First FFT bin of each band, then the end of the last */
+
+ /**
+  * struct fingerprint_job - One message fingerprinted for a --fp-index file.
+  * @job:          Location of the message (collect_decode_jobs()).
+  * @fingerprints: Sub-fingerprints of the message (little-endian 32-bit values).
+  */
+ typedef struct {
+     const DecodeJob *job;
+     OutputBuffer fingerprints;
+ } FingerprintJob;
+
+ /**
+  * struct fingerprint_scheduler - Shared state of the fingerprinting jobs on a WorkPool.
+  * @jobs:    Jobs, in ROM and message order (as the DecodeJobList).
+  * @scratch: Decoded samples, one buffer per worker.
+  */
+ typedef struct {
+     FingerprintJob *jobs;
+     PcmBuffer scratch[MAX_WORKER_THREADS];
+ } FingerprintScheduler;
+
+ /**
+  * struct fingerprint_index - A --fp-index file mapped for queries.
+  * @map:               Mapped file (release with close_fingerprint_index()).
+  * @size:              Size of @map.
+  * @prompt_count:      Number of prompt records.
+  * @fingerprint_count: Number of sub-fingerprints of all prompts.
+  * @posting_count:     Number of postings.
+  * @prompts:           Prompt records, FP_PROMPT_RECORD_SIZE bytes each.
+  * @fingerprints:      Sub-fingerprints, prompt after prompt.
+  * @postings:          (sub-fingerprint, frame) pairs sorted by sub-fingerprint.
+  * @strings:           String pool of ROM names and message names.
+  * @strings_size:      Size of @strings.
+  */
+ typedef struct {
+     const uint8_t *map;
+     size_t size;
+     uint32_t prompt_count;
+     uint32_t fingerprint_count;
+     uint32_t posting_count;
+     const uint8_t *prompts;
+     const uint8_t *fingerprints;
+     const uint8_t *postings;
+     const char *strings;
+     uint32_t strings_size;
+ } FingerprintIndex;
+
+ /**
+  * struct fingerprint_match - Best alignment of one indexed prompt with the query.
+  * @prompt:         Prompt record number.
+  * @bit_error_rate: Fraction of differing bits over the aligned frames.
+  */
+ typedef struct {
+     uint32_t prompt;
+     double bit_error_rate;
+ } FingerprintMatch;
+
+ /**
+  * init_fingerprint_tables() - Fills the window, FFT and band tables of the fingerprinter.
+  *
+  * The FP_BANDS bands split FP_LOW_HZ..FP_HIGH_HZ evenly on the mel scale;
+  * each band gets at least one FFT bin.
+  */
+ void
+ init_fingerprint_tables(void)
+ {
+     const double pi = 3.14159265358979323846;
+     double mel_low = 2595.0 * log10(1.0 + FP_LOW_HZ / 700.0);
+     double mel_high = 2595.0 * log10(1.0 + FP_HIGH_HZ / 700.0);
+     size_t i;
+
+     for (i = 0; i < FP_FRAME_SIZE; ++i)
+         fp_window[i] = 0.5 - 0.5 * cos(2.0 * pi * (double)i / FP_FRAME_SIZE);
+     for (i = 0; i < FP_FRAME_SIZE / 2; ++i) {
+         fp_twiddle_cos[i] = cos(2.0 * pi * (double)i / FP_FRAME_SIZE);
+         fp_twiddle_sin[i] = -sin(2.0 * pi * (double)i / FP_FRAME_SIZE);
+     }
+     for (i = 0; i <= FP_BANDS; ++i) {
+         double mel = mel_low + (mel_high - mel_low) * (double)i / FP_BANDS;
+         double hz = 700.0 * (pow(10.0, mel / 2595.0) - 1.0);
+         size_t bin = (size_t)(hz * FP_FRAME_SIZE / DEFAULT_SAMPLE_RATE + 0.5);
+
+         fp_band_edges[i] = (i > 0 && bin <= fp_band_edges[i - 1]) ? fp_band_edges[i - 1] + 1 : bin;
+     }
+ }
+
+ /**
+  * fingerprint_fft() - In-place radix-2 FFT of one FP_FRAME_SIZE frame.
+  * @re: Real parts.
+  * @im: Imaginary parts.
+  */
+ void
+ fingerprint_fft(double *re, double *im)
+ {
+     size_t i, j, bit, length, k;
+
+     for (i = 1, j = 0; i < FP_FRAME_SIZE; ++i) { /* Bit-reversed order */
+         for (bit = FP_FRAME_SIZE >> 1; j & bit; bit >>= 1)
+             j ^= bit;
+         j |= bit;
+         if (i < j) {
+             double t = re[i];
+             re[i] = re[j];
+             re[j] = t;
+             t = im[i];
+             im[i] = im[j];
+             im[j] = t;
+         }
+     }
+     for (length = 2; length <= FP_FRAME_SIZE; length <<= 1) {
+         size_t half = length >> 1;
+         size_t stride = FP_FRAME_SIZE / length;
+
+         for (i = 0; i < FP_FRAME_SIZE; i += length) {
+             for (k = 0; k < half; ++k) {
+                 double wr = fp_twiddle_cos[k * stride], wi = fp_twiddle_sin[k * stride];
+                 double xr = re[i + k + half] * wr - im[i + k + half] * wi;
+                 double xi = re[i + k + half] * wi + im[i + k + half] * wr;
+
+                 re[i + k + half] = re[i + k] - xr;
+                 im[i + k + half] = im[i + k] - xi;
+                 re[i + k] += xr;
+                 im[i + k] += xi;
+             }
+         }
+     }
+ }
+
+ /**
+  * append_fingerprints() - Appends the sub-fingerprints of decoded audio.
+  * @pcm:          Decoded 8 kHz samples.
+  * @fingerprints: OutputBuffer receiving one little-endian 32-bit value per frame.
+  *
+  * Frames of FP_FRAME_SIZE samples start every FP_FRAME_HOP samples. Bit m
+  * of a frame is set when the energy difference of bands m and m+1 grew
+  * since the previous frame (Haitsma/Kalker). The signs of these differences
+  * survive re-encoding and level changes that break exact hashes. Digital
+  * silence gives 0.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_fingerprints(const PcmBuffer *pcm, OutputBuffer *fingerprints)
+ {
+     double re[FP_FRAME_SIZE], im[FP_FRAME_SIZE];
+     double energy[FP_BANDS], previous[FP_BANDS];
+     size_t start, i, band;
+
+     for (start = 0; start + FP_FRAME_SIZE <= pcm->count; start += FP_FRAME_HOP) {
+         uint32_t value = 0;
+
+         for (i = 0; i < FP_FRAME_SIZE; ++i) {
+             re[i] = fp_window[i] * pcm->samples[start + i];
+             im[i] = 0.0;
+         }
+         fingerprint_fft(re, im);
+         for (band = 0; band < FP_BANDS; ++band) {
+             energy[band] = 0.0;
+             for (i = fp_band_edges[band]; i < fp_band_edges[band + 1]; ++i)
+                 energy[band] += re[i] * re[i] + im[i] * im[i];
+         }
+         if (start > 0) {
+             for (band = 0; band + 1 < FP_BANDS; ++band) {
+                 if (energy[band] - energy[band + 1] > previous[band] - previous[band + 1])
+                     value |= (uint32_t)1 << band;
+             }
+             if (!append_u32le(fingerprints, value))
+                 return false;
+         }
+         memcpy(previous, energy, sizeof(energy));
+     }
+     return true;
+ }
+
+ /**
+  * fingerprint_distance() - Counts the differing bits of two fingerprint blocks.
+  * @a:      First block (little-endian 32-bit values).
+  * @b:      Second block.
+  * @frames: Number of values to compare.
+  *
+  * XORs 16 bytes per step and counts the bits with SSE2 (bit-sliced counts
+  * summed by PSADBW) or NEON (VCNT); a scalar loop does the tail.
+  *
+  * Return: Number of differing bits.
+  */
+ size_t
+ fingerprint_distance(const uint8_t *a, const uint8_t *b, size_t frames)
+ {
+     size_t bytes = frames * 4, i = 0, distance = 0;
+ #if defined(HAVE_SSE2)
+     const __m128i m1 = _mm_set1_epi8(0x55), m2 = _mm_set1_epi8(0x33), m4 = _mm_set1_epi8(0x0F);
+     const __m128i zero = _mm_setzero_si128();
+     __m128i sum = _mm_setzero_si128();
+
+     for (; i + 16 <= bytes; i += 16) {
+         __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+         x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi64(x, 1), m1));
+         x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+         x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+         sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+     }
+     distance = (size_t)_mm_cvtsi128_si32(sum) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+ #elif defined(HAVE_NEON)
+     for (; i + 16 <= bytes; i += 16)
+         distance += vaddvq_u8(vcntq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+ #endif
+     for (; i < bytes; ++i) {
+         unsigned x = (unsigned)(a[i] ^ b[i]);
+
+         x = x - ((x >> 1) & 0x55);
+         x = (x & 0x33) + ((x >> 2) & 0x33);
+         distance += (x + (x >> 4)) & 0x0F;
+     }
+     return distance;
+ }
+
+ /**
+  * run_fingerprint_job() - WorkPool job: fingerprints the decoded audio of one message.
+  * @arg:    Pointer to the shared FingerprintScheduler.
+  * @job:    Job number.
+  * @worker: Worker running the job (selects the scratch buffer).
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ run_fingerprint_job(void *arg, size_t job, int worker)
+ {
+     FingerprintScheduler *scheduler = (FingerprintScheduler *)arg;
+     FingerprintJob *fingerprint_job = &scheduler->jobs[job];
+     const MessageCatalog *catalog = &fingerprint_job->job->rom->catalog;
+     size_t message = fingerprint_job->job->message;
+     PcmBuffer *pcm = &scheduler->scratch[worker];
+
+     if (catalog->start[message] >= catalog->rom_size)
+         return true;
+     return decode_message_samples(catalog->rom_data, catalog->rom_size, catalog->start[message],
+                                   catalog->end[message], pcm) &&
+            append_fingerprints(pcm, &fingerprint_job->fingerprints);
+ }
+
+ /**
+  * compare_fingerprint_keys() - qsort() comparator for 64-bit postings and candidates.
+  */
+ int
+ compare_fingerprint_keys(const void *a, const void *b)
+ {
+     uint64_t key_a = *(const uint64_t *)a;
+     uint64_t key_b = *(const uint64_t *)b;
+
+     return (key_a > key_b) - (key_a < key_b);
+ }
+
+ /**
+  * write_fingerprint_index() - Writes fingerprinted prompts as a --fp-index file.
+  * @jobs:     Fingerprinted messages in ROM and message order.
+  * @count:    Number of jobs.
+  * @filepath: Path of the index file to write.
+  *
+  * Postings of silent frames (value 0) are left out; they match everything.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ write_fingerprint_index(const FingerprintJob *jobs, size_t count, const char *filepath)
+ {
+     OutputBuffer header, prompts, fingerprints, postings, strings;
+     uint64_t *keys = NULL;
+     size_t key_count = 0, frame_count = 0, i, k;
+     const BatchRom *last_rom = NULL;
+     uint32_t rom_string = 0;
+     FILE *fp;
+     bool written, success = false;
+
+     init_output_buffer(&header);
+     init_output_buffer(&prompts);
+     init_output_buffer(&fingerprints);
+     init_output_buffer(&postings);
+     init_output_buffer(&strings);
+
+     for (i = 0; i < count; ++i)
+         frame_count += jobs[i].fingerprints.size / 4;
+     if ((uint64_t)count * FP_PROMPT_RECORD_SIZE + (uint64_t)frame_count * 12 > UINT32_MAX / 2) {
+         fprintf(stderr, "ERROR: Too many prompts for one fingerprint index.\n");
+         return false;
+     }
+     keys = (uint64_t *)malloc((frame_count ? frame_count : 1) * sizeof(uint64_t));
+     if (!keys) {
+         fprintf(stderr, "ERROR: Memory allocation failed for fingerprint postings.\n");
+         return false;
+     }
+
+     for (i = 0; i < count; ++i) {
+         const DecodeJob *job = jobs[i].job;
+         const MessageCatalog *catalog = &job->rom->catalog;
+         uint32_t first = (uint32_t)(fingerprints.size / 4);
+         uint32_t frames = (uint32_t)(jobs[i].fingerprints.size / 4);
+         uint32_t name_string = (uint32_t)strings.size;
+         char default_name[64];
+         const char *name = default_name;
+
+         if (job->rom != last_rom) {
+             last_rom = job->rom;
+             rom_string = (uint32_t)strings.size;
+             if (!append_bytes(&strings, last_rom->rom_basename, strlen(last_rom->rom_basename) + 1))
+                 goto cleanup;
+             name_string = (uint32_t)strings.size;
+         }
+         if (catalog->mapping[job->message])
+             name = catalog->mapping[job->message]->output_filename_base;
+         else
+             snprintf(default_name, sizeof(default_name), "message_%u_%03u", catalog->segment[job->message],
+                      (unsigned)catalog->index[job->message]);
+         if (!append_bytes(&strings, name, strlen(name) + 1) ||
+             !append_u32le(&prompts, rom_string) ||
+             !append_u32le(&prompts, name_string) ||
+             !append_u32le(&prompts, catalog->segment[job->message]) ||
+             !append_u32le(&prompts, catalog->index[job->message]) ||
+             !append_u32le(&prompts, catalog->absolute[job->message]) ||
+             !append_u32le(&prompts, first) ||
+             !append_u32le(&prompts, frames) ||
+             !append_u32le(&prompts, 0) ||
+             (frames > 0 && !append_bytes(&fingerprints, jobs[i].fingerprints.data, jobs[i].fingerprints.size)))
+             goto cleanup;
+         for (k = 0; k < frames; ++k) {
+             uint32_t value = read_u32le(jobs[i].fingerprints.data + k * 4);
+             if (value != 0)
+                 keys[key_count++] = ((uint64_t)value << 32) | (first + k);
+         }
+     }
+     if (strings.size > UINT32_MAX / 2) {
+         fprintf(stderr, "ERROR: Fingerprint index strings are too large.\n");
+         goto cleanup;
+     }
+
+     /* Inverted index: frames grouped by sub-fingerprint */
+     qsort(keys, key_count, sizeof(uint64_t), compare_fingerprint_keys);
+     if (!reserve_output_buffer(&postings, key_count * 8))
+         goto cleanup;
+     for (k = 0; k < key_count; ++k) {
+         append_u32le(&postings, (uint32_t)(keys[k] >> 32));
+         append_u32le(&postings, (uint32_t)keys[k]);
+     }
+
+     if (!append_bytes(&header, FP_INDEX_MAGIC, 4) ||
+         !append_u32le(&header, FP_INDEX_VERSION) ||
+         !append_u32le(&header, (uint32_t)count) ||
+         !append_u32le(&header, (uint32_t)frame_count) ||
+         !append_u32le(&header, (uint32_t)key_count) ||
+         !append_u32le(&header, (uint32_t)(FP_INDEX_HEADER_SIZE + prompts.size)) ||
+         !append_u32le(&header, (uint32_t)(FP_INDEX_HEADER_SIZE + prompts.size + fingerprints.size)) ||
+         !append_u32le(&header, (uint32_t)(FP_INDEX_HEADER_SIZE + prompts.size + fingerprints.size + postings.size)))
+         goto cleanup;
+
+     fp = fopen(filepath, "wb");
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot create fingerprint index '%s'.\n", filepath);
+         goto cleanup;
+     }
+     written = fwrite(header.data, 1, header.size, fp) == header.size &&
+               fwrite(prompts.data, 1, prompts.size, fp) == prompts.size &&
+               (fingerprints.size == 0 || fwrite(fingerprints.data, 1, fingerprints.size, fp) == fingerprints.size) &&
+               (postings.size == 0 || fwrite(postings.data, 1, postings.size, fp) == postings.size) &&
+               fwrite(strings.data, 1, strings.size, fp) == strings.size;
+     if (fclose(fp) != 0 || !written) {
+         fprintf(stderr, "ERROR: Failed to write fingerprint index '%s'.\n", filepath);
+         goto cleanup;
+     }
+     status_printf("Fingerprint index: %zu prompt(s), %zu frame(s), %zu posting(s) written to '%s'.\n",
+                   count, frame_count, key_count, filepath);
+     success = true;
+
+ cleanup:
+     free(keys);
+     free_output_buffer(&header);
+     free_output_buffer(&prompts);
+     free_output_buffer(&fingerprints);
+     free_output_buffer(&postings);
+     free_output_buffer(&strings);
+     return success;
+ }
+
+ /**
+  * run_fingerprint_index() - Fingerprints every message of the batch inputs into an index file.
+  * @options: Parsed command line options (--fp-index).
+  *
+  * Inputs are collected like run_batch() (files, directories, manifest), and
+  * names come from each ROM's mapping file. Messages are decoded and
+  * fingerprinted on the worker pool, longest first.
+  *
+  * Return: EXIT_SUCCESS or EXIT_FAILURE.
+  */
+ int
+ run_fingerprint_index(const ProgramOptions *options)
+ {
+     BatchRomList roms = {NULL, 0, 0};
+     DecodeJobList jobs = {NULL, 0, 0};
+     FingerprintScheduler scheduler;
+     WorkPool pool;
+     FingerprintJob *fingerprint_jobs = NULL;
+     uint64_t start_ns = get_monotonic_ns();
+     int exit_code = EXIT_SUCCESS;
+     size_t failed, i;
+
+     for (i = 0; i < MAX_WORKER_THREADS; ++i)
+         init_pcm_buffer(&scheduler.scratch[i]);
+
+     if (!collect_batch_inputs(&roms, options)) {
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     status_printf("Fingerprint index: %zu ROM(s), %d worker thread(s)\n", roms.count, options->thread_count);
+
+     for (i = 0; i < roms.count; ++i) {
+         BatchRom *rom = &roms.roms[i];
+
+         verbose_printf("Loading batch ROM %zu: %s\n", i, rom->rom_filepath);
+         if (!load_batch_rom(rom)) {
+             fprintf(stderr, "ERROR: Skipping '%s' (not a usable ROM image).\n", rom->rom_filepath);
+             exit_code = EXIT_FAILURE;
+             free(rom->rom_data);
+             rom->rom_data = NULL;
+             continue;
+         }
+         if (!collect_decode_jobs(rom, -1, &jobs)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
+         }
+     }
+
+     if (jobs.count == 0) {
+         fprintf(stderr, "ERROR: No messages to fingerprint.\n");
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     fingerprint_jobs = (FingerprintJob *)malloc(jobs.count * sizeof(FingerprintJob));
+     if (!fingerprint_jobs) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for fingerprint jobs.\n");
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     for (i = 0; i < jobs.count; ++i) {
+         fingerprint_jobs[i].job = &jobs.jobs[i];
+         init_output_buffer(&fingerprint_jobs[i].fingerprints);
+     }
+
+     init_fingerprint_tables();
+     scheduler.jobs = fingerprint_jobs;
+     if (!init_work_pool(&pool, &jobs, options->thread_count, run_fingerprint_job, &scheduler)) {
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     failed = run_work_pool(&pool);
+     free_work_pool(&pool);
+     if (failed > 0) {
+         fprintf(stderr, "ERROR: Failed to fingerprint %zu message(s).\n", failed);
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+
+     if (!write_fingerprint_index(fingerprint_jobs, jobs.count, options->fp_index_filepath))
+         exit_code = EXIT_FAILURE;
+     status_printf("Fingerprinted %zu message(s) from %zu ROM(s) in %.1f ms.\n", jobs.count, roms.count,
+                   (double)(get_monotonic_ns() - start_ns) / 1e6);
+
+ cleanup:
+     if (fingerprint_jobs) {
+         for (i = 0; i < jobs.count; ++i)
+             free_output_buffer(&fingerprint_jobs[i].fingerprints);
+     }
+     for (i = 0; i < MAX_WORKER_THREADS; ++i)
+         free_pcm_buffer(&scheduler.scratch[i]);
+     free(fingerprint_jobs);
+     free(jobs.jobs);
+     free_batch_rom_list(&roms);
+     return exit_code;
+ }
+
+ /**
+  * close_fingerprint_index() - Unmaps a FingerprintIndex.
+  * @index: Pointer to the FingerprintIndex.
+  */
+ void
+ close_fingerprint_index(FingerprintIndex *index)
+ {
+     if (index->map) {
+ #ifdef _WIN32
+         UnmapViewOfFile(index->map);
+ #else
+         munmap((void *)index->map, index->size);
+ #endif
+     }
+     memset(index, 0, sizeof(*index));
+ }
+
+ /**
+  * open_fingerprint_index() - Maps a --fp-index file for queries.
+  * @filepath: Path to the index file.
+  * @index:    Pointer to the FingerprintIndex to fill.
+  *
+  * The header and the prompt records are validated; postings are checked as
+  * they are used. Nothing is parsed or copied.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ open_fingerprint_index(const char *filepath, FingerprintIndex *index)
+ {
+     uint64_t fingerprints_offset, postings_offset, strings_offset;
+     uint32_t i, next_first = 0;
+
+     memset(index, 0, sizeof(*index));
+     index->map = map_file_read_only(filepath, &index->size);
+     if (!index->map) {
+         fprintf(stderr, "ERROR: Cannot map fingerprint index '%s'.\n", filepath);
+         return false;
+     }
+     if (index->size < FP_INDEX_HEADER_SIZE || memcmp(index->map, FP_INDEX_MAGIC, 4) != 0 ||
+         read_u32le(index->map + 4) != FP_INDEX_VERSION) {
+         fprintf(stderr, "ERROR: '%s' is not a supported fingerprint index.\n", filepath);
+         goto fail;
+     }
+     index->prompt_count = read_u32le(index->map + 8);
+     index->fingerprint_count = read_u32le(index->map + 12);
+     index->posting_count = read_u32le(index->map + 16);
+     fingerprints_offset = read_u32le(index->map + 20);
+     postings_offset = read_u32le(index->map + 24);
+     strings_offset = read_u32le(index->map + 28);
+     if (fingerprints_offset != FP_INDEX_HEADER_SIZE + (uint64_t)index->prompt_count * FP_PROMPT_RECORD_SIZE ||
+         postings_offset != fingerprints_offset + (uint64_t)index->fingerprint_count * 4 ||
+         strings_offset != postings_offset + (uint64_t)index->posting_count * 8 ||
+         strings_offset > index->size || index->map[index->size - 1] != '\0')
+         goto corrupt;
+     index->prompts = index->map + FP_INDEX_HEADER_SIZE;
+     index->fingerprints = index->map + fingerprints_offset;
+     index->postings = index->map + postings_offset;
+     index->strings = (const char *)index->map + strings_offset;
+     index->strings_size = (uint32_t)(index->size - strings_offset);
+
+     /* Prompts must tile the fingerprints in order (frame lookups bisect them) */
+     for (i = 0; i < index->prompt_count; ++i) {
+         const uint8_t *prompt = index->prompts + (size_t)i * FP_PROMPT_RECORD_SIZE;
+
+         if (read_u32le(prompt) >= index->strings_size || read_u32le(prompt + 4) >= index->strings_size ||
+             read_u32le(prompt + 20) != next_first ||
+             (uint64_t)next_first + read_u32le(prompt + 24) > index->fingerprint_count)
+             goto corrupt;
+         next_first += read_u32le(prompt + 24);
+     }
+     return true;
+
+ corrupt:
+     fprintf(stderr, "ERROR: Fingerprint index '%s' is truncated or corrupt.\n", filepath);
+ fail:
+     close_fingerprint_index(index);
+     return false;
+ }
+
+ /**
+  * find_fingerprint_prompt() - Finds the prompt that owns an indexed frame.
+  * @index: Pointer to the FingerprintIndex.
+  * @frame: Frame number (below @index->fingerprint_count).
+  *
+  * Return: Prompt record number.
+  */
+ uint32_t
+ find_fingerprint_prompt(const FingerprintIndex *index, uint32_t frame)
+ {
+     uint32_t low = 0, high = index->prompt_count;
+
+     while (high - low > 1) { /* Last prompt whose first frame is <= @frame */
+         uint32_t mid = low + (high - low) / 2;
+         if (read_u32le(index->prompts + (size_t)mid * FP_PROMPT_RECORD_SIZE + 20) <= frame)
+             low = mid;
+         else
+             high = mid;
+     }
+     return low;
+ }
+
+ /**
+  * find_fingerprint_candidates() - Collects the alignments suggested by the inverted index.
+  * @index:      Pointer to the FingerprintIndex.
+  * @query:      Sub-fingerprints of the query (little-endian 32-bit values).
+  * @frames:     Number of query frames.
+  * @candidates: Receives a malloc'd array of (prompt << 32 | biased shift) keys.
+  * @count:      Receives the number of keys.
+  *
+  * Every query frame and its 32 one-bit variants are looked up by binary
+  * search. A hit places the query at one offset within one prompt. Values
+  * posted more than FP_MAX_POSTING_RUN times (near-silence) are skipped.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ find_fingerprint_candidates(const FingerprintIndex *index, const uint8_t *query, size_t frames,
+                             uint64_t **candidates, size_t *count)
+ {
+     size_t capacity = 0, i;
+     int flip;
+
+     *candidates = NULL;
+     *count = 0;
+     for (i = 0; i < frames; ++i) {
+         uint32_t value = read_u32le(query + i * 4);
+
+         if (value == 0)
+             continue;
+         for (flip = -1; flip < 32; ++flip) {
+             uint32_t key = (flip < 0) ? value : value ^ ((uint32_t)1 << flip);
+             uint32_t low = 0, high = index->posting_count, end;
+
+             while (low < high) {
+                 uint32_t mid = low + (high - low) / 2;
+                 if (read_u32le(index->postings + (size_t)mid * 8) < key)
+                     low = mid + 1;
+                 else
+                     high = mid;
+             }
+             for (end = low; end < index->posting_count && read_u32le(index->postings + (size_t)end * 8) == key; ++end)
+                 ;
+             if (end - low > FP_MAX_POSTING_RUN)
+                 continue;
+
+             for (; low < end; ++low) {
+                 uint32_t frame = read_u32le(index->postings + (size_t)low * 8 + 4);
+                 uint32_t prompt;
+                 int64_t shift;
+
+                 if (frame >= index->fingerprint_count)
+                     continue;
+                 prompt = find_fingerprint_prompt(index, frame);
+                 shift = (int64_t)frame - read_u32le(index->prompts + (size_t)prompt * FP_PROMPT_RECORD_SIZE + 20) -
+                         (int64_t)i;
+                 if (*count >= capacity) {
+                     size_t new_capacity = (capacity == 0) ? 1024 : capacity * 2;
+                     uint64_t *new_candidates = (uint64_t *)realloc(*candidates, new_capacity * sizeof(uint64_t));
+                     if (!new_candidates) {
+                         fprintf(stderr, "ERROR: Failed to allocate memory for fingerprint candidates.\n");
+                         return false;
+                     }
+                     *candidates = new_candidates;
+                     capacity = new_capacity;
+                 }
+                 (*candidates)[(*count)++] = ((uint64_t)prompt << 32) | (uint32_t)(shift + INT32_MAX);
+             }
+         }
+     }
+     return true;
+ }
+
+ /**
+  * compare_fingerprint_matches() - qsort() comparator ordering matches best first.
+  */
+ int
+ compare_fingerprint_matches(const void *a, const void *b)
+ {
+     const FingerprintMatch *match_a = (const FingerprintMatch *)a;
+     const FingerprintMatch *match_b = (const FingerprintMatch *)b;
+
+     if (match_a->bit_error_rate != match_b->bit_error_rate)
+         return (match_a->bit_error_rate < match_b->bit_error_rate) ? -1 : 1;
+     return (match_a->prompt > match_b->prompt) - (match_a->prompt < match_b->prompt);
+ }
+
+ /**
+  * run_fingerprint_query() - Prints the indexed prompts similar to one message.
+  * @options: Parsed command line options (--fp-query, -i, one ROM).
+  *
+  * Each candidate alignment from the inverted index is scored over its
+  * overlap with fingerprint_distance(); the best alignment of every prompt
+  * whose bit error rate is at most FP_MAX_BIT_ERROR_RATE is printed to
+  * stdout, best first.
+  *
+  * Return: EXIT_SUCCESS or EXIT_FAILURE.
+  */
+ int
+ run_fingerprint_query(const ProgramOptions *options)
+ {
+     const char *rom_filepath = options->rom_filepaths[0];
+     uint8_t *rom_data = NULL;
+     size_t rom_size = 0;
+     SegmentDirectory directory;
+     MessageCatalog catalog;
+     MappingTable mapping_table;
+     FingerprintIndex index;
+     PcmBuffer pcm;
+     OutputBuffer query;
+     uint64_t *candidates = NULL;
+     FingerprintMatch *matches = NULL;
+     size_t candidate_count = 0, match_count = 0, frames, message, i;
+     char default_name[64];
+     const char *name = NULL;
+     uint64_t start_ns;
+     int exit_code = EXIT_FAILURE;
+
+     init_segment_directory(&directory);
+     init_message_catalog(&catalog);
+     init_mapping_table(&mapping_table);
+     memset(&index, 0, sizeof(index));
+     init_pcm_buffer(&pcm);
+     init_output_buffer(&query);
+     init_fingerprint_tables();
+
+     if (!load_rom_data(rom_filepath, &rom_data, &rom_size) ||
+         !load_mapping_data(options->map_filepath, &mapping_table))
+         goto cleanup;
+     if (!(scan_mode ? scan_segment_directory(rom_data, rom_size, &directory) :
+           build_segment_directory_fixed(rom_data, rom_size, &directory)) && directory.count == 0)
+         goto cleanup;
+
+     /* Locate and fingerprint the query message */
+     if (!build_message_catalog(&catalog, rom_data, rom_size, &directory, 0, 0, &mapping_table))
+         goto cleanup;
+     message = find_catalog_message(&catalog, options->target_message_idx);
+     if (message < catalog.count) {
+         if (catalog.mapping[message]) {
+             name = catalog.mapping[message]->output_filename_base;
+         } else {
+             snprintf(default_name, sizeof(default_name), "message_%u_%03u", catalog.segment[message],
+                      (unsigned)catalog.index[message]);
+             name = default_name;
+         }
+         if (catalog.start[message] < rom_size &&
+             (!decode_message_samples(rom_data, rom_size, catalog.start[message], catalog.end[message], &pcm) ||
+              !append_fingerprints(&pcm, &query)))
+             goto cleanup;
+     }
+     if (!name) {
+         fprintf(stderr, "ERROR: Target message index %ld not found in '%s'.\n", options->target_message_idx, rom_filepath);
+         goto cleanup;
+     }
+     frames = query.size / 4;
+     if (frames == 0) {
+         fprintf(stderr, "ERROR: Message %ld is too short to fingerprint.\n", options->target_message_idx);
+         goto cleanup;
+     }
+
+     /* Look up the candidates in the inverted index, then score each alignment */
+     start_ns = get_monotonic_ns();
+     if (!open_fingerprint_index(options->fp_query_filepath, &index) ||
+         !find_fingerprint_candidates(&index, query.data, frames, &candidates, &candidate_count))
+         goto cleanup;
+     if (candidate_count > 0)
+         qsort(candidates, candidate_count, sizeof(uint64_t), compare_fingerprint_keys);
+     matches = (FingerprintMatch *)malloc((candidate_count ? candidate_count : 1) * sizeof(FingerprintMatch));
+     if (!matches) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for fingerprint matches.\n");
+         goto cleanup;
+     }
+     for (i = 0; i < candidate_count; ++i) {
+         uint32_t prompt = (uint32_t)(candidates[i] >> 32);
+         int64_t shift = (int64_t)(uint32_t)candidates[i] - INT32_MAX;
+         const uint8_t *record = index.prompts + (size_t)prompt * FP_PROMPT_RECORD_SIZE;
+         int64_t prompt_frames = read_u32le(record + 24);
+         int64_t first = (shift < 0) ? -shift : 0;
+         int64_t last = ((int64_t)frames < prompt_frames - shift) ? (int64_t)frames : prompt_frames - shift;
+         int64_t longest = ((int64_t)frames > prompt_frames) ? (int64_t)frames : prompt_frames;
+         double bit_error_rate;
+
+         if (i > 0 && candidates[i] == candidates[i - 1])
+             continue;
+         if (last - first < (int64_t)(FP_MIN_OVERLAP * (double)longest) || last <= first)
+             continue;
+         bit_error_rate = (double)fingerprint_distance(query.data + first * 4,
+                                                       index.fingerprints + (read_u32le(record + 20) + first + shift) * 4,
+                                                       (size_t)(last - first)) / (32.0 * (double)(last - first));
+         if (bit_error_rate > FP_MAX_BIT_ERROR_RATE)
+             continue;
+         if (match_count > 0 && matches[match_count - 1].prompt == prompt) {
+             if (bit_error_rate < matches[match_count - 1].bit_error_rate)
+                 matches[match_count - 1].bit_error_rate = bit_error_rate;
+             continue;
+         }
+         matches[match_count].prompt = prompt;
+         matches[match_count].bit_error_rate = bit_error_rate;
+         match_count++;
+     }
+     qsort(matches, match_count, sizeof(FingerprintMatch), compare_fingerprint_matches);
+
+     printf("# Similar to: %s message %ld (%s)\n", get_base_filename(rom_filepath), options->target_message_idx, name);
+     for (i = 0; i < match_count; ++i) {
+         const uint8_t *record = index.prompts + (size_t)matches[i].prompt * FP_PROMPT_RECORD_SIZE;
+
+         printf("%5.1f%%\t%s\t%u\t%u\t%u\t%s\n", (1.0 - matches[i].bit_error_rate) * 100.0,
+                index.strings + read_u32le(record), read_u32le(record + 8), read_u32le(record + 12),
+                read_u32le(record + 16), index.strings + read_u32le(record + 4));
+     }
+     fflush(stdout);
+     status_printf("Fingerprint query: %zu frame(s), %zu candidate alignment(s), %zu match(es) among %u prompt(s) in %.2f ms.\n",
+                   frames, candidate_count, match_count, index.prompt_count, (double)(get_monotonic_ns() - start_ns) / 1e6);
+     exit_code = EXIT_SUCCESS;
+
+ cleanup:
+     free(matches);
+     free(candidates);
+     close_fingerprint_index(&index);
+     free_output_buffer(&query);
+     free_pcm_buffer(&pcm);
+     free_mapping_table(&mapping_table);
+     free_segment_directory(&directory);
+     free_message_catalog(&catalog);
+     free(rom_data);
+     return exit_code;
+ }
+
+
+ /* --- ROM Diff --- */
+
+ /**
+  * enum diff_status - How a message of a changed segment compares with the other ROM.
+  * @DIFF_UNCHANGED: Same payload at the same position.
+  * @DIFF_MOVED:     Same payload at another position.
+  * @DIFF_CHANGED:   Other payload at the same position.
+  * @DIFF_ADDED:     Only in the new ROM.
+  * @DIFF_REMOVED:   Only in the known ROM.
+  */
+ typedef enum {
+     DIFF_UNCHANGED,
+     DIFF_MOVED,
+     DIFF_CHANGED,
+     DIFF_ADDED,
+     DIFF_REMOVED
+ } DiffStatus;
+
+ /**
+  * struct diff_message - A message of a segment that differs between the ROMs.
+  * @hash:                FNV-1a 64 hash of the message bytes (as in list_message()).
+  * @segment_index:       0-based segment index.
+  * @msg_idx_in_seg:      0-based message index within the segment.
+  * @absolute_msg_idx:    0-based absolute message index.
+  * @message_offset:      Offset (bytes) from segment start to the mode byte.
+  * @next_message_offset: Offset (bytes) of the next message or segment end.
+  * @status:              Result of the comparison.
+  * @partner:             Index of the paired message in the other ROM (moved, changed).
+  */
+ typedef struct {
+     uint64_t hash;
+     int segment_index;
+     int msg_idx_in_seg;
+     int absolute_msg_idx;
+     uint32_t message_offset;
+     uint32_t next_message_offset;
+     DiffStatus status;
+     size_t partner;
+ } DiffMessage;
+
+ /**
+  * struct diff_rom - One side of a ROM diff.
+  * @rom_filepath:     Path to the ROM file.
+  * @rom_data:         Malloc'd ROM contents.
+  * @rom_size:         Size of @rom_data.
+  * @segments:         Segment directory of the ROM.
+  * @messages:         Messages of the segments that differ, in ROM order.
+  * @message_count:    Number of entries in @messages.
+  * @message_capacity: Allocated capacity of @messages.
+  */
+ typedef struct {
+     const char *rom_filepath;
+     uint8_t *rom_data;
+     size_t rom_size;
+     SegmentDirectory segments;
+     DiffMessage *messages;
+     size_t message_count;
+     size_t message_capacity;
+ } DiffRom;
+
+ /**
+  * load_diff_rom() - Loads one ROM of a diff and finds its segments.
+  * @rom:          Pointer to the DiffRom to fill (zeroed, with an initialized directory).
+  * @rom_filepath: Path to the ROM file.
+  *
+  * Return: true on success, false if the ROM cannot be used.
+  */
+ bool
+ load_diff_rom(DiffRom *rom, const char *rom_filepath)
+ {
+     rom->rom_filepath = rom_filepath;
+     if (!load_rom_data(rom_filepath, &rom->rom_data, &rom->rom_size))
+         return false;
+     if (!(scan_mode ? scan_segment_directory(rom->rom_data, rom->rom_size, &rom->segments) :
+           build_segment_directory_fixed(rom->rom_data, rom->rom_size, &rom->segments)) && rom->segments.count == 0) {
+         fprintf(stderr, "ERROR: No segments found in '%s'.\n", rom_filepath);
+         return false;
+     }
+     return true;
+ }
+
+ /**
+  * free_diff_rom() - Frees memory associated with a DiffRom.
+  * @rom: Pointer to the DiffRom.
+  */
+ void
+ free_diff_rom(DiffRom *rom)
+ {
+     free(rom->rom_data);
+     free(rom->messages);
+     free_segment_directory(&rom->segments);
+     rom->rom_data = NULL;
+     rom->messages = NULL;
+     rom->message_count = 0;
+     rom->message_capacity = 0;
+ }
+
+ /**
+  * collect_diff_messages() - Hashes the messages of one segment that differs.
+  * @rom:               Pointer to the DiffRom.
+  * @segment_pos:       Index of the segment in @rom->segments.
+  * @absolute_msg_base: Absolute index of the segment's first message.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ collect_diff_messages(DiffRom *rom, size_t segment_pos, int absolute_msg_base)
+ {
+     const SegmentEntry *segment = &rom->segments.segments[segment_pos];
+     const uint8_t *table = rom->rom_data + segment->start + 5;
+     uint32_t k;
+
+     for (k = 0; k < segment->message_count; ++k) {
+         DiffMessage *message;
+         size_t start, end, samples;
+
+         if (rom->message_count >= rom->message_capacity) {
+             size_t new_capacity = (rom->message_capacity == 0) ? 256 : rom->message_capacity * 2;
+             DiffMessage *new_messages = (DiffMessage *)realloc(rom->messages, new_capacity * sizeof(DiffMessage));
+             if (!new_messages) {
+                 fprintf(stderr, "ERROR: Failed to allocate memory for the diff of '%s'.\n", rom->rom_filepath);
+                 return false;
+             }
+             rom->messages = new_messages;
+             rom->message_capacity = new_capacity;
+         }
+
+         message = &rom->messages[rom->message_count++];
+         message->segment_index = (int)segment_pos;
+         message->msg_idx_in_seg = (int)k;
+         message->absolute_msg_idx = absolute_msg_base + (int)k;
+         message->message_offset = (uint32_t)read_u16be(table + k * 2) * 2;
+         message->next_message_offset = (k + 1 < segment->message_count) ?
+             (uint32_t)read_u16be(table + (k + 1) * 2) * 2 : (uint32_t)segment->size;
+         message->status = DIFF_UNCHANGED;
+         message->partner = 0;
+         start = segment->start + message->message_offset;
+         end = start;
+         if (start < rom->rom_size)
+             measure_message(rom->rom_data, rom->rom_size, start, segment->start + message->next_message_offset,
+                             k + 1 == segment->message_count, &end, &samples);
+         message->hash = hash_message_bytes(rom->rom_data + start, end - start);
+     }
+     return true;
+ }
+
+ /**
+  * compare_diff_messages_by_hash() - qsort() comparator ordering message pointers by hash, then ROM order.
+  */
+ int
+ compare_diff_messages_by_hash(const void *a, const void *b)
+ {
+     const DiffMessage *message_a = *(const DiffMessage *const *)a;
+     const DiffMessage *message_b = *(const DiffMessage *const *)b;
+
+     if (message_a->hash != message_b->hash)
+         return (message_a->hash < message_b->hash) ? -1 : 1;
+     return message_a->absolute_msg_idx - message_b->absolute_msg_idx;
+ }
+
+ /**
+  * find_diff_message() - Finds the message at a position among the collected messages.
+  * @rom:            Pointer to the DiffRom.
+  * @segment_index:  0-based segment index.
+  * @msg_idx_in_seg: 0-based message index within the segment.
+  *
+  * Return: Index into @rom->messages, or @rom->message_count if not collected.
+  */
+ size_t
+ find_diff_message(const DiffRom *rom, int segment_index, int msg_idx_in_seg)
+ {
+     size_t low = 0, high = rom->message_count;
+
+     while (low < high) { /* Messages are in (segment, index) order */
+         size_t mid = low + (high - low) / 2;
+         const DiffMessage *message = &rom->messages[mid];
+
+         if (message->segment_index < segment_index ||
+             (message->segment_index == segment_index && message->msg_idx_in_seg < msg_idx_in_seg))
+             low = mid + 1;
+         else
+             high = mid;
+     }
+     if (low < rom->message_count && rom->messages[low].segment_index == segment_index &&
+         rom->messages[low].msg_idx_in_seg == msg_idx_in_seg)
+         return low;
+     return rom->message_count;
+ }
+
+ /**
+  * print_diff_line() - Prints one moved, changed, added or removed message.
+  * @status:      Result of the comparison.
+  * @old_message: Message of the known ROM (or NULL if added).
+  * @new_message: Message of the new ROM (or NULL if removed).
+  * @mapping:     Mapping of the known ROM's message (or NULL).
+  */
+ void
+ print_diff_line(DiffStatus status, const DiffMessage *old_message, const DiffMessage *new_message,
+                 const MessageMapping *mapping)
+ {
+     static const char *const status_names[] = {"unchanged", "moved", "changed", "added", "removed"};
+     char old_position[32] = "-\t-";
+     char new_position[32] = "-\t-";
+     char default_name[64];
+
+     if (old_message)
+         snprintf(old_position, sizeof(old_position), "%d\t%d", old_message->segment_index, old_message->msg_idx_in_seg);
+     if (new_message)
+         snprintf(new_position, sizeof(new_position), "%d\t%d", new_message->segment_index, new_message->msg_idx_in_seg);
+     if (!mapping) {
+         const DiffMessage *named = old_message ? old_message : new_message;
+         snprintf(default_name, sizeof(default_name), "message_%d_%03d", named->segment_index, named->msg_idx_in_seg);
+     }
+     printf("%s\t%s\t%s\t%s%s%s\n", status_names[status], old_position, new_position,
+            mapping ? mapping->output_filename_base : default_name,
+            (mapping && mapping->comment) ? "\t# " : "", (mapping && mapping->comment) ? mapping->comment : "");
+ }
+
+ /**
+  * run_rom_diff() - Reports how a ROM differs from a known ROM.
+  * @options: Parsed command line options (--diff; -m maps the known ROM).
+  *
+  * Segments at the same position whose bytes hash alike are skipped whole.
+  * Only the messages of the other segments are hashed and paired: the same
+  * payload at the same position is unchanged, elsewhere moved (first
+  * unpaired copy in ROM order); an unpaired message at a position the other
+  * ROM also has is changed, otherwise added or removed. With -o, only the
+  * changed and added messages of the new ROM are decoded.
+  *
+  * Return: EXIT_SUCCESS or EXIT_FAILURE.
+  */
+ int
+ run_rom_diff(const ProgramOptions *options)
+ {
+     DiffRom old_rom, new_rom;
+     MappingTable mapping_table;
+     MessageMapping mapping;
+     const DiffMessage **by_hash = NULL;
+     size_t segment_count, segment_pos, old_pos, new_pos, i;
+     size_t identical_segments = 0, counts[DIFF_REMOVED + 1] = {0, 0, 0, 0, 0};
+     int old_base = 0, new_base = 0;
+     const char *new_basename = get_base_filename(options->rom_filepaths[0]);
+     uint64_t start_ns;
+     int exit_code = EXIT_FAILURE;
+
+     memset(&old_rom, 0, sizeof(old_rom));
+     memset(&new_rom, 0, sizeof(new_rom));
+     init_segment_directory(&old_rom.segments);
+     init_segment_directory(&new_rom.segments);
+     init_mapping_table(&mapping_table);
+     if (!load_diff_rom(&old_rom, options->diff_filepath) || !load_diff_rom(&new_rom, options->rom_filepaths[0]) ||
+         !load_mapping_data(options->map_filepath, &mapping_table))
+         goto cleanup;
+
+     /* Segment level: skip segments whose bytes are the same */
+     start_ns = get_monotonic_ns();
+     segment_count = (old_rom.segments.count > new_rom.segments.count) ? old_rom.segments.count : new_rom.segments.count;
+     for (segment_pos = 0; segment_pos < segment_count; ++segment_pos) {
+         const SegmentEntry *old_segment = (segment_pos < old_rom.segments.count) ? &old_rom.segments.segments[segment_pos] : NULL;
+         const SegmentEntry *new_segment = (segment_pos < new_rom.segments.count) ? &new_rom.segments.segments[segment_pos] : NULL;
+
+         if (old_segment && new_segment && old_segment->size == new_segment->size &&
+             old_segment->message_count == new_segment->message_count &&
+             hash_message_bytes(old_rom.rom_data + old_segment->start, old_segment->size) ==
+             hash_message_bytes(new_rom.rom_data + new_segment->start, new_segment->size)) {
+             identical_segments++;
+             counts[DIFF_UNCHANGED] += new_segment->message_count;
+         } else if ((old_segment && !collect_diff_messages(&old_rom, segment_pos, old_base)) ||
+                    (new_segment && !collect_diff_messages(&new_rom, segment_pos, new_base))) {
+             goto cleanup;
+         }
+         old_base += old_segment ? (int)old_segment->message_count : 0;
+         new_base += new_segment ? (int)new_segment->message_count : 0;
+     }
+
+     /* Message level: same payload at the same position */
+     for (old_pos = 0, new_pos = 0; old_pos < old_rom.message_count && new_pos < new_rom.message_count;) {
+         DiffMessage *old_message = &old_rom.messages[old_pos];
+         DiffMessage *new_message = &new_rom.messages[new_pos];
+
+         if (old_message->segment_index == new_message->segment_index &&
+             old_message->msg_idx_in_seg == new_message->msg_idx_in_seg) {
+             if (old_message->hash != new_message->hash) {
+                 old_message->status = DIFF_REMOVED;
+                 new_message->status = DIFF_ADDED;
+             } else {
+                 counts[DIFF_UNCHANGED]++;
+             }
+             old_pos++;
+             new_pos++;
+         } else if (old_message->segment_index < new_message->segment_index ||
+                    (old_message->segment_index == new_message->segment_index &&
+                     old_message->msg_idx_in_seg < new_message->msg_idx_in_seg)) {
+             old_message->status = DIFF_REMOVED;
+             old_pos++;
+         } else {
+             new_message->status = DIFF_ADDED;
+             new_pos++;
+         }
+     }
+     for (; old_pos < old_rom.message_count; ++old_pos)
+         old_rom.messages[old_pos].status = DIFF_REMOVED;
+     for (; new_pos < new_rom.message_count; ++new_pos)
+         new_rom.messages[new_pos].status = DIFF_ADDED;
+
+     /* Same payload elsewhere: moved */
+     by_hash = (const DiffMessage **)malloc((old_rom.message_count ? old_rom.message_count : 1) * sizeof(DiffMessage *));
+     if (!by_hash) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the diff index.\n");
+         goto cleanup;
+     }
+     for (i = 0; i < old_rom.message_count; ++i)
+         by_hash[i] = &old_rom.messages[i];
+     if (old_rom.message_count > 0)
+         qsort((void *)by_hash, old_rom.message_count, sizeof(DiffMessage *), compare_diff_messages_by_hash);
+     for (new_pos = 0; new_pos < new_rom.message_count; ++new_pos) {
+         DiffMessage *new_message = &new_rom.messages[new_pos];
+         size_t low = 0, high = old_rom.message_count;
+
+         if (new_message->status != DIFF_ADDED)
+             continue;
+         while (low < high) {
+             size_t mid = low + (high - low) / 2;
+             if (by_hash[mid]->hash < new_message->hash)
+                 low = mid + 1;
+             else
+                 high = mid;
+         }
+         for (; low < old_rom.message_count && by_hash[low]->hash == new_message->hash; ++low) {
+             DiffMessage *old_message = &old_rom.messages[by_hash[low] - old_rom.messages];
+
+             if (old_message->status == DIFF_REMOVED) {
+                 old_message->status = DIFF_MOVED;
+                 new_message->status = DIFF_MOVED;
+                 new_message->partner = (size_t)(old_message - old_rom.messages);
+                 break;
+             }
+         }
+     }
+
+     /* Different payload at a position both ROMs have: changed */
+     for (new_pos = 0; new_pos < new_rom.message_count; ++new_pos) {
+         DiffMessage *new_message = &new_rom.messages[new_pos];
+
+         if (new_message->status != DIFF_ADDED)
+             continue;
+         old_pos = find_diff_message(&old_rom, new_message->segment_index, new_message->msg_idx_in_seg);
+         if (old_pos < old_rom.message_count && old_rom.messages[old_pos].status == DIFF_REMOVED) {
+             old_rom.messages[old_pos].status = DIFF_CHANGED;
+             new_message->status = DIFF_CHANGED;
+             new_message->partner = old_pos;
+         }
+     }
+     status_printf("Diff: %zu of %zu segment(s) identical, %zu + %zu message(s) compared in %.2f ms.\n",
+                   identical_segments, segment_count, old_rom.message_count, new_rom.message_count,
+                   (double)(get_monotonic_ns() - start_ns) / 1e6);
+
+     /* Report: new ROM order, then what is gone */
+     printf("# ROM diff: %s -> %s\n", get_base_filename(old_rom.rom_filepath), new_basename);
+     printf("# status\told_segment\told_index\tnew_segment\tnew_index\tname\n");
+     for (new_pos = 0; new_pos < new_rom.message_count; ++new_pos) {
+         const DiffMessage *new_message = &new_rom.messages[new_pos];
+         const DiffMessage *old_message = (new_message->status == DIFF_ADDED) ? NULL : &old_rom.messages[new_message->partner];
+
+         if (new_message->status == DIFF_UNCHANGED)
+             continue;
+         counts[new_message->status]++;
+         print_diff_line(new_message->status, old_message, new_message,
+                         (old_message && find_mapping(&mapping_table, old_message->segment_index,
+                                                      old_message->msg_idx_in_seg, &mapping)) ? &mapping : NULL);
+     }
+     for (old_pos = 0; old_pos < old_rom.message_count; ++old_pos) {
+         const DiffMessage *old_message = &old_rom.messages[old_pos];
+
+         if (old_message->status != DIFF_REMOVED)
+             continue;
+         counts[DIFF_REMOVED]++;
+         print_diff_line(DIFF_REMOVED, old_message, NULL,
+                         find_mapping(&mapping_table, old_message->segment_index, old_message->msg_idx_in_seg,
+                                      &mapping) ? &mapping : NULL);
+     }
+     fflush(stdout);
+     status_printf("Diff: %zu unchanged, %zu moved, %zu changed, %zu added, %zu removed message(s).\n",
+                   counts[DIFF_UNCHANGED], counts[DIFF_MOVED], counts[DIFF_CHANGED], counts[DIFF_ADDED],
+                   counts[DIFF_REMOVED]);
+
+     /* Decode only what is new: changed messages keep the known ROM's names */
+     exit_code = EXIT_SUCCESS;
+     if (options->output_dir) {
+         size_t decoded = 0;
+
+         if (!make_directories(options->output_dir)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
+         }
+         for (new_pos = 0; new_pos < new_rom.message_count; ++new_pos) {
+             const DiffMessage *new_message = &new_rom.messages[new_pos];
+             const DiffMessage *old_message = &old_rom.messages[new_message->partner];
+
+             if (new_message->status != DIFF_CHANGED && new_message->status != DIFF_ADDED)
+                 continue;
+             if (!process_message(new_rom.rom_data, new_rom.rom_size,
+                                  new_rom.segments.segments[new_message->segment_index].start,
+                                  new_message->segment_index, new_message->msg_idx_in_seg,
+                                  new_message->absolute_msg_idx, new_message->message_offset,
+                                  new_message->next_message_offset,
+                                  (new_message->status == DIFF_CHANGED &&
+                                   find_mapping(&mapping_table, old_message->segment_index,
+                                                old_message->msg_idx_in_seg, &mapping)) ? &mapping : NULL,
+                                  new_basename, options->output_dir))
+                 exit_code = EXIT_FAILURE;
+             decoded++;
+         }
+         status_printf("Diff: Decoded %zu changed or added message(s) to %s.\n", decoded, options->output_dir);
+     }
+
+ cleanup:
+     free((void *)by_hash);
+     free_mapping_table(&mapping_table);
+     free_diff_rom(&old_rom);
+     free_diff_rom(&new_rom);
+     return exit_code;
+ }
+
+
+ /* --- ADPCM Encoding --- */
+
+ float trellis_steps[16][16]; /* step_table[source][nibble], indexed [nibble][destination state] */
+ float trellis_codes[16][16]; /* Backpointer (source << 4 | nibble), indexed [nibble][destination state] */
+ float trellis_magnitudes[8][16]; /* step_table[state][k] for the non-negative half of each row, indexed [k][state] */
+
+ /**
+  * struct encode_span - A run of input samples encoded one way.
+  * @length:  Number of samples.
+  * @silence: True for a silence run (multiple of 8 samples), false for ADPCM nibbles.
+  */
+ typedef struct {
+     uint32_t length;
+     bool silence;
+ } EncodeSpan;
+
+ /**
+  * struct encode_file - One WAV file encoded by --encode.
+  * @wav_filepath:  Input path (a label for messages if @source is set).
+  * @source:        Samples to encode instead of reading @wav_filepath (or NULL).
+  * @output_base:   Output filename without extension (stem of @wav_filepath).
+  * @pcm:           Input samples at DEFAULT_SAMPLE_RATE.
+  * @spans:         Silence and ADPCM runs covering @pcm, in order.
+  * @span_count:    Number of entries in @spans.
+  * @target:        Samples of the ADPCM runs in decoder units (sample / 128).
+  * @voiced_count:  Number of entries in @target.
+  * @nibbles:       Chosen nibble of each entry in @target.
+  * @states:        Decoder step state after each nibble.
+  * @values:        Decoder value after each nibble.
+  * @repaired:      Samples re-searched when joining trellis chunks.
+  * @signal_energy: Sum of squared input samples.
+  * @noise_energy:  Sum of squared differences between input and decoded samples.
+  * @output_bytes:  Size of the encoded message.
+  * @message:       The encoded message, if the scheduler keeps messages.
+  * @failed:        True if the file could not be read or encoded.
+  */
+ typedef struct {
+     const char *wav_filepath;
+     const PcmBuffer *source;
+     char output_base[FILENAME_MAX];
+     PcmBuffer pcm;
+     EncodeSpan *spans;
+     size_t span_count;
+     float *target;
+     size_t voiced_count;
+     uint8_t *nibbles;
+     uint8_t *states;
+     int16_t *values;
+     size_t repaired;
+     double signal_energy;
+     double noise_energy;
+     size_t output_bytes;
+     OutputBuffer message;
+     bool failed;
+ } EncodeFile;
+
+ /**
+  * struct encode_chunk - ENCODE_CHUNK_SIZE samples of one file searched by the trellis.
+  * @file:        File the chunk belongs to.
+  * @first:       Index of the chunk's first sample in @file->target.
+  * @count:       Number of samples.
+  * @start_state: Step state the search starts from (greedy estimate for chunks after the first).
+  * @start_value: Decoder value the search starts from.
+  */
+ typedef struct {
+     EncodeFile *file;
+     size_t first;
+     size_t count;
+     int start_state;
+     int start_value;
+ } EncodeChunk;
+
+ /**
+  * struct encode_scheduler - Shared state of the encoder worker pool.
+  * @files:       Files of the current group.
+  * @file_count:  Number of files.
+  * @chunks:      Trellis chunks of all files.
+  * @chunk_count: Number of chunks.
+  * @quality:     Nibble search (--quality).
+  * @output_dir:  Output directory (or NULL for the current directory).
+  * @keep_messages: True to keep each message in its EncodeFile instead of writing it.
+  * @next_job:    Index of the next file or chunk to hand out.
+  * @failed:      Number of jobs that failed.
+  * @lock:        Protects @next_job and @failed.
+  */
+ typedef struct {
+     EncodeFile *files;
+     size_t file_count;
+     EncodeChunk *chunks;
+     size_t chunk_count;
+     EncodeQuality quality;
+     const char *output_dir;
+     bool keep_messages;
+     size_t next_job;
+     size_t failed;
+     MutexLock lock;
+ } EncodeScheduler;
+
+ /**
+  * init_trellis_tables() - Lays out the step table by destination state for the trellis search.
+  *
+  * Column n of the trellis holds, for each destination state s, the
+  * transition from source state s - state_table[n] with nibble n. Lanes
+  * without such a source get an out-of-range step, so the value check
+  * discards them. Transitions clamped at state 0 or 15 are handled
+  * separately by trellis_step().
+  */
+ void
+ init_trellis_tables(void)
+ {
+     int n, s;
+
+     for (n = 0; n < 16; ++n) {
+         for (s = 0; s < 16; ++s) {
+             int source = s - state_table[n];
+             bool valid = source >= 0 && source <= 15;
+
+             trellis_steps[n][s] = valid ? (float)step_table[source][n] : 4.0f * ENCODE_MIN_VALUE;
+             trellis_codes[n][s] = valid ? (float)((source << 4) | n) : 0.0f;
+         }
+     }
+     for (n = 0; n < 8; ++n) {
+         for (s = 0; s < 16; ++s)
+             trellis_magnitudes[n][s] = (float)step_table[s][n];
+     }
+ }
+
+ /**
+  * apply_nibble() - Runs one nibble through the decoder model.
+  * @state:  Step state (updated).
+  * @value:  Decoder value (updated).
+  * @nibble: 4-bit ADPCM code.
+  *
+  * Mirrors decode_nibble() for values in ENCODE_MIN_VALUE..ENCODE_MAX_VALUE,
+  * where the decoded sample is exactly value * 128.
+  *
+  * Return: false (leaving @state and @value alone) if the value would leave that range.
+  */
+ bool
+ apply_nibble(int *state, int *value, int nibble)
+ {
+     int next_value = *value + step_table[*state][nibble];
+     int next_state = *state + state_table[nibble];
+
+     if (next_value < ENCODE_MIN_VALUE || next_value > ENCODE_MAX_VALUE)
+         return false;
+     *value = next_value;
+     *state = (next_state < 0) ? 0 : (next_state > 15) ? 15 : next_state;
+     return true;
+ }
+
+ /**
+  * replay_nibbles() - Records the decoder state after each of a run of nibbles.
+  * @nibbles: Nibbles to run.
+  * @count:   Number of nibbles.
+  * @state:   Step state before the first nibble.
+  * @value:   Decoder value before the first nibble.
+  * @states:  Receives the step state after each nibble.
+  * @values:  Receives the decoder value after each nibble.
+  */
+ void
+ replay_nibbles(const uint8_t *nibbles, size_t count, int state, int value, uint8_t *states, int16_t *values)
+ {
+     size_t i;
+
+     for (i = 0; i < count; ++i) {
+         apply_nibble(&state, &value, nibbles[i]);
+         states[i] = (uint8_t)state;
+         values[i] = (int16_t)value;
+     }
+ }
+
+ /**
+  * encode_greedy() - Picks each nibble to land closest to its sample.
+  * @file: File whose @target is encoded into @nibbles, @states and @values.
+  */
+ void
+ encode_greedy(EncodeFile *file)
+ {
+     int state = 0, value = 0;
+     size_t i;
+
+     for (i = 0; i < file->voiced_count; ++i) {
+         float best_error = ENCODE_INFINITE_COST;
+         int n, best = 0;
+
+         for (n = 0; n < 16; ++n) {
+             int next_state = state, next_value = value;
+             float error;
+
+             if (!apply_nibble(&next_state, &next_value, n))
+                 continue;
+             error = (file->target[i] - (float)next_value) * (file->target[i] - (float)next_value);
+             if (error < best_error) {
+                 best_error = error;
+                 best = n;
+             }
+         }
+         apply_nibble(&state, &value, best);
+         file->nibbles[i] = (uint8_t)best;
+         file->states[i] = (uint8_t)state;
+         file->values[i] = (int16_t)value;
+     }
+ }
+
+ /**
+  * encode_lookahead() - Picks each nibble by the best pair of nibbles starting with it.
+  * @file: File whose @target is encoded into @nibbles, @states and @values.
+  *
+  * Scores all 256 two-sample continuations, so a nibble that lands a little
+  * off but sets up a better step state for the next sample can win.
+  */
+ void
+ encode_lookahead(EncodeFile *file)
+ {
+     int state = 0, value = 0;
+     size_t i;
+
+     for (i = 0; i < file->voiced_count; ++i) {
+         float best_cost = ENCODE_INFINITE_COST;
+         int n, best = 0;
+
+         for (n = 0; n < 16; ++n) {
+             int next_state = state, next_value = value;
+             float cost, follow = 0.0f;
+             int m;
+
+             if (!apply_nibble(&next_state, &next_value, n))
+                 continue;
+             cost = (file->target[i] - (float)next_value) * (file->target[i] - (float)next_value);
+             if (i + 1 < file->voiced_count) {
+                 follow = ENCODE_INFINITE_COST;
+                 for (m = 0; m < 16; ++m) {
+                     int after_state = next_state, after_value = next_value;
+                     float error;
+
+                     if (!apply_nibble(&after_state, &after_value, m))
+                         continue;
+                     error = (file->target[i + 1] - (float)after_value) * (file->target[i + 1] - (float)after_value);
+                     if (error < follow)
+                         follow = error;
+                 }
+             }
+             if (cost + follow < best_cost) {
+                 best_cost = cost + follow;
+                 best = n;
+             }
+         }
+         apply_nibble(&state, &value, best);
+         file->nibbles[i] = (uint8_t)best;
+         file->states[i] = (uint8_t)state;
+         file->values[i] = (int16_t)value;
+     }
+ }
+
+ /**
+  * trellis_lookahead() - Lowest squared error the next sample can reach from a state.
+  * @next:  Next sample (decoder units).
+  * @value: Decoder value after this sample.
+  * @state: Step state after this sample.
+  *
+  * Each step_table row is its first 8 entries and their negatives, so the
+  * distance to the nearest of the 8 magnitudes is enough.
+  *
+  * Return: The squared error.
+  */
+ float
+ trellis_lookahead(float next, float value, int state)
+ {
+     float distance = fabsf(next - value), best = ENCODE_INFINITE_COST;
+     int k;
+
+     for (k = 0; k < 8; ++k) {
+         float e = distance - trellis_magnitudes[k][state];
+         if (e * e < best)
+             best = e * e;
+     }
+     return best;
+ }
+
+ /**
+  * trellis_step() - Advances the 16 surviving paths of the trellis by one sample.
+  * @cost:         Path costs by state, with 4 padding entries of ENCODE_INFINITE_COST on each side.
+  * @value:        Decoder values by state, padded like @cost.
+  * @target:       Sample to match (decoder units).
+  * @next:         Sample after @target (for choosing survivors).
+  * @next_cost:    Receives the new path costs (padded like @cost).
+  * @next_value:   Receives the new decoder values (padded like @cost).
+  * @backpointers: Receives the (source << 4 | nibble) of each new state's best path.
+  *
+  * Each nibble is one column: destination state s takes the path of source
+  * s - state_table[nibble], so a column is 16 independent lanes computed
+  * 4 at a time with SSE2 or NEON. The few transitions clamped at state 0
+  * or 15 are added afterwards.
+  *
+  * Paths into a state differ in their decoder value, which the state does
+  * not capture, so the survivor is the path with the lowest cost plus the
+  * error the next sample can at best reach from it (trellis_lookahead()).
+  * Candidates are compared in the same order with strict less-than on
+  * every build, so ties resolve identically.
+  */
+ void
+ trellis_step(const float *cost, const float *value, float target, float next, float *next_cost, float *next_value,
+              uint8_t *backpointers)
+ {
+     float best_metric[16], best_cost[16], best_value[16], best_code[16];
+     float minimum;
+     int n, s, source;
+
+ #if defined(HAVE_SSE2)
+     const __m128 low = _mm_set1_ps((float)ENCODE_MIN_VALUE), high = _mm_set1_ps((float)ENCODE_MAX_VALUE);
+     const __m128 goal = _mm_set1_ps(target), ahead = _mm_set1_ps(next);
+     const __m128 sign = _mm_set1_ps(-0.0f);
+     __m128 bm[4], bc[4], bv[4], bp[4];
+     int q, k;
+
+     for (q = 0; q < 4; ++q) {
+         bm[q] = bc[q] = _mm_set1_ps(ENCODE_INFINITE_COST);
+         bv[q] = bp[q] = _mm_setzero_ps();
+     }
+     for (n = 0; n < 16; ++n) {
+         const float *source_cost = cost + 4 - state_table[n];
+         const float *source_value = value + 4 - state_table[n];
+         for (q = 0; q < 4; ++q) {
+             __m128 v = _mm_add_ps(_mm_loadu_ps(source_value + 4 * q), _mm_loadu_ps(trellis_steps[n] + 4 * q));
+             __m128 e = _mm_sub_ps(goal, v);
+             __m128 c = _mm_add_ps(_mm_loadu_ps(source_cost + 4 * q), _mm_mul_ps(e, e));
+             __m128 distance = _mm_andnot_ps(sign, _mm_sub_ps(ahead, v));
+             __m128 h = _mm_set1_ps(ENCODE_INFINITE_COST), m, better;
+             for (k = 0; k < 8; ++k) {
+                 __m128 d = _mm_sub_ps(distance, _mm_loadu_ps(trellis_magnitudes[k] + 4 * q));
+                 h = _mm_min_ps(_mm_mul_ps(d, d), h);
+             }
+             m = _mm_add_ps(c, h);
+             better = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(v, low), _mm_cmple_ps(v, high)), _mm_cmplt_ps(m, bm[q]));
+             bm[q] = _mm_or_ps(_mm_and_ps(better, m), _mm_andnot_ps(better, bm[q]));
+             bc[q] = _mm_or_ps(_mm_and_ps(better, c), _mm_andnot_ps(better, bc[q]));
+             bv[q] = _mm_or_ps(_mm_and_ps(better, v), _mm_andnot_ps(better, bv[q]));
+             bp[q] = _mm_or_ps(_mm_and_ps(better, _mm_loadu_ps(trellis_codes[n] + 4 * q)), _mm_andnot_ps(better, bp[q]));
+         }
+     }
+     for (q = 0; q < 4; ++q) {
+         _mm_storeu_ps(best_metric + 4 * q, bm[q]);
+         _mm_storeu_ps(best_cost + 4 * q, bc[q]);
+         _mm_storeu_ps(best_value + 4 * q, bv[q]);
+         _mm_storeu_ps(best_code + 4 * q, bp[q]);
+     }
+ #elif defined(HAVE_NEON)
+     const float32x4_t low = vdupq_n_f32((float)ENCODE_MIN_VALUE), high = vdupq_n_f32((float)ENCODE_MAX_VALUE);
+     const float32x4_t goal = vdupq_n_f32(target), ahead = vdupq_n_f32(next);
+     float32x4_t bm[4], bc[4], bv[4], bp[4];
+     int q, k;
+
+     for (q = 0; q < 4; ++q) {
+         bm[q] = bc[q] = vdupq_n_f32(ENCODE_INFINITE_COST);
+         bv[q] = bp[q] = vdupq_n_f32(0.0f);
+     }
+     for (n = 0; n < 16; ++n) {
+         const float *source_cost = cost + 4 - state_table[n];
+         const float *source_value = value + 4 - state_table[n];
+         for (q = 0; q < 4; ++q) {
+             float32x4_t v = vaddq_f32(vld1q_f32(source_value + 4 * q), vld1q_f32(trellis_steps[n] + 4 * q));
+             float32x4_t e = vsubq_f32(goal, v);
+             float32x4_t c = vaddq_f32(vld1q_f32(source_cost + 4 * q), vmulq_f32(e, e));
+             float32x4_t distance = vabsq_f32(vsubq_f32(ahead, v));
+             float32x4_t h = vdupq_n_f32(ENCODE_INFINITE_COST), m;
+             uint32x4_t better;
+             for (k = 0; k < 8; ++k) {
+                 float32x4_t d = vsubq_f32(distance, vld1q_f32(trellis_magnitudes[k] + 4 * q));
+                 h = vminq_f32(vmulq_f32(d, d), h);
+             }
+             m = vaddq_f32(c, h);
+             better = vandq_u32(vandq_u32(vcgeq_f32(v, low), vcleq_f32(v, high)), vcltq_f32(m, bm[q]));
+             bm[q] = vbslq_f32(better, m, bm[q]);
+             bc[q] = vbslq_f32(better, c, bc[q]);
+             bv[q] = vbslq_f32(better, v, bv[q]);
+             bp[q] = vbslq_f32(better, vld1q_f32(trellis_codes[n] + 4 * q), bp[q]);
+         }
+     }
+     for (q = 0; q < 4; ++q) {
+         vst1q_f32(best_metric + 4 * q, bm[q]);
+         vst1q_f32(best_cost + 4 * q, bc[q]);
+         vst1q_f32(best_value + 4 * q, bv[q]);
+         vst1q_f32(best_code + 4 * q, bp[q]);
+     }
+ #else
+     for (s = 0; s < 16; ++s) {
+         best_metric[s] = best_cost[s] = ENCODE_INFINITE_COST;
+         best_value[s] = best_code[s] = 0.0f;
+     }
+     for (n = 0; n < 16; ++n) {
+         const float *source_cost = cost + 4 - state_table[n];
+         const float *source_value = value + 4 - state_table[n];
+         for (s = 0; s < 16; ++s) {
+             float v = source_value[s] + trellis_steps[n][s];
+             float e = target - v;
+             float c = source_cost[s] + e * e;
+             float m = c + trellis_lookahead(next, v, s);
+             if (v >= (float)ENCODE_MIN_VALUE && v <= (float)ENCODE_MAX_VALUE && m < best_metric[s]) {
+                 best_metric[s] = m;
+                 best_cost[s] = c;
+                 best_value[s] = v;
+                 best_code[s] = trellis_codes[n][s];
+             }
+         }
+     }
+ #endif
+
+     /* Transitions clamped at the lowest and highest step state */
+     for (source = 0; source < 16; ++source) {
+         if (source > 0 && source < 13)
+             continue;
+         for (n = 0; n < 16; ++n) {
+             int destination = source + state_table[n];
+             float v, e, c, m;
+
+             if (destination >= 0 && destination <= 15)
+                 continue;
+             destination = (destination < 0) ? 0 : 15;
+             v = value[4 + source] + (float)step_table[source][n];
+             e = target - v;
+             c = cost[4 + source] + e * e;
+             m = c + trellis_lookahead(next, v, destination);
+             if (v >= (float)ENCODE_MIN_VALUE && v <= (float)ENCODE_MAX_VALUE && m < best_metric[destination]) {
+                 best_metric[destination] = m;
+                 best_cost[destination] = c;
+                 best_value[destination] = v;
+                 best_code[destination] = (float)((source << 4) | n);
+             }
+         }
+     }
+
+     /* Keep costs small so float precision does not fade over long chunks */
+     minimum = best_cost[0];
+     for (s = 1; s < 16; ++s) {
+         if (best_cost[s] < minimum)
+             minimum = best_cost[s];
+     }
+     for (s = 0; s < 16; ++s) {
+         next_cost[4 + s] = (best_cost[s] >= ENCODE_INFINITE_COST) ? ENCODE_INFINITE_COST : best_cost[s] - minimum;
+         next_value[4 + s] = best_value[s];
+         backpointers[s] = (uint8_t)best_code[s];
+     }
+ }
+
+ /**
+  * trellis_search() - Finds the nibbles of a run of samples with the lowest squared error.
+  * @target:       Samples to match (decoder units).
+  * @count:        Number of samples.
+  * @start_state:  Step state before the first sample.
+  * @start_value:  Decoder value before the first sample.
+  * @ref_states:   Step states of a path to join (or NULL).
+  * @ref_values:   Decoder values of the path to join.
+  * @backpointers: Scratch space of @count * 16 bytes.
+  * @nibbles:      Receives the chosen nibbles.
+  *
+  * A Viterbi search: after every sample, one path into each of the 16 step
+  * states survives (see trellis_step()). With @ref_states, the search stops at
+  * the first sample where the surviving path into the reference state has
+  * the reference value: from there on, the reference nibbles decode
+  * identically, so only the nibbles up to that sample are written.
+  *
+  * Return: Number of leading nibbles written (@count unless the paths joined).
+  */
+ size_t
+ trellis_search(const float *target, size_t count, int start_state, int start_value,
+                const uint8_t *ref_states, const int16_t *ref_values, uint8_t *backpointers, uint8_t *nibbles)
+ {
+     float cost[2][24], value[2][24];
+     size_t i, written = count;
+     int s, state = 0, current = 0;
+
+     for (s = 0; s < 24; ++s) {
+         cost[0][s] = cost[1][s] = ENCODE_INFINITE_COST;
+         value[0][s] = value[1][s] = 0.0f;
+     }
+     cost[0][4 + start_state] = 0.0f;
+     value[0][4 + start_state] = (float)start_value;
+
+     for (i = 0; i < count; ++i) {
+         trellis_step(cost[current], value[current], target[i], target[(i + 1 < count) ? i + 1 : i],
+                      cost[1 - current], value[1 - current], backpointers + i * 16);
+         current = 1 - current;
+         if (ref_states && cost[current][4 + ref_states[i]] < ENCODE_INFINITE_COST &&
+             value[current][4 + ref_states[i]] == (float)ref_values[i]) {
+             written = i + 1;
+             state = ref_states[i];
+             break;
+         }
+     }
+     if (written == count) {
+         for (s = 1; s < 16; ++s) {
+             if (cost[current][4 + s] < cost[current][4 + state])
+                 state = s;
+         }
+     }
+
+     for (i = written; i-- > 0;) {
+         uint8_t code = backpointers[i * 16 + state];
+         nibbles[i] = code & 0x0F;
+         state = code >> 4;
+     }
+     return written;
+ }
+
+ /**
+  * load_wav_samples() - Reads a PCM WAV file as mono samples at DEFAULT_SAMPLE_RATE.
+  * @filepath: Path to the WAV file.
+  * @pcm:      PcmBuffer that receives the samples (initialized, empty).
+  *
+  * 8- and 16-bit PCM (also as WAVE_FORMAT_EXTENSIBLE) with any number of
+  * channels is accepted; channels are averaged, and other sample rates are
+  * converted with the --rate resampler.
+  *
+  * Return: true on success, false on failure.
+  */
+ bool
+ load_wav_samples(const char *filepath, PcmBuffer *pcm)
+ {
+     size_t size = 0, pos = 12, frames, i, data_size = 0;
+     const uint8_t *data = map_file_read_only(filepath, &size);
+     const uint8_t *samples = NULL;
+     unsigned format = 0, channels = 0, bits = 0, frame_size;
+     uint32_t rate = 0;
+     bool success = false;
+
+     if (!data) {
+         fprintf(stderr, "ERROR: Cannot open WAV file '%s'.\n", filepath);
+         return false;
+     }
+     if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) {
+         fprintf(stderr, "ERROR: '%s' is not a WAV file.\n", filepath);
+         goto cleanup;
+     }
+     while (pos + 8 <= size) {
+         size_t chunk_size = read_u32le(data + pos + 4);
+         const uint8_t *body = data + pos + 8;
+
+         if (chunk_size > size - pos - 8)
+             chunk_size = size - pos - 8; /* Truncated file: use what is there */
+         if (memcmp(data + pos, "fmt ", 4) == 0 && chunk_size >= 16) {
+             format = read_u16le(body);
+             channels = read_u16le(body + 2);
+             rate = read_u32le(body + 4);
+             bits = read_u16le(body + 14);
+             if (format == 0xFFFE && chunk_size >= 26)
+                 format = read_u16le(body + 24); /* Sub-format GUID starts with the format tag */
+         } else if (memcmp(data + pos, "data", 4) == 0) {
+             samples = body;
+             data_size = chunk_size;
+         }
+         pos += 8 + chunk_size + (chunk_size & 1);
+     }
+     if (format != 1 || (bits != 8 && bits != 16) || channels == 0 || rate == 0 || !samples) {
+         fprintf(stderr, "ERROR: '%s' is not an 8- or 16-bit PCM WAV file.\n", filepath);
+         goto cleanup;
+     }
+
+     frame_size = channels * (bits / 8);
+     frames = data_size / frame_size;
+     if (!reserve_pcm_buffer(pcm, frames))
+         goto cleanup;
+     for (i = 0; i < frames; ++i) {
+         const uint8_t *frame = samples + i * frame_size;
+         long sum = 0;
+         unsigned c;
+
+         for (c = 0; c < channels; ++c)
+             sum += (bits == 8) ? ((long)frame[c] - 0x80) * 256 : (long)(int16_t)read_u16le(frame + 2 * c);
+         pcm->samples[i] = (int16_t)(sum / (long)channels);
+     }
+     pcm->count = frames;
+
+     if (rate != DEFAULT_SAMPLE_RATE && frames > 0) {
+         Resampler bank;
+         PcmBuffer converted;
+
+         init_pcm_buffer(&converted);
+         if (!init_resampler(&bank, rate, DEFAULT_SAMPLE_RATE))
+             goto cleanup;
+         success = resample_pcm(&bank, pcm, &converted);
+         free_resampler(&bank);
+         if (!success)
+             goto cleanup;
+         free_pcm_buffer(pcm);
+         *pcm = converted;
+     }
+     success = true;
+
+ cleanup:
+ #ifdef _WIN32
+     UnmapViewOfFile(data);
+ #else
+     munmap((void *)data, size);
+ #endif
+     return success;
+ }
+
+ /**
+  * split_encode_spans() - Splits a file's samples into silence and ADPCM runs.
+  * @file: File whose @pcm is split into @spans and @target.
+  *
+  * At least ENCODE_MIN_SILENCE samples below ENCODE_SILENCE_LEVEL become
+  * silence commands (in whole units of 8 samples); the decoder keeps its
+  * state across them, so the other samples form one continuous ADPCM
+  * stream in @target.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ split_encode_spans(EncodeFile *file)
+ {
+     const int16_t *samples = file->pcm.samples;
+     size_t count = file->pcm.count, capacity = 0, pos = 0;
+
+     file->target = (float *)malloc((count > 0 ? count : 1) * sizeof(float));
+     file->nibbles = (uint8_t *)malloc(count > 0 ? count : 1);
+     file->states = (uint8_t *)malloc(count > 0 ? count : 1);
+     file->values = (int16_t *)malloc((count > 0 ? count : 1) * sizeof(int16_t));
+     if (!file->target || !file->nibbles || !file->states || !file->values)
+         return false;
+
+     while (pos < count) {
+         size_t run = 0, length;
+         bool silence;
+
+         while (pos + run < count && samples[pos + run] > -ENCODE_SILENCE_LEVEL &&
+                samples[pos + run] < ENCODE_SILENCE_LEVEL)
+             run++;
+         silence = run >= ENCODE_MIN_SILENCE;
+         if (silence) {
+             length = run & ~(size_t)7;
+         } else {
+             /* ADPCM up to the next silence run (short quiet stretches included) */
+             length = run;
+             while (pos + length < count) {
+                 size_t quiet = 0;
+
+                 while (pos + length + quiet < count && samples[pos + length + quiet] > -ENCODE_SILENCE_LEVEL &&
+                        samples[pos + length + quiet] < ENCODE_SILENCE_LEVEL)
+                     quiet++;
+                 if (quiet >= ENCODE_MIN_SILENCE)
+                     break;
+                 length += quiet;
+                 while (pos + length < count && (samples[pos + length] <= -ENCODE_SILENCE_LEVEL ||
+                                                samples[pos + length] >= ENCODE_SILENCE_LEVEL))
+                     length++;
+             }
+         }
+
+         if (file->span_count >= capacity) {
+             size_t new_capacity = (capacity == 0) ? 16 : capacity * 2;
+             EncodeSpan *new_spans = (EncodeSpan *)realloc(file->spans, new_capacity * sizeof(EncodeSpan));
+             if (!new_spans)
+                 return false;
+             file->spans = new_spans;
+             capacity = new_capacity;
+         }
+         file->spans[file->span_count].length = (uint32_t)length;
+         file->spans[file->span_count].silence = silence;
+         file->span_count++;
+         if (!silence) {
+             size_t i;
+             for (i = 0; i < length; ++i)
+                 file->target[file->voiced_count++] = (float)samples[pos + i] / 128.0f;
+         }
+         pos += length;
+     }
+     return true;
+ }
+
+ /**
+  * append_nibble_bytes() - Packs nibbles two per byte, high nibble first.
+  * @output:  Message being built.
+  * @nibbles: Nibbles to store.
+  * @count:   Number of nibbles (an odd count leaves the last low nibble 0).
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_nibble_bytes(OutputBuffer *output, const uint8_t *nibbles, size_t count)
+ {
      size_t i;
 
-     fp = fopen(output_filepath, "wb");
-     if (!fp) {
-         fprintf(stderr, "ERROR: Cannot open output WAV file '%s' for writing.\n", output_filepath);
+     if (!reserve_output_buffer(output, (count + 1) / 2))
          return false;
+     for (i = 0; i < count; i += 2)
+         output->data[output->size++] = (uint8_t)((nibbles[i] << 4) | ((i + 1 < count) ? nibbles[i + 1] : 0));
+     return true;
+ }
+
+ /**
+  * append_adpcm_literals() - Appends nibbles as short (256) or long (1-256) blocks.
+  * @output:  Message being built.
+  * @nibbles: Nibbles to store.
+  * @count:   Number of nibbles.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ append_adpcm_literals(OutputBuffer *output, const uint8_t *nibbles, size_t count)
+ {
+     while (count > 0) {
+         size_t block = (count > 256) ? 256 : count;
+         uint8_t header[2];
+
+         header[0] = (block == 256) ? 0x40 : 0x80;
+         header[1] = (uint8_t)(block - 1);
+         if (!append_bytes(output, header, (block == 256) ? 1 : 2) || !append_nibble_bytes(output, nibbles, block))
+             return false;
+         nibbles += block;
+         count -= block;
      }
+     return true;
+ }
 
-     /* --- Prepare Metadata --- */
-     now = time(NULL);
-     t = localtime(&now);
-     strftime(date_str, sizeof(date_str), "%Y-%m-%d", t);
+ /**
+  * find_adpcm_repeat() - Looks for a nibble pattern that repeats right away.
+  * @nibbles: Nibbles from the current position on.
+  * @count:   Number of nibbles available.
+  * @repeats: Receives how often the pattern plays (2-7).
+  *
+  * Return: Length of the pattern covering the most nibbles (0 if none saves
+  *         ENCODE_MIN_REPEAT_SAVING nibbles).
+  */
+ size_t
+ find_adpcm_repeat(const uint8_t *nibbles, size_t count, int *repeats)
+ {
+     size_t length, best_length = 0, best_cover = 0;
 
-     /* --- Calculate Sizes --- */
-     num_samples = (uint32_t)pcm_buffer->count;
-     bytes_per_sample = ADPCM_BITS / 8;
-     data_chunk_size_64 = (uint64_t)num_samples * bytes_per_sample;
+     for (length = 1; length <= 256 && 2 * length <= count; ++length) {
+         size_t matched = 0;
+         int plays;
 
-     /* Check for data chunk size overflow */
-     if (data_chunk_size_64 > UINT32_MAX) {
-         fprintf(stderr, "ERROR: WAV data chunk size exceeds 4GB limit for message '%s'.\n", track_title);
-         goto cleanup;
+         if (nibbles[length] != nibbles[0])
+             continue;
+         while (length + matched < count && matched < 6 * length && nibbles[length + matched] == nibbles[matched % length])
+             matched++;
+         plays = 1 + (int)(matched / length);
+         if (plays >= 2 && (size_t)(plays - 1) * length >= ENCODE_MIN_REPEAT_SAVING &&
+             (size_t)plays * length > best_cover) {
+             best_cover = (size_t)plays * length;
+             best_length = length;
+             *repeats = plays;
+         }
      }
-     data_chunk_size = (uint32_t)data_chunk_size_64;
-     data_needs_padding = (data_chunk_size % 2 != 0);
-     padded_data_chunk_size = data_chunk_size + (data_needs_padding ? 1 : 0);
+     return best_length;
+ }
 
+ /**
+  * build_adpcm_message() - Writes a file's spans and nibbles as a uPD7759 message.
+  * @file:   Encoded file.
+  * @output: Receives the mode byte, the commands and the end command.
+  *
+  * Silence runs become silence commands of up to 63 x 8 samples. Nibbles
+  * go into short and long blocks, except where a pattern repeats right
+  * away: that becomes one repeat block played up to 7 times.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ build_adpcm_message(const EncodeFile *file, OutputBuffer *output)
+ {
+     uint8_t byte = MODE_ADPCM;
+     size_t span, next = 0;
 
-     /* Calculate LIST/INFO chunk size */
-     info_chunk_total_size = 4; /* LIST chunk ID "LIST" */
-     info_chunk_data_size = 4; /* Type ID "INFO" */
+     if (!append_bytes(output, &byte, 1))
+         return false;
+     for (span = 0; span < file->span_count; ++span) {
+         size_t remaining = file->spans[span].length, literal = next;
 
-     /* IALB */
-     temp_len = strlen(album) + 1; temp_pad = temp_len % 2 != 0;
-     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
-     /* IART */
-     temp_len = strlen(artist) + 1; temp_pad = temp_len % 2 != 0;
-     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
-     /* INAM */
-     temp_len = strlen(track_title) + 1; temp_pad = temp_len % 2 != 0;
-     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
-     /* ITRK */
-     temp_len = strlen(track_number_str) + 1; temp_pad = temp_len % 2 != 0;
-     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
-     /* ICRD */
-     temp_len = strlen(date_str) + 1; temp_pad = temp_len % 2 != 0;
-     info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
-     /* ICMT */
-     if (comment && strlen(comment) > 0) {
-          temp_len = strlen(comment) + 1; temp_pad = temp_len % 2 != 0;
-          info_chunk_data_size += 4 + 4 + temp_len + (temp_pad ? 1 : 0);
+         if (file->spans[span].silence) {
+             while (remaining > 0) {
+                 byte = (uint8_t)((remaining / 8 > ENCODE_MAX_SILENCE_UNITS) ? ENCODE_MAX_SILENCE_UNITS : remaining / 8);
+                 if (!append_bytes(output, &byte, 1))
+                     return false;
+                 remaining -= (size_t)byte * 8;
+             }
+             continue;
+         }
+         while (remaining > 0) {
+             int repeats = 0;
+             size_t length = find_adpcm_repeat(file->nibbles + next, remaining, &repeats);
+             uint8_t header[2];
+
+             if (length == 0) {
+                 next++;
+                 remaining--;
+                 if (next - literal == 256 || remaining == 0) {
+                     if (!append_adpcm_literals(output, file->nibbles + literal, next - literal))
+                         return false;
+                     literal = next;
+                 }
+                 continue;
+             }
+             if (!append_adpcm_literals(output, file->nibbles + literal, next - literal))
+                 return false;
+             header[0] = (uint8_t)(0xC0 | (repeats << 3));
+             header[1] = (uint8_t)(length - 1);
+             if (!append_bytes(output, header, 2) || !append_nibble_bytes(output, file->nibbles + next, length))
+                 return false;
+             next += (size_t)repeats * length;
+             remaining -= (size_t)repeats * length;
+             literal = next;
+         }
+     }
+     byte = 0x00; /* End of Message */
+     return append_bytes(output, &byte, 1);
+ }
+
+ /**
+  * encode_prepare_worker() - Worker thread body: reads, splits and first-pass encodes files.
+  * @arg: Pointer to the shared EncodeScheduler.
+  *
+  * Greedy and lookahead encoding finish here. For the trellis, the greedy
+  * pass gives the start state of every chunk after the first.
+  */
+ void
+ encode_prepare_worker(void *arg)
+ {
+     EncodeScheduler *scheduler = (EncodeScheduler *)arg;
+
+     for (;;) {
+         EncodeFile *file;
+         size_t index;
+
+         mutex_lock(&scheduler->lock);
+         index = scheduler->next_job++;
+         mutex_unlock(&scheduler->lock);
+         if (index >= scheduler->file_count)
+             break;
+
+         file = &scheduler->files[index];
+         if (file->source ? copy_pcm_buffer(file->source, &file->pcm) : load_wav_samples(file->wav_filepath, &file->pcm)) {
+             if (split_encode_spans(file)) {
+                 if (scheduler->quality == ENCODE_QUALITY_LOOKAHEAD)
+                     encode_lookahead(file);
+                 else
+                     encode_greedy(file);
+                 continue;
+             }
+             fprintf(stderr, "ERROR: Failed to allocate memory to encode '%s'.\n", file->wav_filepath);
+         }
+         file->failed = true;
+         mutex_lock(&scheduler->lock);
+         scheduler->failed++;
+         mutex_unlock(&scheduler->lock);
+     }
+ }
+
+ /**
+  * encode_chunk_worker() - Worker thread body: runs the trellis search on chunks.
+  * @arg: Pointer to the shared EncodeScheduler.
+  *
+  * Chunks are independent: each starts from its greedy start state and
+  * writes only its own range of the file's arrays.
+  */
+ void
+ encode_chunk_worker(void *arg)
+ {
+     EncodeScheduler *scheduler = (EncodeScheduler *)arg;
+     uint8_t *backpointers = (uint8_t *)malloc((size_t)ENCODE_CHUNK_SIZE * 16);
+
+     if (!backpointers) {
+         fprintf(stderr, "ERROR: Failed to allocate trellis memory.\n");
+         return; /* The other workers take the chunks; the join pass searches any left over */
+     }
+     for (;;) {
+         EncodeChunk *chunk;
+         EncodeFile *file;
+         size_t index;
+
+         mutex_lock(&scheduler->lock);
+         index = scheduler->next_job++;
+         mutex_unlock(&scheduler->lock);
+         if (index >= scheduler->chunk_count)
+             break;
+
+         chunk = &scheduler->chunks[index];
+         file = chunk->file;
+         trellis_search(file->target + chunk->first, chunk->count, chunk->start_state, chunk->start_value,
+                        NULL, NULL, backpointers, file->nibbles + chunk->first);
+         replay_nibbles(file->nibbles + chunk->first, chunk->count, chunk->start_state, chunk->start_value,
+                        file->states + chunk->first, file->values + chunk->first);
+     }
+     free(backpointers);
+ }
+
+ /**
+  * encode_finish_worker() - Worker thread body: joins trellis chunks and writes the messages.
+  * @arg: Pointer to the shared EncodeScheduler.
+  *
+  * Every chunk after the first is searched again from the state its
+  * predecessor really ended in, until the survivors rejoin the chunk's own
+  * path: at once if the greedy start state was right, otherwise usually
+  * within a few dozen samples. Chunk boundaries do not depend on -j, so
+  * neither does the output.
+  */
+ void
+ encode_finish_worker(void *arg)
+ {
+     EncodeScheduler *scheduler = (EncodeScheduler *)arg;
+     uint8_t *backpointers = NULL;
+
+     if (scheduler->quality == ENCODE_QUALITY_TRELLIS) {
+         backpointers = (uint8_t *)malloc((size_t)ENCODE_CHUNK_SIZE * 16);
+         if (!backpointers) {
+             fprintf(stderr, "ERROR: Failed to allocate trellis memory.\n");
+             mutex_lock(&scheduler->lock);
+             scheduler->failed++;
+             mutex_unlock(&scheduler->lock);
+             return;
+         }
+     }
+     for (;;) {
+         EncodeFile *file;
+         OutputBuffer message;
+         size_t index, first, span, sample = 0, voiced = 0;
+
+         mutex_lock(&scheduler->lock);
+         index = scheduler->next_job++;
+         mutex_unlock(&scheduler->lock);
+         if (index >= scheduler->file_count)
+             break;
+
+         file = &scheduler->files[index];
+         if (file->failed)
+             continue;
+         /* Join each trellis chunk to the state the one before it really ended in */
+         for (first = ENCODE_CHUNK_SIZE; backpointers && first < file->voiced_count; first += ENCODE_CHUNK_SIZE) {
+             size_t count = (file->voiced_count - first < ENCODE_CHUNK_SIZE) ? file->voiced_count - first : ENCODE_CHUNK_SIZE;
+             int state = file->states[first - 1], value = file->values[first - 1];
+             size_t written = trellis_search(file->target + first, count, state, value, file->states + first,
+                                             file->values + first, backpointers, file->nibbles + first);
+
+             replay_nibbles(file->nibbles + first, written, state, value, file->states + first, file->values + first);
+             file->repaired += written;
+         }
+
+         /* Decode the model output to measure the quality */
+         for (span = 0; span < file->span_count; ++span) {
+             size_t i;
+             for (i = 0; i < file->spans[span].length; ++i, ++sample) {
+                 double input = file->pcm.samples[sample];
+                 double output = file->spans[span].silence ? 0.0 : (double)file->values[voiced++] * 128.0;
+                 file->signal_energy += input * input;
+                 file->noise_energy += (input - output) * (input - output);
+             }
+         }
+
+         init_output_buffer(&message);
+         if (!build_adpcm_message(file, &message)) {
+             fprintf(stderr, "ERROR: Failed to allocate memory to encode '%s'.\n", file->wav_filepath);
+             free_output_buffer(&message);
+             file->failed = true;
+             mutex_lock(&scheduler->lock);
+             scheduler->failed++;
+             mutex_unlock(&scheduler->lock);
+             continue;
+         }
+         file->output_bytes = message.size;
+         if (scheduler->keep_messages) {
+             file->message = message;
+             continue;
+         }
+         if (!submit_output_file(scheduler->output_dir, file->output_base, ".adpcm", OUTPUT_FILE_ADPCM, &message,
+                                 file->pcm.count, -1, -1, (int)index)) {
+             file->failed = true;
+             mutex_lock(&scheduler->lock);
+             scheduler->failed++;
+             mutex_unlock(&scheduler->lock);
+         }
+     }
+     free(backpointers);
+ }
+
+ /**
+  * free_encode_file() - Frees memory associated with an EncodeFile.
+  * @file: Pointer to the EncodeFile.
+  */
+ void
+ free_encode_file(EncodeFile *file)
+ {
+     free_pcm_buffer(&file->pcm);
+     free_output_buffer(&file->message);
+     free(file->spans);
+     free(file->target);
+     free(file->nibbles);
+     free(file->states);
+     free(file->values);
+     file->spans = NULL;
+     file->target = NULL;
+     file->nibbles = NULL;
+     file->states = NULL;
+     file->values = NULL;
+ }
+
+ /**
+  * get_encode_quality_name() - Returns the --quality name of an encoder search.
+  * @quality: The EncodeQuality.
+  *
+  * Return: Static string.
+  */
+ const char *
+ get_encode_quality_name(EncodeQuality quality)
+ {
+     switch (quality) {
+     case ENCODE_QUALITY_GREEDY:    return "greedy";
+     case ENCODE_QUALITY_LOOKAHEAD: return "lookahead";
+     default:                       return "trellis";
+     }
+ }
+
+ /**
+  * encode_group() - Encodes the files of one group on the worker pool.
+  * @scheduler:    Scheduler holding the group's files (@file_count set) and the quality.
+  * @thread_count: Number of worker threads.
+  *
+  * Runs the three passes: read and first-pass encode every file, run the
+  * trellis on the ENCODE_CHUNK_SIZE chunks of all files, then join the
+  * chunks and build (and write or keep) each message. Files that fail are
+  * marked and counted in @scheduler->failed.
+  *
+  * Return: true on success, false on memory allocation failure.
+  */
+ bool
+ encode_group(EncodeScheduler *scheduler, int thread_count)
+ {
+     EncodeFile *files = scheduler->files;
+     size_t file_count = scheduler->file_count, chunk_count = 0, i;
+     EncodeChunk *chunks = NULL;
+
+     scheduler->next_job = 0;
+     scheduler->failed = 0;
+     run_worker_threads(thread_count < (int)file_count ? thread_count : (int)file_count,
+                        encode_prepare_worker, scheduler);
+
+     /* Trellis chunks start from the greedy state at their first sample */
+     if (scheduler->quality == ENCODE_QUALITY_TRELLIS) {
+         for (i = 0; i < file_count; ++i)
+             chunk_count += (files[i].voiced_count + ENCODE_CHUNK_SIZE - 1) / ENCODE_CHUNK_SIZE;
+         chunks = (EncodeChunk *)malloc((chunk_count > 0 ? chunk_count : 1) * sizeof(EncodeChunk));
+         if (!chunks) {
+             fprintf(stderr, "ERROR: Failed to allocate memory for trellis chunks.\n");
+             return false;
+         }
+         chunk_count = 0;
+         for (i = 0; i < file_count; ++i) {
+             size_t first;
+             for (first = 0; first < files[i].voiced_count; first += ENCODE_CHUNK_SIZE) {
+                 EncodeChunk *chunk = &chunks[chunk_count++];
+                 chunk->file = &files[i];
+                 chunk->first = first;
+                 chunk->count = (files[i].voiced_count - first < ENCODE_CHUNK_SIZE) ?
+                     files[i].voiced_count - first : ENCODE_CHUNK_SIZE;
+                 chunk->start_state = (first > 0) ? files[i].states[first - 1] : 0;
+                 chunk->start_value = (first > 0) ? files[i].values[first - 1] : 0;
+             }
+         }
+         scheduler->chunks = chunks;
+         scheduler->chunk_count = chunk_count;
+         scheduler->next_job = 0;
+         if (chunk_count > 0)
+             run_worker_threads(thread_count < (int)chunk_count ? thread_count : (int)chunk_count,
+                                encode_chunk_worker, scheduler);
      }
 
-     info_chunk_total_size += info_chunk_data_size; /* Add size field itself */
-
-
-     /* RIFF Chunk Size */
-     fmt_chunk_size = 16; /* For standard PCM */
-     riff_chunk_size = 4 + /* "WAVE" ID */
-               (4 + 4 + fmt_chunk_size) + /* "fmt " chunk */
-               info_chunk_total_size +     /* "LIST" chunk */
-               (4 + 4 + padded_data_chunk_size); /* "data" chunk */
-
-     /* --- Write RIFF Header --- */
-     if (!write_chunk_id("RIFF", fp)) goto cleanup;
-     if (!write_u32le(riff_chunk_size, fp)) goto cleanup;
-     if (!write_chunk_id("WAVE", fp)) goto cleanup;
+     scheduler->next_job = 0;
+     run_worker_threads(thread_count < (int)file_count ? thread_count : (int)file_count,
+                        encode_finish_worker, scheduler);
+     scheduler->chunks = NULL;
+     scheduler->chunk_count = 0;
+     free(chunks);
+     return true;
+ }
 
-     /* --- Write "fmt " Chunk --- */
-     if (!write_chunk_id("fmt ", fp)) goto cleanup;
-     if (!write_u32le(fmt_chunk_size, fp)) goto cleanup; /* Size of chunk data */
-     if (!write_u16le(1, fp)) goto cleanup;             /* wFormatTag (1 = PCM) */
-     if (!write_u16le(ADPCM_CHANNELS, fp)) goto cleanup; /* nChannels */
-     if (!write_u32le(sample_rate, fp)) goto cleanup;    /* nSamplesPerSec */
-     bytes_per_sec = sample_rate * ADPCM_CHANNELS * bytes_per_sample;
-     if (!write_u32le(bytes_per_sec, fp)) goto cleanup; /* nAvgBytesPerSec */
-     block_align = ADPCM_CHANNELS * bytes_per_sample;
-     if (!write_u16le(block_align, fp)) goto cleanup;   /* nBlockAlign */
-     if (!write_u16le(ADPCM_BITS, fp)) goto cleanup;    /* wBitsPerSample */
+ /**
+  * run_encode() - Encodes WAV files to uPD7759 ADPCM messages (--encode).
+  * @options: Parsed command line options (WAV files, -o, -j, --quality).
+  *
+  * Each '<name>.wav' becomes '<output_dir>/<name>.adpcm' holding the message
+  * exactly as stored in a ROM: the mode byte, the commands and the end
+  * command. Files are encoded ENCODE_GROUP_SIZE at a time in three passes
+  * over the worker pool: read and first-pass encode per file, then (for the
+  * trellis) the ENCODE_CHUNK_SIZE chunks of all files, then joining the
+  * chunks and writing per file. One long prompt thus keeps every thread
+  * busy as well as thousands of short ones.
+  *
+  * Return: EXIT_SUCCESS or EXIT_FAILURE.
+  */
+ int
+ run_encode(const ProgramOptions *options)
+ {
+     EncodeScheduler scheduler;
+     EncodeFile *files = NULL;
+     size_t group, i, encoded = 0, samples = 0, bytes = 0, repaired = 0;
+     double signal_energy = 0.0, noise_energy = 0.0;
+     uint64_t start_ns = get_monotonic_ns();
+     int exit_code = EXIT_SUCCESS;
 
-     /* --- Write "LIST" (INFO) Chunk --- */
-     if (!write_chunk_id("LIST", fp)) goto cleanup;
-     if (!write_u32le(info_chunk_data_size, fp)) goto cleanup; /* Size of LIST data */
-     if (!write_chunk_id("INFO", fp)) goto cleanup; /* List type */
-
-     if (write_info_sub_chunk("IALB", album, fp) == 0) goto cleanup;
-     if (write_info_sub_chunk("IART", artist, fp) == 0) goto cleanup;
-     if (write_info_sub_chunk("INAM", track_title, fp) == 0) goto cleanup;
-     if (write_info_sub_chunk("ITRK", track_number_str, fp) == 0) goto cleanup;
-     if (write_info_sub_chunk("ICRD", date_str, fp) == 0) goto cleanup;
-     if (comment && strlen(comment) > 0) {
-         if (write_info_sub_chunk("ICMT", comment, fp) == 0) goto cleanup;
+     if (options->output_dir && !make_directories(options->output_dir))
+         return EXIT_FAILURE;
+     files = (EncodeFile *)calloc(ENCODE_GROUP_SIZE, sizeof(EncodeFile));
+     if (!files) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the encoder.\n");
+         return EXIT_FAILURE;
      }
+     init_trellis_tables();
+     status_printf("Encode: %d WAV file(s), %s search, %d worker thread(s)\n", options->rom_filepath_count,
+                   get_encode_quality_name(options->encode_quality), options->thread_count);
+
+     memset(&scheduler, 0, sizeof(scheduler));
+     scheduler.files = files;
+     scheduler.quality = options->encode_quality;
+     scheduler.output_dir = options->output_dir;
+     mutex_init(&scheduler.lock);
+     for (group = 0; group < (size_t)options->rom_filepath_count; group += ENCODE_GROUP_SIZE) {
+         size_t file_count = (size_t)options->rom_filepath_count - group;
+
+         if (file_count > ENCODE_GROUP_SIZE)
+             file_count = ENCODE_GROUP_SIZE;
+         for (i = 0; i < file_count; ++i) {
+             files[i].wav_filepath = options->rom_filepaths[group + i];
+             get_filename_stem(files[i].wav_filepath, files[i].output_base, sizeof(files[i].output_base));
+             init_pcm_buffer(&files[i].pcm);
+         }
+         scheduler.file_count = file_count;
+         if (!encode_group(&scheduler, options->thread_count)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
+         }
+         if (scheduler.failed > 0)
+             exit_code = EXIT_FAILURE;
 
-     /* --- Write "data" Chunk --- */
-     if (!write_chunk_id("data", fp)) goto cleanup;
-     if (!write_u32le(data_chunk_size, fp)) goto cleanup; /* Actual data size */
-
-     /* Write sample data explicitly as Little Endian */
-     for (i = 0; i < pcm_buffer->count; ++i) {
-         if (!write_u16le((uint16_t)pcm_buffer->samples[i], fp)) goto cleanup;
+         for (i = 0; i < file_count; ++i) {
+             if (!files[i].failed) {
+                 encoded++;
+                 samples += files[i].pcm.count;
+                 bytes += files[i].output_bytes;
+                 repaired += files[i].repaired;
+                 signal_energy += files[i].signal_energy;
+                 noise_energy += files[i].noise_energy;
+                 verbose_printf("Encoded '%s': %zu samples, %zu bytes, SNR %.1f dB\n", files[i].wav_filepath,
+                                files[i].pcm.count, files[i].output_bytes,
+                                10.0 * log10((files[i].signal_energy + 1.0) / (files[i].noise_energy + 1.0)));
+             }
+             free_encode_file(&files[i]);
+             memset(&files[i], 0, sizeof(files[i]));
+         }
      }
 
-     /* Add padding byte if data chunk size was odd */
-     if (data_needs_padding) {
-         uint8_t padding_byte = 0;
-         if (fwrite(&padding_byte, 1, 1, fp) != 1) goto cleanup;
-     }
+     status_printf("Encoded %zu of %d file(s): %.1f s of audio to %zu bytes (%.0f bytes/s), SNR %.1f dB, in %.1f ms.\n",
+                   encoded, options->rom_filepath_count, (double)samples / DEFAULT_SAMPLE_RATE, bytes,
+                   samples > 0 ? (double)bytes * DEFAULT_SAMPLE_RATE / (double)samples : 0.0,
+                   10.0 * log10((signal_energy + 1.0) / (noise_energy + 1.0)), (double)(get_monotonic_ns() - start_ns) / 1e6);
+     if (options->encode_quality == ENCODE_QUALITY_TRELLIS)
+         verbose_printf("Trellis: %zu sample(s) searched again to join chunks.\n", repaired);
 
-     /* If we reached here, writing was successful */
-     success = true;
-     status_printf("Successfully wrote WAV: %s (%u samples)\n", output_filepath, num_samples);
+ cleanup:
+     for (i = 0; i < ENCODE_GROUP_SIZE; ++i)
+         free_encode_file(&files[i]);
+     mutex_destroy(&scheduler.lock);
+     free(files);
+     return exit_code;
+ }
 
 
- cleanup:
-     if (!success)
-         fprintf(stderr, "ERROR: Failed to write WAV file '%s'.\n", output_filepath);
+ /* --- ROM Builder --- */
 
-     fclose(fp);
-     /* If writing failed, consider deleting the incomplete file */
-     /* if (!success) remove(output_filepath); */
-     return success;
- }
+ /**
+  * struct build_message - A message file placed into a built ROM image.
+  * @mapping:   Entry of the input mapping file (source position, name and comment).
+  * @data:      Mapped contents of the message file.
+  * @file_size: Size of @data.
+  * @size:      Message bytes stored: mode byte through the end command or last PCM sample.
+  * @segment:   0-based segment assigned by the packer.
+  * @index:     0-based message index within @segment.
+  */
+ typedef struct {
+     MessageMapping mapping;
+     const uint8_t *data;
+     size_t file_size;
+     size_t size;
+     int segment;
+     uint32_t index;
+ } BuildMessage;
 
- /* --- Raw PCM Saving --- */
+ /**
+  * compare_mappings_by_position() - qsort() comparator ordering mappings by (segment, message).
+  */
+ int
+ compare_mappings_by_position(const void *a, const void *b)
+ {
+     const MessageMapping *x = (const MessageMapping *)a;
+     const MessageMapping *y = (const MessageMapping *)b;
+
+     if (x->segment_index != y->segment_index)
+         return (x->segment_index < y->segment_index) ? -1 : 1;
+     if (x->message_index_in_seg != y->message_index_in_seg)
+         return (x->message_index_in_seg < y->message_index_in_seg) ? -1 : 1;
+     return 0;
+ }
 
  /**
-  * save_raw_pcm() - Saves raw message data to a .pcm file.
-  * @output_filepath:      Full path for the output .pcm file.
-  * @rom_data:             Pointer to the start of the ROM data buffer.
-  * @message_start_offset: Offset of the message's mode byte.
-  * @message_end_offset:   Offset of the byte *after* the last byte of message.
+  * collect_build_messages() - Lists the mapped messages in ROM order.
+  * @table:    Mapping table (text or compiled).
+  * @messages: Receives a malloc'd array with one entry per mapping.
+  * @count:    Receives the number of entries.
   *
-  * Return: true on success, false on failure.
+  * Return: true on success, false on memory allocation failure.
   */
  bool
- save_raw_pcm(const char *output_filepath, const uint8_t *rom_data,
-          size_t message_start_offset, size_t message_end_offset)
+ collect_build_messages(const MappingTable *table, BuildMessage **messages, size_t *count)
  {
-     FILE *fp;
-     size_t data_size, written;
-
-     if (message_end_offset <= message_start_offset) {
-          fprintf(stderr, "ERROR: Invalid offsets for saving raw PCM for '%s'.\n", output_filepath);
-          return false;
-     }
-
-     fp = fopen(output_filepath, "wb");
-     if (!fp) {
-         fprintf(stderr, "ERROR: Cannot open output PCM file '%s' for writing.\n", output_filepath);
+     size_t capacity = table->count, i;
+     MessageMapping *sorted;
+
+     *messages = NULL;
+     *count = 0;
+     sorted = (MessageMapping *)malloc((capacity > 0 ? capacity : 1) * sizeof(MessageMapping));
+     if (!sorted) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the ROM message list.\n");
          return false;
      }
+     if (table->binary) {
+         uint32_t segment_count = read_u32le(table->binary + 8), segment;
+         int k;
+
+         for (segment = 0; segment < segment_count && *count < capacity; ++segment) {
+             for (k = 0; k < MAX_MESSAGES_PER_SEGMENT && *count < capacity; ++k) {
+                 if (find_compiled_mapping(table, (int)segment, k, &sorted[*count]))
+                     (*count)++;
+             }
+         }
+     } else {
+         memcpy(sorted, table->mappings, capacity * sizeof(MessageMapping));
+         *count = capacity;
+         qsort(sorted, *count, sizeof(MessageMapping), compare_mappings_by_position);
+     }
 
-     data_size = message_end_offset - message_start_offset;
-     written = fwrite(rom_data + message_start_offset, 1, data_size, fp);
-
-     fclose(fp);
-
-     if (written != data_size) {
-         fprintf(stderr, "ERROR: Failed to write complete data to PCM file '%s'.\n", output_filepath);
-         /* remove(output_filepath); */
+     *messages = (BuildMessage *)calloc(*count > 0 ? *count : 1, sizeof(BuildMessage));
+     if (!*messages) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the ROM message list.\n");
+         free(sorted);
+         *count = 0;
          return false;
      }
-
-     status_printf("Saved raw PCM data: %s (%zu bytes)\n", output_filepath, data_size);
-
+     for (i = 0; i < *count; ++i)
+         (*messages)[i].mapping = sorted[i];
+     free(sorted);
      return true;
  }
 
-
- /* --- Message Processing --- */
-
  /**
-  * process_message() - Processes a single message (ADPCM decoding or Raw PCM saving).
-  * NOTE: This function is NOT called when list_mode is active.
-  * @rom_data:             Pointer to the start of the ROM data buffer.
-  * @rom_size:             Total size of the ROM data.
-  * @segment_start_offset: Byte offset of the current segment's start.
-  * @segment_index_0_based: 0-based index of the current segment.
-  * @msg_idx_in_segment:   0-based index of the message within the segment.
-  * @absolute_msg_idx:     0-based absolute index of the message.
-  * @message_offset_in_segment: Offset (bytes) from segment start to mode byte.
-  * @next_message_offset_in_segment: Offset (bytes) of the *next* message.
-  * @mapping:              Pointer to mapping info (or NULL if none).
-  * @rom_basename:         Base filename of the input ROM file.
+  * measure_message_file() - Checks a message file and finds the bytes to store.
+  * @filepath: Path of the file (for messages).
+  * @data:     Contents of the file.
+  * @size:     Size of @data (at least 1).
+  * @length:   Receives the message length: through the end command of an
+  *            ADPCM message (--encode), the whole file for a PCM message
+  *            (--raw-pcm). 0x00 and 0xFF are full-scale PCM samples, so
+  *            nothing is trimmed from an authored PCM message.
   *
-  * Return: true if processing should continue, false on fatal error.
+  * Return: true if the file holds a message, false otherwise.
   */
  bool
- process_message(const uint8_t *rom_data, size_t rom_size,
-         size_t segment_start_offset, int segment_index_0_based,
-         int msg_idx_in_segment, int absolute_msg_idx,
-         uint32_t message_offset_in_segment, uint32_t next_message_offset_in_segment,
-         const MessageMapping *mapping, const char *rom_basename)
+ measure_message_file(const char *filepath, const uint8_t *data, size_t size, size_t *length)
  {
-     size_t start_address = segment_start_offset + message_offset_in_segment;
-     uint8_t message_mode;
-     size_t current_pos;
-     char default_filename_base[25]; /* "message_S_XXX" + buffer */
-     const char *output_base;
-     const char *comment = NULL;
+     size_t end = 0;
 
-     /* Basic bounds check for start address */
-     if (start_address >= rom_size) {
-         fprintf(stderr, "WARN: Calculated start address (0x%zX) for message %d (Seg %d, Idx %d) is out of bounds (ROM size 0x%zX). Skipping.\n",
-             start_address, absolute_msg_idx, segment_index_0_based, msg_idx_in_segment, rom_size);
-         return true; /* Continue processing other messages */
+     if (data[0] == MODE_ADPCM) {
+         measure_adpcm_stream(data, size, 1, &end);
+         if (end < 2 || data[end - 1] != 0x00) {
+             fprintf(stderr, "ERROR: ADPCM message '%s' has no end command.\n", filepath);
+             return false;
+         }
+         *length = end;
+         return true;
      }
-
-     message_mode = rom_data[start_address];
-     current_pos = start_address + 1; /* Position for reading commands/data */
-
-     /* Generate default filename: message_S_XXX (0-based indices) */
-     snprintf(default_filename_base, sizeof(default_filename_base), "message_%d_%03d",
-          segment_index_0_based, msg_idx_in_segment);
-
-     output_base = default_filename_base;
-     if (mapping) {
-         output_base = mapping->output_filename_base;
-         comment = mapping->comment;
+     if (data[0] == MODE_PCM) {
+         *length = size;
+         return true;
      }
+     fprintf(stderr, "ERROR: '%s' does not start with an ADPCM or PCM mode byte.\n", filepath);
+     return false;
+ }
 
-     status_printf("Processing Message: Absolute Index %d (Segment %d, Index %d), Mode 0x%02X, Offset 0x%zX\n",
-            absolute_msg_idx, segment_index_0_based, msg_idx_in_segment, message_mode, start_address);
-
-     if (message_mode == MODE_ADPCM) {
-         AdpcmState adpcm_state = {0, 0}; /* Initial state */
-         PcmBuffer pcm_buffer;
-         bool decoding_ok = true;
-         bool end_of_message = false;
-         uint32_t nibble_count = 0;
-         uint8_t repeat_count = 0; /* Times to repeat *next* block (0=play once) */
-         uint32_t current_repeat_nibble_start = 0;
-         uint32_t current_repeat_nibble_count = 0;
-
-         verbose_printf("  Type: ADPCM\n");
-         init_pcm_buffer(&pcm_buffer);
-
-         while (!end_of_message && current_pos < rom_size) {
-             /* --- Nibble Decoding Phase --- */
-             if (nibble_count > 0) {
-                 uint8_t data_byte, nibble1, nibble2;
-
-                 if (current_pos >= rom_size) {
-                     fprintf(stderr, "WARN: Unexpected end of ROM data while reading ADPCM data nibble for message %d.\n", absolute_msg_idx);
-                     decoding_ok = false;
-                     break;
-                 }
-                 data_byte = rom_data[current_pos++];
-                 nibble1 = (data_byte >> 4) & 0x0F; /* MSN */
-                 nibble2 = data_byte & 0x0F;        /* LSN */
+ /**
+  * load_build_message() - Maps the file of one message and measures it.
+  * @message_dir: Directory holding the message files (NULL for the current directory).
+  * @message:     Message whose mapped name is looked up as '<name>.adpcm', then '<name>.pcm'.
+  *
+  * Return: true on success, false if the file is missing or not a message.
+  */
+ bool
+ load_build_message(const char *message_dir, BuildMessage *message)
+ {
+     static const char *const extensions[] = {".adpcm", ".pcm"};
+     const char *name = message->mapping.output_filename_base;
+     char filepath[FILENAME_MAX];
+     int k;
+
+     for (k = 0; k < 2 && !message->data; ++k) {
+         if (!build_output_path(filepath, sizeof(filepath), message_dir, name, extensions[k])) {
+             fprintf(stderr, "ERROR: Message file path for '%s' is too long.\n", name);
+             return false;
+         }
+         message->data = map_file_read_only(filepath, &message->file_size);
+     }
+     if (!message->data) {
+         fprintf(stderr, "ERROR: No message file '%s.adpcm' or '%s.pcm' for segment %d, message %d.\n",
+                 name, name, message->mapping.segment_index, message->mapping.message_index_in_seg);
+         return false;
+     }
 
-                 verbose_printf("    Nibble Read: Byte 0x%02X -> N1=0x%X, N2=0x%X (Pos 0x%zX)\n", data_byte, nibble1, nibble2, current_pos - 1);
+     if (!measure_message_file(filepath, message->data, message->file_size, &message->size))
+         return false;
+     if (6 + 2 + message->size > ROM_SEGMENT_SIZE) {
+         fprintf(stderr, "ERROR: Message '%s' (%zu bytes) does not fit into a %d-byte segment.\n",
+                 filepath, message->size, ROM_SEGMENT_SIZE);
+         return false;
+     }
+     return true;
+ }
 
-                 /* Decode first nibble */
-                 if (!decode_nibble(nibble1, &adpcm_state, &pcm_buffer)) {
-                     decoding_ok = false; break;
-                 }
-                 nibble_count--;
+ /**
+  * pack_build_messages() - Assigns the messages to segments in order.
+  * @messages: Messages in the required order.
+  * @count:    Number of messages.
+  *
+  * A segment holds the 5-byte header, one 2-byte offset table entry per
+  * message and the messages at word-aligned offsets. Because the order is
+  * fixed, filling every segment before starting the next gives the fewest
+  * segments: ending a segment earlier only moves messages into later ones.
+  *
+  * Return: The number of segments used.
+  */
+ int
+ pack_build_messages(BuildMessage *messages, size_t count)
+ {
+     size_t bytes = 0, i;
+     uint32_t in_segment = 0;
+     int segment = 0;
+
+     for (i = 0; i < count; ++i) {
+         /* Table entries and aligned messages so far, plus this message unpadded */
+         if (in_segment == MAX_MESSAGES_PER_SEGMENT ||
+             (in_segment > 0 && 6 + 2 * ((size_t)in_segment + 1) + bytes + messages[i].size > ROM_SEGMENT_SIZE)) {
+             segment++;
+             in_segment = 0;
+             bytes = 0;
+         }
+         messages[i].segment = segment;
+         messages[i].index = in_segment++;
+         bytes += (messages[i].size + 1) & ~(size_t)1;
+     }
+     return count > 0 ? segment + 1 : 0;
+ }
 
-                 /* Decode second nibble if needed */
-                 if (nibble_count > 0) {
-                     if (!decode_nibble(nibble2, &adpcm_state, &pcm_buffer)) {
-                         decoding_ok = false; break;
-                     }
-                     nibble_count--;
-                 }
+ /**
+  * fill_build_segment() - Writes the header, offset table and messages of one segment.
+  * @segment_data: ROM_SEGMENT_SIZE bytes, pre-filled with ROM_ERASED_BYTE.
+  * @messages:     The messages of this segment, in order.
+  * @count:        Number of messages (1 to MAX_MESSAGES_PER_SEGMENT).
+  *
+  * Return: Number of bytes used (header through the last message).
+  */
+ size_t
+ fill_build_segment(uint8_t *segment_data, const BuildMessage *messages, uint32_t count)
+ {
+     size_t offset = 6 + 2 * (size_t)count; /* First word after the header and table */
+     uint32_t k;
+
+     segment_data[0] = (uint8_t)(count - 1);
+     memcpy(segment_data + 1, ROM_MAGIC, 4);
+     for (k = 0; k < count; ++k) {
+         write_u16be(segment_data + 5 + k * 2, (uint16_t)(offset / 2));
+         memcpy(segment_data + offset, messages[k].data, messages[k].size);
+         offset += messages[k].size;
+         if ((offset & 1) && k + 1 < count)
+             segment_data[offset++] = 0x00; /* Word alignment of the next message */
+     }
+     segment_data[5 + 2 * count] = 0x00; /* Word alignment of the first message */
+     return offset;
+ }
 
-                 /* Handle repeat logic */
-                 if (repeat_count > 0 && nibble_count == 0) {
-                     repeat_count--;
-                     if (repeat_count > 0) {
-                         /* Reset position and count to repeat block */
-                         verbose_printf("    Repeating block (%u nibbles left, %u repeats left)\n", current_repeat_nibble_count, repeat_count);
-                         current_pos = current_repeat_nibble_start;
-                         nibble_count = current_repeat_nibble_count;
-                     } else {
-                          verbose_printf("    Finished repeating block.\n");
-                          current_repeat_nibble_start = 0;
-                          current_repeat_nibble_count = 0;
-                     }
-                 }
-             }
-             /* --- Command Reading Phase --- */
-             else {
-                 uint8_t command;
+ /**
+  * run_build_rom() - Builds a ROM image and its mapping file from message files (--build-rom).
+  * @options: Parsed command line options.
+  *
+  * The -m mapping file lists the messages: their (segment, message) order
+  * is kept and their names select '<name>.adpcm' or '<name>.pcm' in the
+  * message directory (first positional argument, else the current
+  * directory). The messages are repacked into as few segments as possible
+  * (pack_build_messages()), so their positions can change; the mapping file
+  * written beside the ROM ('<rom without extension>.map') has the new
+  * positions with the original names and comments.
+  *
+  * Return: EXIT_SUCCESS or EXIT_FAILURE.
+  */
+ int
+ run_build_rom(const ProgramOptions *options)
+ {
+     const char *message_dir = (options->rom_filepath_count > 0) ? options->rom_filepaths[0] : NULL;
+     const char *rom_filepath = options->build_rom_filepath;
+     const char *dot = strrchr(get_base_filename(rom_filepath), '.');
+     char map_filepath[FILENAME_MAX];
+     MappingTable mapping_table;
+     BuildMessage *messages = NULL;
+     uint8_t *image = NULL;
+     size_t count = 0, used = 0, moved = 0, i, first;
+     int segment_count = 0;
+     uint64_t start_ns = get_monotonic_ns();
+     int exit_code = EXIT_FAILURE;
+     FILE *fp;
+     bool written;
 
-                 if (current_pos >= rom_size) {
-                     fprintf(stderr, "WARN: Unexpected end of ROM data while reading ADPCM command for message %d.\n", absolute_msg_idx);
-                     end_of_message = (pcm_buffer.count > 0);
-                     decoding_ok = end_of_message;
-                     break;
-                 }
-                 command = rom_data[current_pos++];
-                 verbose_printf("  Command Read: 0x%02X (Pos 0x%zX)\n", command, current_pos - 1);
-
-                 if (command == 0x00) { /* End of Message */
-                     verbose_printf("    Opcode: End of Message\n");
-                     end_of_message = true;
-                 } else if (command >= 0x01 && command <= 0x3F) { /* Silence */
-                     uint32_t silence_samples = (uint32_t)command * 8;
-                     uint32_t i;
-                     verbose_printf("    Opcode: Silence (%u samples)\n", silence_samples);
-                     for (i = 0; i < silence_samples; ++i) {
-                         if (!add_pcm_sample(&pcm_buffer, 0)) {
-                             decoding_ok = false; break;
-                         }
-                     }
-                 } else if (command >= 0x40 && command <= 0x7F) { /* Play Short Block */
-                     nibble_count = 256; /* 128 bytes * 2 nibbles/byte */
-                     repeat_count = 0;
-                     verbose_printf("    Opcode: Play Short Block (%u nibbles)\n", nibble_count);
-                 } else if (command >= 0x80 && command <= 0xBF) { /* Play Long Block */
-                     uint8_t n;
-                     if (current_pos >= rom_size) {
-                         fprintf(stderr, "WARN: Unexpected end of ROM reading N for Long Block (Cmd 0x%02X) in message %d.\n", command, absolute_msg_idx);
-                         decoding_ok = false; break;
-                     }
-                     n = rom_data[current_pos++];
-                     nibble_count = (uint32_t)n + 1;
-                     repeat_count = 0;
-                     verbose_printf("    Opcode: Play Long Block (N=0x%02X -> %u nibbles) (Pos 0x%zX)\n", n, nibble_count, current_pos - 1);
-                 } else if (command >= 0xC0 && command <= 0xFF) { /* Play Repeat Block */
-                     uint8_t n;
-                     if (current_pos >= rom_size) {
-                         fprintf(stderr, "WARN: Unexpected end of ROM reading N for Repeat Block (Cmd 0x%02X) in message %d.\n", command, absolute_msg_idx);
-                         decoding_ok = false; break;
-                     }
-                     n = rom_data[current_pos++];
-                     nibble_count = (uint32_t)n + 1;
-                     repeat_count = ((command >> 3) & 0x07); /* R bits (0-7) */
-                     current_repeat_nibble_start = current_pos;
-                     current_repeat_nibble_count = nibble_count;
-                     verbose_printf("    Opcode: Play Repeat Block (N=0x%02X -> %u nibbles, R=%u -> %u plays total) (Pos 0x%zX)\n",
-                                n, nibble_count, repeat_count, repeat_count + 1, current_pos - 1);
-                 } else {
-                     fprintf(stderr, "WARN: Unknown ADPCM command byte 0x%02X at offset 0x%zX in message %d. Stopping decode.\n",
-                         command, current_pos - 1, absolute_msg_idx);
-                     decoding_ok = false; /* Treat as error */
-                     break;
-                 }
-                 if (!decoding_ok) break; /* Break outer loop on error */
-             }
-         } /* end while(!end_of_message) */
+     init_output_buffer(&list_output);
+     if (dot && dot != get_base_filename(rom_filepath))
+         snprintf(map_filepath, sizeof(map_filepath), "%.*s.map", (int)(dot - rom_filepath), rom_filepath);
+     else
+         snprintf(map_filepath, sizeof(map_filepath), "%s.map", rom_filepath);
 
-         if (decoding_ok && pcm_buffer.count > 0) {
-             char wav_filename[FILENAME_MAX];
-             char track_num_str[12];
+     if (!load_mapping_data(options->map_filepath, &mapping_table) ||
+         !collect_build_messages(&mapping_table, &messages, &count))
+         goto cleanup;
+     if (count == 0) {
+         fprintf(stderr, "ERROR: The mapping file '%s' lists no messages.\n", options->map_filepath);
+         goto cleanup;
+     }
+     for (i = 0; i < count; ++i) {
+         if (!load_build_message(message_dir, &messages[i]))
+             goto cleanup;
+     }
 
-             snprintf(wav_filename, sizeof(wav_filename), "%s.wav", output_base);
-             snprintf(track_num_str, sizeof(track_num_str), "%d", absolute_msg_idx);
+     segment_count = pack_build_messages(messages, count);
+     image = (uint8_t *)malloc((size_t)segment_count * ROM_SEGMENT_SIZE);
+     if (!image) {
+         fprintf(stderr, "ERROR: Failed to allocate %d segments for the ROM image.\n", segment_count);
+         goto cleanup;
+     }
+     memset(image, ROM_ERASED_BYTE, (size_t)segment_count * ROM_SEGMENT_SIZE);
 
-             if (!write_wav_file(wav_filename, &pcm_buffer, DEFAULT_SAMPLE_RATE,
-                         rom_basename, output_base, track_num_str, comment)) {
-                 /* Error already printed */
-             }
-         } else if (decoding_ok && pcm_buffer.count == 0) {
-             status_printf("  Message %d resulted in 0 PCM samples. No WAV file written.\n", absolute_msg_idx);
-         } else {
-              fprintf(stderr, "ERROR: Decoding failed for message %d. No WAV file written.\n", absolute_msg_idx);
+     if (!append_text(&list_output, "# ROM: ") || !append_text(&list_output, get_base_filename(rom_filepath)) ||
+         !append_text(&list_output, "\n\n"))
+         goto cleanup;
+     for (first = 0; first < count; first = i) {
+         size_t segment_used;
+
+         for (i = first; i < count && messages[i].segment == messages[first].segment; ++i) {
+             if (messages[i].segment != messages[i].mapping.segment_index ||
+                 (int)messages[i].index != messages[i].mapping.message_index_in_seg)
+                 moved++;
+             if (!append_map_line(messages[i].segment, messages[i].index, messages[i].mapping.output_filename_base,
+                                  messages[i].mapping.comment, messages[i].data[0] == MODE_PCM))
+                 goto cleanup;
          }
+         segment_used = fill_build_segment(image + (size_t)messages[first].segment * ROM_SEGMENT_SIZE,
+                                           &messages[first], (uint32_t)(i - first));
+         verbose_printf("Segment %d: %zu message(s), %zu bytes free\n", messages[first].segment, i - first,
+                        (size_t)ROM_SEGMENT_SIZE - segment_used);
+         used += segment_used;
+     }
 
-         free_pcm_buffer(&pcm_buffer);
-
-     } else if (message_mode == MODE_PCM) {
-         size_t message_end_offset;
-         char pcm_filename[FILENAME_MAX];
-
-         verbose_printf("  Type: Raw PCM (Saving raw data, decoding not supported)\n");
-         /* Determine end of message data */
-         message_end_offset = segment_start_offset + next_message_offset_in_segment;
-         if (message_end_offset > rom_size) /* Clamp to ROM size */
-             message_end_offset = rom_size;
+     fp = fopen(rom_filepath, "wb");
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot create ROM file '%s'.\n", rom_filepath);
+         goto cleanup;
+     }
+     written = fwrite(image, 1, (size_t)segment_count * ROM_SEGMENT_SIZE, fp) == (size_t)segment_count * ROM_SEGMENT_SIZE;
+     if (fclose(fp) != 0 || !written) {
+         fprintf(stderr, "ERROR: Failed to write ROM file '%s'.\n", rom_filepath);
+         goto cleanup;
+     }
+     fp = fopen(map_filepath, "wb");
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot create mapping file '%s'.\n", map_filepath);
+         goto cleanup;
+     }
+     written = fwrite(list_output.data, 1, list_output.size, fp) == list_output.size;
+     if (fclose(fp) != 0 || !written) {
+         fprintf(stderr, "ERROR: Failed to write mapping file '%s'.\n", map_filepath);
+         goto cleanup;
+     }
 
-         snprintf(pcm_filename, sizeof(pcm_filename), "%s.pcm", output_base);
+     status_printf("Built '%s': %zu message(s) in %d segment(s), %zu of %zu bytes used, in %.1f ms.\n",
+                   rom_filepath, count, segment_count, used, (size_t)segment_count * ROM_SEGMENT_SIZE,
+                   (double)(get_monotonic_ns() - start_ns) / 1e6);
+     status_printf("Wrote mapping file '%s' (%zu message(s) at a new position).\n", map_filepath, moved);
+     exit_code = EXIT_SUCCESS;
 
-         if (message_end_offset <= start_address) {
-              fprintf(stderr, "WARN: Cannot determine valid data range for Raw PCM message %d. Skipping save.\n", absolute_msg_idx);
-         } else {
-             if (!save_raw_pcm(pcm_filename, rom_data, start_address, message_end_offset)) {
-                 /* Error already printed */
-             }
+ cleanup:
+     for (i = 0; i < count; ++i) {
+         if (messages[i].data) {
+ #ifdef _WIN32
+             UnmapViewOfFile(messages[i].data);
+ #else
+             munmap((void *)messages[i].data, messages[i].file_size);
+ #endif
          }
-
-     } else {
-         fprintf(stderr, "WARN: Unknown message mode 0x%02X for message %d at offset 0x%zX. Skipping.\n",
-             message_mode, absolute_msg_idx, start_address);
      }
-
-     return true; /* Continue processing next message */
+     free(messages);
+     free(image);
+     free_output_buffer(&list_output);
+     free_mapping_table(&mapping_table);
+     return exit_code;
  }
 
+
+ /* --- Message Patching --- */
+
  /**
-  * handle_message_iteration() - Handles a single message during iteration (list or decode).
-  * @rom_data:             Pointer to the start of the ROM data buffer.
-  * @rom_size:             Total size of the ROM data.
-  * @segment_start_offset: Byte offset of the current segment's start.
-  * @segment_index_0_based: 0-based index of the current segment.
-  * @msg_idx_in_seg:       0-based index of the message within the segment.
-  * @absolute_msg_idx:     0-based absolute index of the message.
-  * @offset_table:         Pointer to the offset table for the current segment.
-  * @message_count_in_segment: Total number of messages in the current segment.
-  * @mapping_table:        Pointer to the loaded mapping table.
-  * @rom_basename:         Base filename of the input ROM file.
-  * @list_mode:            True if list mode is active.
-  * @quiet_mode:           True if quiet mode is active.
-  * @target_message_idx:   Target absolute message index for decoding (-1 for all).
+  * run_patch() - Replaces one message of a ROM in place (--patch).
+  * @options: Parsed command line options.
   *
-  * Return: Enum indicating status (continue, target found, error).
+  * The ROM file is mapped read-write and only the segment holding message
+  * -i changes: the new message is written over the old one, the messages
+  * after it in the segment are moved by the size difference with one
+  * memmove, and their offset table entries are adjusted. Space given up by
+  * a smaller message becomes ROM_ERASED_BYTE. Every other segment stays
+  * byte-identical.
+  *
+  * Return: EXIT_SUCCESS or EXIT_FAILURE.
   */
- HandleMessageResult
- handle_message_iteration(
-     const uint8_t *rom_data, size_t rom_size,
-     size_t segment_start_offset, int segment_index_0_based,
-     uint32_t msg_idx_in_seg, int absolute_msg_idx,
-     const uint16_t *offset_table, uint32_t message_count_in_segment,
-     const MappingTable *mapping_table, const char *rom_basename,
-     bool list_mode, bool quiet_mode, long target_message_idx)
- {
-     const MessageMapping *mapping = find_mapping(mapping_table, segment_index_0_based, msg_idx_in_seg);
-     uint32_t relative_base_offset_words = offset_table[msg_idx_in_seg];
-     uint32_t message_offset_bytes = (uint32_t)relative_base_offset_words * 2;
-     size_t start_address = segment_start_offset + message_offset_bytes;
-
-     /* --- LIST MODE --- */
-     if (list_mode) {
-         /* Only proceed with list output if not in quiet mode */
-         if (!quiet_mode) {
-             const char *output_base;
-             const char *user_comment = NULL;
-             char default_filename_base[25];
-             uint8_t message_mode = 0xFF;
-             bool mode_read_ok = false;
-             char comment_buffer[256] = "";
-             bool pcm_tag_added = false;
-             bool pcm_already_in_user_comment = false;
-             bool has_user_comment = false;
-             int filename_len, num_stops, target_stops, tabs_to_print, pad_idx;
-
-             /* Determine filename base and check existing comment for (PCM) */
-             if (mapping) {
-                 output_base = mapping->output_filename_base;
-                 user_comment = mapping->comment;
-                 if (user_comment) {
-                     pcm_already_in_user_comment = (strstr(user_comment, "(PCM)") != NULL);
-                     has_user_comment = (strlen(user_comment) > 0);
-                 }
-             } else {
-                 snprintf(default_filename_base, sizeof(default_filename_base), "message_%d_%03d",
-                      segment_index_0_based, msg_idx_in_seg);
-                 output_base = default_filename_base;
-             }
-
-             /* Read message mode for PCM check */
-             if (start_address < rom_size) {
-                 message_mode = rom_data[start_address];
-                 mode_read_ok = true;
-             } else {
-                 fprintf(stderr, "WARN: Cannot read mode byte for list entry (Seg %d, Idx %u) - offset out of bounds.\n",
-                     segment_index_0_based, msg_idx_in_seg);
-             }
-
-             /* Build the comment string */
-             strcpy(comment_buffer, "#"); /* Start with hash */
-             if (mode_read_ok && message_mode == MODE_PCM && !pcm_already_in_user_comment) {
-                 strcat(comment_buffer, " (PCM)");
-                 pcm_tag_added = true;
-             }
-             if (has_user_comment) {
-                 if (pcm_tag_added || strcmp(comment_buffer, "#") == 0)
-                      strcat(comment_buffer, " ");
-                 strcat(comment_buffer, user_comment);
-             } else if (!pcm_tag_added) {
-                 strcat(comment_buffer, " ");
-             }
-
-
-             /* Print first fields */
-             printf("%d\t%u\t%s", segment_index_0_based, msg_idx_in_seg, output_base);
-
-             /* Calculate and print padding TABS */
-             filename_len = strlen(output_base);
-             num_stops = filename_len / TAB_WIDTH;
-             target_stops = (LIST_FILENAME_ALIGN_WIDTH + TAB_WIDTH - 1) / TAB_WIDTH;
-             tabs_to_print = (num_stops < target_stops) ? (target_stops - num_stops) : 1;
-             for (pad_idx = 0; pad_idx < tabs_to_print; ++pad_idx)
-                 putchar('\t');
+ int
+ run_patch(const ProgramOptions *options)
+ {
+     const char *rom_filepath = options->rom_filepaths[0];
+     const uint8_t *message = NULL;
+     uint8_t *rom_data = NULL, *base;
+     size_t rom_size = 0, message_file_size = 0, length = 0, segment_pos;
+     size_t old_start, old_end, tail_end, new_end, samples;
+     SegmentDirectory directory;
+     const SegmentEntry *segment = NULL;
+     long absolute_base = 0, delta;
+     uint32_t k = 0, j;
+     uint64_t start_ns = get_monotonic_ns();
+     int exit_code = EXIT_FAILURE;
+
+     init_segment_directory(&directory);
+     message = map_file_read_only(options->patch_filepath, &message_file_size);
+     if (!message) {
+         fprintf(stderr, "ERROR: Cannot read message file '%s'.\n", options->patch_filepath);
+         goto cleanup;
+     }
+     if (!measure_message_file(options->patch_filepath, message, message_file_size, &length))
+         goto cleanup;
+     rom_data = map_file_read_write(rom_filepath, &rom_size);
+     if (!rom_data) {
+         fprintf(stderr, "ERROR: Cannot open ROM file '%s' for writing.\n", rom_filepath);
+         goto cleanup;
+     }
+     if (!(scan_mode ? scan_segment_directory(rom_data, rom_size, &directory) :
+           build_segment_directory_fixed(rom_data, rom_size, &directory)) && directory.count == 0)
+         goto cleanup;
 
-             /* Print comment */
-             printf("%s\n", comment_buffer);
+     for (segment_pos = 0; segment_pos < directory.count; ++segment_pos) {
+         if (options->target_message_idx < absolute_base + (long)directory.segments[segment_pos].message_count) {
+             segment = &directory.segments[segment_pos];
+             k = (uint32_t)(options->target_message_idx - absolute_base);
+             break;
          }
-         return MSG_HANDLED_CONTINUE; /* List mode always continues */
+         absolute_base += (long)directory.segments[segment_pos].message_count;
+     }
+     if (!segment) {
+         fprintf(stderr, "ERROR: Target message index %ld not found in '%s'.\n", options->target_message_idx, rom_filepath);
+         goto cleanup;
      }
-     /* --- DECODE MODE --- */
-     else {
-         if (target_message_idx < 0 || absolute_msg_idx == target_message_idx) {
-             uint32_t next_message_offset_bytes;
-             bool success;
 
-             /* Determine the end offset for Raw PCM saving */
-             if (msg_idx_in_seg + 1 < message_count_in_segment) {
-                 next_message_offset_bytes = (uint32_t)offset_table[msg_idx_in_seg + 1] * 2;
-             } else {
-                 next_message_offset_bytes = ROM_SEGMENT_SIZE; /* Assume end of segment */
-             }
+     /* Offsets relative to the segment; the used area ends with the last message */
+     base = rom_data + segment->start;
+     old_start = (size_t)read_u16be(base + 5 + k * 2) * 2;
+     measure_message(rom_data, rom_size, segment->start + (size_t)read_u16be(base + 5 + (segment->message_count - 1) * 2) * 2,
+                     segment->start + segment->size, true, &tail_end, &samples);
+     tail_end -= segment->start;
+     old_end = (k + 1 < segment->message_count) ? (size_t)read_u16be(base + 5 + (k + 1) * 2) * 2 : tail_end;
+     if (old_start < 5 + 2 * (size_t)segment->message_count || old_end < old_start || tail_end < old_end ||
+         tail_end > segment->size) {
+         fprintf(stderr, "ERROR: The offset table of segment %zu is inconsistent; not patching.\n", segment_pos);
+         goto cleanup;
+     }
+     new_end = old_start + length;
+     if (k + 1 < segment->message_count)
+         new_end = (new_end + 1) & ~(size_t)1; /* The next message starts on a word */
+     delta = (long)new_end - (long)old_end;
+     if ((long)tail_end + delta > (long)segment->size) {
+         fprintf(stderr, "ERROR: The new message needs %ld more bytes, but segment %zu has %zu bytes free.\n",
+                 delta, segment_pos, segment->size - tail_end);
+         goto cleanup;
+     }
 
-             success = process_message(rom_data, rom_size, segment_start_offset, segment_index_0_based,
-                           msg_idx_in_seg, absolute_msg_idx,
-                           message_offset_bytes, next_message_offset_bytes,
-                           mapping, rom_basename);
+     memmove(base + old_end + delta, base + old_end, tail_end - old_end);
+     memcpy(base + old_start, message, length);
+     if (new_end > old_start + length)
+         base[old_start + length] = 0x00;
+     if (delta < 0)
+         memset(base + tail_end + delta, ROM_ERASED_BYTE, (size_t)-delta);
+     for (j = k + 1; j < segment->message_count; ++j)
+         write_u16be(base + 5 + j * 2, (uint16_t)(read_u16be(base + 5 + j * 2) + delta / 2));
+
+     status_printf("Patched segment %zu, message %u (absolute %ld) of '%s': %zu -> %zu bytes, %u following message(s) "
+                   "moved by %ld bytes, %zu bytes free in the segment, in %.3f ms.\n",
+                   segment_pos, k, options->target_message_idx, rom_filepath, old_end - old_start, new_end - old_start,
+                   segment->message_count - k - 1, delta, segment->size - (size_t)((long)tail_end + delta),
+                   (double)(get_monotonic_ns() - start_ns) / 1e6);
+     exit_code = EXIT_SUCCESS;
 
-             if (!success)
-                 return MSG_HANDLED_ERROR;
+ cleanup:
+ #ifdef _WIN32
+     if (rom_data)
+         UnmapViewOfFile(rom_data);
+     if (message)
+         UnmapViewOfFile(message);
+ #else
+     if (rom_data)
+         munmap(rom_data, rom_size);
+     if (message)
+         munmap((void *)message, message_file_size);
+ #endif
+     free_segment_directory(&directory);
+     return exit_code;
+ }
 
-             if (target_message_idx >= 0 && absolute_msg_idx == target_message_idx)
-                 return MSG_HANDLED_TARGET_FOUND;
 
+ /* --- Encoder Benchmark --- */
+
+ /**
+  * struct bench_message - One message of the encoder benchmark corpus.
+  * @job: Decode job the message came from (for its ROM path).
+  * @pcm: Samples decoded from the ROM.
+  */
+ typedef struct {
+     const DecodeJob *job;
+     PcmBuffer pcm;
+ } BenchMessage;
+
+ /**
+  * struct bench_run - Round-trip result of one encoder quality and thread count.
+  * @quality:       Nibble search used.
+  * @threads:       Number of encoder worker threads.
+  * @encode_ns:     Time spent encoding the corpus.
+  * @decode_ns:     Time spent decoding the encoded messages back.
+  * @bytes:         Total size of the encoded messages.
+  * @signal_energy: Sum of squared corpus samples.
+  * @noise_energy:  Sum of squared differences between corpus and round-trip samples.
+  * @segmental_sum: Sum of the clamped SNR of the voiced BENCH_FRAME_SAMPLES frames.
+  * @frames:        Number of frames in @segmental_sum.
+  */
+ typedef struct {
+     EncodeQuality quality;
+     int threads;
+     uint64_t encode_ns;
+     uint64_t decode_ns;
+     size_t bytes;
+     double signal_energy;
+     double noise_energy;
+     double segmental_sum;
+     size_t frames;
+ } BenchRun;
+
+ /**
+  * measure_round_trip() - Adds the error of one round-trip message to a BenchRun.
+  * @input:  Samples that were encoded.
+  * @output: Samples decoded from the encoded message.
+  * @run:    BenchRun accumulating the energies and frame SNRs.
+  *
+  * Input samples past the end of @output count against silence. Frames
+  * whose input is all zero carry no signal and are left out of the
+  * segmental SNR.
+  */
+ void
+ measure_round_trip(const PcmBuffer *input, const PcmBuffer *output, BenchRun *run)
+ {
+     size_t first;
+
+     for (first = 0; first < input->count; first += BENCH_FRAME_SAMPLES) {
+         size_t last = (input->count - first < BENCH_FRAME_SAMPLES) ? input->count : first + BENCH_FRAME_SAMPLES;
+         double signal = 0.0, noise = 0.0, snr;
+         size_t i;
+
+         for (i = first; i < last; ++i) {
+             double in = input->samples[i];
+             double out = (i < output->count) ? output->samples[i] : 0.0;
+             signal += in * in;
+             noise += (in - out) * (in - out);
          }
-         return MSG_HANDLED_CONTINUE; /* Continue if not target or target processed ok */
+         run->signal_energy += signal;
+         run->noise_energy += noise;
+         if (signal == 0.0)
+             continue;
+         snr = (noise > 0.0) ? 10.0 * log10(signal / noise) : BENCH_MAX_FRAME_SNR;
+         if (snr < BENCH_MIN_FRAME_SNR)
+             snr = BENCH_MIN_FRAME_SNR;
+         if (snr > BENCH_MAX_FRAME_SNR)
+             snr = BENCH_MAX_FRAME_SNR;
+         run->segmental_sum += snr;
+         run->frames++;
      }
  }
 
-
- /* --- Argument Parsing Function --- */
-
  /**
-  * parse_arguments() - Parses command line arguments.
-  * @argc: Argument count.
-  * @argv: Argument vector.
-  * @rom_filepath_ptr: Pointer to store ROM file path.
-  * @map_filepath_ptr: Pointer to store mapping file path.
-  * @target_message_idx_ptr: Pointer to store target message index.
-  * @list_mode_ptr: Pointer to store list mode flag.
-  * @quiet_mode_ptr: Pointer to store quiet mode flag.
-  * @verbose_mode_ptr: Pointer to store verbose mode flag.
+  * run_bench_pass() - Encodes the benchmark corpus once and decodes it back.
+  * @scheduler: Encoder scheduler with ENCODE_GROUP_SIZE zeroed files, @quality
+  *             and @keep_messages set.
+  * @corpus:    Messages to encode.
+  * @count:     Number of entries in @corpus.
+  * @run:       BenchRun (@quality and @threads set) receiving the results.
   *
-  * Return: true on success, false on error or if help requested.
+  * Only encode_group() is timed for the encoder; each message is then
+  * decoded by decode_message(), the decoder that writes every WAV file.
+  * Its per-message status lines are captured and dropped, so a run prints
+  * only its summary line.
+  *
+  * Return: true on success, false if a message could not be encoded or decoded.
   */
  bool
- parse_arguments(int argc, char *argv[],
-         const char **rom_filepath_ptr, const char **map_filepath_ptr,
-         long *target_message_idx_ptr, bool *list_mode_ptr,
-         bool *quiet_mode_ptr, bool *verbose_mode_ptr)
+ run_bench_pass(EncodeScheduler *scheduler, const BenchMessage *corpus, size_t count, BenchRun *run)
  {
-     int i;
-
-     /* Initialize defaults */
-     *rom_filepath_ptr = NULL;
-     *map_filepath_ptr = NULL;
-     *target_message_idx_ptr = -1;
-     *list_mode_ptr = false;
-     *quiet_mode_ptr = false;
-     *verbose_mode_ptr = false;
+     EncodeFile *files = scheduler->files;
+     OutputBuffer status_lines;
+     size_t group, i;
+     bool success = true;
 
-     for (i = 1; i < argc; ++i) {
-         if (strcmp(argv[i], "-m") == 0) {
-             if (++i < argc) {
-                 *map_filepath_ptr = argv[i];
-             } else {
-                 fprintf(stderr, "ERROR: Option -m requires a filepath argument.\n");
-                 print_usage(argv[0]);
-                 return false;
-             }
-         } else if (strcmp(argv[i], "-i") == 0) {
-             if (++i < argc) {
-                 char *endptr;
-                 *target_message_idx_ptr = strtol(argv[i], &endptr, 10);
-                 if (*endptr != '\0' || *target_message_idx_ptr < 0) {
-                     fprintf(stderr, "ERROR: Invalid message index '%s' for -i option.\n", argv[i]);
-                     print_usage(argv[0]);
-                     return false;
-                 }
-             } else {
-                 fprintf(stderr, "ERROR: Option -i requires a message index argument.\n");
-                 print_usage(argv[0]);
-                 return false;
+     init_output_buffer(&status_lines);
+     for (group = 0; group < count && success; group += ENCODE_GROUP_SIZE) {
+         size_t file_count = count - group;
+         uint64_t start_ns;
+
+         if (file_count > ENCODE_GROUP_SIZE)
+             file_count = ENCODE_GROUP_SIZE;
+         for (i = 0; i < file_count; ++i) {
+             files[i].wav_filepath = corpus[group + i].job->rom->rom_filepath;
+             files[i].source = &corpus[group + i].pcm;
+             init_pcm_buffer(&files[i].pcm);
+         }
+         scheduler->file_count = file_count;
+         start_ns = get_monotonic_ns();
+         if (!encode_group(scheduler, run->threads) || scheduler->failed > 0)
+             success = false;
+         run->encode_ns += get_monotonic_ns() - start_ns;
+
+         for (i = 0; i < file_count && success; ++i) {
+             const OutputBuffer *message = &files[i].message;
+             DecodedMessage decoded;
+
+             start_ns = get_monotonic_ns();
+             thread_status_capture = &status_lines;
+             if (!decode_message(message->data, message->size, 0, 0, (int)(group + i), (int)(group + i), 0,
+                                 (uint32_t)message->size, NULL, NULL, &decoded) ||
+                 !decoded.has_output) {
+                 fprintf(stderr, "ERROR: Failed to decode benchmark message %zu.\n", group + i);
+                 success = false;
              }
-         } else if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--list") == 0) {
-             *list_mode_ptr = true;
-         } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
-             *quiet_mode_ptr = true;
-         } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
-             *verbose_mode_ptr = true;
-         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-              print_usage(argv[0]);
-              return false; /* Indicate help requested, not an error */
-         } else if (argv[i][0] == '-') {
-             fprintf(stderr, "ERROR: Unknown option '%s'.\n", argv[i]);
-             print_usage(argv[0]);
-             return false;
-         } else if (*rom_filepath_ptr == NULL) {
-             *rom_filepath_ptr = argv[i];
-         } else {
-             fprintf(stderr, "ERROR: Unexpected argument '%s'. ROM filepath already specified?\n", argv[i]);
-             print_usage(argv[0]);
-             return false;
+             thread_status_capture = NULL;
+             status_lines.size = 0;
+             run->decode_ns += get_monotonic_ns() - start_ns;
+             run->bytes += message->size;
+             if (success)
+                 measure_round_trip(&corpus[group + i].pcm, &decoded.pcm, run);
+             free_decoded_message(&decoded);
+         }
+         for (i = 0; i < file_count; ++i) {
+             free_encode_file(&files[i]);
+             memset(&files[i], 0, sizeof(files[i]));
          }
      }
-
-     if (*rom_filepath_ptr == NULL) {
-         fprintf(stderr, "ERROR: Input ROM filepath is required.\n");
-         print_usage(argv[0]);
-         return false;
-     }
-
-     /* Quiet mode overrides verbose mode */
-     if (*quiet_mode_ptr)
-         *verbose_mode_ptr = false;
-
-
-     /* If listing, ignore target index */
-     if (*list_mode_ptr && *target_message_idx_ptr >= 0) {
-         status_printf("INFO: Option -i ignored when -l or --list is specified.\n");
-         *target_message_idx_ptr = -1; /* Ensure we don't accidentally use it later */
-     }
-
-     return true;
+     free_output_buffer(&status_lines);
+     return success;
  }
 
  /**
-  * load_rom_data() - Loads ROM file content into memory.
-  * @rom_filepath: Path to the ROM file.
-  * @rom_data_ptr: Pointer to store the allocated buffer address.
-  * @rom_size_ptr: Pointer to store the size of the loaded ROM.
+  * write_bench_results() - Writes the encoder benchmark results as one JSON object.
+  * @json_filepath: Output path, or "-" for stdout.
+  * @rom_count:     Number of ROMs in the corpus.
+  * @message_count: Number of messages in the corpus.
+  * @audio_seconds: Duration of the corpus.
+  * @runs:          Results, in run order.
+  * @run_count:     Number of entries in @runs.
   *
   * Return: true on success, false on failure.
   */
  bool
- load_rom_data(const char *rom_filepath, uint8_t **rom_data_ptr, size_t *rom_size_ptr)
+ write_bench_results(const char *json_filepath, size_t rom_count, size_t message_count, double audio_seconds,
+                     const BenchRun *runs, size_t run_count)
  {
-     FILE *rom_fp;
-     long file_size_long;
+     bool to_stdout = (strcmp(json_filepath, "-") == 0);
+     FILE *fp = to_stdout ? stdout : fopen(json_filepath, "w");
+     size_t i;
+     bool success;
 
-     verbose_printf("Loading ROM file...\n");
-     rom_fp = fopen(rom_filepath, "rb");
-     if (!rom_fp) {
-         fprintf(stderr, "ERROR: Cannot open ROM file '%s'.\n", rom_filepath);
+     if (!fp) {
+         fprintf(stderr, "ERROR: Cannot create benchmark file '%s'.\n", json_filepath);
          return false;
      }
+     fprintf(fp, "{\"roms\":%zu,\"messages\":%zu,\"audio_seconds\":%.3f,\"runs\":[", rom_count, message_count,
+             audio_seconds);
+     for (i = 0; i < run_count; ++i) {
+         const BenchRun *run = &runs[i];
+         double encode_s = (double)run->encode_ns / 1e9;
+
+         fprintf(fp, "%s{\"quality\":\"%s\",\"threads\":%d,\"encode_ms\":%.3f,\"realtime_factor\":%.2f,"
+                 "\"decode_ms\":%.3f,\"bytes\":%zu,\"bytes_per_second\":%.1f,\"snr_db\":%.2f,\"segmental_snr_db\":%.2f}",
+                 i ? "," : "", get_encode_quality_name(run->quality), run->threads, (double)run->encode_ns / 1e6,
+                 encode_s > 0 ? audio_seconds / encode_s : 0.0, (double)run->decode_ns / 1e6, run->bytes,
+                 audio_seconds > 0 ? (double)run->bytes / audio_seconds : 0.0,
+                 10.0 * log10((run->signal_energy + 1.0) / (run->noise_energy + 1.0)),
+                 run->frames > 0 ? run->segmental_sum / (double)run->frames : 0.0);
+     }
+     fprintf(fp, "]}\n");
+     success = !ferror(fp);
+     if (!to_stdout && fclose(fp) != 0)
+         success = false;
+     else if (to_stdout && fflush(fp) != 0)
+         success = false;
+     if (!success)
+         fprintf(stderr, "ERROR: Failed to write benchmark file '%s'.\n", json_filepath);
+     return success;
+ }
 
-     fseek(rom_fp, 0, SEEK_END);
-     file_size_long = ftell(rom_fp);
-     fseek(rom_fp, 0, SEEK_SET);
-
-     if (file_size_long < 0 || file_size_long == 0) {
-          fprintf(stderr, "ERROR: Invalid ROM file size (%ld).\n", file_size_long);
-          fclose(rom_fp);
-          return false;
+ /**
+  * run_encode_benchmark() - Measures encoder quality and speed on messages decoded from ROMs (--bench-encode).
+  * @options: Parsed command line options (batch inputs, -j, --bench-encode).
+  *
+  * Every message with audio in the batch inputs is decoded to form the
+  * corpus. The corpus is then encoded with each --quality at 1, 2, 4, ...
+  * up to -j worker threads, and decoded back. Each run reports encode
+  * and decode time, encode speed as a multiple of real time, bytes per
+  * second of audio, SNR and segmental SNR (mean over BENCH_FRAME_SAMPLES
+  * frames, each clamped to BENCH_MIN_FRAME_SNR..BENCH_MAX_FRAME_SNR).
+  *
+  * Return: EXIT_SUCCESS or EXIT_FAILURE.
+  */
+ int
+ run_encode_benchmark(const ProgramOptions *options)
+ {
+     BatchRomList roms = {NULL, 0, 0};
+     DecodeJobList jobs = {NULL, 0, 0};
+     BenchMessage *corpus = NULL;
+     BenchRun *runs = NULL;
+     EncodeScheduler scheduler;
+     size_t corpus_count = 0, run_count = 0, samples = 0, i;
+     double audio_seconds;
+     int quality, threads, exit_code = EXIT_SUCCESS;
+
+     memset(&scheduler, 0, sizeof(scheduler));
+     mutex_init(&scheduler.lock);
+     if (!collect_batch_inputs(&roms, options)) {
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
      }
-     *rom_size_ptr = (size_t)file_size_long;
+     status_printf("Encoder benchmark: %zu ROM(s), up to %d worker thread(s)\n", roms.count, options->thread_count);
 
+     for (i = 0; i < roms.count; ++i) {
+         BatchRom *rom = &roms.roms[i];
 
-     *rom_data_ptr = (uint8_t *)malloc(*rom_size_ptr);
-     if (!*rom_data_ptr) {
-         fprintf(stderr, "ERROR: Failed to allocate %zu bytes for ROM data.\n", *rom_size_ptr);
-         fclose(rom_fp);
-         return false;
+         verbose_printf("Loading batch ROM %zu: %s\n", i, rom->rom_filepath);
+         if (!load_batch_rom(rom)) {
+             fprintf(stderr, "ERROR: Skipping '%s' (not a usable ROM image).\n", rom->rom_filepath);
+             exit_code = EXIT_FAILURE;
+             free(rom->rom_data);
+             rom->rom_data = NULL;
+             continue;
+         }
+         if (!collect_decode_jobs(rom, -1, &jobs)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
+         }
      }
 
-     if (fread(*rom_data_ptr, 1, *rom_size_ptr, rom_fp) != *rom_size_ptr) {
-         fprintf(stderr, "ERROR: Failed to read ROM file '%s'.\n", rom_filepath);
-         fclose(rom_fp);
-         free(*rom_data_ptr);
-         *rom_data_ptr = NULL;
-         return false;
+     /* Decode the corpus; silent and empty messages have nothing to encode */
+     corpus = (BenchMessage *)calloc(jobs.count > 0 ? jobs.count : 1, sizeof(BenchMessage));
+     if (!corpus) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the benchmark corpus.\n");
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
      }
-     fclose(rom_fp);
-     verbose_printf("ROM loaded (%zu bytes).\n", *rom_size_ptr);
-     return true;
- }
+     for (i = 0; i < jobs.count; ++i) {
+         const DecodeJob *job = &jobs.jobs[i];
+         const MessageCatalog *catalog = &job->rom->catalog;
+         BenchMessage *message = &corpus[corpus_count];
 
- /**
-  * load_mapping_data() - Loads mapping file data.
-  * @map_filepath: Path to the mapping file (can be NULL).
-  * @mapping_table: Pointer to the mapping table structure.
-  *
-  * Return: true on success, false on failure.
-  */
- bool
- load_mapping_data(const char *map_filepath, MappingTable *mapping_table)
- {
-     init_mapping_table(mapping_table);
-     if (map_filepath) {
-         verbose_printf("Loading mappings (expecting 0-based segment index)...\n");
-         if (!load_mappings(map_filepath, mapping_table)) {
-             /* Error message already printed by load_mappings */
-             return false;
+         if (catalog->start[job->message] >= catalog->rom_size)
+             continue;
+         init_pcm_buffer(&message->pcm);
+         if (!decode_message_samples(catalog->rom_data, catalog->rom_size, catalog->start[job->message],
+                                     catalog->end[job->message], &message->pcm)) {
+             fprintf(stderr, "ERROR: Failed to allocate memory for the benchmark corpus.\n");
+             free_pcm_buffer(&message->pcm);
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
          }
-         verbose_printf("Loaded %zu mappings.\n", mapping_table->count);
+         if (message->pcm.count == 0) {
+             free_pcm_buffer(&message->pcm);
+             continue;
+         }
+         message->job = job;
+         samples += message->pcm.count;
+         corpus_count++;
      }
-     return true;
+     if (corpus_count == 0) {
+         fprintf(stderr, "ERROR: No messages with audio to benchmark.\n");
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     audio_seconds = (double)samples / DEFAULT_SAMPLE_RATE;
+     status_printf("Corpus: %zu message(s), %.1f s of audio\n", corpus_count, audio_seconds);
+
+     scheduler.files = (EncodeFile *)calloc(ENCODE_GROUP_SIZE, sizeof(EncodeFile));
+     runs = (BenchRun *)calloc((size_t)(ENCODE_QUALITY_TRELLIS + 1) * 32, sizeof(BenchRun)); /* 1, 2, 4, ... threads */
+     if (!scheduler.files || !runs) {
+         fprintf(stderr, "ERROR: Failed to allocate memory for the encoder.\n");
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     init_trellis_tables();
+     scheduler.keep_messages = true;
+
+     for (quality = ENCODE_QUALITY_GREEDY; quality <= ENCODE_QUALITY_TRELLIS; ++quality) {
+         for (threads = 1;; threads = (threads * 2 < options->thread_count) ? threads * 2 : options->thread_count) {
+             BenchRun *run = &runs[run_count++];
+             double encode_s;
+
+             run->quality = (EncodeQuality)quality;
+             run->threads = threads;
+             scheduler.quality = run->quality;
+             if (!run_bench_pass(&scheduler, corpus, corpus_count, run)) {
+                 fprintf(stderr, "ERROR: Benchmark run (%s, %d thread(s)) failed.\n",
+                         get_encode_quality_name(run->quality), threads);
+                 exit_code = EXIT_FAILURE;
+                 goto cleanup;
+             }
+             encode_s = (double)run->encode_ns / 1e9;
+             status_printf("%-9s -j %-3d: encode %.1f ms (%.1fx real time), decode %.1f ms, %.0f bytes/s, "
+                           "SNR %.1f dB, segmental SNR %.1f dB\n",
+                           get_encode_quality_name(run->quality), threads, (double)run->encode_ns / 1e6,
+                           encode_s > 0 ? audio_seconds / encode_s : 0.0, (double)run->decode_ns / 1e6,
+                           (double)run->bytes / audio_seconds,
+                           10.0 * log10((run->signal_energy + 1.0) / (run->noise_energy + 1.0)),
+                           run->frames > 0 ? run->segmental_sum / (double)run->frames : 0.0);
+             if (threads >= options->thread_count)
+                 break;
+         }
+     }
+
+     if (!write_bench_results(options->bench_encode_filepath, roms.count, corpus_count, audio_seconds, runs,
+                              run_count))
+         exit_code = EXIT_FAILURE;
+
+ cleanup:
+     if (scheduler.files) {
+         for (i = 0; i < ENCODE_GROUP_SIZE; ++i)
+             free_encode_file(&scheduler.files[i]);
+     }
+     free(scheduler.files);
+     mutex_destroy(&scheduler.lock);
+     if (corpus) {
+         for (i = 0; i < corpus_count; ++i)
+             free_pcm_buffer(&corpus[i].pcm);
+     }
+     free(corpus);
+     free(runs);
+     free(jobs.jobs);
+     free_batch_rom_list(&roms);
+     return exit_code;
  }
 
 
@@ -1459,20 +12782,92 @@
  void
  print_usage(const char *prog_name)
  {
-     fprintf(stderr, "Usage: %s <rom_filepath> [-m <map_filepath>] [-i <message_index>] [-l|--list] [-q|--quiet] [-v|--verbose]\n", prog_name);
+     fprintf(stderr, "Usage: %s <rom_filepath> [-m <map_filepath>] [-i <message_index>] [-o <output_dir>] [-j <threads>] [-l|--list] [--list-format=<format>] [--automap <reference_rom>] [--fp-query <index_filepath>] [--diff <known_rom>] [-s|--scan] [--stream] [--stats[=json]] [--trace <trace_filepath>] [--format=<format>] [--rate <hz>] [--raw-pcm] [--arena] [--writer=<backend>] [-q|--quiet] [-v|--verbose]\n", prog_name);
+     fprintf(stderr, "       %s -b <rom_or_dir>... [--manifest <manifest_filepath>] [options]\n", prog_name);
+     fprintf(stderr, "       %s -m <map_filepath> --compile-map <compiled_map_filepath>\n", prog_name);
+     fprintf(stderr, "       %s --fp-index <index_filepath> <rom_or_dir>... [--manifest <manifest_filepath>] [-m <map_filepath>] [-j <threads>]\n", prog_name);
+     fprintf(stderr, "       %s <rom_filepath> --diff <known_rom> [-m <map_filepath>] [-o <output_dir>]\n", prog_name);
+     fprintf(stderr, "       %s --encode <wav_filepath>... [-o <output_dir>] [--quality=<quality>] [-j <threads>]\n", prog_name);
+     fprintf(stderr, "       %s --bench-encode <json_filepath> <rom_or_dir>... [--manifest <manifest_filepath>] [-j <threads>]\n", prog_name);
+     fprintf(stderr, "       %s --build-rom <rom_filepath> -m <map_filepath> [<message_dir>]\n", prog_name);
+     fprintf(stderr, "       %s <rom_filepath> --patch <message_filepath> -i <message_index> [-s]\n", prog_name);
      fprintf(stderr, "Decodes Nortel Millennium VoiceWare ROM files (NEC uPD7759 ADPCM).\n");
      fprintf(stderr, "Uses 0-based segment indexing.\n");
      fprintf(stderr, "Options:\n");
-     fprintf(stderr, "  <rom_filepath>      Path to the input ROM file.\n");
+     fprintf(stderr, "  <rom_filepath>      Path to the input ROM file, or '-' to read from stdin (implies --stream).\n");
      fprintf(stderr, "  -m <map_filepath>   Path to the optional tab-delimited mapping file.\n");
      fprintf(stderr, "                      Format: SegIdx(0+)\\tMsgIdxInSeg(0+)\\tFilenameBase[\\tComment]\n");
+     fprintf(stderr, "                      A compiled mapping file (--compile-map) is detected and memory-mapped.\n");
+     fprintf(stderr, "  --compile-map <file> Compile the -m text mapping file into a binary mapping file with a\n");
+     fprintf(stderr, "                      direct (segment, message) index and one string pool, then exit.\n");
      fprintf(stderr, "  -i <message_index>  Decode only the specified absolute message index (0-based).\n");
      fprintf(stderr, "                      (Ignored if -l or --list is specified).\n");
+     fprintf(stderr, "  -o <output_dir>     Write output files to this directory (created if needed).\n");
+     fprintf(stderr, "                      In batch mode each ROM gets a subdirectory here.\n");
+     fprintf(stderr, "                      '-o -' streams the audio of the selected messages to stdout instead\n");
+     fprintf(stderr, "                      (--format=wav as one streaming WAV, s16le, ul or al; status goes to stderr).\n");
+     fprintf(stderr, "  -j <threads>        Number of decode worker threads (default: all CPUs in batch mode, 1 otherwise).\n");
+     fprintf(stderr, "                      A single ROM is decoded longest message first on a worker pool; with --stream\n");
+     fprintf(stderr, "                      a staged pipeline runs instead: the reader feeds <threads> decoders, which\n");
+     fprintf(stderr, "                      feed encoder threads and the output writer.\n");
+     fprintf(stderr, "  -b, --batch         Batch mode. Accept several ROM files and/or directories of ROM files.\n");
+     fprintf(stderr, "                      Each ROM uses '<rom path without extension>.map' if present (else -m)\n");
+     fprintf(stderr, "                      and writes to '<output_dir>/<rom name without extension>/'.\n");
+     fprintf(stderr, "  --manifest <file>   Add the ROMs listed in a manifest file (implies -b).\n");
+     fprintf(stderr, "                      Format: RomPath[\\tMapPath[\\tOutputSubdir]]\n");
      fprintf(stderr, "  -l, --list          List messages in mapping file format (0-based SegIdx) to stdout\n");
      fprintf(stderr, "                      instead of decoding. Includes header comment '# ROM: <basename>\\n\\n'.\n");
      fprintf(stderr, "                      Uses tabs for padding to align comments (assuming %d char filename width & %d-space tabs).\n", LIST_FILENAME_ALIGN_WIDTH, TAB_WIDTH);
      fprintf(stderr, "                      Comments are prefixed with '#'. PCM messages are indicated,\n");
      fprintf(stderr, "                      avoiding duplication if '(PCM)' is already in map comment.\n");
+     fprintf(stderr, "  --list-format=<fmt> Listing format (implies -l): map (default, as above), jsonl, csv or tsv.\n");
+     fprintf(stderr, "                      Records hold rom, segment, index, absolute_index, offset (in segment),\n");
+     fprintf(stderr, "                      length, mode, samples, hash (FNV-1a 64 of the message bytes), name and\n");
+     fprintf(stderr, "                      comment. They are written even with -q; status goes to stderr.\n");
+     fprintf(stderr, "  --automap <ref_rom> List the ROM(s) (implies -l) with names taken from <ref_rom> and its -m map:\n");
+     fprintf(stderr, "                      messages with an identical payload get the reference name, others the name\n");
+     fprintf(stderr, "                      of a reference with a similar decoded loudness envelope (comment notes the\n");
+     fprintf(stderr, "                      score). Stdout is a ready-made map for the ROM; status goes to stderr.\n");
+     fprintf(stderr, "  --fp-index <file>   Fingerprint every message of the inputs (implies -b) into an index file:\n");
+     fprintf(stderr, "                      32-bit spectral sub-fingerprints every 8 ms and an inverted index of them.\n");
+     fprintf(stderr, "                      Names come from each ROM's mapping file.\n");
+     fprintf(stderr, "  --fp-query <file>   Print the indexed prompts that sound like message -i of the ROM, best first,\n");
+     fprintf(stderr, "                      with the percentage of matching fingerprint bits (unrelated audio: ~50%%).\n");
+     fprintf(stderr, "  --diff <known_rom>  Print how the ROM differs from <known_rom> as TSV (moved, changed, added,\n");
+     fprintf(stderr, "                      removed), named by the -m map of <known_rom>. Identical segments are\n");
+     fprintf(stderr, "                      skipped by hash. With -o, only changed and added messages are decoded.\n");
+     fprintf(stderr, "  --encode            Encode the given WAV files (8/16-bit PCM, any rate and channel count) to\n");
+     fprintf(stderr, "                      uPD7759 ADPCM messages '<name>.adpcm' (mode byte, commands, end command).\n");
+     fprintf(stderr, "  --quality=<q>       Encoder search: greedy, lookahead or trellis (default, best SNR).\n");
+     fprintf(stderr, "  --bench-encode <file> Encode the messages of the inputs (implies -b) with each quality at 1, 2, 4, ...\n");
+     fprintf(stderr, "                      -j threads, decode them back and write speed, size and SNR as JSON ('-': stdout).\n");
+     fprintf(stderr, "  --build-rom <file>  Build a ROM image from the '<name>.adpcm'/'<name>.pcm' files named by -m, in map\n");
+     fprintf(stderr, "                      order, and write the mapping file of the new layout to '<rom>.map'.\n");
+     fprintf(stderr, "  --patch <file>      Replace message -i of the ROM file in place with an .adpcm or .pcm message file,\n");
+     fprintf(stderr, "                      moving only the following messages of its segment.\n");
+     fprintf(stderr, "  -s, --scan          Recovery mode. Scan the whole file for segment headers ('xx 5A A5 69 55')\n");
+     fprintf(stderr, "                      instead of assuming one segment every %d bytes.\n", ROM_SEGMENT_SIZE);
+     fprintf(stderr, "  --stream            Read the ROM through a fixed %d-byte window instead of loading it\n", STREAM_WINDOW_SIZE);
+     fprintf(stderr, "                      into memory. Works with pipes and arbitrarily large concatenated archives.\n");
+     fprintf(stderr, "  --stats[=json]      Print per-phase timings and throughput/opcode counters to stderr at exit\n");
+     fprintf(stderr, "                      (also in quiet mode). '=json' prints a single JSON object instead.\n");
+     fprintf(stderr, "  --trace <file>      Write a Chrome trace-event timeline of ROM load and per-message decode/write\n");
+     fprintf(stderr, "                      spans for each thread (open in chrome://tracing or ui.perfetto.dev).\n");
+     fprintf(stderr, "  --format=<format>   Audio format of decoded messages: wav (default, 16-bit PCM), flac\n");
+     fprintf(stderr, "                      (built-in lossless encoder, Vorbis comments instead of INFO tags),\n");
+     fprintf(stderr, "                      ulaw/alaw (8-bit G.711 WAV), ul/al (headerless G.711 .ul/.al files)\n");
+     fprintf(stderr, "                      ima (4-bit IMA ADPCM WAV, %d-byte blocks) or s16le (headerless\n", IMA_BLOCK_ALIGN);
+     fprintf(stderr, "                      16-bit little-endian .raw files).\n");
+     fprintf(stderr, "  --rate <hz>         Resample decoded audio to this rate (%d-%d, default %d) with a polyphase\n",
+         MIN_OUTPUT_SAMPLE_RATE, MAX_OUTPUT_SAMPLE_RATE, DEFAULT_SAMPLE_RATE);
+     fprintf(stderr, "                      windowed-sinc filter before encoding, e.g. 16000, 44100 or 48000.\n");
+     fprintf(stderr, "  --raw-pcm           Save PCM (mode 0x40) messages as raw '.pcm' files (mode byte and samples)\n");
+     fprintf(stderr, "                      instead of decoding them to the --format output.\n");
+     fprintf(stderr, "  --arena             Decode into a per-thread bump arena reset after every message instead of\n");
+     fprintf(stderr, "                      growing heap buffers (no heap calls in steady state; see --stats).\n");
+     fprintf(stderr, "  --writer=<backend>  How output files are written: sync (default), thread (background writer\n");
+     fprintf(stderr, "                      threads), uring (batched io_uring openat/write/close, Linux only;\n");
+     fprintf(stderr, "                      falls back to thread) or auto (uring if available, else thread).\n");
      fprintf(stderr, "  -q, --quiet         Quiet mode. Suppress all informational output (stdout & stderr).\n" );
      fprintf(stderr, "                      Only errors are printed to stderr. Overrides -v.\n");
      fprintf(stderr, "  -v, --verbose       Enable verbose debugging output to stderr. Ignored if -q is used.\n");
@@ -1488,31 +12883,137 @@
  int
  main(int argc, char *argv[])
  {
-     const char *rom_filepath = NULL;
-     const char *map_filepath = NULL;
-     long target_message_idx = -1;
+     ProgramOptions options;
+     const char *rom_filepath;
+     const char *map_filepath;
+     const char *output_dir;
+     long target_message_idx;
      const char *rom_basename;
      MappingTable mapping_table;
      size_t rom_size = 0;
      uint8_t *rom_data = NULL;
-     int segment_index_0_based = 0;
-     int absolute_msg_idx_counter = 0;
      bool target_found_and_processed = false;
      int exit_code = EXIT_SUCCESS;
-     size_t segment_start;
-
-     mapping_table.mappings = NULL; /* Ensure initialized for cleanup */
-     mapping_table.count = 0;
-     mapping_table.capacity = 0;
+     SegmentDirectory segment_directory;
+     MessageCatalog catalog;
+     HandleMessageResult result;
+     uint64_t phase_start;
+     Pipeline pipeline;
+     AutomapIndex automap_index;
+     bool stdout_started = false;
+
+     init_segment_directory(&segment_directory);
+     init_message_catalog(&catalog);
+     init_mapping_table(&mapping_table); /* Ensure initialized for cleanup */
+     init_automap_index(&automap_index);
 
      /* --- Argument Parsing --- */
-     if (!parse_arguments(argc, argv, &rom_filepath, &map_filepath,
-                  &target_message_idx, &list_mode, &quiet_mode, &verbose_mode)) {
+     if (!parse_arguments(argc, argv, &options)) {
          /* Error or help message already printed */
          return (argc > 1 && (strcmp(argv[argc-1], "-h") == 0 || strcmp(argv[argc-1], "--help") == 0)) ? EXIT_SUCCESS : EXIT_FAILURE;
      }
+     list_mode = options.list_mode;
+     list_format = options.list_format;
+     scan_mode = options.scan_mode;
+     stream_mode = options.stream_mode;
+     raw_pcm_mode = options.raw_pcm_mode;
+     stdout_mode = options.stdout_mode;
+     output_format = options.output_format;
+     if (options.automap_filepath)
+         active_automap = &automap_index; /* Index is built below; status goes to stderr from here on */
+     init_g711_tables(); /* Before any worker thread reads them */
+     if (!options.list_mode && options.output_rate != 0 && options.output_rate != DEFAULT_SAMPLE_RATE) {
+         if (!init_resampler(&resampler, DEFAULT_SAMPLE_RATE, options.output_rate)) {
+             free(options.rom_filepaths);
+             return EXIT_FAILURE;
+         }
+         output_sample_rate = options.output_rate;
+     }
+     quiet_mode = options.quiet_mode;
+     verbose_mode = options.verbose_mode;
+
+     /* --- Mapping Compilation (no ROM) --- */
+     if (options.compile_map_filepath) {
+         if (!load_mapping_data(options.map_filepath, &mapping_table) ||
+             !compile_mappings(&mapping_table, options.compile_map_filepath))
+             exit_code = EXIT_FAILURE;
+         free_mapping_table(&mapping_table);
+         free(options.rom_filepaths);
+         free_resampler(&resampler);
+         return exit_code;
+     }
 
-     rom_basename = get_base_filename(rom_filepath);
+     /* --- ROM Building (no ROM input) --- */
+     if (options.build_rom_filepath) {
+         exit_code = run_build_rom(&options);
+         free(options.rom_filepaths);
+         free_resampler(&resampler);
+         return exit_code;
+     }
+     if (options.stats_mode)
+         stats_init(options.stats_json);
+     if (options.trace_filepath)
+         trace_init();
+     if (options.arena_mode)
+         init_thread_arenas();
+     if (!options.list_mode && !options.stdout_mode && !output_writer_start(options.output_backend)) {
+         free(options.rom_filepaths);
+         free_resampler(&resampler);
+         return EXIT_FAILURE;
+     }
+     map_filepath = options.map_filepath;
+     output_dir = options.output_dir;
+     target_message_idx = options.target_message_idx;
+
+     /* --- Automap Reference Index (names by content) --- */
+     if (options.automap_filepath) {
+         if (!load_mapping_data(map_filepath, &mapping_table) ||
+             !build_automap_index(&automap_index, options.automap_filepath, &mapping_table)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
+         }
+     }
+
+     /* --- Batch Mode (shared worker pool), Fingerprint Index/Query, ROM Diff, Encoding and Patching --- */
+     if (options.batch_mode || options.fp_query_filepath || options.diff_filepath || options.encode_mode ||
+         options.patch_filepath) {
+         status_printf("Nortel Millennium VoiceWare Decoder (0-Based Segments)\n");
+         status_printf("Version: %s (%s)\n", GIT_TAG_NAME, GIT_COMMIT_HASH);
+         if (options.encode_mode)
+             exit_code = run_encode(&options);
+         else if (options.patch_filepath)
+             exit_code = run_patch(&options);
+         else if (options.diff_filepath)
+             exit_code = run_rom_diff(&options);
+         else if (options.fp_query_filepath)
+             exit_code = run_fingerprint_query(&options);
+         else if (options.bench_encode_filepath)
+             exit_code = run_encode_benchmark(&options);
+         else if (options.fp_index_filepath)
+             exit_code = run_fingerprint_index(&options);
+         else
+             exit_code = run_batch(&options);
+         if (active_automap)
+             status_printf("Automap: %zu exact, %zu fuzzy, %zu unmatched message(s).\n", automap_index.exact_matches,
+                       automap_index.fuzzy_matches, automap_index.unmatched);
+         free_automap_index(&automap_index);
+         free_mapping_table(&mapping_table);
+         free(options.rom_filepaths);
+         output_writer_finish();
+         free_resampler(&resampler);
+         free_thread_arenas();
+         if (trace_enabled && !write_trace_file(options.trace_filepath))
+             exit_code = EXIT_FAILURE;
+         status_printf("Processing finished with exit code %d.\n", exit_code);
+         if (stats_enabled) {
+             print_stats();
+             mutex_destroy(&stats_lock);
+         }
+         return exit_code;
+     }
+     rom_filepath = options.rom_filepaths[0];
+
+     rom_basename = (strcmp(rom_filepath, "-") == 0) ? "stdin" : get_base_filename(rom_filepath);
 
      /* Print startup messages unless quiet */
      status_printf("Nortel Millennium VoiceWare Decoder (0-Based Segments)\n");
@@ -1521,116 +13022,118 @@
      status_printf("Input ROM: %s (Artist Tag: %s)\n", rom_filepath, rom_basename);
      if (map_filepath)
          status_printf("Mapping File: %s\n", map_filepath);
+     if (options.automap_filepath)
+         status_printf("Automap Reference: %s (names matched by content)\n", options.automap_filepath);
+     if (output_dir && !list_mode)
+         status_printf("Output Directory: %s\n", output_dir);
+     if (stdout_mode)
+         status_printf("Output: Streaming %s audio to stdout\n", (output_format == OUTPUT_FORMAT_WAV) ? "WAV" :
+                   (output_format == OUTPUT_FORMAT_S16LE) ? "s16le" : "G.711");
      if (list_mode)
          status_printf("Mode: Listing messages\n");
      else if (target_message_idx >= 0)
          status_printf("Mode: Decoding target message index %ld\n", target_message_idx);
      else
          status_printf("Mode: Decoding all messages\n");
+     if (scan_mode)
+         status_printf("Segment Detection: Scanning for segment headers (recovery mode)\n");
+     if (stream_mode)
+         status_printf("Input: Streaming through a %d-byte window\n", STREAM_WINDOW_SIZE);
      if (verbose_mode) /* verbose implies not quiet */
-         printf("Verbose Mode: Enabled\n"); /* Use printf as verbose goes to stderr */
+         status_printf("Verbose Mode: Enabled\n"); /* Not verbose_printf, which goes to stderr */
 
 
-     /* --- Load Mappings --- */
-     if (!load_mapping_data(map_filepath, &mapping_table)) {
+     /* --- Load Mappings (already loaded as the automap reference) --- */
+     if (!active_automap && !load_mapping_data(map_filepath, &mapping_table)) {
          exit_code = EXIT_FAILURE;
          goto cleanup;
      }
 
-     /* --- Load ROM Data --- */
-     if (!load_rom_data(rom_filepath, &rom_data, &rom_size)) {
+     if (output_dir && !list_mode && !make_directories(output_dir)) {
          exit_code = EXIT_FAILURE;
          goto cleanup;
      }
 
-     /* --- Print List Header (if applicable) --- */
-     if (list_mode && !quiet_mode) {
-         printf("# ROM: %s\n\n", rom_basename);
+     if (stdout_mode) {
+         if (!stdout_stream_start(output_format, output_sample_rate)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
+         }
+         stdout_started = true;
      }
 
-     /* --- Process Segments and Messages --- */
-     for (segment_start = 0; segment_start < rom_size; segment_start += ROM_SEGMENT_SIZE, ++segment_index_0_based) {
-         uint8_t last_message_index;
-         uint32_t message_count_in_segment;
-         size_t offset_table_start, offset_table_size;
-         uint16_t *offset_table = NULL;
-         uint32_t msg_idx_in_seg; /* Use unsigned to match message_count */
-         bool segment_error = false;
-
-         verbose_printf("Processing Segment %d (Offset 0x%zX)...\n", segment_index_0_based, segment_start);
-
-         /* Check header */
-         if (segment_start + 5 > rom_size) {
-             if (segment_index_0_based > 0) {
-                  verbose_printf("  INFO: Incomplete segment data at end of file. Stopping.\n");
-             } else {
-                  fprintf(stderr, "ERROR: ROM file too small for even one segment header.\n");
-                  exit_code = EXIT_FAILURE;
-             }
-             break;
-         }
-         last_message_index = rom_data[segment_start];
-         if (memcmp(rom_data + segment_start + 1, ROM_MAGIC, 4) != 0) {
-             if (segment_index_0_based == 0) {
-                 fprintf(stderr, "ERROR: Invalid magic number in first segment (Segment 0) header.\n");
-                 exit_code = EXIT_FAILURE;
-             } else {
-                 verbose_printf("  INFO: Invalid magic number found at segment %d start. Assuming end of ROM data.\n", segment_index_0_based);
-             }
-             break;
+     /* --- Streaming Parallel Decoding (reader -> decoders -> encoders -> writer) --- */
+     if (!list_mode && options.thread_count > 1 && target_message_idx < 0 && stream_mode) {
+         if (!pipeline_start(&pipeline, options.thread_count, rom_basename, output_dir, stream_mode)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
          }
+     }
 
-         message_count_in_segment = (uint32_t)last_message_index + 1;
-         verbose_printf("  Segment Header OK: Last Message Index %u (%u messages)\n", last_message_index, message_count_in_segment);
-
-         /* Check offset table size */
-         offset_table_start = segment_start + 5;
-         offset_table_size = message_count_in_segment * sizeof(uint16_t);
-         if (offset_table_start + offset_table_size > rom_size ||
-             offset_table_start + offset_table_size > segment_start + ROM_SEGMENT_SIZE) {
-             fprintf(stderr, "ERROR: Offset table size (%zu bytes for %u messages) exceeds segment/ROM bounds for segment %d.\n",
-                 offset_table_size, message_count_in_segment, segment_index_0_based);
+     /* --- Streaming Input (bounded memory, no ROM buffer) --- */
+     if (stream_mode) {
+         FILE *rom_fp = open_rom_stream(rom_filepath);
+         if (!rom_fp) {
              exit_code = EXIT_FAILURE;
-             break;
+             goto cleanup;
          }
-
-         /* Read offset table */
-         offset_table = (uint16_t *)malloc(offset_table_size);
-         if (!offset_table) {
-              fprintf(stderr, "ERROR: Failed to allocate memory for offset table (segment %d).\n", segment_index_0_based);
-              exit_code = EXIT_FAILURE;
-              break;
+         if (list_mode && !list_rom_header(rom_basename)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
          }
-         for (uint32_t k = 0; k < message_count_in_segment; ++k)
-             offset_table[k] = read_u16be(rom_data + offset_table_start + k * 2);
-         verbose_printf("  Offset table read for %u messages.\n", message_count_in_segment);
+         if (!stream_rom_segments(rom_fp, &mapping_table, rom_basename, output_dir,
+                      target_message_idx, &target_found_and_processed))
+             exit_code = EXIT_FAILURE;
+         if (rom_fp != stdin)
+             fclose(rom_fp);
+         goto check_target;
+     }
 
-         /* Process messages within the segment */
-         for (msg_idx_in_seg = 0; msg_idx_in_seg < message_count_in_segment; ++msg_idx_in_seg) {
-             HandleMessageResult result = handle_message_iteration(
-                 rom_data, rom_size, segment_start, segment_index_0_based,
-                 msg_idx_in_seg, absolute_msg_idx_counter + msg_idx_in_seg,
-                 offset_table, message_count_in_segment,
-                 &mapping_table, rom_basename,
-                 list_mode, quiet_mode, target_message_idx);
+     /* --- Load ROM Data --- */
+     if (!load_rom_data(rom_filepath, &rom_data, &rom_size)) {
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
 
-             if (result == MSG_HANDLED_ERROR) {
-                 exit_code = EXIT_FAILURE; /* Mark failure but continue loop to free table */
-                 segment_error = true;
-                 break; /* Stop processing messages in this segment */
-             } else if (result == MSG_HANDLED_TARGET_FOUND) {
-                 target_found_and_processed = true;
-                 break; /* Stop processing messages in this segment */
-             }
-         } /* End message loop */
+     /* --- Start the Listing (if applicable) --- */
+     if (list_mode && !list_rom_header(rom_basename)) {
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
 
-         free(offset_table);
-         absolute_msg_idx_counter += message_count_in_segment;
+     /* --- Locate Segments --- */
+     phase_start = stats_timer_start();
+     if (scan_mode) {
+         if (!scan_segment_directory(rom_data, rom_size, &segment_directory)) {
+             exit_code = EXIT_FAILURE;
+             goto cleanup;
+         }
+         status_printf("Scan found %zu segment(s).\n", segment_directory.count);
+     } else if (!build_segment_directory_fixed(rom_data, rom_size, &segment_directory)) {
+         exit_code = EXIT_FAILURE; /* Still process any segments found before the error */
+     }
+     stats_record_phase(STATS_PHASE_SEGMENT_PARSE, phase_start, 0);
 
-         if (segment_error || target_found_and_processed)
-             break; /* Stop processing segments */
+     /* --- Catalog and Process the Messages --- */
+     if (!build_message_catalog(&catalog, rom_data, rom_size, &segment_directory, 0, 0, &mapping_table)) {
+         exit_code = EXIT_FAILURE;
+         goto cleanup;
+     }
+     if (!list_mode && options.thread_count > 1 && target_message_idx < 0) {
+         /* Every sample count is known up front: decode longest first on the work pool */
+         if (!run_catalog_pool(&catalog, rom_basename, output_dir, options.thread_count))
+             exit_code = EXIT_FAILURE;
+         goto check_target;
+     }
+     result = process_catalog(&catalog, rom_basename, output_dir, target_message_idx);
+     if (result == MSG_HANDLED_ERROR)
+         exit_code = EXIT_FAILURE;
+     else if (result == MSG_HANDLED_TARGET_FOUND)
+         target_found_and_processed = true;
 
-     } /* End segment loop */
+check_target:
+     if (list_mode && !flush_list_output())
+         exit_code = EXIT_FAILURE;
 
      /* Check if the target message was specified but not found (only in decode mode) */
      if (!list_mode && target_message_idx >= 0 && !target_found_and_processed && exit_code != EXIT_FAILURE) {
@@ -1641,10 +13144,31 @@
  cleanup:
      /* --- Cleanup --- */
      verbose_printf("Cleaning up...\n");
+     if (active_pipeline && !pipeline_finish(active_pipeline))
+         exit_code = EXIT_FAILURE; /* Drain before the ROM buffer and mappings go away */
      free(rom_data);
+     free_segment_directory(&segment_directory);
+     free_message_catalog(&catalog);
+     if (active_automap)
+         status_printf("Automap: %zu exact, %zu fuzzy, %zu unmatched message(s).\n", automap_index.exact_matches,
+                   automap_index.fuzzy_matches, automap_index.unmatched);
+     free_automap_index(&automap_index);
      free_mapping_table(&mapping_table);
+     free_output_buffer(&list_output); /* Unflushed after an error */
+     output_writer_finish();
+     if (stdout_started && !stdout_stream_finish())
+         exit_code = EXIT_FAILURE;
+     free_resampler(&resampler);
+     free_thread_arenas();
+     if (trace_enabled && !write_trace_file(options.trace_filepath))
+         exit_code = EXIT_FAILURE;
+     free(options.rom_filepaths);
 
      status_printf("Processing finished with exit code %d.\n", exit_code);
+     if (stats_enabled) {
+         print_stats();
+         mutex_destroy(&stats_lock);
+     }
 
      return exit_code;
  }